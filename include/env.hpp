@@ -4,6 +4,7 @@
 #include<map>
 #include<string>
 #include<vector>
+#include<utility>
 #include<ostream>
 #include<istream>
 #include "expr.hpp"
@@ -26,6 +27,10 @@ struct Environment {
         std::vector<uint64_t> deps;
         // # arguments
         size_t n_args;
+        // Definition version, changed whenever the function is
+        // (re)defined or deleted; used to invalidate compiled
+        // expressions holding inlined copies of the body
+        uint64_t version = 0;
     };
 
     // Check if a variable is defined
@@ -55,6 +60,12 @@ struct Environment {
     // Delete function (return true if success, false if func not found)
     bool del_func(const std::string& func_name);
 
+    // User functions called by expr, directly or through other user
+    // functions (following deps), as (address, version) pairs sorted by
+    // address; anything derived from expr by expanding calls is current
+    // while these versions are
+    std::vector<std::pair<uint64_t, uint64_t> > call_versions(const Expr& expr) const;
+
     // Clear all vars/funcs
     void clear();
 
@@ -75,6 +86,9 @@ struct Environment {
     mutable std::string error_msg;
 
 private:
+    // Recompile user functions whose inlined callees were redefined
+    void recompile_stale_funcs();
+
     // Free addresses on vars vector
     std::vector<uint64_t> free_addrs;
     // Map variable name to address
@@ -83,5 +97,42 @@ private:
     std::map<std::string, uint64_t> freg;
 };
 
+// Evaluation context: variable values for evaluating expressions against
+// an Environment whose user functions are only read. Evaluation writes
+// (e.g. sums/prods indices) go to the context's variables, so any number
+// of threads can evaluate expressions in the same Environment
+// concurrently, each with its own context, without copying it.
+// Scratch stacks used by the evaluators are per-thread.
+struct EvalContext {
+    // Create context with a private copy of env's variable values
+    explicit EvalContext(const Environment& env);
+    EvalContext(const EvalContext& other) =delete;
+    EvalContext& operator=(const EvalContext& other) =delete;
+
+    // Create context which evaluates directly on env's variables
+    // (advanced; used by evaluation functions taking an Environment)
+    static EvalContext view(Environment& env);
+
+    // Create context with a private copy of another context's
+    // variable values
+    static EvalContext fork(const EvalContext& other);
+
+    // Re-copy variable values from the environment, e.g. after
+    // variables were set or added (no-op for a view)
+    void sync();
+
+    // Environment evaluated in; must outlive the context
+    const Environment& env;
+    // Values of variables (by address, as env.vars)
+    double* vars;
+
+private:
+    // View of env.vars (see view()); the flag only selects this overload
+    explicit EvalContext(Environment& env, bool is_view);
+    EvalContext(const Environment& env, const double* vars);
+    // Storage for private copy of variables
+    std::vector<double> own_vars;
+};
+
 }  // namespace nivalis
 #endif // ifndef _ENV_H_0C15810C_45B5_42D2_80B4_B4292F4A5E6C
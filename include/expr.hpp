@@ -5,11 +5,18 @@
 #include <limits>
 #include <istream>
 #include <vector>
+#include <memory>
+#include <utility>
 
 #include "opcodes.hpp"
 namespace nivalis {
 
 struct Environment; // in env.hpp
+struct EvalContext; // in env.hpp
+namespace detail {
+struct Program;     // in compile_expr.cpp
+struct JitFunction; // in jit_expr.cpp
+}  // namespace detail
 
 // Nivalis expression
 struct Expr {
@@ -40,6 +47,11 @@ struct Expr {
     };
     typedef std::vector<Expr::ASTNode> AST;
 
+    // Value and first two derivatives of an expression wrt a variable
+    struct Jet {
+        double val, diff, ddiff;
+    };
+
     Expr();
     Expr(const AST& ast);
 
@@ -49,6 +61,97 @@ struct Expr {
     double operator()(double arg, Environment& env) const;
     // Evaluate expression in environment, setting arguments
     double operator()(const std::vector<double>& args, Environment& env) const;
+    // Versions evaluating in a context (see EvalContext);
+    // safe to call concurrently with different contexts
+    double operator()(EvalContext& ctx) const;
+    double operator()(double arg, EvalContext& ctx) const;
+    double operator()(const std::vector<double>& args, EvalContext& ctx) const;
+
+    // Next section implemented eval_batch_expr.cpp
+    // Evaluate expression at n values of the variable with address var_addr
+    // (xs[i] -> out[i]), other variables taken from env.
+    // Uses SIMD kernels where possible; much faster than calling operator()
+    // in a loop. Afterwards the variable is left at xs[n-1].
+    void eval_batch(uint64_t var_addr, const double* xs, double* out,
+                    size_t n, Environment& env) const;
+    // Batch evaluation, binding several variables at once:
+    // inputs[j][i] is the i-th value of the variable with address var_addrs[j]
+    void eval_batch(const std::vector<uint64_t>& var_addrs,
+                    const std::vector<const double*>& inputs,
+                    double* out, size_t n, Environment& env) const;
+    // Versions evaluating in a context (see EvalContext)
+    void eval_batch(uint64_t var_addr, const double* xs, double* out,
+                    size_t n, EvalContext& ctx) const;
+    void eval_batch(const std::vector<uint64_t>& var_addrs,
+                    const std::vector<const double*>& inputs,
+                    double* out, size_t n, EvalContext& ctx) const;
+
+    // Next section implemented compile_expr.cpp
+    // Compile expression into register bytecode; afterwards operator()
+    // runs the bytecode instead of interpreting the AST (much faster).
+    // Copies of the Expr share the compiled program.
+    // If env is given, calls to small user functions are inlined first
+    // (see inline_calls); is_compiled(env) then reports whether any of them
+    // has been redefined since.
+    // Member functions which modify the AST discard the program; if you
+    // modify ast directly, call compile() (or uncompile()) again.
+    void compile(const Environment* env = nullptr);
+    // Discard compiled program and native code, if any
+    void uncompile();
+    // Check if a compiled program is available
+    bool is_compiled() const;
+    // Check if a compiled program is available and up-to-date with
+    // the user functions inlined into it (and the same for native code)
+    bool is_compiled(const Environment& env) const;
+
+    // Next section implemented jit_expr.cpp
+    // Compile expression to native x86-64 machine code; afterwards
+    // operator() calls the native code (takes priority over compile()).
+    // Subexpressions the JIT does not handle (user function calls,
+    // sums/prods) are evaluated by the interpreter.
+    // If env is given, calls to small user functions are inlined first.
+    // Only available if built with the USE_JIT CMake option on x86-64
+    // (non-Windows); otherwise does nothing and returns false.
+    // The same caveats as compile() apply when modifying ast directly.
+    bool jit(const Environment* env = nullptr);
+    // Check if native code is available
+    bool is_jitted() const;
+
+    // Next section implemented inline_expr.cpp
+    // Substitute the bodies of small (at most max_size nodes),
+    // non-recursive user functions at their call sites, recursively.
+    // Calls whose arguments have side effects (sums/prods/calls),
+    // or whose body would duplicate a non-trivial argument, are kept.
+    // inlined: optionally, outputs ids of user functions inlined
+    Expr inline_calls(const Environment& env, size_t max_size = 64,
+                      std::vector<uint64_t>* inlined = nullptr) const;
+
+    // Next section implemented jet_expr.cpp
+    // Evaluate expression and its first and second derivatives wrt
+    // the variable with address var_addr, at x, in one pass over the AST
+    // (forward-mode automatic differentiation; user function calls are
+    // differentiated through). Derivatives which are not available
+    // (e.g. wrt polygamma index) are NaN. Afterwards the variable is left at x.
+    Jet eval_jet(uint64_t var_addr, double x, Environment& env) const;
+    // Version evaluating in a context (see EvalContext)
+    Jet eval_jet(uint64_t var_addr, double x, EvalContext& ctx) const;
+
+    // Newton's method like newton(), but using eval_jet instead of a
+    // symbolic derivative. Finds a root of f if deriv_order = 0,
+    // a root of f' (extremum) if deriv_order = 1,
+    // or a root of 1/f (pole) if deriv_order = -1.
+    // jet0: optionally, supply jet at x0
+    double newton_jet(uint64_t var_addr, double x0, Environment& env,
+                      double eps_step, double eps_abs, int max_iter = 20,
+                      double xmin = -std::numeric_limits<double>::max(),
+                      double xmax = std::numeric_limits<double>::max(),
+                      int deriv_order = 0, const Jet* jet0 = nullptr) const;
+    // Version evaluating in a context (see EvalContext)
+    double newton_jet(uint64_t var_addr, double x0, EvalContext& ctx,
+                      double eps_step, double eps_abs, int max_iter = 20,
+                      double xmin = -std::numeric_limits<double>::max(),
+                      double xmax = std::numeric_limits<double>::max(),
+                      int deriv_order = 0, const Jet* jet0 = nullptr) const;
 
     // Combine expressions with basic operator
     Expr operator+(const Expr& other) const;
@@ -106,7 +209,10 @@ struct Expr {
     ASTNode& operator[](int idx);
 
     // Next section implemented optimize_expr.cpp
-    // Optimize expression in-place
+    // Optimize expression in-place: constant folding and algebraic
+    // simplification (like terms, powers, exp/log), keeping the expression's
+    // value and domain (where it is NaN) up to rounding.
+    // Repeats up to num_passes times while the expression changes.
     void optimize(int num_passes = 5);
 
     // Next section implemented diff_expr.cpp
@@ -129,12 +235,47 @@ struct Expr {
 
     // DATA: Abstract syntax tree
     AST ast;
+
+    // Compiled program, or null if not compiled
+    std::shared_ptr<const detail::Program> program;
+    // Native code, or null if not compiled with jit()
+    std::shared_ptr<const detail::JitFunction> native;
 };
 
 namespace detail {
 // Evaluate an AST directly (advanced)
 double eval_ast(Environment& env, const Expr::AST& ast,
                 const std::vector<double>& arg_vals = {});
+// Evaluate an AST directly, with n_args arguments in arg_vals (advanced)
+double eval_ast(Environment& env, const Expr::AST& ast,
+                const double* arg_vals, size_t n_args);
+// Evaluate an AST directly in a context (advanced)
+double eval_ast(EvalContext& ctx, const Expr::AST& ast,
+                const double* arg_vals = nullptr, size_t n_args = 0);
+
+// Derivative of an AST wrt var with address 'var_addr' (advanced);
+// like Expr::diff but without optimize(). {null} if not available
+Expr::AST diff_ast(const Expr::AST& ast, uint64_t var_addr,
+                   const Environment& env);
+
+// Evaluate an AST at n points (advanced); see Expr::eval_batch
+// prog: optionally, compiled program for ast (used in scalar fallback)
+void eval_ast_batch(EvalContext& ctx, const Expr::AST& ast,
+                    const uint64_t* var_addrs, const double* const* inputs,
+                    size_t n_vars, double* out, size_t n,
+                    const Program* prog = nullptr);
+
+// Run compiled program (advanced); see Expr::compile
+double run_program(const Program& prog, EvalContext& ctx,
+                   const double* args = nullptr, size_t n_args = 0);
+
+// Run native code (advanced); see Expr::jit
+double run_jit(const JitFunction& func, EvalContext& ctx,
+               const double* args = nullptr, size_t n_args = 0);
+
+// User functions inlined into native code, as (id, version) (advanced)
+const std::vector<std::pair<uint64_t, uint64_t> >& jit_inlined(
+        const JitFunction& func);
 
 // Print AST
 size_t print_ast(std::ostream& os, const Expr::AST& ast,
@@ -0,0 +1,172 @@
+#pragma once
+#ifndef _EVAL_OPS_H_EB6FA93D_E9B6_4375_A5F3_DFE07760F451
+#define _EVAL_OPS_H_EB6FA93D_E9B6_4375_A5F3_DFE07760F451
+
+// Scalar semantics of the (non-control) nivalis operators,
+// shared by the different evaluators (eval_ast, batch evaluator, ...)
+// so that they all agree exactly.
+#include "version.hpp"
+#include <cmath>
+#include <cstdint>
+#include <cstddef>
+#include <limits>
+#include <numeric>
+#include <algorithm>
+#include <iostream>
+#ifdef ENABLE_NIVALIS_BOOST_MATH
+#include <boost/math/special_functions/beta.hpp>
+#include <boost/math/special_functions/gamma.hpp>
+#include <boost/math/special_functions/digamma.hpp>
+#include <boost/math/special_functions/trigamma.hpp>
+#include <boost/math/special_functions/polygamma.hpp>
+#include <boost/math/special_functions/zeta.hpp>
+#include <boost/math/special_functions/binomial.hpp>
+#include <boost/math/special_functions/factorials.hpp>
+#endif
+#include "opcodes.hpp"
+
+namespace nivalis {
+namespace detail {
+
+#ifndef ENABLE_NIVALIS_BOOST_MATH
+inline void print_boost_warning(uint32_t opcode) {
+    std::cerr << "Function " << OpCode::repr(opcode)
+        << " requires Nivalis to be compiled with Boost" << std::endl;
+}
+
+// Falling factorial
+inline double fa_fact(size_t x, size_t to_exc = 1) {
+    if (x >= to_exc + 175) // too expensive
+        return std::numeric_limits<double>::quiet_NaN();
+    double result = 1.;
+    while (x > to_exc) result *= x--;
+    return result;
+}
+#endif
+
+// Apply binary operator with given opcode;
+// a is the first operand, b the second (e.g. sub: a - b)
+inline double apply_binary(uint32_t opcode, double a, double b) {
+#ifdef ENABLE_NIVALIS_BOOST_MATH
+    using namespace boost::math;
+#endif
+    using namespace nivalis::OpCode;
+    switch (opcode) {
+        case add: return a + b;
+        case sub: return a - b;
+        case mul: return a * b;
+        case divi: return a / b;
+        case mod: return std::fmod(a, b);
+        case power: return std::pow(a, b);
+        case logbase: return std::log(a) / std::log(b);
+        case max: return std::max(a, b);
+        case min: return std::min(a, b);
+        case land: return static_cast<double>(a && b);
+        case lor: return static_cast<double>(a || b);
+        case lxor: return static_cast<double>((a != 0.) ^ (b != 0.));
+        case gcd: return static_cast<double>(
+                          std::gcd((int64_t) a, (int64_t) b));
+        case lcm: return a * b / static_cast<double>(
+                          std::gcd((int64_t) a, (int64_t) b));
+#ifdef ENABLE_NIVALIS_BOOST_MATH
+        case choose: return binomial_coefficient<double>(
+                             (uint32_t)a, (uint32_t)b);
+        case fafact: return falling_factorial<double>(
+                             (uint32_t)a, (uint32_t)b);
+        case rifact: return rising_factorial<double>(
+                             (uint32_t)a, (uint32_t)b);
+        case betab: return beta<double>(a, b);
+        case polygammab: return polygamma<double>((int)a, b);
+#else
+        case choose: case fafact: case rifact:
+            {
+                double ad = std::round(a), bd = std::round(b);
+                if (ad < 0 || bd < 0)
+                    return std::numeric_limits<double>::quiet_NaN();
+                size_t an = static_cast<size_t>(ad), bn = static_cast<size_t>(bd);
+                if (opcode == choose) {
+                    bn = std::min(bn, an - bn);
+                    return fa_fact(an, an - bn) / fa_fact(bn);
+                } else if (opcode == fafact) {
+                    return fa_fact(an, an - bn);
+                }
+                return fa_fact(an + bn - 1, an - 1);
+            }
+        case betab: case polygammab:
+            print_boost_warning(opcode);
+            return std::numeric_limits<double>::quiet_NaN();
+#endif
+        case lt: return static_cast<double>(a < b);
+        case le: return static_cast<double>(a <= b);
+        case eq: return static_cast<double>(a == b);
+        case ne: return static_cast<double>(a != b);
+        case ge: return static_cast<double>(a >= b);
+        case gt: return static_cast<double>(a > b);
+        case bsel: return b;
+    }
+    return std::numeric_limits<double>::quiet_NaN();
+}
+
+// Apply unary operator with given opcode
+inline double apply_unary(uint32_t opcode, double x) {
+#ifdef ENABLE_NIVALIS_BOOST_MATH
+    using namespace boost::math;
+#endif
+    using namespace nivalis::OpCode;
+    switch (opcode) {
+        case unaryminus: return -x;
+        case lnot: return static_cast<double>(!x);
+        case absb: return std::fabs(x);
+        case sqrtb: return std::sqrt(x);
+        case sqrb: return x * x;
+        case sgn: return x > 0 ? 1 : (x == 0 ? 0 : -1);
+        case floorb: return std::floor(x);
+        case ceilb: return std::ceil(x);
+        case roundb: return std::round(x);
+        case expb: return std::exp(x);
+        case exp2b: return std::exp2(x);
+        case logb: return std::log(x);
+        case log2b: return std::log2(x);
+        case log10b: return std::log10(x);
+        case factb:
+            {
+                unsigned n = static_cast<unsigned>(std::max(x, 0.));
+#ifdef ENABLE_NIVALIS_BOOST_MATH
+                return factorial<double>(n);
+#else
+                return fa_fact(n, 1);
+#endif
+            }
+        case sinb: return std::sin(x);
+        case cosb: return std::cos(x);
+        case tanb: return std::tan(x);
+        case asinb: return std::asin(x);
+        case acosb: return std::acos(x);
+        case atanb: return std::atan(x);
+        case sinhb: return std::sinh(x);
+        case coshb: return std::cosh(x);
+        case tanhb: return std::tanh(x);
+        case tgammab: return std::tgamma(x);
+        case lgammab: return std::lgamma(x);
+#ifdef ENABLE_NIVALIS_BOOST_MATH
+        case digammab: return digamma<double>(x);
+        case trigammab: return trigamma<double>(x);
+        case zetab: return zeta<double>(x);
+#else
+        // The following functions are unavailable without Boost
+        case digammab: case trigammab: case zetab:
+            print_boost_warning(opcode);
+            return std::numeric_limits<double>::quiet_NaN();
+#endif
+        case erfb: return std::erf(x);
+        case sigmoidb: return 1.f / (1.f + std::exp(-x));
+        case softplusb: return x < 15.f ? std::log(1.f + std::exp(x)) : x;
+        case gausspdfb:
+            return 1.f / std::sqrt(M_PI * 2.f) * std::exp(-std::pow(x, 2.f) * 0.5f);
+    }
+    return std::numeric_limits<double>::quiet_NaN();
+}
+
+}  // namespace detail
+}  // namespace nivalis
+#endif // ifndef _EVAL_OPS_H_EB6FA93D_E9B6_4375_A5F3_DFE07760F451
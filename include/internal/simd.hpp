@@ -0,0 +1,27 @@
+#pragma once
+#ifndef _SIMD_H_72A5028D_65BD_49DC_A38D_A56D37B32838
+#define _SIMD_H_72A5028D_65BD_49DC_A38D_A56D37B32838
+
+// x86 SIMD helpers. SSE2 is always available on x86-64;
+// AVX2 code paths are compiled with a target attribute and selected at
+// runtime, so the library does not need to be built with -mavx2.
+#if (defined(__x86_64__) || defined(_M_X64)) && \
+    (defined(__GNUC__) || defined(__clang__))
+#define NIVALIS_SIMD_X86
+#include <immintrin.h>
+// Mark function as compiled for AVX2 (+FMA)
+#define NIVALIS_TARGET_AVX2 __attribute__((target("avx2,fma")))
+
+namespace nivalis {
+namespace detail {
+// Check (once) whether the CPU supports AVX2 and FMA
+inline bool cpu_has_avx2() {
+    static const bool has_avx2 = __builtin_cpu_supports("avx2") &&
+                                 __builtin_cpu_supports("fma");
+    return has_avx2;
+}
+}  // namespace detail
+}  // namespace nivalis
+#endif
+
+#endif // ifndef _SIMD_H_72A5028D_65BD_49DC_A38D_A56D37B32838
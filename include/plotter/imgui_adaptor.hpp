@@ -31,8 +31,11 @@ struct ImGuiDrawListGraphicsAdaptor {
     void string(float x, float y,
                 const std::string& s, const color::color& c,
                 float align_x = 0.0, float align_y = 0.0);
-    void image(float x, float y, float w, float h, char* data_rgb, int cols, int rows);
+    // RGBA image (row major, 4 bytes per pixel), alpha blended;
+    // the texture is reused by each call
+    void image(float x, float y, float w, float h, const char* data_rgba, int cols, int rows);
     ImDrawList* draw_list = nullptr;
+    unsigned int image_texture = 0;
     int swid, shigh;
 };
 
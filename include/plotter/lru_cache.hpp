@@ -0,0 +1,118 @@
+#pragma once
+#ifndef _LRU_CACHE_H_3F8A61D2_95B7_4C1E_8E0A_6D2C47B19F53
+#define _LRU_CACHE_H_3F8A61D2_95B7_4C1E_8E0A_6D2C47B19F53
+
+#include "version.hpp"
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#ifndef NIVALIS_EMSCRIPTEN
+#include <mutex>
+#endif
+
+namespace nivalis {
+
+// Cache of immutable values by string key, with a budget on the total
+// cost (e.g. bytes) of values; when over budget, the least recently
+// used values are evicted. Values are shared, so a value obtained from
+// get() stays valid after it is evicted. Thread-safe.
+template<class Value>
+class LRUCache {
+public:
+    explicit LRUCache(size_t max_cost) : max_cost(max_cost) { }
+    LRUCache(const LRUCache& other) =delete;
+    LRUCache& operator=(const LRUCache& other) =delete;
+
+    // Get value with key and mark it as most recently used;
+    // nullptr if not present
+    std::shared_ptr<const Value> get(const std::string& key) {
+#ifndef NIVALIS_EMSCRIPTEN
+        std::lock_guard<std::mutex> lock(mtx);
+#endif
+        auto it = index.find(key);
+        if (it == index.end()) return nullptr;
+        entries.splice(entries.begin(), entries, it->second);
+        return it->second->value;
+    }
+
+    // Add (or replace) value with key and given cost,
+    // then evict values until within budget
+    void put(const std::string& key, std::shared_ptr<const Value> value,
+             size_t cost) {
+#ifndef NIVALIS_EMSCRIPTEN
+        std::lock_guard<std::mutex> lock(mtx);
+#endif
+        auto it = index.find(key);
+        if (it != index.end()) {
+            total_cost -= it->second->cost;
+            entries.erase(it->second);
+            index.erase(it);
+        }
+        entries.push_front(Entry{key, std::move(value), cost});
+        index[key] = entries.begin();
+        total_cost += cost;
+        evict();
+    }
+
+    // Change the budget, evicting values if needed
+    void set_max_cost(size_t new_max_cost) {
+#ifndef NIVALIS_EMSCRIPTEN
+        std::lock_guard<std::mutex> lock(mtx);
+#endif
+        max_cost = new_max_cost;
+        evict();
+    }
+
+    // Remove all values
+    void clear() {
+#ifndef NIVALIS_EMSCRIPTEN
+        std::lock_guard<std::mutex> lock(mtx);
+#endif
+        entries.clear();
+        index.clear();
+        total_cost = 0;
+    }
+
+    // Total cost of values in the cache
+    size_t cost() const {
+#ifndef NIVALIS_EMSCRIPTEN
+        std::lock_guard<std::mutex> lock(mtx);
+#endif
+        return total_cost;
+    }
+    // Number of values in the cache
+    size_t size() const {
+#ifndef NIVALIS_EMSCRIPTEN
+        std::lock_guard<std::mutex> lock(mtx);
+#endif
+        return entries.size();
+    }
+
+private:
+    struct Entry {
+        std::string key;
+        std::shared_ptr<const Value> value;
+        size_t cost;
+    };
+
+    void evict() {
+        while (total_cost > max_cost && entries.size()) {
+            total_cost -= entries.back().cost;
+            index.erase(entries.back().key);
+            entries.pop_back();
+        }
+    }
+
+    // Entries, most recently used first
+    std::list<Entry> entries;
+    std::unordered_map<std::string, typename std::list<Entry>::iterator> index;
+    size_t total_cost = 0, max_cost;
+#ifndef NIVALIS_EMSCRIPTEN
+    mutable std::mutex mtx;
+#endif
+};
+
+}  // namespace nivalis
+#endif // ifndef _LRU_CACHE_H_3F8A61D2_95B7_4C1E_8E0A_6D2C47B19F53
@@ -19,6 +19,9 @@
 #include <set>
 #include <algorithm>
 #include <chrono>
+#include <functional>
+#include <atomic>
+#include <memory>
 #ifndef NIVALIS_EMSCRIPTEN
 #include <thread>
 #include <mutex>
@@ -29,6 +32,8 @@
 #include "color.hpp"
 #include "point.hpp"
 #include "util.hpp"
+#include "plotter/thread_pool.hpp"
+#include "plotter/lru_cache.hpp"
 
 namespace nivalis {
 namespace util {
@@ -106,15 +111,23 @@ struct Function {
     // Internal
     // Function expression
     Expr expr;
-    // Derivative, 2nd derivative (only for explicit)
-    Expr diff, ddiff;
-    // Reciprocal, derivative of reciprocal (only for explicit)
-    Expr recip, drecip;
+    // Whether expr has a symbolic derivative (only for explicit); only gates
+    // the search for critical points, which evaluates derivatives from
+    // jets of expr (Expr::eval_jet)
+    bool differentiable = false;
     // Stores string data
     std::string str;
     // Polyline type: stores line point expressions,
     // Parameteric type: polyline[0] is x, ..[1] is y
     std::vector<Expr> exprs;
+
+    // Frame specialization (see Plotter::specialize_func): expr and exprs
+    // with the variables which are constant during a render (all but x, y,
+    // t) substituted by their values, folded and compiled
+    Expr frame_expr;
+    std::vector<Expr> frame_exprs;
+    // Encoding of expr, exprs and the values substituted
+    std::string frame_key;
 };
 
 // Marks a single point on the plot which can be clicked
@@ -210,6 +223,22 @@ struct DrawBufferObject {
     std::istream& from_bin(std::istream& is);
 };
 
+// Filled rectangle in screen coordinates, for inequality regions;
+// render() rasterizes these into the background bitmap (bg_bitmap)
+// instead of adding objects to the draw buffer
+struct FillRect {
+    float x, y, w, h;
+    color::color c;
+};
+
+// Output of a function in one tile of the screen-aligned lattice of a
+// zoom level (see Plotter::tile_cache)
+struct RenderTile {
+    std::vector<DrawBufferObject> draw_buf;  // In plot coordinates
+    std::vector<FillRect> fills;             // In tile pixel coordinates
+    bool loss_detail = false;
+};
+
 /** Nivalis GUI plotter logic, decoupled from GUI implementation
  * Register GUI event handlers to call handle_xxx
  * Register resize handler to call resize
@@ -217,7 +246,7 @@ struct DrawBufferObject {
  *                   in drawing loop
  *  * Two-thread:  draw_grid()/ (under lock)draw() in drawing thread
  *                 worker thread runs render() on a second plotter
- *                 with functions copied with export_binary_func_and_env()
+ *                 with functions copied with export_snapshot()
  *                 (under lock) on each frame
  * Call reset_view() to reset view, delete_func() delete function,
  * set_curr_func() to set current function, etc.
@@ -595,6 +624,16 @@ public:
                 graph.string(points[0][0], points[0][1], obj.str, obj.c, 0.5f, 0.5f /* Center text */);
             }
         };
+        if (bg_bitmap.size()) {
+            // Background bitmap (inequality regions), positioned
+            // onto current view
+            const View& bv = bg_bitmap_view;
+            const float x0 = static_cast<float>((bv.xmin - view.xmin) * view.swid / (view.xmax - view.xmin));
+            const float x1 = static_cast<float>((bv.xmax - view.xmin) * view.swid / (view.xmax - view.xmin));
+            const float y0 = static_cast<float>((view.ymax - bv.ymax) * view.shigh / (view.ymax - view.ymin));
+            const float y1 = static_cast<float>((view.ymax - bv.ymin) * view.shigh / (view.ymax - view.ymin));
+            graph.image(x0, y0, x1 - x0, y1 - y0, bg_bitmap.data(), bv.swid, bv.shigh);
+        }
         std::vector<size_t> curr_func_obj_idxs;
         for (size_t i = 0; i < draw_buf.size(); ++i) {
             auto& obj = draw_buf[i];
@@ -729,22 +768,123 @@ public:
     std::ostream& export_json(std::ostream& os, bool pretty = false) const;
     std::istream& import_json(std::istream& is, std::string* error_msg = nullptr);
 
-    // Binary serialization, only functions, view, and env (used to sync data to worker before render)
+    // Immutable snapshot of functions, view, and env (used to sync data to
+    // a worker in the same process before render, without serialization).
+    // Functions and env are shared with the previous snapshot if unchanged
+    struct Snapshot {
+        size_t curr_func;
+        std::vector<std::shared_ptr<const Function> > funcs;
+        View view;
+        uint64_t x_var, y_var, t_var, r_var;
+        bool implicit_adaptive;
+        // Variable names and user function definitions; values in
+        // env->vars may be out of date, the current ones are in vars
+        std::shared_ptr<const Environment> env;
+        std::vector<double> vars;
+    };
+    // Take snapshot; copies only functions changed since the last snapshot
+    std::shared_ptr<const Snapshot> export_snapshot();
+    // Load snapshot; copies only functions changed since the last snapshot
+    // loaded, keeping compiled expressions of the others
+    void import_snapshot(const std::shared_ptr<const Snapshot>& snapshot);
+
+    // Binary serialization, only functions, view, render options, and env
+    // (used to sync data to worker before render)
     std::ostream& export_binary_func_and_env(std::ostream& os) const;
     std::istream& import_binary_func_and_env(std::istream& is);
 
-    // Binary serialization, only draw_buf, pt_markers (used to sync data from worker after render)
-    std::ostream& export_binary_render_result(std::ostream& os) const;
+    // Binary serialization of render result: draw_buf, pt_markers, bg_bitmap and
+    // detail lost warning (used to sync data from worker after render).
+    // Output is grouped by function, and only functions whose output changed
+    // since frame ack_frame are included, where ack_frame is the receiver's
+    // render_result_frame(), if it is one of the last few frames exported
+    std::ostream& export_binary_render_result(std::ostream& os, uint64_t ack_frame = 0);
+    // Import render result; fails (setting failbit) if it is relative
+    // to a frame which is not one of the last few frames imported
     std::istream& import_binary_render_result(std::istream& is);
+    // Id of last render result frame imported, 0 if none
+    uint64_t render_result_frame() const;
 private:
     // Helper for detecting if px, py activates a marker (in grid);
     // if so sets marker_* and current function
     // no_passive: if set, ignores passive markers
     // drag_var: if set, allows user to begin dragging a marker
     void detect_marker_click(int px, int py, bool no_passive, bool drag_var);
+
+    // Update differentiable flag of explicit function from its expr
+    void update_differentiable(Function& func);
+    // Shapes/markers drawn for one function; render() draws functions
+    // concurrently into these, then merges them in function order
+    struct FuncRenderOutput {
+        std::vector<DrawBufferObject> draw_buf;
+        std::vector<FillRect> fills;
+        // RGBA raster in view (as bg_bitmap), drawn below fills; empty if none
+        std::string raster;
+        std::vector<PointMarker> pt_markers;
+        bool loss_detail = false;
+    };
+    // Output of a function from an earlier render(), reused while
+    // everything it was drawn from is unchanged
+    struct FuncRenderCache {
+        // Encoding of the inputs other than variable values: view,
+        // relevant settings, the function (and functions it finds
+        // intersections with) and user functions called
+        std::string key;
+        // Variables read, directly or through user functions,
+        // and their values
+        std::vector<uint64_t> var_addrs;
+        std::vector<double> var_vals;
+        FuncRenderOutput out;
+        bool valid = false;
+    };
+    // Whether cancel_render is set (checked periodically while rendering)
+    bool render_cancelled() const {
+        return cancel_render.load(std::memory_order_relaxed);
+    }
+    // Newton's method results from a seed point of plot_explicit
+    struct ExplicitSeed {
+        double y, root, asymp, extr;
+        // Domain boundary between the previous seed and this one
+        // (NaN if none), valid if has_domain
+        double domain;
+        bool has_domain = false;
+    };
+    // Samples and seeds of an explicit function at points of the lattice
+    // of the zoom level, kept for the visible range so that panning only
+    // evaluates newly visible points
+    struct ExplicitSampleCache {
+        // Encoding of the scene, zoom level and lattice
+        std::string key;
+        // Function values at lattice points sample_begin, sample_begin+1, ...
+        int64_t sample_begin = 0;
+        std::vector<double> sample_ys;
+        // Results from seed points seed_begin, seed_begin+1, ...
+        int64_t seed_begin = 0;
+        std::vector<ExplicitSeed> seeds;
+    };
+    // Get render cache key (not including the view) and variables read
+    // for function funcid
+    void get_render_inputs(size_t funcid, std::string& key,
+                           std::vector<uint64_t>& var_addrs) const;
+    // Draw function by tiles of the lattice of the zoom level of view,
+    // using plot_tile(tile_view, tile_out) for tiles not in tile_cache;
+    // for output which depends on the view only through the screen
+    // positions sampled. scene_key must identify all other inputs
+    void plot_tiled(size_t funcid, const View& view, const std::string& scene_key,
+            const std::function<void(const View&, FuncRenderOutput&)>& plot_tile,
+            FuncRenderOutput& out);
+    // Update func.frame_expr, func.frame_exprs for the current values of
+    // the variables (no-op if unchanged)
+    void specialize_func(Function& func);
     // Plotting helpser for specific function types, used in render() code
-    void plot_implicit(size_t funcid);
-    void plot_explicit(size_t funcid, bool reverse_xy);
+    void plot_implicit(size_t funcid, const View& view, FuncRenderOutput& out);
+    // Implicit function plotting by adaptive quadtree subdivision
+    // (used by plot_implicit if implicit_adaptive is set)
+    void plot_implicit_adaptive(size_t funcid, const View& view, FuncRenderOutput& out);
+    void plot_explicit(size_t funcid, bool reverse_xy, const std::string& scene_key,
+            FuncRenderOutput& out);
+    // Mandelbrot/Julia set, rendered into out.raster (in fractal.cpp)
+    void plot_fractal(size_t funcid, FuncRenderOutput& out);
 public:
     // If true, parses expressions as Latex instead of 'Nivalis expression'
     // this is fixed for each plotter instance. The I/O json format
@@ -763,6 +903,12 @@ public:
     bool enable_grid = true;                // If true, draws the grid
     bool polar_grid = false;                // If true, draws polar grid and polar (i.e. unsigned) axes labels
                                             // note this has an effect even when enable_grid = false
+    bool implicit_adaptive = false;         // If true, plots implicit functions and inequalities
+                                            // by adaptive quadtree subdivision, refining only near
+                                            // the curve, instead of on a fixed grid
+    bool render_coarse = false;             // If true, render() draws a quick preview: coarser
+                                            // sampling and no critical points or intersections
+                                            // (for progressive rendering)
 
     std::vector<Function> funcs;            // Functions
     std::string func_error;                 // Function parsing error str
@@ -827,11 +973,31 @@ public:
     std::mutex mtx;
 #endif
 
+    // Worker threads for rendering, reused across frames;
+    // use thread_pool.resize(n) to set the number of workers
+    ThreadPool thread_pool;
+
+    // Set (from any thread) to abandon the render() in progress, e.g. when
+    // its view or functions are stale: render() then returns early with
+    // render_complete = false and partial output; clear before rendering again
+    std::atomic<bool> cancel_render{false};
+
+    // Tiles of implicit function and polar inequality output, by scene,
+    // zoom level and tile position, so that panning only draws newly
+    // visible tiles; cost is in bytes, use tile_cache.set_max_cost(n)
+    // to set the memory budget
+    LRUCache<RenderTile> tile_cache{64 << 20};
+
     std::vector<DrawBufferObject> draw_buf;  // Function draw buffer
                                              // render() populates it
                                              // draw() draws these shapes to
                                              // an adaptor
-    std::string bg_bitmap;                   // Background bitmap
+    std::string bg_bitmap;                   // Background bitmap: RGBA raster of inequality
+                                             // regions and fractals (row major, 4 bytes per pixel,
+                                             // bg_bitmap_view.swid x bg_bitmap_view.shigh),
+                                             // empty if none; render() populates it,
+                                             // draw() draws it below draw_buf
+    View bg_bitmap_view;                     // View bg_bitmap was rendered in
 
     std::vector<PointMarker> pt_markers;    // Point markers
                                             // render() populates non-passive
@@ -846,6 +1012,7 @@ public:
                                             // used on mouse events
 
     bool loss_detail = false;                 // Whether some detail is lost (if set, will show error)
+    bool render_complete = true;              // False if last render() was cancelled
 private:
     std::deque<color::color> reuse_colors;    // Reusable colors
     size_t last_expr_color = 0;               // Next available color index if no reusable
@@ -862,6 +1029,37 @@ private:
         slider_animation_prev_time;
 
     size_t next_func_name = 0;                // Next available function name
+
+    std::vector<FuncRenderCache> render_cache; // Output of each function from
+                                               // previous render() (by index)
+    std::vector<ExplicitSampleCache> explicit_cache; // Samples of each explicit
+                                                     // function (by index)
+
+    // Render result transport (export/import_binary_render_result);
+    // slot i holds the output of function i, the last slot other output
+    // Exported frame: hash of each encoded slot and of bitmap
+    struct RenderResultSent {
+        uint64_t frame;
+        std::vector<size_t> slot_hashes;
+        size_t bitmap_hash;
+    };
+    // Imported frame: slots and bitmap, shared with later frames if unchanged
+    struct RenderResultSlot {
+        std::vector<DrawBufferObject> draw_buf;
+        std::vector<PointMarker> pt_markers;
+    };
+    struct RenderResultFrame {
+        uint64_t frame;
+        std::vector<std::shared_ptr<const RenderResultSlot> > slots;
+        std::shared_ptr<const std::string> bitmap;
+        View bitmap_view;
+    };
+    std::deque<RenderResultSent> render_result_sent;  // Last few exported, newest last
+    std::deque<RenderResultFrame> render_result_recv; // Last few imported, newest last
+    uint64_t next_render_result_frame = 1;
+
+    // Last snapshot exported, or the last one imported
+    std::shared_ptr<const Snapshot> last_snapshot;
 };
 }  // namespace nivalis
 #endif // ifndef _PLOTTER_H_54FCC6EA_4F60_4EBB_88F4_C6E918887C77
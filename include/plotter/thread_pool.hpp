@@ -0,0 +1,75 @@
+#pragma once
+#ifndef _THREAD_POOL_H_7C4E2B9A_3D51_4F0E_9A86_2B1F6D0C8E47
+#define _THREAD_POOL_H_7C4E2B9A_3D51_4F0E_9A86_2B1F6D0C8E47
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+
+namespace nivalis {
+
+// Persistent work-stealing thread pool, used by the plotter's render
+// pipeline so that threads are not created/joined every frame.
+// Each worker owns a task deque: it runs its own newest tasks first, and
+// steals the oldest tasks of other workers when it runs out.
+// A thread waiting on a TaskGroup runs pending tasks while it waits, so
+// tasks may themselves submit and wait on tasks.
+// With 0 workers (always the case under Emscripten), tasks run
+// immediately in the submitting thread.
+class ThreadPool {
+public:
+    // Set of tasks which are waited on together
+    class TaskGroup {
+    public:
+        explicit TaskGroup(ThreadPool& pool);
+        TaskGroup(const TaskGroup& other) =delete;
+        TaskGroup& operator=(const TaskGroup& other) =delete;
+        // Waits for all tasks
+        ~TaskGroup();
+
+        // Submit a task to the pool
+        void run(std::function<void()> task);
+        // Wait for all tasks submitted so far, running tasks meanwhile
+        void wait();
+
+    private:
+        friend class ThreadPool;
+        ThreadPool& pool;
+        // Number of submitted, unfinished tasks
+        std::atomic<size_t> remaining;
+    };
+
+    // Create pool with n_workers worker threads
+    explicit ThreadPool(size_t n_workers = default_size());
+    ThreadPool(const ThreadPool& other) =delete;
+    ThreadPool& operator=(const ThreadPool& other) =delete;
+    ~ThreadPool();
+
+    // Change the number of worker threads;
+    // must not be called while tasks are pending
+    void resize(size_t n_workers);
+
+    // Number of worker threads
+    size_t size() const;
+
+    // Number of threads tasks may run on concurrently
+    // (workers and the waiting thread)
+    size_t concurrency() const;
+
+    // Run fn(begin, end) on subranges of [0, n) of about grain
+    // items each, in parallel; returns once all are done
+    void parallel_for(size_t n, size_t grain,
+                      const std::function<void(size_t, size_t)>& fn);
+
+    // Default number of workers: one less than the number of
+    // hardware threads (the waiting thread also runs tasks)
+    static size_t default_size();
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+}  // namespace nivalis
+#endif // ifndef _THREAD_POOL_H_7C4E2B9A_3D51_4F0E_9A86_2B1F6D0C8E47
@@ -0,0 +1,65 @@
+#pragma once
+#ifndef _POLYNOMIAL_H_EA92018A_66FB_4173_A8E3_D5B3C654C8C6
+#define _POLYNOMIAL_H_EA92018A_66FB_4173_A8E3_D5B3C654C8C6
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "expr.hpp"
+#include "env.hpp"
+
+namespace nivalis {
+
+// Polynomial in one variable with real coefficients
+struct Polynomial {
+    Polynomial();
+    // Constant polynomial
+    explicit Polynomial(double c);
+    explicit Polynomial(const std::vector<double>& coeffs);
+
+    // Degree, -1 for the zero polynomial
+    int degree() const;
+    // Evaluate at x (Horner's method)
+    double operator()(double x) const;
+    // Evaluate at n points: out[i] = p(xs[i])
+    void eval_batch(const double* xs, double* out, size_t n) const;
+    // Derivative
+    Polynomial diff() const;
+
+    Polynomial operator+(const Polynomial& other) const;
+    Polynomial operator-(const Polynomial& other) const;
+    Polynomial operator*(const Polynomial& other) const;
+    Polynomial operator*(double c) const;
+    Polynomial operator-() const;
+
+    // Distinct real roots in [lo, hi], in increasing order, each to within
+    // eps; found by isolating them with a Sturm sequence, then bisection
+    std::vector<double> real_roots(double lo, double hi, double eps) const;
+
+    // Coefficients: coeffs[i] is the coefficient of x^i;
+    // the last one is nonzero
+    std::vector<double> coeffs;
+};
+
+// Rational function num(x) / den(x)
+struct RationalFunction {
+    // Evaluate at x
+    double operator()(double x) const;
+    // Evaluate at n points: out[i] = f(xs[i])
+    void eval_batch(const double* xs, double* out, size_t n) const;
+    // Whether the denominator is a constant
+    bool is_polynomial() const;
+
+    Polynomial num, den;
+};
+
+// Detect if expr is a rational function of the variable with address
+// var_addr, with other variables taken from ctx; false if not, or if
+// a degree would exceed max_degree.
+// Only sums of monomials (and quotients of such) are accepted: expanding
+// products of sums like (x-1)^8 can lose precision near their roots
+bool to_rational(const Expr& expr, uint64_t var_addr, EvalContext& ctx,
+                 RationalFunction& out, int max_degree = 16);
+
+}  // namespace nivalis
+
+#endif // ifndef _POLYNOMIAL_H_EA92018A_66FB_4173_A8E3_D5B3C654C8C6
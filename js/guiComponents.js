@@ -380,6 +380,7 @@ var ViewConfig = {
         $('#view-axes').prop('checked', Nivalis.get_axes_enabled());
         $('#view-grid').prop('checked', Nivalis.get_grid_enabled());
         $('#view-polar').prop('checked', Nivalis.get_is_polar_grid());
+        $('#view-adaptive').prop('checked', Nivalis.get_implicit_adaptive());
     },
     resetView: function() {
         Nivalis.reset_view();
@@ -422,6 +423,12 @@ var ViewConfig = {
             );
             Nivalis.redraw();
         });
+        $('#view-adaptive').change(function(){
+            Nivalis.set_implicit_adaptive(
+                $('#view-adaptive').prop('checked')
+            );
+            Nivalis.redraw();
+        });
     }
 };
 
@@ -0,0 +1,769 @@
+#include "expr.hpp"
+
+#include "env.hpp"
+
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <unordered_map>
+#include "opcodes.hpp"
+#include "internal/eval_ops.hpp"
+
+// Compile AST into a flat register-machine program:
+// - control flow (bnz/sums/prods) becomes jumps with precomputed targets,
+//   so no thunk bookkeeping at runtime
+// - function arguments and constants live in registers
+//   (no load instructions needed)
+// - common patterns are fused into superinstructions (a*b+c, x^2, x^const)
+// - repeated subexpressions are computed once into a dedicated register
+// - where supported (GCC/Clang), instructions are dispatched by
+//   direct threading (each instruction stores its handler address)
+
+#if defined(__GNUC__) || defined(__clang__)
+#define NIVALIS_THREADED_DISPATCH
+#endif
+
+namespace nivalis {
+
+namespace {
+const double NONE = std::numeric_limits<double>::quiet_NaN();
+
+// Bytecode operations; R = registers
+#define NIVALIS_BYTECODE_OPS(X) \
+    X(LOADV)   /* R[dst] = vars[ref] */ \
+    X(ADD) X(SUB) X(MUL) X(DIV) X(MAX) X(MIN)  /* R[dst] = R[a] op R[b] */ \
+    X(LT) X(LE) X(EQ) X(NE) X(GE) X(GT) \
+    X(POW) \
+    X(BIN)     /* R[dst] = apply_binary(opcode, R[a], R[b]) */ \
+    X(MULADD)  /* R[dst] = R[a] * R[b] + R[c] */ \
+    X(POWC)    /* R[dst] = pow(R[a], imm) */ \
+    X(NEG) X(ABS) X(SQRT) X(SQR) X(EXP) X(LOG) X(SIN) X(COS) /* R[dst] = op(R[a]) */ \
+    X(UN)      /* R[dst] = apply_unary(opcode, R[a]) */ \
+    X(MOV)     /* R[dst] = R[a] */ \
+    X(JZ)      /* if R[a] == 0 jump to target */ \
+    X(JMP)     /* jump to target */ \
+    X(LOOP)    /* sums/prods step: if R[a] is nan jump to target, else */ \
+               /* set vars[ref] to loop index and advance R[a] towards R[b] */ \
+    X(ACCADD) X(ACCMUL) /* R[dst] += R[a], R[dst] *= R[a] */ \
+    X(CALL)    /* R[dst] = call user function (args in R[a..a+n_args), */ \
+               /* in reverse order) */ \
+    X(RET)     /* return R[a] */
+
+enum BytecodeOp {
+#define NIVALIS_BYTECODE_ENUM(name) BC_##name,
+    NIVALIS_BYTECODE_OPS(NIVALIS_BYTECODE_ENUM)
+#undef NIVALIS_BYTECODE_ENUM
+    _BC_COUNT
+};
+}  // namespace
+
+namespace detail {
+struct Program {
+    struct Instr {
+        // Handler address (direct threading), set at compile time
+        const void* handler;
+        // Bytecode op (BytecodeOp)
+        uint32_t op;
+        // Register operands; for jumps, c is the target instruction index
+        uint32_t dst, a, b, c;
+        union {
+            double imm;
+            uint64_t ref;
+            // opcode for BIN/UN
+            uint32_t opcode;
+            // For function calls: (func_id, n_args)
+            uint32_t call_info[2];
+        };
+    };
+    std::vector<Instr> code;
+    // Constants; copied into registers n_args.. at start of evaluation
+    std::vector<double> consts;
+    // Number of args (registers 0..n_args-1)
+    uint32_t n_args;
+    // Total number of registers used
+    uint32_t n_regs;
+    // User functions inlined, as (id, version)
+    std::vector<std::pair<uint64_t, uint64_t> > inlined;
+};
+}  // namespace detail
+
+namespace {
+using Program = detail::Program;
+using Instr = detail::Program::Instr;
+
+// Register file shared by all programs on this thread;
+// each evaluation uses a frame [base, base + n_regs)
+thread_local std::vector<double> reg_stack;
+thread_local size_t reg_top = 0;
+// Function call stack height
+thread_local size_t call_stk_height = 0;
+// Max function call stack height (as in eval_ast)
+const size_t MAX_CALL_STK_HEIGHT = 256;
+
+// Execute program with frame at reg_stack[base], whose arguments are
+// already in place. If table_out is set, instead outputs the
+// dispatch table and returns.
+double exec_program(const Program* prog, EvalContext* ctx, size_t base,
+                    const void* const** table_out = nullptr) {
+#ifdef NIVALIS_THREADED_DISPATCH
+    static const void* const dispatch_table[] = {
+#define NIVALIS_BYTECODE_LABEL(name) &&L_##name,
+        NIVALIS_BYTECODE_OPS(NIVALIS_BYTECODE_LABEL)
+#undef NIVALIS_BYTECODE_LABEL
+    };
+    if (table_out != nullptr) {
+        *table_out = dispatch_table;
+        return 0.;
+    }
+#define BC_CASE(name) L_##name:
+#define BC_NEXT goto *(++ip)->handler
+#define BC_JUMP(target) { ip = code + (target); goto *ip->handler; }
+#define BC_START goto *ip->handler;
+#define BC_END
+#else
+#define BC_CASE(name) case BC_##name:
+#define BC_NEXT ++ip; continue
+#define BC_JUMP(target) { ip = code + (target); continue; }
+#define BC_START while (true) { switch (ip->op) {
+#define BC_END } }
+#endif
+    const Instr* const code = prog->code.data();
+    const Instr* ip = code;
+    double* R = &reg_stack[base];
+    std::copy(prog->consts.begin(), prog->consts.end(), R + prog->n_args);
+    double* const vars = ctx->vars;
+    const size_t saved_top = reg_top;
+    reg_top = base + prog->n_regs;
+
+    BC_START
+        BC_CASE(LOADV) R[ip->dst] = vars[ip->ref]; BC_NEXT;
+        BC_CASE(ADD) R[ip->dst] = R[ip->a] + R[ip->b]; BC_NEXT;
+        BC_CASE(SUB) R[ip->dst] = R[ip->a] - R[ip->b]; BC_NEXT;
+        BC_CASE(MUL) R[ip->dst] = R[ip->a] * R[ip->b]; BC_NEXT;
+        BC_CASE(DIV) R[ip->dst] = R[ip->a] / R[ip->b]; BC_NEXT;
+        BC_CASE(MAX) R[ip->dst] = std::max(R[ip->a], R[ip->b]); BC_NEXT;
+        BC_CASE(MIN) R[ip->dst] = std::min(R[ip->a], R[ip->b]); BC_NEXT;
+        BC_CASE(LT) R[ip->dst] = static_cast<double>(R[ip->a] < R[ip->b]); BC_NEXT;
+        BC_CASE(LE) R[ip->dst] = static_cast<double>(R[ip->a] <= R[ip->b]); BC_NEXT;
+        BC_CASE(EQ) R[ip->dst] = static_cast<double>(R[ip->a] == R[ip->b]); BC_NEXT;
+        BC_CASE(NE) R[ip->dst] = static_cast<double>(R[ip->a] != R[ip->b]); BC_NEXT;
+        BC_CASE(GE) R[ip->dst] = static_cast<double>(R[ip->a] >= R[ip->b]); BC_NEXT;
+        BC_CASE(GT) R[ip->dst] = static_cast<double>(R[ip->a] > R[ip->b]); BC_NEXT;
+        BC_CASE(POW) R[ip->dst] = std::pow(R[ip->a], R[ip->b]); BC_NEXT;
+        BC_CASE(BIN) R[ip->dst] = detail::apply_binary(ip->opcode,
+                R[ip->a], R[ip->b]); BC_NEXT;
+        BC_CASE(MULADD) R[ip->dst] = R[ip->a] * R[ip->b] + R[ip->c]; BC_NEXT;
+        BC_CASE(POWC) R[ip->dst] = std::pow(R[ip->a], ip->imm); BC_NEXT;
+        BC_CASE(NEG) R[ip->dst] = -R[ip->a]; BC_NEXT;
+        BC_CASE(ABS) R[ip->dst] = std::fabs(R[ip->a]); BC_NEXT;
+        BC_CASE(SQRT) R[ip->dst] = std::sqrt(R[ip->a]); BC_NEXT;
+        BC_CASE(SQR) R[ip->dst] = R[ip->a] * R[ip->a]; BC_NEXT;
+        BC_CASE(EXP) R[ip->dst] = std::exp(R[ip->a]); BC_NEXT;
+        BC_CASE(LOG) R[ip->dst] = std::log(R[ip->a]); BC_NEXT;
+        BC_CASE(SIN) R[ip->dst] = std::sin(R[ip->a]); BC_NEXT;
+        BC_CASE(COS) R[ip->dst] = std::cos(R[ip->a]); BC_NEXT;
+        BC_CASE(UN) R[ip->dst] = detail::apply_unary(ip->opcode, R[ip->a]); BC_NEXT;
+        BC_CASE(MOV) R[ip->dst] = R[ip->a]; BC_NEXT;
+        BC_CASE(JZ)
+            if (R[ip->a] == 0.) BC_JUMP(ip->c);
+            BC_NEXT;
+        BC_CASE(JMP) BC_JUMP(ip->c);
+        BC_CASE(LOOP)
+            {
+                // Same semantics as sums/prods in eval_ast
+                double& cur = R[ip->a];
+                if (std::isnan(cur)) BC_JUMP(ip->c);
+                int64_t a = static_cast<int64_t>(cur),
+                        b = static_cast<int64_t>(R[ip->b]);
+                int64_t step = (a <= b) ? 1 : -1;
+                vars[ip->ref] = static_cast<double>(a);
+                a += step;
+                if (a == b + step) cur = NONE;
+                else cur = static_cast<double>(a);
+            }
+            BC_NEXT;
+        BC_CASE(ACCADD) R[ip->dst] += R[ip->a]; BC_NEXT;
+        BC_CASE(ACCMUL) R[ip->dst] *= R[ip->a]; BC_NEXT;
+        BC_CASE(CALL)
+            {
+                const size_t n_args = ip->call_info[1];
+                const auto& func = ctx->env.funcs[ip->call_info[0]];
+                if (n_args != func.n_args ||                  // Should not happen
+                    func.expr.program.get() == prog ||       // Disallow recursion
+                    call_stk_height > MAX_CALL_STK_HEIGHT) { // Too many nested calls
+                    reg_top = saved_top;
+                    return NONE;
+                }
+                // Arguments were evaluated into registers in reverse order
+                double* args = R + ip->a;
+                std::reverse(args, args + n_args);
+                ++call_stk_height;
+                double result;
+                if (func.expr.program) {
+                    const Program& callee = *func.expr.program;
+                    const size_t callee_base = reg_top;
+                    if (reg_stack.size() < callee_base + callee.n_regs) {
+                        reg_stack.resize(callee_base + callee.n_regs);
+                        R = &reg_stack[base];
+                        args = R + ip->a;
+                    }
+                    double* callee_regs = &reg_stack[callee_base];
+                    std::copy(args, args + std::min<size_t>(n_args, callee.n_args),
+                              callee_regs);
+                    std::fill(callee_regs + std::min<size_t>(n_args, callee.n_args),
+                              callee_regs + callee.n_args, NONE);
+                    result = exec_program(&callee, ctx, callee_base);
+                    R = &reg_stack[base];
+                } else {
+                    // eval_ast may run programs which resize reg_stack,
+                    // so pass a copy of the arguments
+                    const std::vector<double> arg_vals(args, args + n_args);
+                    result = detail::eval_ast(*ctx, func.expr.ast,
+                                              arg_vals.data(), n_args);
+                    R = &reg_stack[base];
+                }
+                --call_stk_height;
+                R[ip->dst] = result;
+            }
+            BC_NEXT;
+        BC_CASE(RET)
+            {
+                double result = R[ip->a];
+                reg_top = saved_top;
+                return result;
+            }
+    BC_END
+#undef BC_CASE
+#undef BC_NEXT
+#undef BC_JUMP
+#undef BC_START
+#undef BC_END
+    return NONE; // Unreachable
+}
+
+// Compiles AST to Program
+struct Compiler {
+    explicit Compiler(const Expr::AST& ast) : ast(ast) { }
+
+    // Compile program; returns false on failure (malformed AST)
+    bool compile(Program& prog) {
+        using namespace OpCode;
+        // Arguments go in registers 0..n_args-1
+        for (const auto& node : ast) {
+            if (node.opcode == arg) {
+                n_args = std::max<uint32_t>(n_args, node.ref + 1);
+            }
+        }
+        // Then constants (including initial values for sums/prods)
+        const_reg.assign(ast.size(), 0);
+        for (size_t i = 0; i < ast.size(); ++i) {
+            const auto& node = ast[i];
+            if (node.opcode == val) {
+                const_reg[i] = add_const(node.val);
+            } else if (node.opcode == null) {
+                const_reg[i] = add_const(NONE);
+            } else if (node.opcode == sums || node.opcode == prods) {
+                add_const(node.opcode == prods ? 1. : 0.);
+            }
+        }
+        for (auto& reg : const_reg) reg += n_args;
+        first_temp = n_regs = n_args + static_cast<uint32_t>(consts.size());
+        find_common_subexprs();
+        bool ok = true;
+        size_t end;
+        uint32_t result = compile_region(0, first_temp, end, ok);
+        if (!ok || end != ast.size()) return false;
+        emit(BC_RET).a = result;
+
+        prog.code = std::move(code);
+        prog.consts = std::move(consts);
+        prog.n_args = n_args;
+        prog.n_regs = n_regs;
+#ifdef NIVALIS_THREADED_DISPATCH
+        const void* const* table;
+        exec_program(nullptr, nullptr, 0, &table);
+        for (auto& instr : prog.code) instr.handler = table[instr.op];
+#endif
+        return true;
+    }
+
+private:
+    Instr& emit(uint32_t op, uint32_t dst = 0, uint32_t a = 0, uint32_t b = 0) {
+        code.emplace_back();
+        Instr& instr = code.back();
+        instr.handler = nullptr;
+        instr.op = op; instr.dst = dst; instr.a = a; instr.b = b;
+        instr.c = 0; instr.ref = 0;
+        return instr;
+    }
+
+    void use_reg(uint32_t reg) {
+        n_regs = std::max(n_regs, reg + 1);
+    }
+
+    // Index after the subtree at idx
+    size_t skip(size_t idx, bool& ok) {
+        if (idx >= ast.size()) { ok = false; return ast.size(); }
+        size_t n_children = ast[idx].opcode == OpCode::call ?
+            ast[idx].call_info[1] : OpCode::n_args(ast[idx].opcode);
+        ++idx;
+        for (size_t i = 0; i < n_children && ok; ++i) idx = skip(idx, ok);
+        return idx;
+    }
+
+    // Position of the children of node at idx
+    std::vector<size_t> children(size_t idx, size_t n_children, size_t& end, bool& ok) {
+        std::vector<size_t> result(n_children);
+        end = idx + 1;
+        for (size_t i = 0; i < n_children && ok; ++i) {
+            result[i] = end;
+            end = skip(end, ok);
+        }
+        return result;
+    }
+
+    // Body of thunk at idx (thunk_ret body thunk_jmp)
+    size_t thunk_body(size_t idx, bool& ok) {
+        if (idx >= ast.size() || ast[idx].opcode != OpCode::thunk_ret) ok = false;
+        return idx + 1;
+    }
+
+    // Add constant if not already present; returns its index
+    uint32_t add_const(double v) {
+        for (size_t i = 0; i < consts.size(); ++i) {
+            const double c = consts[i];
+            if (c == v ? std::signbit(c) == std::signbit(v) :
+                         std::isnan(c) && std::isnan(v)) {
+                return static_cast<uint32_t>(i);
+            }
+        }
+        consts.push_back(v);
+        return static_cast<uint32_t>(consts.size() - 1);
+    }
+
+    // Find repeated pure subtrees (common subexpressions) within each
+    // region of straight-line code: the root, a bnz branch, or a sums/prods
+    // body. Within a region, the first occurrence evaluated is always
+    // executed before the others, so its result can be kept in a register.
+    void find_common_subexprs() {
+        using namespace OpCode;
+        node_end.assign(ast.size(), 0);
+        node_hash.assign(ast.size(), 0);
+        node_pure.assign(ast.size(), false);
+        node_region.assign(ast.size(), 0);
+        cse_class.assign(ast.size(), -1);
+        region_cse.assign(ast.size(), {});
+        has_call = false;
+        loop_vars.clear();
+        for (const auto& node : ast) {
+            if (node.opcode == call) has_call = true;
+            else if (node.opcode == sums || node.opcode == prods) {
+                loop_vars.push_back(node.ref);
+            }
+        }
+        bool ok = true;
+        analyze(0, 0, ok);
+        if (!ok) {
+            cse_class.assign(ast.size(), -1);
+            return;
+        }
+
+        // Group equal subtrees in the same region (leaves are not worth it)
+        std::unordered_multimap<uint64_t, size_t> rep_of_hash;
+        std::vector<size_t> rep;
+        for (size_t i = 0; i < ast.size(); ++i) {
+            if (!node_pure[i] || node_end[i] == i + 1) continue;
+            const size_t len = node_end[i] - i;
+            auto range = rep_of_hash.equal_range(node_hash[i]);
+            for (auto it = range.first; it != range.second; ++it) {
+                size_t j = it->second;
+                if (node_region[j] == node_region[i] &&
+                    node_end[j] - j == len &&
+                    std::equal(ast.begin() + i, ast.begin() + node_end[i],
+                               ast.begin() + j)) {
+                    cse_class[i] = cse_class[j];
+                    break;
+                }
+            }
+            if (!~cse_class[i]) {
+                cse_class[i] = static_cast<uint32_t>(rep.size());
+                rep.push_back(i);
+                rep_of_hash.emplace(node_hash[i], i);
+            }
+        }
+
+        // Count occurrences, not counting those inside a repeated occurrence
+        // of a larger subexpression (which is not evaluated again)
+        std::vector<uint32_t> count(rep.size()), count_outer(rep.size());
+        for (size_t i = 0; i < ast.size(); ++i) {
+            if (~cse_class[i]) ++count[cse_class[i]];
+        }
+        size_t skip_until = 0;
+        for (size_t i = 0; i < ast.size(); ++i) {
+            if (i < skip_until || !~cse_class[i]) continue;
+            const uint32_t cls = cse_class[i];
+            if (count[cls] < 2) continue;
+            if (count_outer[cls]++) skip_until = node_end[i];
+        }
+        uint32_t n_cse = 0;
+        std::vector<uint32_t> new_class(rep.size(), -1);
+        for (size_t cls = 0; cls < rep.size(); ++cls) {
+            if (count_outer[cls] < 2) continue;
+            new_class[cls] = n_cse++;
+            region_cse[node_region[rep[cls]]].push_back(new_class[cls]);
+        }
+        for (auto& cls : cse_class) {
+            if (~cls) cls = new_class[cls];
+        }
+        cse_reg.assign(n_cse, 0);
+        cse_ready.assign(n_cse, false);
+    }
+
+    // Compute subtree end, hash, purity and region of each node;
+    // returns index after the subtree at idx
+    size_t analyze(size_t idx, size_t region, bool& ok) {
+        using namespace OpCode;
+        if (idx >= ast.size()) { ok = false; return ast.size(); }
+        const auto& node = ast[idx];
+        const size_t n_children = node.opcode == call ?
+            node.call_info[1] : OpCode::n_args(node.opcode);
+        uint64_t hash = node.opcode;
+        bool pure;
+        switch (node.opcode) {
+            case bnz: case sums: case prods: case bsel: case call:
+            case thunk_ret: case thunk_jmp:
+                pure = false; break;
+            case ref:
+                // Sums/prods (also inside called functions) write variables
+                pure = !has_call && std::find(loop_vars.begin(),
+                        loop_vars.end(), node.ref) == loop_vars.end();
+                break;
+            default:
+                pure = true;
+        }
+        if (OpCode::has_ref(node.opcode) || node.opcode == val) {
+            hash ^= node.ref + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+        }
+        size_t end = idx + 1;
+        for (size_t i = 0; i < n_children && ok; ++i) {
+            // Branches and loop bodies are separate regions
+            // (identified by the index of the body)
+            const bool new_region = (node.opcode == bnz && i > 0) ||
+                ((node.opcode == sums || node.opcode == prods) && i == 2);
+            const size_t child = end;
+            end = analyze(child, new_region ? child + 1 : region, ok);
+            if (!ok) return end;
+            hash ^= node_hash[child] + 0x9e3779b97f4a7c15ULL +
+                (hash << 6) + (hash >> 2);
+            pure = pure && node_pure[child];
+        }
+        node_end[idx] = end;
+        node_hash[idx] = hash;
+        node_pure[idx] = pure;
+        node_region[idx] = region;
+        return end;
+    }
+
+    // Compile body of a region (see find_common_subexprs), reserving
+    // registers for its common subexpressions starting at dst
+    uint32_t compile_region(size_t idx, uint32_t dst, size_t& end, bool& ok) {
+        if (idx < ast.size()) {
+            for (uint32_t cls : region_cse[idx]) {
+                cse_reg[cls] = dst++;
+                cse_ready[cls] = false;
+            }
+        }
+        return compile_node(idx, dst, end, ok);
+    }
+
+    // Compile body of a region, making sure the result ends up in register dst
+    void region_to(size_t idx, uint32_t dst, bool& ok) {
+        uint32_t reg = compile_region(idx, dst, tmp_end, ok);
+        use_reg(dst);
+        if (reg != dst) emit(BC_MOV, dst, reg);
+    }
+
+    bool is_cse(size_t idx) const {
+        return idx < cse_class.size() && ~cse_class[idx];
+    }
+
+    // Compile subtree at idx; dst: first free register.
+    // Returns register containing result (dst, an arg/constant register,
+    // or the register of a common subexpression).
+    uint32_t compile_node(size_t idx, uint32_t dst, size_t& end, bool& ok) {
+        if (!is_cse(idx)) return compile_op(idx, dst, end, ok);
+        const uint32_t cls = cse_class[idx];
+        if (cse_ready[cls]) {
+            end = node_end[idx];
+            return cse_reg[cls];
+        }
+        uint32_t reg = compile_op(idx, dst, end, ok);
+        use_reg(cse_reg[cls]);
+        if (reg == dst && code.size() && code.back().dst == dst) {
+            // Write the result directly
+            code.back().dst = cse_reg[cls];
+        } else {
+            emit(BC_MOV, cse_reg[cls], reg);
+        }
+        cse_ready[cls] = true;
+        return cse_reg[cls];
+    }
+
+    // Compile the operation at idx (see compile_node).
+    // Children are evaluated last-to-first, as in eval_ast, so side effects
+    // (sums/prods iteration variables) happen in the same order.
+    uint32_t compile_op(size_t idx, uint32_t dst, size_t& end, bool& ok) {
+        using namespace OpCode;
+        if (idx >= ast.size()) { ok = false; end = idx; return dst; }
+        const auto& node = ast[idx];
+        switch (node.opcode) {
+            case null: case val:
+                end = idx + 1;
+                return const_reg[idx];
+            case arg:
+                end = idx + 1;
+                return static_cast<uint32_t>(node.ref);
+            case ref:
+                end = idx + 1;
+                use_reg(dst);
+                emit(BC_LOADV, dst).ref = node.ref;
+                return dst;
+            case bnz:
+                {
+                    auto ch = children(idx, 3, end, ok);
+                    if (!ok) return dst;
+                    size_t tmp;
+                    uint32_t cond = compile_node(ch[0], dst, tmp, ok);
+                    size_t jz_pos = code.size();
+                    emit(BC_JZ, 0, cond);
+                    region_to(thunk_body(ch[1], ok), dst, ok);
+                    size_t jmp_pos = code.size();
+                    emit(BC_JMP);
+                    code[jz_pos].c = static_cast<uint32_t>(code.size());
+                    region_to(thunk_body(ch[2], ok), dst, ok);
+                    code[jmp_pos].c = static_cast<uint32_t>(code.size());
+                    use_reg(dst);
+                    return dst;
+                }
+            case sums: case prods:
+                {
+                    auto ch = children(idx, 3, end, ok);
+                    if (!ok) return dst;
+                    // dst: accumulator, dst+1: end, dst+2: current index
+                    compile_to(ch[1], dst + 1, ok);
+                    compile_to(ch[0], dst + 2, ok);
+                    emit(BC_MOV, dst, n_args + add_const(node.opcode == prods ? 1. : 0.));
+                    size_t loop_pos = code.size();
+                    Instr& loop = emit(BC_LOOP, 0, dst + 2, dst + 1);
+                    loop.ref = node.ref;
+                    uint32_t body = compile_region(thunk_body(ch[2], ok), dst + 3,
+                            tmp_end, ok);
+                    emit(node.opcode == prods ? BC_ACCMUL : BC_ACCADD, dst, body);
+                    emit(BC_JMP).c = static_cast<uint32_t>(loop_pos);
+                    code[loop_pos].c = static_cast<uint32_t>(code.size());
+                    use_reg(dst + 3);
+                    return dst;
+                }
+            case call:
+                {
+                    const size_t n = node.call_info[1];
+                    auto ch = children(idx, n, end, ok);
+                    if (!ok) return dst;
+                    // Evaluate last-to-first; arg i ends up in dst + (n-1-i)
+                    for (size_t i = n - 1; ~i; --i) {
+                        compile_to(ch[i], dst + static_cast<uint32_t>(n - 1 - i), ok);
+                    }
+                    Instr& instr = emit(BC_CALL, dst, dst);
+                    instr.call_info[0] = node.call_info[0];
+                    instr.call_info[1] = node.call_info[1];
+                    use_reg(dst + static_cast<uint32_t>(n));
+                    return dst;
+                }
+            case bsel:
+                {
+                    // Evaluate second, then first; return second
+                    auto ch = children(idx, 2, end, ok);
+                    if (!ok) return dst;
+                    compile_to(ch[1], dst, ok);
+                    compile_node(ch[0], dst + 1, tmp_end, ok);
+                    return dst;
+                }
+            case thunk_ret: case thunk_jmp:
+                // Should only appear under bnz/sums/prods
+                ok = false; end = idx + 1;
+                return dst;
+        }
+
+        const size_t n_children = OpCode::n_args(node.opcode);
+        auto ch = children(idx, n_children, end, ok);
+        if (!ok) return dst;
+        use_reg(dst);
+        if (n_children == 2) {
+            // Superinstruction: a * b + c
+            // (unless a * b is a common subexpression)
+            if (node.opcode == add) {
+                auto fusable = [&](size_t i) {
+                    return ast[i].opcode == mul && !is_cse(i);
+                };
+                int mul_child = fusable(ch[1]) ? 1 : fusable(ch[0]) ? 0 : -1;
+                if (~mul_child) {
+                    size_t other = ch[1 - mul_child];
+                    size_t tmp;
+                    auto mch = children(ch[mul_child], 2, tmp, ok);
+                    uint32_t rc, ra, rb;
+                    uint32_t next = dst;
+                    if (mul_child == 1) {
+                        // Second child (mul) is evaluated first
+                        rb = compile_node(mch[1], next, tmp, ok); next = fresh(next, rb);
+                        ra = compile_node(mch[0], next, tmp, ok); next = fresh(next, ra);
+                        rc = compile_node(other, next, tmp, ok);
+                    } else {
+                        rc = compile_node(other, next, tmp, ok); next = fresh(next, rc);
+                        rb = compile_node(mch[1], next, tmp, ok); next = fresh(next, rb);
+                        ra = compile_node(mch[0], next, tmp, ok);
+                    }
+                    emit(BC_MULADD, dst, ra, rb).c = rc;
+                    return dst;
+                }
+            }
+            // Superinstructions: x^const
+            if (node.opcode == power && ast[ch[1]].opcode == val) {
+                const double expo = ast[ch[1]].val;
+                uint32_t ra = compile_node(ch[0], dst, tmp_end, ok);
+                if (expo == 2.) emit(BC_SQR, dst, ra);
+                else emit(BC_POWC, dst, ra).imm = expo;
+                return dst;
+            }
+            size_t tmp;
+            uint32_t rb = compile_node(ch[1], dst, tmp, ok);
+            uint32_t ra = compile_node(ch[0], fresh(dst, rb), tmp, ok);
+            uint32_t op;
+            switch (node.opcode) {
+                case add: op = BC_ADD; break; case sub: op = BC_SUB; break;
+                case mul: op = BC_MUL; break; case divi: op = BC_DIV; break;
+                case max: op = BC_MAX; break; case min: op = BC_MIN; break;
+                case lt: op = BC_LT; break; case le: op = BC_LE; break;
+                case eq: op = BC_EQ; break; case ne: op = BC_NE; break;
+                case ge: op = BC_GE; break; case gt: op = BC_GT; break;
+                case power: op = BC_POW; break;
+                default: op = BC_BIN;
+            }
+            Instr& instr = emit(op, dst, ra, rb);
+            if (op == BC_BIN) instr.opcode = node.opcode;
+            return dst;
+        }
+        // Unary
+        size_t tmp;
+        uint32_t ra = compile_node(ch[0], dst, tmp, ok);
+        uint32_t op;
+        switch (node.opcode) {
+            case unaryminus: op = BC_NEG; break; case absb: op = BC_ABS; break;
+            case sqrtb: op = BC_SQRT; break; case sqrb: op = BC_SQR; break;
+            case expb: op = BC_EXP; break; case logb: op = BC_LOG; break;
+            case sinb: op = BC_SIN; break; case cosb: op = BC_COS; break;
+            default: op = BC_UN;
+        }
+        Instr& instr = emit(op, dst, ra);
+        if (op == BC_UN) instr.opcode = node.opcode;
+        return dst;
+    }
+
+    // Compile subtree, making sure the result ends up in register dst
+    void compile_to(size_t idx, uint32_t dst, bool& ok) {
+        uint32_t reg = compile_node(idx, dst, tmp_end, ok);
+        use_reg(dst);
+        if (reg != dst) emit(BC_MOV, dst, reg);
+    }
+
+    // Next free register, given that the result of the previous operand
+    // is in reg (only occupies dst if reg == dst)
+    uint32_t fresh(uint32_t dst, uint32_t reg) {
+        return reg == dst ? dst + 1 : dst;
+    }
+
+    const Expr::AST& ast;
+    std::vector<Instr> code;
+    std::vector<double> consts;
+    // Register containing each constant node in the AST
+    std::vector<uint32_t> const_reg;
+    uint32_t n_args = 0, n_regs = 0, first_temp = 0;
+    size_t tmp_end;
+
+    // Per-node analysis for common subexpressions (find_common_subexprs)
+    std::vector<size_t> node_end, node_region;
+    std::vector<uint64_t> node_hash;
+    std::vector<bool> node_pure;
+    // Common subexpression class of each node, or -1
+    std::vector<uint32_t> cse_class;
+    // Common subexpression classes of the region with body at each index
+    std::vector<std::vector<uint32_t> > region_cse;
+    // Register of each class, and whether it has been computed
+    std::vector<uint32_t> cse_reg;
+    std::vector<bool> cse_ready;
+    std::vector<uint64_t> loop_vars;
+    bool has_call;
+};
+}  // namespace
+
+namespace detail {
+double run_program(const Program& prog, EvalContext& ctx,
+        const double* args, size_t n_args) {
+    const size_t base = reg_top;
+    if (reg_stack.size() < base + prog.n_regs) {
+        reg_stack.resize(base + prog.n_regs);
+    }
+    double* regs = &reg_stack[base];
+    const size_t n_copy = std::min<size_t>(n_args, prog.n_args);
+    std::copy(args, args + n_copy, regs);
+    std::fill(regs + n_copy, regs + prog.n_args, NONE);
+    return exec_program(&prog, &ctx, base);
+}
+}  // namespace detail
+
+void Expr::compile(const Environment* env) {
+    native.reset();
+    auto prog = std::make_shared<detail::Program>();
+    bool success;
+    if (env != nullptr) {
+        std::vector<uint64_t> inlined;
+        Expr inlined_expr = inline_calls(*env, 64, &inlined);
+        for (uint64_t fid : inlined) {
+            prog->inlined.emplace_back(fid, env->funcs[fid].version);
+        }
+        success = Compiler(inlined_expr.ast).compile(*prog);
+    } else {
+        success = Compiler(ast).compile(*prog);
+    }
+    if (success) {
+        program = std::move(prog);
+    } else {
+        program.reset();
+    }
+}
+
+void Expr::uncompile() {
+    program.reset();
+    native.reset();
+}
+
+bool Expr::is_compiled() const {
+    return program != nullptr;
+}
+
+bool Expr::is_compiled(const Environment& env) const {
+    auto is_current = [&env](
+            const std::vector<std::pair<uint64_t, uint64_t> >& inlined) {
+        for (const auto& fid_version : inlined) {
+            if (fid_version.first >= env.funcs.size() ||
+                env.funcs[fid_version.first].version != fid_version.second) {
+                return false;
+            }
+        }
+        return true;
+    };
+    return program != nullptr && is_current(program->inlined) &&
+           (native == nullptr || is_current(detail::jit_inlined(*native)));
+}
+
+}  // namespace nivalis
@@ -20,18 +20,21 @@ namespace {
 #define NEWTON_PRINT(x)
 #endif
 
-#define DIFF_NEXT if (!diff(ast, diff_arg_id)) return false
-#define PUSH(v) out.push_back(v)
-#define CHAIN_RULE(derivop1, derivop2) { \
-                               const Expr::ASTNode* tmp = *ast; \
-                               out.push_back(mul); DIFF_NEXT; \
-                               derivop1; \
-                               copy_ast(tmp, out); \
-                               derivop2; \
+#define DIFF_NEXT(d) Expr::AST d; if (!diff(ast, diff_arg_id, d)) return false
+// Chain rule: dg * f'(g), where the expression f'(g) may use g
+#define CHAIN_RULE(deriv) { \
+                               Expr::AST g = copy(*ast); \
+                               DIFF_NEXT(dg); \
+                               out = make_mul(dg, deriv); \
+                            }
+// Chain rule for f'(g) = 1 / denom: dg / denom
+#define CHAIN_RULE_RECIP(denom) { \
+                               Expr::AST g = copy(*ast); \
+                               DIFF_NEXT(dg); \
+                               out = make_div(dg, denom); \
                             }
 
 void skip_ast(const Expr::ASTNode** ast) {
-    const auto* init_pos = ast;
     auto opc = (*ast)->opcode;
     size_t n_args = OpCode::n_args(opc);
     if (opc == OpCode::call) {
@@ -41,26 +44,8 @@ void skip_ast(const Expr::ASTNode** ast) {
     for (size_t i = 0; i < n_args; ++i) skip_ast(ast);
 }
 
-// Versions of has_var/sub_var that only applies to subtree
-bool ast_has_var(const Expr::ASTNode** ast, uint64_t var_id) {
-    const auto* init_pos = ast;
-    auto opcode = (*ast)->opcode;
-    auto n_args = OpCode::n_args(opcode);
-    if (OpCode::has_ref(opcode) &&
-        opcode != OpCode::arg &&
-        (*ast)->ref == var_id) {
-        return true;
-    }
-
-    ++*ast;
-    for (size_t i = 0; i < n_args; ++i) {
-        if (ast_has_var(ast, var_id)) return true;
-    }
-    return false;
-}
-
+// Version of sub_var that only applies to subtree
 void ast_sub_var(const Expr::ASTNode** ast, uint64_t var_id, double value, Expr::AST& out) {
-    const auto* init_pos = ast;
     auto opcode = (*ast)->opcode;
     out.push_back(**ast);
     if (opcode == OpCode::ref &&
@@ -75,16 +60,31 @@ void ast_sub_var(const Expr::ASTNode** ast, uint64_t var_id, double value, Expr:
     }
 }
 
+bool is_val(const Expr::AST& a) {
+    return a.size() == 1 && a[0].opcode == OpCode::val;
+}
+bool is_val(const Expr::AST& a, double value) {
+    return is_val(a) && a[0].val == value;
+}
+Expr::AST value(double v) {
+    return Expr::AST(1, Expr::ASTNode(v));
+}
+
 // Implementation
+// Each derivative is built bottom-up through simplifying constructors
+// (make_add, make_mul, ...), which drop terms that are 0, factors that
+// are 1 and fold constants. Derivatives of subexpressions which do not depend on the
+// variable are thus exactly 0, and the product/quotient/chain rules
+// collapse to the terms that matter.
 struct Differentiator {
     Differentiator(const Expr::AST& ast, uint64_t var_addr,
-            Environment& env, std::vector<Expr::ASTNode>& out)
-        : nodes(ast), ast_root(&ast[0]), var_addr(var_addr), env(env), out(out) {
+            const Environment& env)
+        : ast_root(&ast[0]), var_addr(var_addr), env(env) {
         vis_asts.insert(ast_root);
     }
 
     const Expr::ASTNode* copy_ast(const Expr::ASTNode* ast,
-            std::vector<Expr::ASTNode>& out) {
+            Expr::AST& out) {
         const auto* init_pos = ast;
         skip_ast(&ast);
         for (const auto* n = init_pos; n != ast; ++n) {
@@ -97,20 +97,90 @@ struct Differentiator {
         }
         return ast;
     }
+    Expr::AST copy(const Expr::ASTNode* ast) {
+        Expr::AST result;
+        copy_ast(ast, result);
+        return result;
+    }
+
+    // Simplifying constructors
+    // Operator node; folded if all arguments are constants
+    Expr::AST make_op(uint32_t opcode, const Expr::AST& a,
+            const Expr::AST& b = Expr::AST()) {
+        Expr::AST result;
+        result.reserve(1 + a.size() + b.size());
+        result.emplace_back(opcode);
+        result.insert(result.end(), a.begin(), a.end());
+        result.insert(result.end(), b.begin(), b.end());
+        if (is_val(a) && (b.empty() || is_val(b))) {
+            return value(detail::eval_ast(fold_env, result));
+        }
+        return result;
+    }
+    Expr::AST make_add(const Expr::AST& a, const Expr::AST& b) {
+        if (is_val(a, 0.)) return b;
+        if (is_val(b, 0.)) return a;
+        return make_op(OpCode::add, a, b);
+    }
+    Expr::AST make_sub(const Expr::AST& a, const Expr::AST& b) {
+        if (is_val(b, 0.)) return a;
+        if (is_val(a, 0.)) return make_neg(b);
+        return make_op(OpCode::sub, a, b);
+    }
+    Expr::AST make_neg(const Expr::AST& a) {
+        if (a[0].opcode == OpCode::unaryminus) {
+            return Expr::AST(a.begin() + 1, a.end());
+        }
+        return make_op(OpCode::unaryminus, a);
+    }
+    Expr::AST make_mul(const Expr::AST& a, const Expr::AST& b) {
+        if (is_val(a, 0.) || is_val(b, 0.)) return value(0.);
+        if (is_val(a, 1.)) return b;
+        if (is_val(b, 1.)) return a;
+        if (is_val(a, -1.)) return make_neg(b);
+        if (is_val(b, -1.)) return make_neg(a);
+        return make_op(OpCode::mul, a, b);
+    }
+    Expr::AST make_div(const Expr::AST& a, const Expr::AST& b) {
+        if (is_val(a, 0.)) return value(0.);
+        if (is_val(b, 1.)) return a;
+        return make_op(OpCode::divi, a, b);
+    }
+    Expr::AST make_pow(const Expr::AST& a, const Expr::AST& b) {
+        if (is_val(b, 0.)) return value(1.);
+        if (is_val(b, 1.)) return a;
+        if (is_val(b, 2.)) return make_op(OpCode::sqrb, a);
+        return make_op(OpCode::power, a, b);
+    }
+    // Branch on cond (bnz); a single branch if both are the same
+    Expr::AST make_branch(const Expr::AST& cond, const Expr::AST& a,
+            const Expr::AST& b) {
+        if (a == b) return a;
+        Expr::AST result;
+        result.emplace_back(OpCode::bnz);
+        result.insert(result.end(), cond.begin(), cond.end());
+        for (const auto* thunk : { &a, &b }) {
+            result.emplace_back(OpCode::thunk_ret);
+            result.insert(result.end(), thunk->begin(), thunk->end());
+            result.emplace_back(OpCode::thunk_jmp, thunk->size() + 1);
+        }
+        return result;
+    }
 
-    bool diff(const Expr::ASTNode** ast = nullptr, uint32_t diff_arg_id = -1) {
-        if (ast == nullptr) ast = &ast_root;
+    // Differentiate the subtree at *ast into out, advancing *ast past it.
+    // diff_arg_id: if -1, differentiate wrt the variable; else wrt the
+    // argument with this index of the function being differentiated
+    bool diff(const Expr::ASTNode** ast, uint32_t diff_arg_id,
+            Expr::AST& out) {
         using namespace OpCode;
         uint32_t opcode = (*ast)->opcode;
-        // std::cout << opcode << " " << diff_arg_id << " " << out.size() << " :: ";
-        // for (auto& i : out) { std::cout << i.opcode << " "; }
-        // std::cout << "\n";
         ++*ast;
         switch(opcode) {
-            case null: PUSH(null); break;
-            case val: PUSH(0.); break;
-            case ref: PUSH(((*ast)-1)->ref == var_addr ? 1. : 0.); break;
-            case arg: PUSH(((*ast)-1)->ref == diff_arg_id ? 1. : 0.); break;
+            case null: out = Expr::AST(1, null); break;
+            case val: out = value(0.); break;
+            case ref: out = value(~diff_arg_id == 0 &&
+                              ((*ast)-1)->ref == var_addr ? 1. : 0.); break;
+            case arg: out = value(((*ast)-1)->ref == diff_arg_id ? 1. : 0.); break;
             case call:
                       {
                           uint32_t fid = ((*ast)-1)->call_info[0];
@@ -121,49 +191,46 @@ struct Differentiator {
                               // Prevent recursion/cycles
                               return false;
                           }
-                          {
-                              std::vector<Expr::AST> call_args;
-                              call_args.resize(n_args);
-                              const Expr::ASTNode* tmp = *ast;
-                              for (size_t i = 0; i < n_args; ++i) {
-                                  tmp = copy_ast(tmp, call_args[i]);
-                              }
-                              argv.push_back(std::move(call_args));
+                          // Derivatives of arguments (in the caller's frame)
+                          std::vector<Expr::AST> call_args(n_args), dargs(n_args);
+                          for (size_t i = 0; i < n_args; ++i) {
+                              copy_ast(*ast, call_args[i]);
+                              if (!diff(ast, diff_arg_id, dargs[i])) return false;
                           }
-                          {
-                              if (n_args > 0) out.push_back(add);
+                          argv.push_back(std::move(call_args));
+                          vis_asts.insert(&fexpr.ast[0]);
+                          Expr::AST dbody;
+                          out = value(0.);
+                          if (~diff_arg_id == 0) {
+                              // Function may refer to the variable directly
                               const Expr::ASTNode* f_astptr = &fexpr.ast[0];
-                              vis_asts.insert(&fexpr.ast[0]);
-                              if (!diff(&f_astptr)) {
-                                  return false;
-                              }
-                              vis_asts.erase(&fexpr.ast[0]);
+                              if (!diff(&f_astptr, -1, dbody)) return false;
+                              out = dbody;
                           }
                           for (size_t i = 0; i < n_args; ++i) {
-                              if (i < n_args - 1) out.push_back(add);
-                              out.push_back(mul);
-                              DIFF_NEXT;
+                              if (is_val(dargs[i], 0.)) continue;
                               const Expr::ASTNode* f_astptr = &fexpr.ast[0];
-                              vis_asts.insert(&fexpr.ast[0]);
-                              if (!diff(&f_astptr, (uint32_t)i)) return false;
-                              vis_asts.erase(&fexpr.ast[0]);
+                              if (!diff(&f_astptr, (uint32_t)i, dbody)) return false;
+                              out = make_add(out, make_mul(dargs[i], dbody));
                           }
+                          vis_asts.erase(&fexpr.ast[0]);
                           argv.pop_back();
                       }
                       break;
             case bnz:
                       {
-                          PUSH(bnz);
-                          *ast = copy_ast(*ast, out);
+                          Expr::AST cond = copy(*ast);
+                          skip_ast(ast);
                           if ((*ast)->opcode != thunk_ret) return false; ++*ast;
-                          begin_thunk(); DIFF_NEXT; end_thunk();
+                          DIFF_NEXT(da);
                           if ((*ast)->opcode != thunk_jmp) return false; ++*ast;
                           if ((*ast)->opcode != thunk_ret) return false; ++*ast;
-                          begin_thunk(); DIFF_NEXT; end_thunk();
+                          DIFF_NEXT(db);
                           if ((*ast)->opcode != thunk_jmp) return false; ++*ast;
+                          out = make_branch(cond, da, db);
                       }
                       break;
-            case sums:
+            case sums: case prods:
                       {
                           uint64_t var_id = ((*ast)-1)->ref;
                           // Can't diff wrt index
@@ -176,318 +243,226 @@ struct Differentiator {
                           int64_t b = static_cast<int64_t>((*ast)->val); ++*ast;
                           int64_t step = (a <= b) ? 1 : -1; b += step;
                           if ((*ast)->opcode != thunk_ret) return false; ++*ast;
-                          Expr::AST diff_tmp;
+                          // Terms (with index substituted) and derivatives
+                          std::vector<Expr::AST> terms, dterms;
                           for (int64_t i = a; i != b; i += step) {
+                              terms.emplace_back();
                               const Expr::ASTNode* tmp = *ast;
-                              if (i + step != b) PUSH(OpCode::add);
-                              env.vars[var_id] = static_cast<double>(i);
-                              diff_tmp.clear();
-                              ast_sub_var(&tmp, var_id, static_cast<double>(i), diff_tmp);
-                              tmp = &diff_tmp[0];
-                              if (!diff(&tmp, diff_arg_id)) return false;
+                              ast_sub_var(&tmp, var_id, static_cast<double>(i),
+                                      terms.back());
+                              tmp = &terms.back()[0];
+                              dterms.emplace_back();
+                              if (!diff(&tmp, diff_arg_id, dterms.back())) return false;
                           }
                           skip_ast(ast);
                           if ((*ast)->opcode != thunk_jmp) return false; ++*ast;
-                      }
-                      break;
-            case prods:
-                      {
-                          uint64_t var_id = ((*ast)-1)->ref;
-                          // Can't diff wrt index
-                          if (var_id == var_addr) return false;
-                          // Index must be constant for derivative
-                          if ((*ast)->opcode != val) return false;
-                          int64_t a = static_cast<int64_t>((*ast)->val); ++*ast;
-                          // Index must be constant for derivative
-                          if ((*ast)->opcode != val) return false;
-                          int64_t b = static_cast<int64_t>((*ast)->val); ++*ast;
-                          int64_t step = (a <= b) ? 1 : -1; b += step;
-                          Expr::AST diff_tmp;
-                          if ((*ast)->opcode != thunk_ret) return false; ++*ast;
-                          for (int64_t i = a; i != b; i += step) {
-                              if (i + step != b) PUSH(OpCode::add);
-                              for (int64_t j = a; j != b; j += step) {
-                                  if (j + step != b) PUSH(OpCode::mul);
-                                  if (j == i) {
-                                      env.vars[var_id] = static_cast<double>(i);
-                                      diff_tmp.clear();
-                                      const Expr::ASTNode* tmp = *ast;
-                                      ast_sub_var(&tmp, var_id, static_cast<double>(j), diff_tmp);
-                                      tmp = &diff_tmp[0];
-                                      if (!diff(&tmp, diff_arg_id)) return false;
-                                  } else {
-                                      const Expr::ASTNode* tmp2 = *ast;
-                                      ast_sub_var(&tmp2, var_id, static_cast<double>(j), out);
-                                  }
+                          out = value(0.);
+                          for (size_t i = 0; i < terms.size(); ++i) {
+                              if (opcode == sums) {
+                                  out = make_add(out, dterms[i]);
+                                  continue;
+                              }
+                              // Product rule
+                              Expr::AST prod = dterms[i];
+                              for (size_t j = 0; j < terms.size(); ++j) {
+                                  if (j != i) prod = make_mul(prod, terms[j]);
                               }
+                              out = make_add(out, prod);
                           }
-                          skip_ast(ast);
-                          if ((*ast)->opcode != thunk_jmp) return false; ++*ast;
                       }
                       break;
 
-            case bsel: skip_ast(ast); DIFF_NEXT; break;
-            case add: case sub: PUSH(opcode); DIFF_NEXT; DIFF_NEXT; break;
+            case bsel: skip_ast(ast); { DIFF_NEXT(d); out = d; } break;
+            case add: case sub: {
+                          DIFF_NEXT(da); DIFF_NEXT(db);
+                          out = opcode == add ? make_add(da, db) : make_sub(da, db);
+                      }
+                      break;
             case mul: {
                           // Product rule
-                          PUSH(add);
-                          const Expr::ASTNode* tmp1 = *ast;
-                          PUSH(mul); DIFF_NEXT; // df *
-                          copy_ast(*ast, out); // g
-                          PUSH(mul);
-                          DIFF_NEXT;
-                          copy_ast(tmp1, out); // + dg * f
+                          Expr::AST f = copy(*ast);
+                          DIFF_NEXT(df);
+                          Expr::AST g = copy(*ast);
+                          DIFF_NEXT(dg);
+                          out = make_add(make_mul(df, g), make_mul(dg, f));
                       }
                 break;
             case divi: {
                           // Quotient rule
-                          PUSH(divi); PUSH(sub);
-                          const Expr::ASTNode* tmp1 = *ast, *tmp1b = *ast;
-                          PUSH(mul); DIFF_NEXT;  // df *
-                          const Expr::ASTNode* tmp2 = *ast;
-                          copy_ast(tmp2, out);  // g
-                          PUSH(mul); DIFF_NEXT; copy_ast(tmp1, out); // - dg * f
-                          tmp1 = tmp1b;
-                          PUSH(sqrb); copy_ast(tmp2, out); // / g^2
+                          Expr::AST f = copy(*ast);
+                          DIFF_NEXT(df);
+                          Expr::AST g = copy(*ast);
+                          DIFF_NEXT(dg);
+                          if (is_val(dg, 0.)) {
+                              out = make_div(df, g);
+                          } else {
+                              out = make_div(make_sub(make_mul(df, g), make_mul(dg, f)),
+                                      make_op(sqrb, g));
+                          }
                       }
                       break;
-            case mod:
-                      DIFF_NEXT;
-                      // Cannot take derivative wrt modulus
-                      if (ast_has_var(ast, var_addr)) return false;
+            case mod: {
+                          DIFF_NEXT(da); DIFF_NEXT(db);
+                          // Cannot take derivative wrt modulus
+                          if (!is_val(db, 0.)) return false;
+                          out = da;
+                      }
                       break;
-
             case power:
                       {
-                          const Expr::ASTNode* tmp1 = *ast;
-                          skip_ast(&tmp1);
-                          const Expr::ASTNode* expon_pos = tmp1;
-                          bool expo_nonconst = ast_has_var(&tmp1, var_addr);
-                          if (expo_nonconst) {
-                              const Expr::ASTNode* base_pos = *ast;
-                              Expr::AST elnb;
-                              elnb.push_back(mul);
-                              copy_ast(expon_pos, elnb);
-                              elnb.push_back(logb);
-                              copy_ast(base_pos, elnb);
-                              skip_ast(ast); skip_ast(ast);
-                              const Expr::ASTNode* elnbptr = &elnb[0];
-                              PUSH(mul); PUSH(expb);
-                              copy_ast(elnbptr, out);
-                              if (!diff(&elnbptr, diff_arg_id)) return false;
+                          Expr::AST base = copy(*ast);
+                          DIFF_NEXT(dbase);
+                          Expr::AST expo = copy(*ast);
+                          DIFF_NEXT(dexpo);
+                          if (!is_val(dexpo, 0.)) {
+                              // d/dx exp(expo * ln(base))
+                              Expr::AST lnb = make_op(logb, base);
+                              out = make_mul(make_op(expb, make_mul(expo, lnb)),
+                                      make_add(make_mul(dexpo, lnb),
+                                          make_mul(expo, make_div(dbase, base))));
                           } else {
-                              CHAIN_RULE(PUSH(mul);
-                                      copy_ast(*ast, out);
-                                      PUSH(power), // g(x) goes here
-                                      PUSH(sub); copy_ast(*ast, out); PUSH(1.));
-                              skip_ast(ast);
+                              out = make_mul(dbase, make_mul(expo,
+                                      make_pow(base, make_sub(expo, value(1.)))));
                           }
                       }
                       break;
             case logbase:
                       {
-                          const Expr::ASTNode* tmp = *ast;
-                          skip_ast(&tmp);
-                          bool base_nonconst = ast_has_var(&tmp, var_addr);
+                          Expr::AST g = copy(*ast);
+                          DIFF_NEXT(dg);
+                          Expr::AST base = copy(*ast);
+                          DIFF_NEXT(dbase);
                           // Cannot take derivative wrt base
-                          if (base_nonconst) return false;
-                          CHAIN_RULE(PUSH(divi);
-                                  PUSH(1.0);PUSH(mul);
-                                  PUSH(logb);
-                                  copy_ast(*ast, out),);
-                          skip_ast(ast);
+                          if (!is_val(dbase, 0.)) return false;
+                          out = make_div(dg, make_mul(make_op(logb, base), g));
                       }
                       break;
             case max: case min:
                       {
-                          PUSH(bnz); PUSH(opcode == max ? ge : le);
-                          const Expr::ASTNode* tmp = *ast;
-                          copy_ast(tmp, out);
-                          skip_ast(&tmp); copy_ast(tmp, out);
-                          begin_thunk(); DIFF_NEXT; end_thunk();
-                          begin_thunk(); DIFF_NEXT; end_thunk();
-                          break;
+                          Expr::AST a = copy(*ast);
+                          DIFF_NEXT(da);
+                          Expr::AST b = copy(*ast);
+                          DIFF_NEXT(db);
+                          out = make_branch(make_op(opcode == max ? ge : le, a, b), da, db);
                       }
+                      break;
             case land: case lor: case lxor: case gcd: case lcm: case choose: case fafact: case rifact:
             case lt: case le: case eq: case ne: case ge: case gt:
-                      PUSH(0.0); skip_ast(ast); skip_ast(ast); // Integer functions: 0 derivative
+                      out = value(0.); skip_ast(ast); skip_ast(ast); // Integer functions: 0 derivative
                       break;
             case betab:
                       {
-                          const Expr::ASTNode* tmp = *ast, *x_pos = *ast;
-                          skip_ast(&tmp);
-                          const Expr::ASTNode* y_pos = tmp;
-                          PUSH(add);
-                          PUSH(mul);
-                          PUSH(mul);
-                          PUSH(betab);
-                          copy_ast(x_pos,out);
-                          copy_ast(y_pos,out);
-                          PUSH(sub);
-                          PUSH(digammab); copy_ast(x_pos,out);
-                          PUSH(digammab); PUSH(add);
-                          copy_ast(x_pos,out); copy_ast(y_pos,out);
-                          DIFF_NEXT;
-                          PUSH(mul);
-                          PUSH(mul);
-                          PUSH(betab);
-                          copy_ast(x_pos,out);
-                          copy_ast(y_pos,out);
-                          PUSH(sub);
-                          PUSH(digammab); copy_ast(y_pos,out);
-                          PUSH(digammab); PUSH(add); copy_ast(x_pos,out); copy_ast(y_pos,out);
-                          DIFF_NEXT;
+                          Expr::AST x = copy(*ast);
+                          DIFF_NEXT(dx);
+                          Expr::AST y = copy(*ast);
+                          DIFF_NEXT(dy);
+                          Expr::AST beta = make_op(betab, x, y),
+                                    digamma_xy = make_op(digammab, make_add(x, y));
+                          out = make_add(
+                                  make_mul(make_mul(beta,
+                                          make_sub(make_op(digammab, x), digamma_xy)), dx),
+                                  make_mul(make_mul(beta,
+                                          make_sub(make_op(digammab, y), digamma_xy)), dy));
                       }
                       break;
             case polygammab:
                       {
-                          const Expr::ASTNode* tmp1 = *ast;
-                          bool idx_nonconst = ast_has_var(&tmp1, var_addr);
-                          if (idx_nonconst) return false; // Can't differentiate wrt polygamma index
-                          tmp1 = *ast;
-                          skip_ast(ast);
-                          CHAIN_RULE(PUSH(polygammab);
-                                  PUSH(add);
-                                  copy_ast(tmp1, out);
-                                  PUSH(1.),);
+                          Expr::AST n = copy(*ast);
+                          DIFF_NEXT(dn);
+                          // Can't differentiate wrt polygamma index
+                          if (!is_val(dn, 0.)) return false;
+                          CHAIN_RULE(make_op(polygammab, make_add(n, value(1.)), g));
                       }
                       break;
-            case unaryminus: PUSH(unaryminus); DIFF_NEXT; break;
-            case absb: {
-                           PUSH(mul); PUSH(sgn);
-                           copy_ast(*ast, out);
-                           DIFF_NEXT;
-                       }
-                             break;
-            case sqrtb: CHAIN_RULE(
-                                PUSH(mul);
-                                PUSH(0.5);
-                                PUSH(power), // g(x) goes here
-                                PUSH(-0.5)); break;
-            case sqrb: CHAIN_RULE(PUSH(mul); PUSH(2.),); break;
+            case unaryminus: { DIFF_NEXT(d); out = make_neg(d); } break;
+            case absb: CHAIN_RULE(make_op(sgn, g)); break;
+            case sqrtb: CHAIN_RULE_RECIP(make_mul(value(2.), make_op(sqrtb, g))); break;
+            case sqrb: CHAIN_RULE(make_mul(value(2.), g)); break;
             case lnot: case sgn: case floorb: case ceilb: case roundb: case factb:
-                       PUSH(0.0); skip_ast(ast); break; // Integer functions; 0 derivative
-            case expb: CHAIN_RULE(PUSH(expb),); break;
-            case exp2b: CHAIN_RULE( PUSH(mul); PUSH(log(2.)); PUSH(exp2b),); break;
-            case logb:  CHAIN_RULE(PUSH(divi);PUSH(1.0),); break;
-            case log2b:  CHAIN_RULE(PUSH(divi);PUSH(1.0);PUSH(mul);PUSH(log(2));,); break;
-            case log10b: CHAIN_RULE(PUSH(divi);PUSH(1.0);PUSH(mul);PUSH(log(10));,); break;
-            case sinb:  CHAIN_RULE(PUSH(cosb),); break;
-            case cosb:  CHAIN_RULE(PUSH(unaryminus); PUSH(sinb),); break;
-            case tanb:  CHAIN_RULE(PUSH(power); PUSH(cosb);
-                                ,PUSH(-2.)); break;
+                       out = value(0.); skip_ast(ast); break; // Integer functions; 0 derivative
+            case expb: CHAIN_RULE(make_op(expb, g)); break;
+            case exp2b: CHAIN_RULE(make_mul(value(log(2.)), make_op(exp2b, g))); break;
+            case logb:  CHAIN_RULE_RECIP(g); break;
+            case log2b:  CHAIN_RULE_RECIP(make_mul(value(log(2.)), g)); break;
+            case log10b: CHAIN_RULE_RECIP(make_mul(value(log(10.)), g)); break;
+            case sinb:  CHAIN_RULE(make_op(cosb, g)); break;
+            case cosb:  CHAIN_RULE(make_neg(make_op(sinb, g))); break;
+            case tanb:  CHAIN_RULE_RECIP(make_op(sqrb, make_op(cosb, g))); break;
             case asinb: case acosb:
-                        CHAIN_RULE(if (opcode == acosb) PUSH(unaryminus);
-                                PUSH(divi); PUSH(1.);
-                                PUSH(sqrtb); PUSH(sub); PUSH(1.); PUSH(sqrb),); break;
-            case atanb:  CHAIN_RULE(PUSH(divi); PUSH(1.); PUSH(add); PUSH(1.); PUSH(sqrb),); break;
-            case sinhb: CHAIN_RULE(PUSH(coshb),); break;
-            case coshb: CHAIN_RULE(PUSH(sinhb),); break;
-            case tanhb: CHAIN_RULE(PUSH(sub); PUSH(1.); PUSH(sqrb); PUSH(tanhb),); break;
-            case tgammab:
                         {
-                            const Expr::ASTNode* tmp = *ast;
-                            out.push_back(mul); DIFF_NEXT;
-                            PUSH(mul); PUSH(tgammab); copy_ast(tmp, out);
-                            PUSH(digammab); copy_ast(tmp, out);
+                            Expr::AST g = copy(*ast);
+                            DIFF_NEXT(dg);
+                            out = make_div(opcode == acosb ? make_neg(dg) : dg,
+                                    make_op(sqrtb, make_sub(value(1.), make_op(sqrb, g))));
                         }
                         break;
-            case digammab: CHAIN_RULE(PUSH(trigammab),); break;
-            case trigammab: CHAIN_RULE(PUSH(polygammab); PUSH(2.),); break;
-            case lgammab: CHAIN_RULE(PUSH(digammab),); break;
-            case erfb:   CHAIN_RULE(
-                                 PUSH(mul); PUSH(2.0 / sqrt(M_PI));
-                                 PUSH(expb); PUSH(unaryminus); PUSH(sqrb),);
+            case atanb:  CHAIN_RULE_RECIP(make_add(value(1.), make_op(sqrb, g))); break;
+            case sinhb: CHAIN_RULE(make_op(coshb, g)); break;
+            case coshb: CHAIN_RULE(make_op(sinhb, g)); break;
+            case tanhb: CHAIN_RULE(make_sub(value(1.), make_op(sqrb, make_op(tanhb, g)))); break;
+            case tgammab: CHAIN_RULE(make_mul(make_op(tgammab, g), make_op(digammab, g))); break;
+            case digammab: CHAIN_RULE(make_op(trigammab, g)); break;
+            case trigammab: CHAIN_RULE(make_op(polygammab, value(2.), g)); break;
+            case lgammab: CHAIN_RULE(make_op(digammab, g)); break;
+            case erfb:   CHAIN_RULE(make_mul(value(2.0 / sqrt(M_PI)),
+                                 make_op(expb, make_neg(make_op(sqrb, g)))));
                          break;
-            case sigmoidb: 
-                         {
-                            PUSH(mul);
-                            PUSH(mul);
-                            PUSH(sigmoidb);
-                            copy_ast(*ast, out);
-                            PUSH(sub);
-                            PUSH(1.);
-                            PUSH(sigmoidb);
-                            copy_ast(*ast, out);
-                            DIFF_NEXT;
-                         }
-                        ; 
-                        break;
-            case softplusb: 
-                         {
-                            PUSH(mul);
-                            PUSH(sigmoidb);
-                            copy_ast(*ast, out);
-                            DIFF_NEXT;
-                         }
+            case sigmoidb:
+                         CHAIN_RULE(make_mul(make_op(sigmoidb, g),
+                                     make_sub(value(1.), make_op(sigmoidb, g))));
                          break;
-
-            case gausspdfb: 
+            case softplusb: CHAIN_RULE(make_op(sigmoidb, g)); break;
+            case gausspdfb:
+                         CHAIN_RULE(make_mul(make_neg(g), make_op(gausspdfb, g)));
+                         break;
+            case zetab:
                          {
-                            PUSH(mul);
-                            PUSH(mul);
-                            PUSH(unaryminus);
-                            copy_ast(*ast, out);
-                            PUSH(gausspdfb);
-                            copy_ast(*ast, out);
-                            DIFF_NEXT;
+                             DIFF_NEXT(dg);
+                             // Derivative not available
+                             if (!is_val(dg, 0.)) return false;
+                             out = value(0.);
                          }
                          break;
-
-            case zetab:  return false; // Derivative not available
+            default: return false;
         }
         return true;
     }
+
+    // Differentiate the whole AST
+    bool diff(Expr::AST& out) {
+        const Expr::ASTNode* ast = ast_root;
+        return diff(&ast, -1, out);
+    }
 private:
-    const Expr::AST& nodes;
     const Expr::ASTNode* ast_root;
     size_t var_addr;
     std::vector<std::vector<Expr::AST> > argv;
-    Environment env;
-    std::vector<Expr::ASTNode>& out;
+    const Environment& env;
     std::unordered_set<const Expr::ASTNode*> vis_asts;
-
-    // Thunk management helpers
-    void begin_thunk() {
-        thunks.push_back(out.size());
-        out.emplace_back(OpCode::thunk_ret);
-    }
-    void end_thunk() {
-        out.emplace_back(OpCode::thunk_jmp,
-                    out.size() - thunks.back());
-        thunks.pop_back();
-    }
-
-    // Beginnings of thunks
-    std::vector<size_t> thunks;
+    // For constant folding
+    Environment fold_env;
 };
 
 }  // namespace
 
-
-std::vector<Expr::ASTNode> diff_ast(const Expr::AST& ast,
-        uint64_t var_addr, Environment& env) {
-    std::vector<Expr::ASTNode> dast;
-    Differentiator diff(ast, var_addr, env, dast);
-    if (!diff.diff()) {
+namespace detail {
+Expr::AST diff_ast(const Expr::AST& ast, uint64_t var_addr,
+        const Environment& env) {
+    Expr::AST dast;
+    Differentiator diff(ast, var_addr, env);
+    if (!diff.diff(dast)) {
         dast.resize(1);
         dast[0] = OpCode::null;
     }
     return dast;
 }
+}  // namespace detail
 
 // Interface for differentiating expr
 Expr Expr::diff(uint64_t var_addr, Environment& env) const {
     Expr dexpr;
-    dexpr.ast.clear();
-
-    Differentiator diff(ast, var_addr, env, dexpr.ast);
-    if (!diff.diff()) {
-        dexpr.ast.resize(1);
-        dexpr.ast[0].opcode = OpCode::null;
-    } else {
-        dexpr.optimize();
-    }
+    dexpr.ast = detail::diff_ast(ast, var_addr, env);
+    dexpr.optimize();
     return dexpr;
 }
 
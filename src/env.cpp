@@ -2,6 +2,7 @@
 #include <cmath>
 #include <unordered_set>
 #include <algorithm>
+#include <atomic>
 #include "util.hpp"
 namespace nivalis {
 namespace {
@@ -20,6 +21,12 @@ bool check_for_cycle(const std::vector<Environment::UserFunction>& funcs,
     return false;
 }
 
+// Versions are unique across all environments, so that a compiled
+// expression is never mistaken as current after clear() or from_bin()
+uint64_t next_func_version() {
+    static std::atomic<uint64_t> counter(0);
+    return ++counter;
+}
 }  // namespace
 
 Environment::Environment() { }
@@ -96,6 +103,14 @@ bool Environment::del(const std::string& var_name) {
     else return false;
 }
 
+void Environment::recompile_stale_funcs() {
+    for (auto& func : funcs) {
+        if (func.expr.is_compiled() && !func.expr.is_compiled(*this)) {
+            func.expr.compile(this);
+        }
+    }
+}
+
 uint64_t Environment::def_func(const std::string& func_name,
                   const Expr& expr,
                   const std::vector<uint64_t>& arg_bindings) {
@@ -139,20 +154,51 @@ uint64_t Environment::def_func(const std::string& func_name,
     }
     std::sort(func.deps.begin(), func.deps.end());
     func.deps.resize(std::unique(func.deps.begin(), func.deps.end()) - func.deps.begin());
+    if (func.version && func.n_args == arg_bindings.size() &&
+            func.expr.ast == ast) {
+        // Same definition: keep the version, so expressions compiled
+        // or differentiated against it stay current
+        return idx;
+    }
     func.n_args = arg_bindings.size();
     func.expr = std::move(func_expr);
+    func.version = next_func_version();
 
     // Check for recursion
     if (check_for_cycle(funcs, idx)) {
         // Found cycle
-        func.expr.ast = { OpCode::null };
+        func.expr = Expr::null();
         func.deps.clear();
+        recompile_stale_funcs();
         error_msg = "Cycle found in definition of " + func_name + "(...)\n";
         return -1;
     }
+    func.expr.compile(this);
+    recompile_stale_funcs();
     return idx;
 }
 
+std::vector<std::pair<uint64_t, uint64_t> > Environment::call_versions(
+        const Expr& expr) const {
+    std::vector<uint64_t> stk;
+    for (const auto& nd : expr.ast) {
+        if (nd.opcode == OpCode::call) stk.push_back(nd.call_info[0]);
+    }
+    std::vector<std::pair<uint64_t, uint64_t> > result;
+    std::vector<bool> visited;
+    while (stk.size()) {
+        uint64_t fid = stk.back(); stk.pop_back();
+        if (fid >= funcs.size()) continue;
+        if (visited.empty()) visited.resize(funcs.size());
+        if (visited[fid]) continue;
+        visited[fid] = true;
+        result.emplace_back(fid, funcs[fid].version);
+        stk.insert(stk.end(), funcs[fid].deps.begin(), funcs[fid].deps.end());
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
 uint64_t Environment::addr_of_func(const std::string& func_name) const {
     error_msg.clear();
     auto it = freg.find(func_name);
@@ -169,12 +215,12 @@ bool Environment::del_func(const std::string& func_name) {
         // Won't actually delete, but try to save some memory
         funcs[it->second].name.clear();
         funcs[it->second].name.shrink_to_fit();
-        funcs[it->second].expr.ast.resize(1);
-        funcs[it->second].expr.ast[0] = OpCode::null;
-        funcs[it->second].expr.ast.shrink_to_fit();
+        funcs[it->second].expr = Expr::null();
         funcs[it->second].deps.clear();
         funcs[it->second].deps.shrink_to_fit();
+        funcs[it->second].version = next_func_version();
         freg.erase(it);
+        recompile_stale_funcs();
         return true;
     }
     return false;
@@ -210,9 +256,51 @@ std::istream& Environment::from_bin(std::istream& is) {
     varname.resize(vars.size());
     util::resize_from_read_bin(is, funcs);
     for (size_t i = 0; i < funcs.size(); ++i) {
-        funcs[i].expr.from_bin(is);
-        util::read_bin(is, funcs[i].n_args);
+        auto& func = funcs[i];
+        func.expr.from_bin(is);
+        util::read_bin(is, func.n_args);
+        func.version = next_func_version();
+        func.deps.clear();
+        for (const auto& nd : func.expr.ast) {
+            if (nd.opcode == OpCode::call) {
+                func.deps.push_back(nd.call_info[0]);
+            }
+        }
+        std::sort(func.deps.begin(), func.deps.end());
+        func.deps.resize(std::unique(func.deps.begin(), func.deps.end()) -
+                         func.deps.begin());
+    }
+    // Compile after all functions are loaded, so calls can be inlined
+    for (auto& func : funcs) {
+        func.expr.compile(this);
     }
     return is;
 }
+
+EvalContext::EvalContext(const Environment& env)
+    : env(env), own_vars(env.vars) {
+    vars = own_vars.data();
+}
+
+EvalContext::EvalContext(Environment& env, bool /* is_view */)
+    : env(env), vars(env.vars.data()) { }
+
+EvalContext::EvalContext(const Environment& env, const double* vars)
+    : env(env), own_vars(vars, vars + env.vars.size()) {
+    this->vars = own_vars.data();
+}
+
+EvalContext EvalContext::view(Environment& env) {
+    return EvalContext(env, true);
+}
+
+EvalContext EvalContext::fork(const EvalContext& other) {
+    return EvalContext(other.env, other.vars);
+}
+
+void EvalContext::sync() {
+    if (vars == env.vars.data()) return;
+    own_vars = env.vars;
+    vars = own_vars.data();
+}
 }  // namespace nivalis
@@ -0,0 +1,323 @@
+#include "expr.hpp"
+
+#include "env.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <limits>
+#include "opcodes.hpp"
+#include "internal/eval_ops.hpp"
+#include "internal/simd.hpp"
+
+namespace nivalis {
+
+namespace {
+const double NONE = std::numeric_limits<double>::quiet_NaN();
+
+// Number of lanes evaluated per pass over the AST
+constexpr size_t BATCH_BLOCK = 256;
+
+// Kernels: binary kernels compute a2[i] = op(a1[i], a2[i]),
+// where a1 is the first operand (top of the stack) as in eval_ast;
+// unary kernels compute a[i] = op(a[i]).
+// On x86-64, SSE2 versions are always available and AVX2 versions
+// are selected at runtime.
+#ifdef NIVALIS_SIMD_X86
+#define DEFINE_BINARY_KERNEL(name, scalar_op, sse_op, avx_op) \
+NIVALIS_TARGET_AVX2 void name##_avx2(double* a2, const double* a1, size_t n) { \
+    size_t i = 0; \
+    for (; i + 4 <= n; i += 4) { \
+        const __m256d x = _mm256_loadu_pd(a1 + i), y = _mm256_loadu_pd(a2 + i); \
+        _mm256_storeu_pd(a2 + i, avx_op); \
+    } \
+    for (; i < n; ++i) { const double x = a1[i], y = a2[i]; a2[i] = scalar_op; } \
+} \
+void name(double* a2, const double* a1, size_t n) { \
+    if (detail::cpu_has_avx2()) { name##_avx2(a2, a1, n); return; } \
+    size_t i = 0; \
+    for (; i + 2 <= n; i += 2) { \
+        const __m128d x = _mm_loadu_pd(a1 + i), y = _mm_loadu_pd(a2 + i); \
+        _mm_storeu_pd(a2 + i, sse_op); \
+    } \
+    for (; i < n; ++i) { const double x = a1[i], y = a2[i]; a2[i] = scalar_op; } \
+}
+#define DEFINE_UNARY_KERNEL(name, scalar_op, sse_op, avx_op) \
+NIVALIS_TARGET_AVX2 void name##_avx2(double* a, size_t n) { \
+    size_t i = 0; \
+    for (; i + 4 <= n; i += 4) { \
+        const __m256d x = _mm256_loadu_pd(a + i); \
+        _mm256_storeu_pd(a + i, avx_op); \
+    } \
+    for (; i < n; ++i) { const double x = a[i]; a[i] = scalar_op; } \
+} \
+void name(double* a, size_t n) { \
+    if (detail::cpu_has_avx2()) { name##_avx2(a, n); return; } \
+    size_t i = 0; \
+    for (; i + 2 <= n; i += 2) { \
+        const __m128d x = _mm_loadu_pd(a + i); \
+        _mm_storeu_pd(a + i, sse_op); \
+    } \
+    for (; i < n; ++i) { const double x = a[i]; a[i] = scalar_op; } \
+}
+// Unary kernel without SSE2 instruction (e.g. rounding needs SSE4.1)
+#define DEFINE_UNARY_KERNEL_AVX(name, scalar_op, avx_op) \
+NIVALIS_TARGET_AVX2 void name##_avx2(double* a, size_t n) { \
+    size_t i = 0; \
+    for (; i + 4 <= n; i += 4) { \
+        const __m256d x = _mm256_loadu_pd(a + i); \
+        _mm256_storeu_pd(a + i, avx_op); \
+    } \
+    for (; i < n; ++i) { const double x = a[i]; a[i] = scalar_op; } \
+} \
+void name(double* a, size_t n) { \
+    if (detail::cpu_has_avx2()) { name##_avx2(a, n); return; } \
+    for (size_t i = 0; i < n; ++i) { const double x = a[i]; a[i] = scalar_op; } \
+}
+
+#define SSE_ONE _mm_set1_pd(1.)
+#define SSE_ZERO _mm_setzero_pd()
+#define SSE_SIGN _mm_set1_pd(-0.)
+#define AVX_ONE _mm256_set1_pd(1.)
+#define AVX_ZERO _mm256_setzero_pd()
+#define AVX_SIGN _mm256_set1_pd(-0.)
+#define AVX_CMP(a, b, pred) _mm256_and_pd(_mm256_cmp_pd(a, b, pred), AVX_ONE)
+#else
+#define DEFINE_BINARY_KERNEL(name, scalar_op, sse_op, avx_op) \
+void name(double* a2, const double* a1, size_t n) { \
+    for (size_t i = 0; i < n; ++i) { const double x = a1[i], y = a2[i]; a2[i] = scalar_op; } \
+}
+#define DEFINE_UNARY_KERNEL(name, scalar_op, sse_op, avx_op) \
+void name(double* a, size_t n) { \
+    for (size_t i = 0; i < n; ++i) { const double x = a[i]; a[i] = scalar_op; } \
+}
+#define DEFINE_UNARY_KERNEL_AVX(name, scalar_op, avx_op) \
+    DEFINE_UNARY_KERNEL(name, scalar_op, , )
+#endif
+
+DEFINE_BINARY_KERNEL(k_add, x + y, _mm_add_pd(x, y), _mm256_add_pd(x, y))
+DEFINE_BINARY_KERNEL(k_sub, x - y, _mm_sub_pd(x, y), _mm256_sub_pd(x, y))
+DEFINE_BINARY_KERNEL(k_mul, x * y, _mm_mul_pd(x, y), _mm256_mul_pd(x, y))
+DEFINE_BINARY_KERNEL(k_div, x / y, _mm_div_pd(x, y), _mm256_div_pd(x, y))
+// Operand order chosen to match std::max/min NaN behavior
+DEFINE_BINARY_KERNEL(k_max, std::max(x, y), _mm_max_pd(y, x), _mm256_max_pd(y, x))
+DEFINE_BINARY_KERNEL(k_min, std::min(x, y), _mm_min_pd(y, x), _mm256_min_pd(y, x))
+
+DEFINE_BINARY_KERNEL(k_lt, static_cast<double>(x < y),
+        _mm_and_pd(_mm_cmplt_pd(x, y), SSE_ONE), AVX_CMP(x, y, _CMP_LT_OQ))
+DEFINE_BINARY_KERNEL(k_le, static_cast<double>(x <= y),
+        _mm_and_pd(_mm_cmple_pd(x, y), SSE_ONE), AVX_CMP(x, y, _CMP_LE_OQ))
+DEFINE_BINARY_KERNEL(k_eq, static_cast<double>(x == y),
+        _mm_and_pd(_mm_cmpeq_pd(x, y), SSE_ONE), AVX_CMP(x, y, _CMP_EQ_OQ))
+DEFINE_BINARY_KERNEL(k_ne, static_cast<double>(x != y),
+        _mm_and_pd(_mm_cmpneq_pd(x, y), SSE_ONE), AVX_CMP(x, y, _CMP_NEQ_UQ))
+DEFINE_BINARY_KERNEL(k_ge, static_cast<double>(x >= y),
+        _mm_and_pd(_mm_cmpge_pd(x, y), SSE_ONE), AVX_CMP(x, y, _CMP_GE_OQ))
+DEFINE_BINARY_KERNEL(k_gt, static_cast<double>(x > y),
+        _mm_and_pd(_mm_cmpgt_pd(x, y), SSE_ONE), AVX_CMP(x, y, _CMP_GT_OQ))
+DEFINE_BINARY_KERNEL(k_land, static_cast<double>(x && y),
+        _mm_and_pd(_mm_and_pd(_mm_cmpneq_pd(x, SSE_ZERO),
+                _mm_cmpneq_pd(y, SSE_ZERO)), SSE_ONE),
+        _mm256_and_pd(_mm256_and_pd(_mm256_cmp_pd(x, AVX_ZERO, _CMP_NEQ_UQ),
+                _mm256_cmp_pd(y, AVX_ZERO, _CMP_NEQ_UQ)), AVX_ONE))
+DEFINE_BINARY_KERNEL(k_lor, static_cast<double>(x || y),
+        _mm_and_pd(_mm_or_pd(_mm_cmpneq_pd(x, SSE_ZERO),
+                _mm_cmpneq_pd(y, SSE_ZERO)), SSE_ONE),
+        _mm256_and_pd(_mm256_or_pd(_mm256_cmp_pd(x, AVX_ZERO, _CMP_NEQ_UQ),
+                _mm256_cmp_pd(y, AVX_ZERO, _CMP_NEQ_UQ)), AVX_ONE))
+DEFINE_BINARY_KERNEL(k_lxor, static_cast<double>((x != 0.) ^ (y != 0.)),
+        _mm_and_pd(_mm_xor_pd(_mm_cmpneq_pd(x, SSE_ZERO),
+                _mm_cmpneq_pd(y, SSE_ZERO)), SSE_ONE),
+        _mm256_and_pd(_mm256_xor_pd(_mm256_cmp_pd(x, AVX_ZERO, _CMP_NEQ_UQ),
+                _mm256_cmp_pd(y, AVX_ZERO, _CMP_NEQ_UQ)), AVX_ONE))
+
+DEFINE_UNARY_KERNEL(k_neg, -x, _mm_xor_pd(x, SSE_SIGN), _mm256_xor_pd(x, AVX_SIGN))
+DEFINE_UNARY_KERNEL(k_abs, std::fabs(x), _mm_andnot_pd(SSE_SIGN, x),
+        _mm256_andnot_pd(AVX_SIGN, x))
+DEFINE_UNARY_KERNEL(k_sqrt, std::sqrt(x), _mm_sqrt_pd(x), _mm256_sqrt_pd(x))
+DEFINE_UNARY_KERNEL(k_sqr, x * x, _mm_mul_pd(x, x), _mm256_mul_pd(x, x))
+DEFINE_UNARY_KERNEL(k_lnot, static_cast<double>(!x),
+        _mm_and_pd(_mm_cmpeq_pd(x, SSE_ZERO), SSE_ONE),
+        AVX_CMP(x, AVX_ZERO, _CMP_EQ_OQ))
+// sgn: 1 if x > 0, 0 if x == 0, -1 otherwise (including NaN)
+DEFINE_UNARY_KERNEL(k_sgn, (x > 0 ? 1. : (x == 0 ? 0. : -1.)),
+        _mm_sub_pd(_mm_and_pd(_mm_cmpgt_pd(x, SSE_ZERO), SSE_ONE),
+                   _mm_and_pd(_mm_cmpnge_pd(x, SSE_ZERO), SSE_ONE)),
+        _mm256_sub_pd(AVX_CMP(x, AVX_ZERO, _CMP_GT_OQ),
+                      AVX_CMP(x, AVX_ZERO, _CMP_NGE_UQ)))
+DEFINE_UNARY_KERNEL_AVX(k_floor, std::floor(x), _mm256_floor_pd(x))
+DEFINE_UNARY_KERNEL_AVX(k_ceil, std::ceil(x), _mm256_ceil_pd(x))
+
+// Elementary functions: applied lane-by-lane so that results agree exactly
+// with eval_ast; this still amortizes dispatch over the whole block
+template<class Func>
+void unary_lanes(double* a, size_t n, Func f) {
+    for (size_t i = 0; i < n; ++i) a[i] = f(a[i]);
+}
+
+// Returns true if AST can be evaluated by the batch evaluator
+// (no control flow, function calls or arguments)
+bool is_batchable(const Expr::AST& ast) {
+    using namespace OpCode;
+    for (const auto& node : ast) {
+        switch (node.opcode) {
+            case thunk_ret: case thunk_jmp: case call: case arg:
+            case bnz: case sums: case prods:
+                return false;
+        }
+    }
+    return true;
+}
+
+// Max stack height needed to evaluate AST
+size_t stack_height(const Expr::AST& ast) {
+    int64_t height = 0, max_height = 0;
+    for (size_t i = ast.size() - 1; ~i; --i) {
+        height += 1 - static_cast<int64_t>(OpCode::n_args(ast[i].opcode));
+        max_height = std::max(max_height, height);
+    }
+    return static_cast<size_t>(max_height);
+}
+}  // namespace
+
+namespace detail {
+void eval_ast_batch(EvalContext& ctx, const Expr::AST& ast,
+        const uint64_t* var_addrs, const double* const* inputs, size_t n_vars,
+        double* out, size_t n, const Program* prog) {
+    if (n == 0) return;
+    if (!is_batchable(ast)) {
+        // Scalar fallback
+        for (size_t i = 0; i < n; ++i) {
+            for (size_t j = 0; j < n_vars; ++j) {
+                ctx.vars[var_addrs[j]] = inputs[j][i];
+            }
+            out[i] = prog ? run_program(*prog, ctx) : eval_ast(ctx, ast);
+        }
+        return;
+    }
+
+    // Stack of blocks; slot k is stk[k * BATCH_BLOCK ...]
+    thread_local std::vector<double> stk;
+    stk.resize(std::max<size_t>(stack_height(ast), 1) * BATCH_BLOCK);
+
+    using namespace OpCode;
+    for (size_t base = 0; base < n; base += BATCH_BLOCK) {
+        const size_t m = std::min(BATCH_BLOCK, n - base);
+        size_t top = -1;
+        // First and second operand blocks
+#define BARG1 (&stk[top * BATCH_BLOCK])
+#define BARG2 (&stk[(top - 1) * BATCH_BLOCK])
+        for (size_t cidx = ast.size() - 1; ~cidx; --cidx) {
+            const auto& node = ast[cidx];
+            switch (node.opcode) {
+                case null:
+                    ++top; std::fill_n(BARG1, m, NONE); break;
+                case val:
+                    ++top; std::fill_n(BARG1, m, node.val); break;
+                case ref:
+                    {
+                        ++top;
+                        size_t j = 0;
+                        while (j < n_vars && var_addrs[j] != node.ref) ++j;
+                        if (j < n_vars) {
+                            std::memcpy(BARG1, inputs[j] + base, m * sizeof(double));
+                        } else {
+                            std::fill_n(BARG1, m, ctx.vars[node.ref]);
+                        }
+                    }
+                    break;
+                case bsel: --top; break;
+                case add: k_add(BARG2, BARG1, m); --top; break;
+                case sub: k_sub(BARG2, BARG1, m); --top; break;
+                case mul: k_mul(BARG2, BARG1, m); --top; break;
+                case divi: k_div(BARG2, BARG1, m); --top; break;
+                case max: k_max(BARG2, BARG1, m); --top; break;
+                case min: k_min(BARG2, BARG1, m); --top; break;
+                case lt: k_lt(BARG2, BARG1, m); --top; break;
+                case le: k_le(BARG2, BARG1, m); --top; break;
+                case eq: k_eq(BARG2, BARG1, m); --top; break;
+                case ne: k_ne(BARG2, BARG1, m); --top; break;
+                case ge: k_ge(BARG2, BARG1, m); --top; break;
+                case gt: k_gt(BARG2, BARG1, m); --top; break;
+                case land: k_land(BARG2, BARG1, m); --top; break;
+                case lor: k_lor(BARG2, BARG1, m); --top; break;
+                case lxor: k_lxor(BARG2, BARG1, m); --top; break;
+                case power:
+                    {
+                        double* a2 = BARG2; const double* a1 = BARG1;
+                        for (size_t i = 0; i < m; ++i) a2[i] = std::pow(a1[i], a2[i]);
+                        --top;
+                    }
+                    break;
+
+                case unaryminus: k_neg(BARG1, m); break;
+                case absb: k_abs(BARG1, m); break;
+                case sqrtb: k_sqrt(BARG1, m); break;
+                case sqrb: k_sqr(BARG1, m); break;
+                case lnot: k_lnot(BARG1, m); break;
+                case sgn: k_sgn(BARG1, m); break;
+                case floorb: k_floor(BARG1, m); break;
+                case ceilb: k_ceil(BARG1, m); break;
+                case expb: unary_lanes(BARG1, m, [](double x) { return std::exp(x); }); break;
+                case logb: unary_lanes(BARG1, m, [](double x) { return std::log(x); }); break;
+                case sinb: unary_lanes(BARG1, m, [](double x) { return std::sin(x); }); break;
+                case cosb: unary_lanes(BARG1, m, [](double x) { return std::cos(x); }); break;
+                case tanb: unary_lanes(BARG1, m, [](double x) { return std::tan(x); }); break;
+                default:
+                    if (OpCode::n_args(node.opcode) == 2) {
+                        double* a2 = BARG2; const double* a1 = BARG1;
+                        for (size_t i = 0; i < m; ++i) {
+                            a2[i] = apply_binary(node.opcode, a1[i], a2[i]);
+                        }
+                        --top;
+                    } else {
+                        unary_lanes(BARG1, m, [&node](double x) {
+                                return apply_unary(node.opcode, x); });
+                    }
+            }
+        }
+#undef BARG1
+#undef BARG2
+        std::memcpy(out + base, stk.data(), m * sizeof(double));
+    }
+    // Leave bound variables as a scalar loop would
+    for (size_t j = 0; j < n_vars; ++j) {
+        ctx.vars[var_addrs[j]] = inputs[j][n - 1];
+    }
+}
+}  // namespace detail
+
+void Expr::eval_batch(uint64_t var_addr, const double* xs, double* out,
+        size_t n, Environment& env) const {
+    EvalContext ctx = EvalContext::view(env);
+    eval_batch(var_addr, xs, out, n, ctx);
+}
+
+void Expr::eval_batch(const std::vector<uint64_t>& var_addrs,
+        const std::vector<const double*>& inputs,
+        double* out, size_t n, Environment& env) const {
+    EvalContext ctx = EvalContext::view(env);
+    eval_batch(var_addrs, inputs, out, n, ctx);
+}
+
+void Expr::eval_batch(uint64_t var_addr, const double* xs, double* out,
+        size_t n, EvalContext& ctx) const {
+    if (native && !is_batchable(ast)) {
+        // Native code beats the scalar fallback
+        for (size_t i = 0; i < n; ++i) {
+            ctx.vars[var_addr] = xs[i];
+            out[i] = detail::run_jit(*native, ctx);
+        }
+        return;
+    }
+    detail::eval_ast_batch(ctx, ast, &var_addr, &xs, 1, out, n, program.get());
+}
+
+void Expr::eval_batch(const std::vector<uint64_t>& var_addrs,
+        const std::vector<const double*>& inputs,
+        double* out, size_t n, EvalContext& ctx) const {
+    detail::eval_ast_batch(ctx, ast, var_addrs.data(), inputs.data(),
+            std::min(var_addrs.size(), inputs.size()), out, n, program.get());
+}
+
+}  // namespace nivalis
@@ -52,9 +52,11 @@ bool Expr::has_var(uint32_t addr) const {
     return detail::has_var_ast(ast, addr);
 }
 void Expr::sub_var(uint32_t addr, double value) {
+    uncompile();
     return detail::sub_var_ast(ast, addr, value);
 }
 void Expr::sub_var(uint32_t addr, const Expr& expr) {
+    uncompile();
     return detail::sub_var_ast(ast, addr, expr);
 }
 
@@ -85,6 +87,7 @@ std::ostream& Expr::to_bin(std::ostream& os) const {
     return os;
 }
 std::istream& Expr::from_bin(std::istream& is) {
+    uncompile();
     util::resize_from_read_bin(is, ast);
     for (size_t i = 0; i < ast.size(); ++i) {
         util::read_bin(is, ast[i]);
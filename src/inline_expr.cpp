@@ -0,0 +1,209 @@
+#include "expr.hpp"
+
+#include "env.hpp"
+
+#include <algorithm>
+#include <vector>
+#include "opcodes.hpp"
+
+namespace nivalis {
+
+namespace {
+// Max number of nested inlined calls
+const size_t MAX_INLINE_DEPTH = 16;
+// Stop inlining once the output AST has this many nodes
+const size_t MAX_INLINED_AST_SIZE = 4096;
+
+// Substitutes bodies of user functions at call sites
+struct Inliner {
+    Inliner(const Environment& env, size_t max_size,
+            std::vector<uint64_t>* inlined)
+        : env(env), max_size(max_size), inlined(inlined) { }
+
+    // Output subtree ast[idx...] to out, replacing arg i with (*args)[i]
+    // (if args is not null). Returns index after subtree.
+    size_t emit(const Expr::AST& ast, size_t idx,
+                const std::vector<Expr::AST>* args,
+                Expr::AST& out, size_t depth) {
+        using namespace OpCode;
+        const auto& node = ast[idx];
+        switch (node.opcode) {
+            case arg:
+                if (args == nullptr) {
+                    out.push_back(node);
+                } else if (node.ref < args->size()) {
+                    const auto& arg_ast = (*args)[node.ref];
+                    out.insert(out.end(), arg_ast.begin(), arg_ast.end());
+                } else {
+                    out.emplace_back(null);
+                }
+                return idx + 1;
+            case thunk_ret:
+                {
+                    // Body length may change, so recompute jump distance
+                    size_t ret_pos = out.size();
+                    out.push_back(node);
+                    idx = emit(ast, idx + 1, args, out, depth);
+                    out.emplace_back(thunk_jmp, out.size() - ret_pos);
+                    return idx + 1;
+                }
+            case call:
+                {
+                    const size_t n_args = node.call_info[1];
+                    std::vector<Expr::AST> call_args(n_args);
+                    ++idx;
+                    for (size_t i = 0; i < n_args; ++i) {
+                        idx = emit(ast, idx, args, call_args[i], depth);
+                    }
+                    const uint64_t fid = node.call_info[0];
+                    if (can_inline(fid, call_args, out.size(), depth)) {
+                        emit(env.funcs[fid].expr.ast, 0, &call_args, out, depth + 1);
+                        if (inlined != nullptr) inlined->push_back(fid);
+                    } else {
+                        out.push_back(node);
+                        for (auto& call_arg : call_args) {
+                            out.insert(out.end(), call_arg.begin(), call_arg.end());
+                        }
+                    }
+                    return idx;
+                }
+        }
+        out.push_back(node);
+        const size_t n_children = n_args(node.opcode);
+        ++idx;
+        for (size_t i = 0; i < n_children; ++i) {
+            idx = emit(ast, idx, args, out, depth);
+        }
+        return idx;
+    }
+
+private:
+    // Check if function fid calls itself, directly or indirectly
+    bool is_recursive(uint64_t fid) const {
+        std::vector<uint64_t> stk = env.funcs[fid].deps;
+        std::vector<bool> visited(env.funcs.size());
+        while (stk.size()) {
+            uint64_t dep = stk.back(); stk.pop_back();
+            if (dep == fid) return true;
+            if (dep >= env.funcs.size() || visited[dep]) continue;
+            visited[dep] = true;
+            const auto& deps = env.funcs[dep].deps;
+            stk.insert(stk.end(), deps.begin(), deps.end());
+        }
+        return false;
+    }
+
+    // Mark arguments used in the body of a sum/prod in subtree ast[idx...]
+    // Returns index after subtree.
+    static size_t find_loop_args(const Expr::AST& ast, size_t idx,
+                                 bool in_loop, std::vector<bool>& loop_args) {
+        using namespace OpCode;
+        const auto& node = ast[idx];
+        switch (node.opcode) {
+            case arg:
+                if (in_loop && node.ref < loop_args.size()) {
+                    loop_args[node.ref] = true;
+                }
+                return idx + 1;
+            case thunk_ret:
+                return find_loop_args(ast, idx + 1, in_loop, loop_args) + 1;
+            case call:
+                {
+                    const size_t n_args = node.call_info[1];
+                    ++idx;
+                    for (size_t i = 0; i < n_args; ++i) {
+                        idx = find_loop_args(ast, idx, in_loop, loop_args);
+                    }
+                    return idx;
+                }
+        }
+        const size_t n_children = n_args(node.opcode);
+        const bool is_loop = node.opcode == sums || node.opcode == prods;
+        ++idx;
+        for (size_t i = 0; i < n_children; ++i) {
+            // Last child of sum/prod is the body
+            idx = find_loop_args(ast, idx,
+                    in_loop || (is_loop && i == n_children - 1), loop_args);
+        }
+        return idx;
+    }
+
+    bool can_inline(uint64_t fid, const std::vector<Expr::AST>& call_args,
+                    size_t out_size, size_t depth) const {
+        using namespace OpCode;
+        if (fid >= env.funcs.size()) return false;
+        const auto& func = env.funcs[fid];
+        if (func.n_args != call_args.size() ||
+            func.expr.ast.size() > max_size ||
+            depth >= MAX_INLINE_DEPTH ||
+            out_size + func.expr.ast.size() > MAX_INLINED_AST_SIZE ||
+            is_recursive(fid)) return false;
+        // Variables written by sum/prod in the body, or in
+        // user functions it calls (directly or indirectly)
+        std::vector<uint64_t> loop_vars;
+        std::vector<uint64_t> stk{ fid };
+        std::vector<bool> visited(env.funcs.size());
+        while (stk.size()) {
+            uint64_t dep = stk.back(); stk.pop_back();
+            if (dep >= env.funcs.size() || visited[dep]) continue;
+            visited[dep] = true;
+            for (const auto& node : env.funcs[dep].expr.ast) {
+                if (node.opcode == sums || node.opcode == prods) {
+                    loop_vars.push_back(node.ref);
+                }
+            }
+            const auto& deps = env.funcs[dep].deps;
+            stk.insert(stk.end(), deps.begin(), deps.end());
+        }
+        std::vector<bool> loop_args(call_args.size());
+        find_loop_args(func.expr.ast, 0, false, loop_args);
+        for (size_t i = 0; i < call_args.size(); ++i) {
+            const auto& call_arg = call_args[i];
+            for (const auto& node : call_arg) {
+                // Arguments with side effects must be evaluated
+                // exactly once, before the body
+                if (node.opcode == sums || node.opcode == prods ||
+                    node.opcode == call) return false;
+                // Arguments reading a loop variable of the body would
+                // see the loop's value instead of the caller's
+                if (node.opcode == ref &&
+                    std::find(loop_vars.begin(), loop_vars.end(),
+                              node.ref) != loop_vars.end()) return false;
+            }
+            if (call_arg.size() > 1) {
+                // Do not duplicate work: non-trivial arguments
+                // may be used at most once in the body, outside of loops
+                if (loop_args[i]) return false;
+                size_t uses = 0;
+                for (const auto& node : func.expr.ast) {
+                    if (node.opcode == arg && node.ref == i) ++uses;
+                }
+                if (uses > 1) return false;
+            }
+        }
+        return true;
+    }
+
+    const Environment& env;
+    size_t max_size;
+    std::vector<uint64_t>* inlined;
+};
+}  // namespace
+
+Expr Expr::inline_calls(const Environment& env, size_t max_size,
+                        std::vector<uint64_t>* inlined) const {
+    Expr result;
+    result.ast.clear();
+    result.ast.reserve(ast.size());
+    if (inlined != nullptr) inlined->clear();
+    Inliner inliner(env, max_size, inlined);
+    inliner.emit(ast, 0, nullptr, result.ast, 0);
+    if (inlined != nullptr) {
+        std::sort(inlined->begin(), inlined->end());
+        inlined->resize(std::unique(inlined->begin(), inlined->end()) -
+                        inlined->begin());
+    }
+    return result;
+}
+
+}  // namespace nivalis
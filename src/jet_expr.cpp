@@ -0,0 +1,439 @@
+#include "expr.hpp"
+
+#include "env.hpp"
+
+#include <cmath>
+#include <vector>
+#include "opcodes.hpp"
+#include "internal/eval_ops.hpp"
+
+namespace nivalis {
+
+namespace {
+const double NONE = std::numeric_limits<double>::quiet_NaN();
+typedef Expr::Jet Jet;
+
+Jet constant(double val) { return Jet{val, 0., 0.}; }
+
+// Chain rule: jet of g(u), where g0, g1, g2 = g(u), g'(u), g''(u)
+Jet chain(const Jet& u, double g0, double g1, double g2) {
+    return Jet{g0, g1 * u.diff, g2 * u.diff * u.diff + g1 * u.ddiff};
+}
+
+Jet jet_mul(const Jet& a, const Jet& b) {
+    return Jet{a.val * b.val, a.diff * b.val + a.val * b.diff,
+               a.ddiff * b.val + 2. * a.diff * b.diff + a.val * b.ddiff};
+}
+
+Jet jet_div(const Jet& a, const Jet& b) {
+    const double q = a.val / b.val;
+    const double dq = (a.diff - q * b.diff) / b.val;
+    return Jet{q, dq, (a.ddiff - 2. * dq * b.diff - q * b.ddiff) / b.val};
+}
+
+Jet jet_log(const Jet& u) {
+    return chain(u, std::log(u.val), 1. / u.val, -1. / (u.val * u.val));
+}
+
+Jet jet_exp(const Jet& u) {
+    const double e = std::exp(u.val);
+    return chain(u, e, e, e);
+}
+
+Jet jet_lgamma(const Jet& u) {
+    using namespace OpCode;
+    return chain(u, std::lgamma(u.val),
+            detail::apply_unary(digammab, u.val),
+            detail::apply_unary(trigammab, u.val));
+}
+
+// Jet of binary operator a op b
+Jet jet_binary(uint32_t opcode, const Jet& a, const Jet& b) {
+    using namespace OpCode;
+    switch (opcode) {
+        case add: return Jet{a.val + b.val, a.diff + b.diff, a.ddiff + b.ddiff};
+        case sub: return Jet{a.val - b.val, a.diff - b.diff, a.ddiff - b.ddiff};
+        case mul: return jet_mul(a, b);
+        case divi: return jet_div(a, b);
+        case mod:
+            {
+                // d/db fmod(a, b) = -trunc(a / b), away from discontinuities
+                const double t = std::trunc(a.val / b.val);
+                return Jet{std::fmod(a.val, b.val), a.diff - t * b.diff,
+                           a.ddiff - t * b.ddiff};
+            }
+        case power:
+            if (b.diff == 0. && b.ddiff == 0.) {
+                // Constant exponent
+                const double p = b.val;
+                return chain(a, std::pow(a.val, p),
+                        p == 0. ? 0. : p * std::pow(a.val, p - 1.),
+                        p == 0. || p == 1. ? 0. :
+                            p * (p - 1.) * std::pow(a.val, p - 2.));
+            } else {
+                // a^b = exp(b ln a)
+                Jet result = jet_exp(jet_mul(b, jet_log(a)));
+                result.val = std::pow(a.val, b.val);
+                return result;
+            }
+        case logbase: return jet_div(jet_log(a), jet_log(b));
+        case max: return a.val < b.val ? b : a;
+        case min: return b.val < a.val ? b : a;
+        case betab:
+            {
+                // B(a, b) = exp(lgamma(a) + lgamma(b) - lgamma(a + b))
+                // up to sign, so B' = B L', B'' = B (L'' + L'^2)
+                const Jet la = jet_lgamma(a), lb = jet_lgamma(b),
+                          lab = jet_lgamma(Jet{a.val + b.val, a.diff + b.diff,
+                                               a.ddiff + b.ddiff});
+                const double d = la.diff + lb.diff - lab.diff,
+                             dd = la.ddiff + lb.ddiff - lab.ddiff,
+                             beta = detail::apply_binary(betab, a.val, b.val);
+                return Jet{beta, beta * d, beta * (dd + d * d)};
+            }
+        case polygammab:
+            if (a.diff != 0. || a.ddiff != 0.) {
+                // Can't differentiate wrt polygamma index
+                return Jet{detail::apply_binary(polygammab, a.val, b.val),
+                           NONE, NONE};
+            }
+            return chain(b, detail::apply_binary(polygammab, a.val, b.val),
+                    detail::apply_binary(polygammab, a.val + 1., b.val),
+                    detail::apply_binary(polygammab, a.val + 2., b.val));
+        default:
+            // Comparison, logical and integer operators: 0 derivative
+            return constant(detail::apply_binary(opcode, a.val, b.val));
+    }
+}
+
+// Jet of unary operator applied to u
+Jet jet_unary(uint32_t opcode, const Jet& u) {
+    using namespace OpCode;
+    const double x = u.val;
+    switch (opcode) {
+        case unaryminus: return Jet{-u.val, -u.diff, -u.ddiff};
+        case absb: return chain(u, std::fabs(x),
+                           detail::apply_unary(sgn, x), 0.);
+        case sqrtb:
+            {
+                const double s = std::sqrt(x);
+                return chain(u, s, 0.5 / s, -0.25 / (s * x));
+            }
+        case sqrb: return chain(u, x * x, 2. * x, 2.);
+        case expb: return jet_exp(u);
+        case exp2b:
+            {
+                const double e = std::exp2(x), l = std::log(2.);
+                return chain(u, e, e * l, e * l * l);
+            }
+        case logb: return jet_log(u);
+        case log10b: case log2b:
+            {
+                const double l = opcode == log2b ? std::log(2.) : std::log(10.);
+                Jet result = jet_log(u);
+                return Jet{detail::apply_unary(opcode, x),
+                           result.diff / l, result.ddiff / l};
+            }
+        case sinb:
+            {
+                const double s = std::sin(x), c = std::cos(x);
+                return chain(u, s, c, -s);
+            }
+        case cosb:
+            {
+                const double s = std::sin(x), c = std::cos(x);
+                return chain(u, c, -s, -c);
+            }
+        case tanb:
+            {
+                const double t = std::tan(x), sec2 = 1. + t * t;
+                return chain(u, t, sec2, 2. * t * sec2);
+            }
+        case asinb: case acosb:
+            {
+                const double r = 1. - x * x, g1 = 1. / std::sqrt(r),
+                             sign = opcode == acosb ? -1. : 1.;
+                return chain(u, detail::apply_unary(opcode, x),
+                        sign * g1, sign * x * g1 / r);
+            }
+        case atanb:
+            {
+                const double r = 1. + x * x;
+                return chain(u, std::atan(x), 1. / r, -2. * x / (r * r));
+            }
+        case sinhb:
+            {
+                const double s = std::sinh(x), c = std::cosh(x);
+                return chain(u, s, c, s);
+            }
+        case coshb:
+            {
+                const double s = std::sinh(x), c = std::cosh(x);
+                return chain(u, c, s, c);
+            }
+        case tanhb:
+            {
+                const double t = std::tanh(x), sech2 = 1. - t * t;
+                return chain(u, t, sech2, -2. * t * sech2);
+            }
+        case tgammab:
+            {
+                const double g = detail::apply_unary(tgammab, x),
+                             psi = detail::apply_unary(digammab, x);
+                return chain(u, g, g * psi,
+                        g * (psi * psi + detail::apply_unary(trigammab, x)));
+            }
+        case lgammab: return jet_lgamma(u);
+        case digammab:
+            return chain(u, detail::apply_unary(digammab, x),
+                    detail::apply_unary(trigammab, x),
+                    detail::apply_binary(polygammab, 2., x));
+        case trigammab:
+            return chain(u, detail::apply_unary(trigammab, x),
+                    detail::apply_binary(polygammab, 2., x),
+                    detail::apply_binary(polygammab, 3., x));
+        case erfb:
+            {
+                const double g1 = 2. / std::sqrt(M_PI) * std::exp(-x * x);
+                return chain(u, std::erf(x), g1, -2. * x * g1);
+            }
+        case sigmoidb:
+            {
+                const double s = detail::apply_unary(sigmoidb, x),
+                             ds = s * (1. - s);
+                return chain(u, s, ds, ds * (1. - 2. * s));
+            }
+        case softplusb:
+            {
+                const double s = detail::apply_unary(sigmoidb, x);
+                return chain(u, detail::apply_unary(softplusb, x),
+                        s, s * (1. - s));
+            }
+        case gausspdfb:
+            {
+                const double p = detail::apply_unary(gausspdfb, x);
+                return chain(u, p, -x * p, (x * x - 1.) * p);
+            }
+        case zetab:
+            // Derivative not available
+            return Jet{detail::apply_unary(zetab, x), NONE, NONE};
+        default:
+            // Integer-valued functions (lnot, sgn, floor, ...): 0 derivative
+            return constant(detail::apply_unary(opcode, x));
+    }
+}
+
+// Max function call stack height
+const size_t MAX_CALL_STK_HEIGHT = 256;
+
+// Evaluates the AST like eval_ast, but on jets: same stack machine
+// (thunks, sums/prods, calls), carrying derivatives along
+struct JetEvaluator {
+    JetEvaluator(EvalContext& ctx, uint64_t var_addr)
+        : ctx(ctx), var_addr(var_addr), stk(stacks().stk),
+          thunks(stacks().thunks), thunks_stk(stacks().thunks_stk) { }
+
+    Jet eval(const Expr::AST& ast, const Jet* args, size_t n_args,
+             size_t depth) {
+        using namespace OpCode;
+        const size_t init_top = stk.size(), init_thunks = thunks.size(),
+              init_thunks_stk = thunks_stk.size();
+        bool _is_thunk_ret = false;
+#define ARG3 stk[stk.size() - 3]
+#define ARG2 stk[stk.size() - 2]
+#define ARG1 stk.back()
+#define RET_VAL ret_val
+#define FAIL_AND_QUIT do { \
+    failed = true; stk.resize(init_top); thunks.resize(init_thunks); \
+    thunks_stk.resize(init_thunks_stk); \
+    return Jet{NONE, NONE, NONE}; } while(0)
+        Jet ret_val;
+        for (size_t cidx = ast.size() - 1; ~cidx; --cidx) {
+            const auto& node = ast[cidx];
+            switch(node.opcode) {
+                case null: stk.push_back(Jet{NONE, NONE, NONE}); break;
+                case val: stk.push_back(constant(node.val)); break;
+                case ref:
+                    if (node.ref == var_addr && n_shadowed == 0) {
+                        stk.push_back(Jet{ctx.vars[node.ref], 1., 0.});
+                    } else {
+                        stk.push_back(constant(ctx.vars[node.ref]));
+                    }
+                    break;
+                case arg:
+                    stk.push_back(node.ref < n_args ? args[node.ref] :
+                            Jet{NONE, NONE, NONE});
+                    break;
+                case thunk_jmp:
+                    thunks.push_back(cidx);
+                    cidx -= node.ref;
+                    break;
+                case thunk_ret:
+                    cidx = thunks_stk.back() + 1;
+                    thunks_stk.pop_back();
+                    ret_val = stk.back(); stk.pop_back();
+                    _is_thunk_ret = true;
+                    break;
+                case call:
+                    {
+                        const size_t n_call_args = node.call_info[1];
+                        const auto& func = ctx.env.funcs[node.call_info[0]];
+                        if (n_call_args != func.n_args ||
+                            &func.expr.ast[0] == &ast[0] ||
+                            depth >= MAX_CALL_STK_HEIGHT) FAIL_AND_QUIT;
+                        // Arguments are on the stack, first argument on top
+                        std::vector<Jet> f_args(stk.rbegin(),
+                                stk.rbegin() + n_call_args);
+                        stk.resize(stk.size() - n_call_args);
+                        Jet result = eval(func.expr.ast, f_args.data(),
+                                n_call_args, depth + 1);
+                        if (failed) FAIL_AND_QUIT;
+                        stk.push_back(result);
+                    }
+                    break;
+                case bnz:
+                    if (_is_thunk_ret) {
+                        _is_thunk_ret = false;
+                        ARG1 = RET_VAL;
+                    } else {
+                        thunks_stk.push_back(cidx);
+                        cidx = thunks[thunks.size() - (ARG1.val == 0.) - 1];
+                        thunks.resize(thunks.size() - 2);
+                    }
+                    break;
+                case sums: case prods:
+                    {
+                        if (_is_thunk_ret) {
+                            _is_thunk_ret = false;
+                            if (node.opcode == prods) {
+                                ARG3 = jet_mul(ARG3, RET_VAL);
+                            } else {
+                                ARG3 = jet_binary(add, ARG3, RET_VAL);
+                            }
+                        } else {
+                            // Move over the arguments and use arg3 as output
+                            stk.push_back(ARG1); ARG2 = ARG3;
+                            ARG3 = constant(node.opcode == prods ? 1. : 0.);
+                            // Inside the loop, the index shadows the variable
+                            if (node.ref == var_addr) ++n_shadowed;
+                        }
+                        // The loop index has no derivative
+                        int64_t a = static_cast<int64_t>(ARG1.val),
+                                b = static_cast<int64_t>(ARG2.val);
+                        int64_t step = (a <= b) ? 1 : -1;
+                        if (std::isnan(ARG1.val)) {
+                            stk.resize(stk.size() - 2); thunks.pop_back();
+                            if (node.ref == var_addr) --n_shadowed;
+                        } else {
+                            ctx.vars[node.ref] = static_cast<double>(a);
+                            a += step;
+                            if (a == b + step) ARG1 = Jet{NONE, 0., 0.};
+                            else ARG1 = constant(static_cast<double>(a));
+                            thunks_stk.push_back(cidx);
+                            cidx = thunks.back();
+                        }
+                    }
+                    break;
+                case bsel: stk.pop_back(); break;
+                default:
+                    if (OpCode::n_args(node.opcode) == 2) {
+                        Jet result = jet_binary(node.opcode, ARG1, ARG2);
+                        stk.pop_back();
+                        ARG1 = result;
+                    } else {
+                        ARG1 = jet_unary(node.opcode, ARG1);
+                    }
+            }
+        }
+#undef ARG3
+#undef ARG2
+#undef ARG1
+#undef RET_VAL
+#undef FAIL_AND_QUIT
+        Jet result = stk.back();
+        stk.resize(init_top);
+        return result;
+    }
+
+private:
+    EvalContext& ctx;
+    uint64_t var_addr;
+    // Number of enclosing sums/prods whose index is the variable
+    size_t n_shadowed = 0;
+    // Set if evaluation failed (e.g. recursion); result is then NaN
+    bool failed = false;
+
+    // Stacks are reused across evaluations, to avoid allocating
+    struct Stacks {
+        std::vector<Jet> stk;
+        // See eval_ast
+        std::vector<size_t> thunks, thunks_stk;
+    };
+    static Stacks& stacks() {
+        thread_local Stacks s;
+        return s;
+    }
+    std::vector<Jet>& stk;
+    std::vector<size_t>& thunks, & thunks_stk;
+};
+}  // namespace
+
+Expr::Jet Expr::eval_jet(uint64_t var_addr, double x,
+                         Environment& env) const {
+    EvalContext ctx = EvalContext::view(env);
+    return eval_jet(var_addr, x, ctx);
+}
+
+Expr::Jet Expr::eval_jet(uint64_t var_addr, double x,
+                         EvalContext& ctx) const {
+    ctx.vars[var_addr] = x;
+    JetEvaluator evaluator(ctx, var_addr);
+    return evaluator.eval(ast, nullptr, 0, 0);
+}
+
+double Expr::newton_jet(uint64_t var_addr, double x0, Environment& env,
+        double eps_step, double eps_abs, int max_iter,
+        double xmin, double xmax, int deriv_order,
+        const Jet* jet0) const {
+    EvalContext ctx = EvalContext::view(env);
+    return newton_jet(var_addr, x0, ctx, eps_step, eps_abs, max_iter,
+                      xmin, xmax, deriv_order, jet0);
+}
+
+double Expr::newton_jet(uint64_t var_addr, double x0, EvalContext& ctx,
+        double eps_step, double eps_abs, int max_iter,
+        double xmin, double xmax, int deriv_order,
+        const Jet* jet0) const {
+    for (int i = 0; i < max_iter; ++i) {
+        Jet jet;
+        if (i == 0 && jet0 != nullptr) {
+            jet = *jet0;
+        } else {
+            jet = eval_jet(var_addr, x0, ctx);
+        }
+        // Newton on f (f, f'), on f' (f', f'') or on 1/f (1/f, -f'/f^2)
+        double fx0, dfx0;
+        if (deriv_order < 0) {
+            fx0 = 1. / jet.val;
+            dfx0 = -jet.diff / (jet.val * jet.val);
+        } else {
+            fx0 = deriv_order ? jet.diff : jet.val;
+            dfx0 = deriv_order ? jet.ddiff : jet.diff;
+        }
+        if (std::isnan(fx0) || std::isnan(dfx0) || dfx0 == 0.) {
+            return NONE; // Fail
+        }
+        double delta = fx0 / dfx0;
+        x0 -= delta;
+        if (std::fabs(delta) < eps_step && std::fabs(fx0) < eps_abs) {
+            // Found root
+            return x0;
+        }
+        if (x0 < xmin || x0 > xmax) {
+            return NONE; // Fail
+        }
+    }
+    return NONE; // Fail
+}
+
+}  // namespace nivalis
@@ -0,0 +1,503 @@
+#include "expr.hpp"
+
+#include "version.hpp"
+#include "env.hpp"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <limits>
+#include <vector>
+#include "opcodes.hpp"
+#include "internal/eval_ops.hpp"
+
+// Native x86-64 code generator for expressions (System V ABI only)
+#if defined(ENABLE_NIVALIS_JIT) && (defined(__x86_64__) || defined(_M_X64)) \
+    && !defined(_WIN32)
+#define NIVALIS_JIT_X86_64
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace nivalis {
+
+namespace {
+const double NONE = std::numeric_limits<double>::quiet_NaN();
+}  // namespace
+
+namespace detail {
+struct JitFunction {
+    // Generated function:
+    // double fn(double* vars, const double* args, EvalContext* ctx)
+    typedef double (*NativeFn)(double*, const double*, EvalContext*);
+
+    // Subexpression evaluated by the interpreter, called from native code
+    struct Fallback {
+        Expr expr;
+        size_t n_args;
+    };
+
+    JitFunction() =default;
+    JitFunction(const JitFunction&) =delete;
+    JitFunction& operator=(const JitFunction&) =delete;
+    ~JitFunction() {
+#ifdef NIVALIS_JIT_X86_64
+        if (code != nullptr) munmap(code, code_size);
+#endif
+    }
+
+    NativeFn fn = nullptr;
+    void* code = nullptr;
+    size_t code_size = 0;
+    // Number of args used by expression
+    size_t n_args = 0;
+    std::vector<std::unique_ptr<Fallback> > fallbacks;
+    // User functions inlined, as (id, version)
+    std::vector<std::pair<uint64_t, uint64_t> > inlined;
+};
+}  // namespace detail
+
+#ifdef NIVALIS_JIT_X86_64
+namespace {
+using detail::JitFunction;
+
+// Helpers called from generated code
+double jit_fallback(const JitFunction::Fallback* fb, EvalContext* ctx,
+                    const double* args) {
+    if (fb->expr.program) {
+        return detail::run_program(*fb->expr.program, *ctx, args, fb->n_args);
+    }
+    return detail::eval_ast(*ctx, fb->expr.ast, args, fb->n_args);
+}
+double jit_unary(uint32_t opcode, double x) {
+    return detail::apply_unary(opcode, x);
+}
+double jit_binary(uint32_t opcode, double a, double b) {
+    return detail::apply_binary(opcode, a, b);
+}
+double jit_pow(double a, double b) { return std::pow(a, b); }
+double jit_fmod(double a, double b) { return std::fmod(a, b); }
+
+// Common libm functions called directly (skipping the opcode switch)
+typedef double (*UnaryFn)(double);
+UnaryFn libm_unary(uint32_t opcode) {
+    using namespace OpCode;
+    switch (opcode) {
+        case expb: return [](double x) { return std::exp(x); };
+        case logb: return [](double x) { return std::log(x); };
+        case sinb: return [](double x) { return std::sin(x); };
+        case cosb: return [](double x) { return std::cos(x); };
+        case tanb: return [](double x) { return std::tan(x); };
+        case floorb: return [](double x) { return std::floor(x); };
+        case ceilb: return [](double x) { return std::ceil(x); };
+        case roundb: return [](double x) { return std::round(x); };
+        case atanb: return [](double x) { return std::atan(x); };
+        case tanhb: return [](double x) { return std::tanh(x); };
+    }
+    return nullptr;
+}
+
+// General purpose registers
+enum { RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI };
+// SSE comparison predicates (cmpsd)
+enum { CMP_EQ = 0, CMP_LT = 1, CMP_LE = 2, CMP_NEQ = 4 };
+
+// Emits x86-64 machine code.
+// Generated code keeps
+//   rbx = vars, r12 = args, r13 = ctx,
+// evaluates each subtree into xmm0, and keeps pending operands
+// in stack slots [rsp + 8 * depth].
+struct Assembler {
+    std::vector<uint8_t> buf;
+
+    void byte(uint8_t b) { buf.push_back(b); }
+    void bytes(std::initializer_list<uint8_t> bs) {
+        buf.insert(buf.end(), bs.begin(), bs.end());
+    }
+    void imm32(uint32_t v) {
+        for (int i = 0; i < 4; ++i) byte(static_cast<uint8_t>(v >> (8 * i)));
+    }
+    void imm64(uint64_t v) {
+        for (int i = 0; i < 8; ++i) byte(static_cast<uint8_t>(v >> (8 * i)));
+    }
+
+    // SSE op xmm(reg), [base + disp32]; base is rsp, rbx or r12
+    // prefix: F2 (scalar double) or 66 (packed double); op: 2nd opcode byte
+    void sse_mem(uint8_t prefix, uint8_t op, int reg, int base, int32_t disp) {
+        byte(prefix);
+        if (base == 12) byte(0x41); // REX.B for r12
+        bytes({0x0F, op});
+        const int rm = base & 7;
+        byte(static_cast<uint8_t>(0x80 | (reg << 3) | rm));
+        if (rm == RSP) byte(0x24); // SIB
+        imm32(static_cast<uint32_t>(disp));
+    }
+    // SSE op xmm(dst), xmm(src)
+    void sse_reg(uint8_t prefix, uint8_t op, int dst, int src) {
+        bytes({prefix, 0x0F, op, static_cast<uint8_t>(0xC0 | (dst << 3) | src)});
+    }
+
+    void load_slot(int xmm, size_t slot) {
+        sse_mem(0xF2, 0x10, xmm, RSP, static_cast<int32_t>(slot * 8));
+    }
+    void store_slot(int xmm, size_t slot) {
+        sse_mem(0xF2, 0x11, xmm, RSP, static_cast<int32_t>(slot * 8));
+    }
+    // movsd xmm, qword constant (via rax)
+    void load_const(int xmm, double val) {
+        uint64_t bits;
+        std::memcpy(&bits, &val, sizeof bits);
+        if (bits == 0) {
+            sse_reg(0x66, 0x57, xmm, xmm); // xorpd
+            return;
+        }
+        bytes({0x48, 0xB8}); imm64(bits);       // mov rax, imm64
+        bytes({0x66, 0x48, 0x0F, 0x6E,          // movq xmm, rax
+               static_cast<uint8_t>(0xC0 | (xmm << 3))});
+    }
+    void mov_xmm(int dst, int src) { sse_reg(0x66, 0x28, dst, src); } // movapd
+    void cmpsd(int dst, int src, uint8_t pred) {
+        sse_reg(0xF2, 0xC2, dst, src); byte(pred);
+    }
+    // Mask in xmm0 -> 1.0 or 0.0
+    void mask_to_bool() {
+        load_const(1, 1.);
+        sse_reg(0x66, 0x54, 0, 1); // andpd xmm0, xmm1
+    }
+    // Call function at addr (all xmm registers are clobbered)
+    void call(const void* addr) {
+        bytes({0x48, 0xB8}); imm64(reinterpret_cast<uint64_t>(addr));
+        bytes({0xFF, 0xD0});      // call rax
+    }
+    void mov_edi(uint32_t v) { byte(0xBF); imm32(v); }
+    void mov_rdi(const void* p) {
+        bytes({0x48, 0xBF}); imm64(reinterpret_cast<uint64_t>(p));
+    }
+    // Jumps with rel32 to be patched; returns position of rel32
+    size_t jmp() { byte(0xE9); imm32(0); return buf.size() - 4; }
+    size_t jcc(uint8_t cc) { bytes({0x0F, cc}); imm32(0); return buf.size() - 4; }
+    // Point jump at patch_pos to current position
+    void patch(size_t patch_pos) {
+        uint32_t rel = static_cast<uint32_t>(buf.size() - (patch_pos + 4));
+        std::memcpy(&buf[patch_pos], &rel, 4);
+    }
+};
+
+struct CodeGen {
+    CodeGen(const Expr::AST& ast, JitFunction& func) : ast(ast), func(func) {}
+
+    bool generate() {
+        for (const auto& node : ast) {
+            if (node.opcode == OpCode::arg) {
+                func.n_args = std::max<size_t>(func.n_args, node.ref + 1);
+            }
+        }
+        // Prologue
+        asm_.bytes({0x53, 0x41, 0x54, 0x41, 0x55}); // push rbx; push r12; push r13
+        asm_.bytes({0x48, 0x89, 0xFB});             // mov rbx, rdi
+        asm_.bytes({0x49, 0x89, 0xF4});             // mov r12, rsi
+        asm_.bytes({0x49, 0x89, 0xD5});             // mov r13, rdx
+        asm_.bytes({0x48, 0x81, 0xEC});             // sub rsp, frame
+        const size_t frame_pos = asm_.buf.size();
+        asm_.imm32(0);
+
+        size_t end = gen(0, 0);
+        if (!ok || end != ast.size()) return false;
+
+        // Stack must stay 16-byte aligned for calls
+        // (3 pushes + return address = 32 bytes)
+        uint32_t frame = static_cast<uint32_t>((max_slots * 8 + 15) & ~size_t(15));
+        std::memcpy(&asm_.buf[frame_pos], &frame, 4);
+        // Epilogue
+        asm_.bytes({0x48, 0x81, 0xC4}); asm_.imm32(frame); // add rsp, frame
+        asm_.bytes({0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3});  // pop r13; pop r12; pop rbx; ret
+
+        // Copy into executable memory
+        const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        const size_t size = (asm_.buf.size() + page - 1) / page * page;
+        void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) return false;
+        std::memcpy(mem, asm_.buf.data(), asm_.buf.size());
+        if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+            munmap(mem, size);
+            return false;
+        }
+        func.code = mem;
+        func.code_size = size;
+        func.fn = reinterpret_cast<JitFunction::NativeFn>(mem);
+        return true;
+    }
+
+private:
+    // Index after the subtree at idx
+    size_t skip(size_t idx) {
+        if (idx >= ast.size()) { ok = false; return ast.size(); }
+        size_t n_children = ast[idx].opcode == OpCode::call ?
+            ast[idx].call_info[1] : OpCode::n_args(ast[idx].opcode);
+        ++idx;
+        for (size_t i = 0; i < n_children && ok; ++i) idx = skip(idx);
+        return idx;
+    }
+
+    bool is_leaf(size_t idx) {
+        using namespace OpCode;
+        const uint32_t op = ast[idx].opcode;
+        return op == val || op == null || op == ref || op == arg;
+    }
+
+    // Check if evaluating nodes [begin, end) may set variables
+    // (sums/prods, or user functions containing them)
+    bool has_side_effects(size_t begin, size_t end) {
+        using namespace OpCode;
+        for (size_t i = begin; i < end; ++i) {
+            const uint32_t op = ast[i].opcode;
+            if (op == sums || op == prods || op == call) return true;
+        }
+        return false;
+    }
+
+    void use_slot(size_t slot) {
+        max_slots = std::max(max_slots, slot + 1);
+    }
+
+    // Load leaf node at idx into xmm register
+    void gen_leaf(size_t idx, int xmm) {
+        using namespace OpCode;
+        const auto& node = ast[idx];
+        switch (node.opcode) {
+            case val: asm_.load_const(xmm, node.val); break;
+            case ref:
+                if (node.ref > INT32_MAX / 8) { ok = false; return; }
+                asm_.sse_mem(0xF2, 0x10, xmm, RBX, static_cast<int32_t>(node.ref * 8));
+                break;
+            case arg:
+                if (node.ref > INT32_MAX / 8) { ok = false; return; }
+                asm_.sse_mem(0xF2, 0x10, xmm, 12, static_cast<int32_t>(node.ref * 8));
+                break;
+            default: asm_.load_const(xmm, NONE);
+        }
+    }
+
+    // Evaluate subtree by calling the interpreter
+    size_t gen_fallback(size_t idx) {
+        size_t end = skip(idx);
+        if (!ok) return end;
+        func.fallbacks.emplace_back(new JitFunction::Fallback);
+        auto& fb = *func.fallbacks.back();
+        fb.expr.ast.assign(ast.begin() + idx, ast.begin() + end);
+        fb.expr.compile();
+        fb.n_args = func.n_args;
+        asm_.mov_rdi(&fb);
+        asm_.bytes({0x4C, 0x89, 0xEE}); // mov rsi, r13
+        asm_.bytes({0x4C, 0x89, 0xE2}); // mov rdx, r12
+        asm_.call(reinterpret_cast<const void*>(&jit_fallback));
+        return end;
+    }
+
+    // Evaluate both children of binary node at idx: first child (A)
+    // into xmm0, second (B) into xmm1. As in eval_ast, B is evaluated first.
+    size_t gen_operands(size_t idx, size_t depth) {
+        size_t b_idx = skip(idx + 1);
+        if (!ok) return b_idx;
+        if (is_leaf(b_idx) && !has_side_effects(idx + 1, b_idx)) {
+            // Order does not matter
+            gen(idx + 1, depth);
+            gen_leaf(b_idx, 1);
+            return b_idx + 1;
+        }
+        size_t end = gen(b_idx, depth);
+        use_slot(depth);
+        asm_.store_slot(0, depth);
+        gen(idx + 1, depth + 1);
+        asm_.load_slot(1, depth);
+        return end;
+    }
+
+    // Generate code for subtree at idx, result in xmm0;
+    // stack slots >= depth are free. Returns index after subtree.
+    size_t gen(size_t idx, size_t depth) {
+        using namespace OpCode;
+        if (!ok || idx >= ast.size()) { ok = false; return ast.size(); }
+        const auto& node = ast[idx];
+        if (is_leaf(idx)) {
+            gen_leaf(idx, 0);
+            return idx + 1;
+        }
+        switch (node.opcode) {
+            case call: case sums: case prods:
+            case thunk_ret: case thunk_jmp:
+                return gen_fallback(idx);
+            case bnz:
+                {
+                    // bnz cond thunk(then) thunk(else)
+                    size_t then_idx = skip(idx + 1);
+                    size_t else_idx = skip(then_idx);
+                    size_t end = skip(else_idx);
+                    if (!ok || ast[then_idx].opcode != thunk_ret ||
+                            ast[else_idx].opcode != thunk_ret) {
+                        ok = false; return end;
+                    }
+                    gen(idx + 1, depth);
+                    asm_.sse_reg(0x66, 0x57, 1, 1);       // xorpd xmm1, xmm1
+                    asm_.sse_reg(0x66, 0x2E, 0, 1);       // ucomisd xmm0, xmm1
+                    size_t to_then = asm_.jcc(0x8A);      // jp (nan: then branch)
+                    size_t to_else = asm_.jcc(0x84);      // je
+                    asm_.patch(to_then);
+                    gen(then_idx + 1, depth);
+                    size_t to_end = asm_.jmp();
+                    asm_.patch(to_else);
+                    gen(else_idx + 1, depth);
+                    asm_.patch(to_end);
+                    return end;
+                }
+            case bsel:
+                {
+                    // Evaluate second, then first; return second
+                    size_t b_idx = skip(idx + 1);
+                    size_t end = gen(b_idx, depth);
+                    use_slot(depth);
+                    asm_.store_slot(0, depth);
+                    gen(idx + 1, depth + 1);
+                    asm_.load_slot(0, depth);
+                    return end;
+                }
+        }
+
+        if (n_args(node.opcode) == 2) {
+            size_t b_idx = skip(idx + 1);
+            if (!ok) return b_idx;
+            if (node.opcode == power && ast[b_idx].opcode == val &&
+                    ast[b_idx].val == 2.) {
+                size_t end = gen(idx + 1, depth);
+                asm_.sse_reg(0xF2, 0x59, 0, 0);           // mulsd xmm0, xmm0
+                return end + 1;
+            }
+            size_t end = gen_operands(idx, depth);
+            switch (node.opcode) {
+                case add: asm_.sse_reg(0xF2, 0x58, 0, 1); break;
+                case sub: asm_.sse_reg(0xF2, 0x5C, 0, 1); break;
+                case mul: asm_.sse_reg(0xF2, 0x59, 0, 1); break;
+                case divi: asm_.sse_reg(0xF2, 0x5E, 0, 1); break;
+                case max: case min:
+                    // maxsd/minsd return the source operand if either is nan,
+                    // so maxsd(B, A) == std::max(A, B)
+                    asm_.sse_reg(0xF2, node.opcode == max ? 0x5F : 0x5D, 1, 0);
+                    asm_.mov_xmm(0, 1);
+                    break;
+                case lt: asm_.cmpsd(0, 1, CMP_LT); asm_.mask_to_bool(); break;
+                case le: asm_.cmpsd(0, 1, CMP_LE); asm_.mask_to_bool(); break;
+                case eq: asm_.cmpsd(0, 1, CMP_EQ); asm_.mask_to_bool(); break;
+                case ne: asm_.cmpsd(0, 1, CMP_NEQ); asm_.mask_to_bool(); break;
+                case gt: case ge:
+                    asm_.cmpsd(1, 0, node.opcode == gt ? CMP_LT : CMP_LE);
+                    asm_.mov_xmm(0, 1);
+                    asm_.mask_to_bool();
+                    break;
+                case land: case lor: case lxor:
+                    asm_.sse_reg(0x66, 0x57, 2, 2);       // xorpd xmm2, xmm2
+                    asm_.cmpsd(0, 2, CMP_NEQ);
+                    asm_.cmpsd(1, 2, CMP_NEQ);
+                    asm_.sse_reg(0x66, node.opcode == land ? 0x54 :
+                            node.opcode == lor ? 0x56 : 0x57, 0, 1);
+                    asm_.mask_to_bool();
+                    break;
+                case power: asm_.call(reinterpret_cast<const void*>(&jit_pow)); break;
+                case mod: asm_.call(reinterpret_cast<const void*>(&jit_fmod)); break;
+                default:
+                    asm_.mov_edi(node.opcode);
+                    asm_.call(reinterpret_cast<const void*>(&jit_binary));
+            }
+            return end;
+        }
+
+        // Unary
+        size_t end = gen(idx + 1, depth);
+        switch (node.opcode) {
+            case unaryminus:
+                asm_.load_const(1, -0.);
+                asm_.sse_reg(0x66, 0x57, 0, 1);           // xorpd
+                break;
+            case absb:
+                {
+                    uint64_t bits = ~(uint64_t(1) << 63);
+                    double mask;
+                    std::memcpy(&mask, &bits, sizeof mask);
+                    asm_.load_const(1, mask);
+                    asm_.sse_reg(0x66, 0x54, 0, 1);       // andpd
+                }
+                break;
+            case sqrtb: asm_.sse_reg(0xF2, 0x51, 0, 0); break;
+            case sqrb: asm_.sse_reg(0xF2, 0x59, 0, 0); break;
+            case lnot:
+                asm_.sse_reg(0x66, 0x57, 1, 1);
+                asm_.cmpsd(0, 1, CMP_EQ);
+                asm_.mask_to_bool();
+                break;
+            default:
+                if (UnaryFn fn = libm_unary(node.opcode)) {
+                    asm_.call(reinterpret_cast<const void*>(fn));
+                } else {
+                    asm_.mov_edi(node.opcode);
+                    asm_.call(reinterpret_cast<const void*>(&jit_unary));
+                }
+        }
+        return end;
+    }
+
+    const Expr::AST& ast;
+    JitFunction& func;
+    Assembler asm_;
+    size_t max_slots = 0;
+    bool ok = true;
+};
+}  // namespace
+#endif // NIVALIS_JIT_X86_64
+
+namespace detail {
+double run_jit(const JitFunction& func, EvalContext& ctx,
+        const double* args, size_t n_args) {
+    if (n_args < func.n_args) {
+        // Pad missing arguments with nan
+        std::vector<double> padded(func.n_args, NONE);
+        std::copy(args, args + n_args, padded.begin());
+        return func.fn(ctx.vars, padded.data(), &ctx);
+    }
+    return func.fn(ctx.vars, args, &ctx);
+}
+
+const std::vector<std::pair<uint64_t, uint64_t> >& jit_inlined(
+        const JitFunction& func) {
+    return func.inlined;
+}
+}  // namespace detail
+
+bool Expr::jit(const Environment* env) {
+#ifdef NIVALIS_JIT_X86_64
+    auto func = std::make_shared<detail::JitFunction>();
+    bool success;
+    if (env != nullptr) {
+        std::vector<uint64_t> inlined;
+        Expr inlined_expr = inline_calls(*env, 64, &inlined);
+        for (uint64_t fid : inlined) {
+            func->inlined.emplace_back(fid, env->funcs[fid].version);
+        }
+        success = CodeGen(inlined_expr.ast, *func).generate();
+    } else {
+        success = CodeGen(ast, *func).generate();
+    }
+    if (success) {
+        native = std::move(func);
+        return true;
+    }
+#endif
+    native.reset();
+    return false;
+}
+
+bool Expr::is_jitted() const {
+    return native != nullptr;
+}
+
+}  // namespace nivalis
@@ -167,7 +167,7 @@ std::string latex_to_nivalis(const std::string& expr_in) {
         "circ", "fcirc", "Fcirc",
         "ellipse", "fellipse", "Fellipse",
         "text",
-        "mandelbrot"
+        "mandelbrot", "julia"
     };
 
     // Remove operatorname
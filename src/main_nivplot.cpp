@@ -26,6 +26,7 @@
 #include <thread>
 #include <condition_variable>
 #include <mutex>
+#include <chrono>
 #include <atomic>
 #include <GL/glew.h>
 #include "imfilebrowser.h"
@@ -48,7 +49,7 @@ bool run_worker_flag;
 volatile bool worker_quit_flag;
 std::condition_variable worker_cv;
 std::mutex worker_mtx;
-std::stringstream state_encoding;
+std::shared_ptr<const Plotter::Snapshot> worker_snapshot; // Scene to render next
 
 // Fonts
 ImFont* font_sm, * font_md;
@@ -57,34 +58,64 @@ ImFont* font_sm, * font_md;
 // to prevent infinite update loop, do not call WebWorker in that case
 bool worker_req_update;
 
+// Time a render may take before a preview is published first, in ms
+const double RENDER_BUDGET_MS = 1000. / 30;
+
+// Publish render result of worker_plot to plot (caller must hold worker_mtx)
+void publish_render(nivalis::Plotter& plot) {
+    // worker_plot.export_binary_render_result(output_encoding);
+    // plot.import_binary_render_result(output_encoding);
+    // Use swap rather than messaging for better performacne
+    plot.draw_buf.swap(worker_plot.draw_buf);
+    plot.pt_markers.swap(worker_plot.pt_markers);
+    plot.bg_bitmap.swap(worker_plot.bg_bitmap);
+    plot.bg_bitmap_view = worker_plot.bg_bitmap_view;
+    plot.require_update = true;
+    if (worker_plot.loss_detail) {
+        plot.func_error = worker_plot.func_error;
+    } else if (plot.loss_detail) {
+        plot.func_error.clear();
+    }
+    plot.loss_detail = worker_plot.loss_detail;
+    worker_req_update = true;
+}
+
 // Draw worker thread entry point
 void draw_worker(nivalis::Plotter& plot) {
+    // Duration of the last full render, in ms
+    double render_ms = 0.;
     while (!worker_quit_flag) {
         Plotter::View view;
         {
             std::unique_lock<std::mutex> lock(worker_mtx);
             worker_cv.wait(lock, []{return run_worker_flag;});
             if (worker_quit_flag) break;
-            view = worker_plot.view;
             run_worker_flag = false;
-            worker_plot.import_binary_func_and_env(state_encoding);
-            state_encoding.str("");
+            worker_plot.cancel_render = false;
+            worker_plot.import_snapshot(worker_snapshot);
+            view = worker_plot.view;
         }
+        // If full renders are slow, publish a quick preview first,
+        // then refine; renders are abandoned once a newer request comes
+        if (render_ms > RENDER_BUDGET_MS) {
+            worker_plot.render_coarse = true;
+            worker_plot.render(view);
+            worker_plot.render_coarse = false;
+            if (!worker_plot.render_complete) continue;
+            std::lock_guard<std::mutex> lock(worker_mtx);
+            publish_render(plot);
+        }
+        auto start = std::chrono::high_resolution_clock::now();
         worker_plot.render(view);
-        std::lock_guard<std::mutex> lock(worker_mtx);
-        // worker_plot.export_binary_render_result(output_encoding);
-        // plot.import_binary_render_result(output_encoding);
-        // Use swap rather than messaging for better performacne
-        plot.draw_buf.swap(worker_plot.draw_buf);
-        plot.pt_markers.swap(worker_plot.pt_markers);
-        plot.require_update = true;
-        if (worker_plot.loss_detail) {
-            plot.func_error = worker_plot.func_error;
-        } else if (plot.loss_detail) {
-            plot.func_error.clear();
+        const double ms = std::chrono::duration<double, std::milli>(
+                std::chrono::high_resolution_clock::now() - start).count();
+        if (!worker_plot.render_complete) {
+            render_ms = std::max(render_ms, ms);
+            continue;
         }
-        plot.loss_detail = worker_plot.loss_detail;
-        worker_req_update = true;
+        render_ms = ms;
+        std::lock_guard<std::mutex> lock(worker_mtx);
+        publish_render(plot);
     }
 }
 
@@ -95,11 +126,13 @@ void maybe_run_worker(nivalis::Plotter& plot) {
     using namespace nivalis;
     {
         std::lock_guard<std::mutex> lock(worker_mtx);
-        run_worker_flag = !(worker_req_update &&
-                worker_plot.view == plot.view);
-        state_encoding.str("");
-        plot.export_binary_func_and_env(state_encoding);
-        worker_plot.view = plot.view;
+        if (!(worker_req_update && worker_snapshot &&
+              worker_snapshot->view == plot.view)) {
+            run_worker_flag = true;
+            // Render in progress (if any) is stale
+            worker_plot.cancel_render = true;
+        }
+        worker_snapshot = plot.export_snapshot();
         worker_req_update = false;
     }
     worker_cv.notify_one();
@@ -409,6 +442,7 @@ void main_loop_step() {
     ImGui::SameLine();
     if (ImGui::Checkbox("Grid", &plot.enable_grid)) plot.require_update = true;
     if (ImGui::Checkbox("Polar grid", &plot.polar_grid)) plot.require_update = true;
+    if (ImGui::Checkbox("Adaptive implicit", &plot.implicit_adaptive)) plot.require_update = true;
     ImGui::PopItemWidth();
     ImGui::End(); // View
 
@@ -838,6 +872,7 @@ int main(int argc, char ** argv) {
     // Cleanup
     run_worker_flag = true;
     worker_quit_flag = true;
+    worker_plot.cancel_render = true;
     worker_cv.notify_one();
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplGlfw_Shutdown();
@@ -65,6 +65,9 @@ void webworker_cback(char* data, int size, void* arg) {
     state_encoding_strm.str("");
     state_encoding_strm.write(data, size);
     plot.import_binary_render_result(state_encoding_strm);
+    // Import fails if the frame is relative to one we no longer have;
+    // the next frame is then sent in full
+    state_encoding_strm.clear();
     redraw_canvas(true);                // Redraw
     plot.populate_grid();               // Populate grid of point
                                         // markers for mouse events
@@ -126,6 +129,8 @@ bool redraw_canvas(bool worker_req_update) {
         plot.draw(adaptor, plot_view_pre);       // Draw functions
 
         state_encoding_strm.str("");
+        // Worker sends only output changed since our last frame
+        util::write_bin(state_encoding_strm, plot.render_result_frame());
         plot.export_binary_func_and_env(state_encoding_strm);
         state_encoding = state_encoding_strm.str();
         if (emscripten_get_worker_queue_size(worker) > 1) {
@@ -313,6 +318,11 @@ void set_is_polar_grid(bool val) {
     plot.polar_grid = val;
     plot.require_update = true;
 }
+bool get_implicit_adaptive() { return plot.implicit_adaptive; }
+void set_implicit_adaptive(bool val) {
+    plot.implicit_adaptive = val;
+    plot.require_update = true;
+}
 bool get_axes_enabled() { return plot.enable_axes; }
 void set_axes_enabled(bool val) {
     plot.enable_axes = val;
@@ -445,6 +455,8 @@ EMSCRIPTEN_BINDINGS(Nivalis) {
     function("get_ymax", &get_ymax);
     function("get_is_polar_grid", &get_is_polar_grid);
     function("set_is_polar_grid", &set_is_polar_grid);
+    function("get_implicit_adaptive", &get_implicit_adaptive);
+    function("set_implicit_adaptive", &set_implicit_adaptive);
     function("get_axes_enabled", &get_axes_enabled);
     function("set_axes_enabled", &set_axes_enabled);
     function("get_grid_enabled", &get_grid_enabled);
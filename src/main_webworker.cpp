@@ -1,4 +1,5 @@
 #include "plotter/plotter.hpp"
+#include "util.hpp"
 #include <emscripten/emscripten.h>
 #include <sstream>
 #include <iostream>
@@ -15,15 +16,18 @@ std::ostringstream os;
 extern "C" {
 // Syncrhonize functions/environment
 void webworker_sync(char* data, int size) {
+    // Last render result frame the main thread has
+    uint64_t ack_frame;
     {
         std::stringstream ss; ss.write(data, size);
+        util::read_bin(ss, ack_frame);
         plot.import_binary_func_and_env(ss);
     }
 
     plot.render();
 
     os.str("");
-    plot.export_binary_render_result(os);
+    plot.export_binary_render_result(os, ack_frame);
     result = os.str();
     emscripten_worker_respond(&result[0], result.size());
 }
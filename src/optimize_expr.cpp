@@ -5,6 +5,9 @@
 #include <cstring>
 #include <cmath>
 #include <algorithm>
+#include <functional>
+#include <limits>
+#include <unordered_map>
 #include "env.hpp"
 #include "util.hpp"
 #include "opcodes.hpp"
@@ -25,9 +28,8 @@ void hash_combine(uint64_t& seed, uint64_t v) {
 struct ASTLinkNode {
     explicit ASTLinkNode(uint32_t opcode) : opcode(opcode) {
         ref = -1;
-        nonconst_flag = false;
-        null_flag = false;
         hash = 0;
+        call_info[0] = call_info[1] = 0;
         val = 0.;
     }
     static ASTLinkNode value(double val) {
@@ -39,7 +41,9 @@ struct ASTLinkNode {
         hash = (uint64_t) opcode;
         hash_combine(hash, ref);
         if (opcode == OpCode::val) {
-            hash_combine(hash, *reinterpret_cast<uint64_t*>(&val));
+            uint64_t val_bits;
+            memcpy(&val_bits, &val, sizeof(val));
+            hash_combine(hash, val_bits);
         } else hash_combine(hash, 0);
         for (size_t i = 0; i < std::min<size_t>(c.size(), 3); ++i) {
             hash_combine(hash, nodes[c[i]].hash);
@@ -55,25 +59,12 @@ struct ASTLinkNode {
         return hash;
     }
 
-    bool equals(const ASTLinkNode& other,
-            const std::vector<ASTLinkNode>& nodes) const {
-        if (other.hash != hash || other.opcode != opcode || other.ref != ref ||
-                other.val != val || other.c.size() != c.size()) return false;
-        for (size_t i = 0; i < c.size(); ++i) {
-            if (!nodes[other.c[i]].equals(nodes[c[i]], nodes)) {
-                return false;
-            }
-        }
-        return true;
-    }
-
     uint64_t hash;
     uint32_t opcode;
     uint64_t ref;
     uint32_t call_info[2];
     std::vector<size_t> c;
     double val;
-    bool nonconst_flag, null_flag;
 };
 
 
@@ -216,580 +207,616 @@ void ast_from_link_nodes(const std::vector<ASTLinkNode>& nodes,
     }
 }
 
-// Print link nodes for debugging purposes
-void print_link_nodes(const std::vector<ASTLinkNode>& nodes) {
-    for (size_t i = 0; i < nodes.size(); ++i) {
-        std::cout << i << ": ";
-        const char* r = OpCode::repr(nodes[i].opcode);
-        for (size_t j = 0; j < strlen(r); ++j){
-            if (r[j] == '\v') std::cout << "v";
-            else if (r[j] == '\r') std::cout << "r";
-            else std::cout << r[j];
+bool is_int(double v) {
+    return std::isfinite(v) && v == std::floor(v);
+}
+
+// Rewrites link node trees into a canonical form and back.
+// Nodes are hash-consed: structurally equal subtrees built by the optimizer
+// share an index, so like terms/factors can be found by comparing indices.
+// Canonical form (output of simplify()):
+// - no sub, divi, unaryminus, exp*, log*, sqrt, sqr:
+//   these are expressed with add, mul, power, logbase
+// - a sum is an add chain of terms R or c*R, with any constant last
+// - a product is c*R with R a mul chain of factors b or b^e
+// finalize() converts a canonical tree back to the cheapest opcodes.
+struct Optimizer {
+    explicit Optimizer(std::vector<ASTLinkNode>& nodes) : nodes(nodes) {
+        for (const auto& node : nodes) {
+            if (node.opcode == OpCode::sums || node.opcode == OpCode::prods) {
+                loop_vars.push_back(node.ref);
+            }
         }
-        if (nodes[i].opcode == OpCode::val) {
-            std::cout << nodes[i].val;
+    }
+
+    // Make a node, reusing an existing equal node if possible
+    size_t make(ASTLinkNode node) {
+        node.rehash(nodes);
+        auto range = index.equal_range(node.hash);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (same(nodes[it->second], node)) return it->second;
         }
-        if (OpCode::has_ref(nodes[i].opcode)) {
-            std::cout << nodes[i].ref;
+        nodes.push_back(std::move(node));
+        index.emplace(nodes.back().hash, nodes.size() - 1);
+        return nodes.size() - 1;
+    }
+    size_t op(uint32_t opcode, std::vector<size_t> c) {
+        ASTLinkNode node(opcode);
+        node.c = std::move(c);
+        return make(std::move(node));
+    }
+    size_t value(double v) {
+        if (std::isnan(v)) return make(ASTLinkNode(OpCode::null));
+        return make(ASTLinkNode::value(v));
+    }
+
+    bool is_const(size_t i) const {
+        return nodes[i].opcode == OpCode::val || nodes[i].opcode == OpCode::null;
+    }
+    double const_val(size_t i) const {
+        return nodes[i].opcode == OpCode::val ? nodes[i].val :
+            std::numeric_limits<double>::quiet_NaN();
+    }
+    bool is_val(size_t i, double v) const {
+        return nodes[i].opcode == OpCode::val && nodes[i].val == v;
+    }
+    bool is_pos_val(size_t i) const {
+        return nodes[i].opcode == OpCode::val && nodes[i].val > 0.;
+    }
+
+    // True if node is known to evaluate to >= 0 or NaN
+    bool nonneg(size_t i) const {
+        using namespace OpCode;
+        const auto& node = nodes[i];
+        switch (node.opcode) {
+            case val: return node.val >= 0.;
+            case null: case absb: return true;
+            case power:
+                {
+                    size_t bi = node.c[0], ei = node.c[1];
+                    if (is_pos_val(bi) || nonneg(bi)) return true;
+                    // x^(even) >= 0, x^(non-integer) is NaN if x < 0
+                    return nodes[ei].opcode == val &&
+                        (!is_int(nodes[ei].val) ||
+                         std::fmod(nodes[ei].val, 2.) == 0.);
+                }
         }
-        std::cout << " -> ";
-        for (size_t j = 0; j < nodes[i].c.size(); ++j) {
-            std::cout << nodes[i].c[j] << " ";
+        return false;
+    }
+
+    // True if node is known not to be NaN when variables are finite
+    bool defined(size_t i) const {
+        using namespace OpCode;
+        const auto& node = nodes[i];
+        switch (node.opcode) {
+            case val: return std::isfinite(node.val);
+            case ref: case arg: return true;
+            case power:
+                return defined(node.c[0]) && nodes[node.c[1]].opcode == val &&
+                    is_int(nodes[node.c[1]].val) && nodes[node.c[1]].val > 0.;
+            case add: case mul: case max: case min:
+            case absb: case sgn: case floorb: case ceilb: case roundb:
+            case sinb: case cosb:
+                for (size_t ci : node.c) {
+                    if (!defined(ci)) return false;
+                }
+                return true;
         }
-        std::cout << "\n";
+        return false;
     }
-}
 
-// Main optimization rules
-void optim_link_nodes_main(Environment& env,
-        std::vector<ASTLinkNode>& nodes, size_t vi = 0) {
-    if ((OpCode::has_ref(nodes[vi].opcode) && ~nodes[vi].ref) ||
-         nodes[vi].opcode == OpCode::call) nodes[vi].nonconst_flag = true;
-    size_t i = 0;
-    for (; i < nodes[vi].c.size(); ++i) {
-        auto ui = nodes[vi].c[i];
-        if (ui == -1) break;
-        nodes[ui].nonconst_flag = false;
-        nodes[ui].null_flag = false;
-        optim_link_nodes_main(env, nodes, ui);
-        // Detect nonconst
-        nodes[vi].nonconst_flag |= nodes[ui].nonconst_flag;
-        // Detect nan
-        if (nodes[ui].opcode == OpCode::val &&
-             nodes[vi].opcode != OpCode::bnz // bnz can short-circuit
-             ) {
-            if (std::isnan(nodes[ui].val)) nodes[vi].null_flag = true;
+    // Evaluate an operator on constant arguments
+    double fold(uint32_t opcode, const std::vector<size_t>& args) {
+        Expr::AST ast;
+        ast.emplace_back(opcode);
+        for (size_t i : args) {
+            if (nodes[i].opcode == OpCode::val) {
+                ast.emplace_back(OpCode::val);
+                ast.back().val = nodes[i].val;
+            } else {
+                ast.emplace_back(OpCode::null);
+            }
         }
+        return detail::eval_ast(env, ast);
     }
-    if (i == 0) {
-        // nothing
-    } else if (nodes[vi].null_flag) {
-        // Set null
-        nodes[vi].opcode = OpCode::null;
-        nodes[vi].c.clear();
-    } else if (!nodes[vi].nonconst_flag &&
-            nodes[vi].opcode != OpCode::thunk_ret &&
-            nodes[vi].opcode != OpCode::thunk_jmp) {
-        // Evaluate constants
-        std::vector<Expr::ASTNode> ast;
-        ast_from_link_nodes(nodes, ast, vi);
-        // Debug
-        // print_link_nodes(nodes); std::cout << ast <<" T\n";
-        nodes[vi].val = detail::eval_ast(env, ast);
-        nodes[vi].opcode = OpCode::val;
-        nodes[vi].c.clear();
-    } else {
-        static auto is_positive = [](std::vector<ASTLinkNode>& nodes,
-                    size_t idx) -> bool{
-            return nodes[idx].opcode == OpCode::absb ||
-                     nodes[idx].opcode == OpCode::sqrb ||
-                     (nodes[idx].opcode == OpCode::power &&
-                        nodes[nodes[idx].c[1]].opcode == OpCode::val &&
-                        nodes[nodes[idx].c[1]].val >= 0 &&
-                        std::fmod(nodes[nodes[idx].c[1]].val, 2.) == 0) ||
-                     (nodes[idx].opcode == OpCode::power &&
-                        nodes[nodes[idx].c[0]].opcode == OpCode::val);
-        };
-        // Apply rules
+
+    // Evaluate b^e for constants, using the same opcode finalize() would
+    // emit (e.g. sqrt(-inf) is NaN but pow(-inf, 0.5) is inf)
+    double fold_power(size_t b, size_t e) {
         using namespace OpCode;
-        size_t li = vi, ri = vi;
-        if (nodes[vi].c.size() > 0){
-            li = nodes[vi].c[0];
-            if (nodes[vi].c.size() > 1)
-                ri = nodes[vi].c[1];
+        if (nodes[e].opcode == val && nodes[e].val < 0.) {
+            // Emitted as division
+            return 1. / fold_power(b, value(-nodes[e].val));
+        }
+        if (is_val(e, 2.)) return fold(sqrb, {b});
+        if (is_val(e, 0.5)) return fold(sqrtb, {b});
+        if (is_val(b, 2.)) return fold(exp2b, {e});
+        if (is_val(b, M_E)) return fold(expb, {e});
+        return fold(power, {b, e});
+    }
+
+    // Convert subtree at i (in ast_to_link_nodes form) to canonical form
+    size_t simplify(size_t i) {
+        using namespace OpCode;
+        ASTLinkNode node = nodes[i];
+        switch (node.opcode) {
+            case val: return value(node.val);
+            case ref:
+                if (std::find(loop_vars.begin(), loop_vars.end(), node.ref) !=
+                        loop_vars.end()) {
+                    // A sum/product index variable changes during
+                    // evaluation, so reads of it are never merged
+                    node.rehash(nodes);
+                    nodes.push_back(std::move(node));
+                    return nodes.size() - 1;
+                }
+                return make(std::move(node));
+            case null: case arg: case thunk_jmp:
+                return make(std::move(node));
+        }
+        for (auto& ci : node.c) ci = simplify(ci);
+        switch (node.opcode) {
+            case add: return sum(node.c);
+            case mul: return product(node.c);
+            case unaryminus: return product({value(-1.), node.c[0]});
+            case power: return power_of(node.c[0], node.c[1]);
+            case logbase: return log_of(node.c[0], node.c[1]);
+            case bnz:
+                {
+                    size_t then_body = nodes[node.c[1]].c[0],
+                           else_body = nodes[node.c[2]].c[0];
+                    if (is_const(node.c[0])) {
+                        // NaN condition takes the first branch
+                        return const_val(node.c[0]) != 0. ?
+                            then_body : else_body;
+                    }
+                    if (then_body == else_body) return then_body;
+                    return make(std::move(node));
+                }
+            case sums: case prods: case call: case bsel: case thunk_ret:
+                return make(std::move(node));
         }
-        static const size_t NEW_NODE = std::numeric_limits<size_t>::max();
-        switch(nodes[vi].opcode) {
+        bool all_const = true;
+        for (size_t ci : node.c) all_const = all_const && is_const(ci);
+        if (all_const) return value(fold(node.opcode, node.c));
+        switch (node.opcode) {
             case absb:
-                // Involution
-                if (is_positive(nodes, li)) nodes[vi] = nodes[li];
+                if (nonneg(node.c[0])) return node.c[0];
                 break;
             case floorb: case ceilb: case roundb:
-                if (nodes[li].opcode == floorb ||
-                    nodes[li].opcode == ceilb ||
-                    nodes[li].opcode == roundb) {
-                    nodes[vi] = nodes[li];
-                }
-                break;
-            case unaryminus:
-                // Combine -
-                if (nodes[li].opcode == val) {
-                    nodes[vi] = nodes[li];
-                    nodes[vi].val = -nodes[vi].val;
-                } else if (nodes[li].opcode == unaryminus) {
-                    nodes[vi] = nodes[nodes[li].c[0]];
-                    break;
-                }
-                if (nodes[li].opcode == mul) {
-                    auto lli = nodes[li].c[0];
-                    auto* ll = &nodes[lli];
-                    if (ll->opcode == val) {
-                        ll->val = -ll->val;
-                        nodes[vi] = nodes[li];
+                {
+                    uint32_t inner = nodes[node.c[0]].opcode;
+                    if (inner == floorb || inner == ceilb || inner == roundb) {
+                        return node.c[0];
                     }
-                    break;
                 }
                 break;
-            case add:
-                // Normalize
-                if ((nodes[ri].opcode == val && nodes[li].opcode != val) ||
-                     nodes[li].opcode == add) {
-                    if (nodes[vi].opcode == add) {
-                        std::swap(nodes[li], nodes[ri]);
-                    }
-                }
-                if (nodes[ri].opcode == add && nodes[li].opcode == val) {
-                    auto rli = nodes[ri].c[0];
-                    auto* rl = &nodes[rli];
-                    if (rl->opcode == val) {
-                        nodes[li].val += rl->val;
-                        nodes[ri] = nodes[nodes[ri].c[1]];
-                    }
-                }
-                if (nodes[ri].opcode == unaryminus &&
-                      nodes[nodes[ri].c[0]].opcode == add &&
-                      nodes[li].opcode == val) {
-                    auto rli = nodes[nodes[ri].c[0]].c[0];
-                    auto* rl = &nodes[rli];
-                    if (rl->opcode == val) {
-                        nodes[li].val -= rl->val;
-                        nodes[nodes[ri].c[0]] =
-                            nodes[nodes[nodes[ri].c[0]].c[1]];
-                    }
-                }
+            case max: case min:
+                if (node.c[0] == node.c[1]) return node.c[0];
+                break;
+            case lt: case gt:
+                if (node.c[0] == node.c[1]) return value(0.);
+                break;
+        }
+        return make(std::move(node));
+    }
 
-                if (nodes[vi].opcode == add) {
-                    // Try swapping, if also add
-                    if (nodes[li].opcode == add) {
-                        std::swap(nodes[nodes[li].c[0]], nodes[ri]);
-                        optim_link_nodes_main(env, nodes, li);
-                        if (nodes[li].opcode == add) std::swap(nodes[nodes[li].c[0]], nodes[ri]);
-                    }
-                    if (nodes[li].opcode == add) {
-                        std::swap(nodes[nodes[li].c[1]], nodes[ri]);
-                        optim_link_nodes_main(env, nodes, li);
-                        if (nodes[li].opcode == add) std::swap(nodes[nodes[li].c[0]], nodes[ri]);
-                    }
-                    if (nodes[ri].opcode == add) {
-                        std::swap(nodes[li], nodes[nodes[ri].c[0]]);
-                        optim_link_nodes_main(env, nodes, ri);
-                        if (nodes[ri].opcode == add) std::swap(nodes[li], nodes[nodes[ri].c[0]]);
-                    }
-                    if (nodes[ri].opcode == add) {
-                        std::swap(nodes[li], nodes[nodes[ri].c[1]]);
-                        optim_link_nodes_main(env, nodes, ri);
-                        if (nodes[ri].opcode == add) std::swap(nodes[li], nodes[nodes[ri].c[0]]);
+    // Canonical sum of canonical operands
+    size_t sum(const std::vector<size_t>& operands) {
+        double constant = 0.;
+        std::vector<std::pair<size_t, double> > terms; // (R, coefficient)
+        std::function<void(size_t)> collect = [&](size_t i) {
+            const auto& node = nodes[i];
+            if (is_const(i)) {
+                constant += const_val(i);
+            } else if (node.opcode == OpCode::add) {
+                for (size_t ci : node.c) collect(ci);
+            } else {
+                size_t r = i;
+                double coeff = 1.;
+                if (node.opcode == OpCode::mul && is_const(node.c[0])) {
+                    coeff = const_val(node.c[0]);
+                    r = node.c[1];
+                }
+                for (auto& term : terms) {
+                    if (term.first == r) {
+                        term.second += coeff;
+                        return;
                     }
                 }
+                terms.emplace_back(r, coeff);
+            }
+        };
+        for (size_t i : operands) collect(i);
+        if (std::isnan(constant)) return value(constant);
 
-                // Factoring
-                {
-                    bool factored = false;
-                    for (int l_side = 0; l_side < 2; ++l_side) {
-                        for (int r_side = 0; r_side < 2; ++r_side) {
-                            size_t lcoeffi, rcoeffi, rtermi, ltermi;
-                            bool l_neg = false, r_neg = false;
-                            lcoeffi = NEW_NODE;
-                            if (nodes[li].opcode == unaryminus) {
-                                ltermi = nodes[li].c[0];
-                                l_neg = true;
-                            } else {
-                                ltermi = li;
-                            }
-                            if (nodes[ltermi].opcode == mul) {
-                                lcoeffi = nodes[ltermi].c[l_side];
-                                ltermi = nodes[ltermi].c[1 - l_side];
-                            } else if (l_side == 1) continue;
-                            rcoeffi = NEW_NODE;
-                            if (nodes[ri].opcode == unaryminus) {
-                                rtermi = nodes[ri].c[0];
-                                r_neg = true;
-                            } else {
-                                rtermi = ri;
-                            }
-                            if (nodes[rtermi].opcode == mul) {
-                                rcoeffi = nodes[rtermi].c[r_side];
-                                rtermi = nodes[rtermi].c[1 - r_side];
-                            } else if (r_side == 1) continue;
-
-                            bool lcoeff_new = (lcoeffi == NEW_NODE);
-                            if (lcoeff_new) {
-                                lcoeffi = nodes.size();
-                                nodes.push_back(ASTLinkNode::value(1.0));
-                            }
-                            if (rcoeffi == NEW_NODE) {
-                                rcoeffi = nodes.size();
-                                nodes.push_back(ASTLinkNode::value(1.0));
-                            }
-
-                            if (nodes[ltermi].equals(nodes[rtermi], nodes)) {
-                                // print_link_nodes(nodes);
-                                if (l_neg) {
-                                    size_t neg_i = lcoeff_new ?  nodes[li].c[0] :
-                                        nodes[nodes[li].c[0]].c[1-r_side];
-                                    nodes[neg_i].opcode = unaryminus;
-                                    nodes[neg_i].c.resize(1);
-                                    nodes[neg_i].c[0] = lcoeffi;
-                                    lcoeffi = neg_i;
-                                }
-                                if (r_neg) {
-                                    nodes[ri].c[0] = rcoeffi;
-                                    rcoeffi = ri;
-                                }
-
-                                nodes[li].opcode = add; nodes[vi].opcode = mul;
-                                nodes[li].c.resize(2); nodes[li].ref = -1;
-                                nodes[li].c[0] = lcoeffi; nodes[li].c[1] = rcoeffi;
-                                nodes[vi].c[1] = rtermi;
-                                nodes[vi].nonconst_flag = false;
-                                optim_link_nodes_main(env, nodes, vi);
-                                factored = true;
-                                break;
-                            }
-                        }
-                        if (factored) break;
-                    }
-                    if (factored) break;
+        // sin(u)^2 + cos(u)^2 = 1
+        for (auto& term : terms) {
+            size_t u = squared_arg(term.first, OpCode::sinb);
+            if (!~u || term.second == 0.) continue;
+            for (auto& other : terms) {
+                if (other.second == term.second &&
+                        squared_arg(other.first, OpCode::cosb) == u) {
+                    constant += term.second;
+                    term.second = other.second = 0.;
+                    break;
                 }
+            }
+        }
 
-                // Trig
-                if (nodes[vi].opcode == add && nodes[li].opcode == power &&
-                        nodes[ri].opcode == power) {
-                    size_t lli = nodes[li].c[0], lri = nodes[li].c[1];
-                    size_t rli = nodes[ri].c[0], rri = nodes[ri].c[1];
-                    if (nodes[lri].opcode == val && nodes[rri].opcode == val &&
-                        nodes[lri].val == 2. && nodes[rri].val == 2.) {
-                        if (((nodes[lli].opcode == sinb && nodes[rli].opcode == cosb) ||
-                            (nodes[lli].opcode == cosb && nodes[rli].opcode == sinb)) &&
-                            nodes[nodes[lli].c[0]].equals(nodes[nodes[rli].c[0]], nodes)) {
-                            nodes[vi].opcode = val; nodes[vi].val = 1.;
-                            break;
-                        }
-                    }
-                }
+        size_t result = -1;
+        for (const auto& term : terms) {
+            // Keep 0*R if R may be NaN
+            if (term.second == 0. && defined(term.first)) continue;
+            size_t t = term.second == 1. ? term.first :
+                product({value(term.second), term.first});
+            result = ~result ? op(OpCode::add, {result, t}) : t;
+        }
+        if (!~result) return value(constant);
+        if (constant != 0.) result = op(OpCode::add, {result, value(constant)});
+        return result;
+    }
 
-                if (nodes[li].opcode == val && nodes[li].val == 0.) {
-                    nodes[vi] = nodes[ri];
-                } else if (nodes[ri].opcode == val && nodes[ri].val == 0.) nodes[vi] = nodes[li];
-                break;
-            case mul:
-                // Take out - sign
-                if (nodes[li].opcode == unaryminus &&
-                        nodes[ri].opcode == unaryminus) {
-                    nodes[li] = nodes[nodes[li].c[0]]; nodes[ri] = nodes[nodes[ri].c[0]]; // Cancel
-                } else if (nodes[li].opcode == unaryminus)  {
-                    size_t tmp = nodes[li].c[0]; nodes[li] = nodes[vi];
-                    nodes[vi].opcode = unaryminus;
-                    nodes[vi].c.resize(1);
-                    nodes[li].c[0] = tmp;
-                    nodes[vi].nonconst_flag = false;
-                    optim_link_nodes_main(env, nodes, vi);
-                    return;
-                } else if (nodes[ri].opcode == unaryminus)  {
-                    size_t tmp = nodes[ri].c[0]; nodes[ri] = nodes[vi];
-                    nodes[vi].opcode = unaryminus;
-                    nodes[vi].c[0] = nodes[vi].c[1]; nodes[vi].c.resize(1);
-                    nodes[ri].c[1] = tmp;
-                    nodes[vi].nonconst_flag = false;
-                    nodes[ri].nonconst_flag = false;
-                    optim_link_nodes_main(env, nodes, vi);
-                    return;
-                }
-                // Try swapping, if also mul
-                if (nodes[li].opcode == mul) {
-                    std::swap(nodes[nodes[li].c[0]], nodes[ri]);
-                    optim_link_nodes_main(env, nodes, li);
-                }
-                if (nodes[li].opcode == mul) {
-                    std::swap(nodes[nodes[li].c[1]], nodes[ri]);
-                    optim_link_nodes_main(env, nodes, li);
-                }
-                if (nodes[ri].opcode == mul) {
-                    std::swap(nodes[li], nodes[nodes[ri].c[0]]);
-                    optim_link_nodes_main(env, nodes, ri);
-                }
-                if (nodes[ri].opcode == mul) {
-                    std::swap(nodes[li], nodes[nodes[ri].c[1]]);
-                    optim_link_nodes_main(env, nodes, ri);
-                }
-                // Normalize left/right
-                if ((nodes[ri].opcode == val && nodes[li].opcode != val) ||
-                    (nodes[ri].opcode != mul && nodes[li].opcode == mul)) {
-                    std::swap(nodes[li], nodes[ri]);
-                }
-                if ((nodes[li].opcode == val && nodes[li].val == 0.) |
-                    (nodes[ri].opcode == val && nodes[ri].val == 0.)) {
-                    nodes[vi].opcode = OpCode::val; nodes[vi].val = 0.;
-                }
-                else if (nodes[li].opcode == val && nodes[li].val == 1.) nodes[vi] = nodes[ri];
-                else if (nodes[ri].opcode == val && nodes[ri].val == 1.) nodes[vi] = nodes[li];
-                else if (nodes[li].opcode == val && nodes[li].val == -1.) {
-                    nodes[vi].opcode = unaryminus;
-                    nodes[li] = nodes[ri];
-                    nodes[vi].c.pop_back();
-                    break;
-                } else if (nodes[ri].opcode == val && nodes[ri].val == -1.) {
-                    nodes[vi].opcode = unaryminus;
-                    nodes[vi].c.pop_back();
-                } else {
-                    // Combining powers
-                    size_t lf, rf, rmi, lmi;
-                    double lf_new_val, rf_new_val;
-                    if (nodes[li].opcode == power) {
-                        lmi = nodes[li].c[0];
-                        lf = nodes[li].c[1];
-                    } else if (nodes[li].opcode == unaryminus) {
-                        lmi = nodes[ri].c[0];
-                        lf = NEW_NODE;
-                        lf_new_val = -1.;
-                    } else {
-                        lmi = li;
-                        lf = NEW_NODE;
-                        lf_new_val = 1.;
-                    }
-                    if (nodes[ri].opcode == power) {
-                        rf = nodes[ri].c[1];
-                        rmi = nodes[ri].c[0];
-                    } else if (nodes[ri].opcode == unaryminus) {
-                        rmi = nodes[ri].c[0];
-                        rf = NEW_NODE;
-                        rf_new_val = -1.;
-                    } else {
-                        rf = NEW_NODE;
-                        rmi = ri;
-                        rf_new_val = 1.;
-                    }
-                    if (lf == NEW_NODE) {
-                        lf = nodes.size();
-                        nodes.push_back(ASTLinkNode::value(lf_new_val));
-                    }
-                    if (rf == NEW_NODE) {
-                        rf = nodes.size();
-                        nodes.push_back(ASTLinkNode::value(rf_new_val));
-                    }
-                    if (nodes[lmi].equals(nodes[rmi], nodes)) {
-                        nodes[vi].opcode = OpCode::power; nodes[li].opcode = OpCode::add;
-                        nodes[li].c.resize(2);
-                        nodes[li].ref = -1;
-                        nodes[li].c[0] = lf; nodes[li].c[1] = rf;
-                        nodes[vi].c[0] = rmi; nodes[vi].c[1] = li;
-                        nodes[vi].nonconst_flag = false;
-                        optim_link_nodes_main(env, nodes, vi);
-                    }
-                }
-                break;
-            case power:
-                if (nodes[li].opcode == val) {
-                    if (nodes[li].val == 1. || nodes[li].val == 0) {
-                        nodes[vi].opcode = OpCode::val;
-                        nodes[vi].val = nodes[li].val;
-                        break;
-                    }
-                }
-                if (nodes[ri].opcode == val) {
-                    if (nodes[ri].val == 1.) {
-                        nodes[vi] = nodes[li]; break;
-                    } else if (nodes[ri].val == 0.) {
-                        nodes[vi].opcode = OpCode::val;
-                        nodes[vi].val = 1.;
-                        nodes[vi].c.clear();
-                        nodes[vi].nonconst_flag = false;
-                        break;
-                    }
-                }
-                if (nodes[li].opcode == power) {
-                    nodes[li].opcode = mul;
-                    nodes[vi].opcode = power;
-                    nodes[vi].c[0] = nodes[li].c[0];
-                    nodes[li].c[0] = ri;
-                    nodes[vi].c[1] = li;
-                    nodes[vi].nonconst_flag = false;
-                    optim_link_nodes_main(env, nodes, vi);
-                    break;
-                }
-                if (nodes[ri].opcode == logbase &&
-                    nodes[li].equals(nodes[nodes[ri].c[1]], nodes) &&
-                    is_positive(nodes, nodes[ri].c[0])) {
-                    // Inverse
-                    nodes[vi] = nodes[nodes[ri].c[0]];
-                    nodes[vi].nonconst_flag = false;
-                    optim_link_nodes_main(env, nodes, vi);
-                    break;
+    // If node i is f(u)^2 for given f, returns u, else -1
+    size_t squared_arg(size_t i, uint32_t f) const {
+        const auto& node = nodes[i];
+        if (node.opcode != OpCode::power || !is_val(node.c[1], 2.) ||
+                nodes[node.c[0]].opcode != f) return -1;
+        return nodes[node.c[0]].c[0];
+    }
+
+    // Emit base^v for each v in expos, merged into base^(sum of expos)
+    // unless this changes where the result is NaN
+    // (e.g. x^0.5 * x^0.5 is NaN for x < 0 but x^1 is not)
+    template<class Emit>
+    void emit_powers(size_t base, const std::vector<double>& expos,
+                     Emit& emit) {
+        double total = 0., int_total = 0.;
+        bool all_int = true;
+        for (double v : expos) {
+            total += v;
+            if (is_int(v)) int_total += v;
+            else all_int = false;
+        }
+        // Also x^a * x^-a = 1 only if x is not NaN
+        if ((expos.size() == 1 || all_int || !is_int(total) ||
+                nonneg(base)) && (total != 0. || defined(base))) {
+            if (total != 0.) emit(power_of(base, value(total)));
+        } else {
+            const bool merge_ints = int_total != 0. || defined(base);
+            if (int_total != 0.) emit(power_of(base, value(int_total)));
+            for (double v : expos) {
+                if (!is_int(v) || !merge_ints) {
+                    emit(power_of(base, value(v)));
                 }
-                break;
-            case logbase:
-                if (nodes[li].opcode == power &&
-                    nodes[ri].equals(nodes[nodes[li].c[0]], nodes)) {
-                    // Inverse
-                    nodes[vi] = nodes[nodes[li].c[1]];
-                    nodes[vi].nonconst_flag = false;
-                    optim_link_nodes_main(env, nodes, vi);
-                    break;
-                } else if (nodes[li].opcode == power &&
-                        is_positive(nodes, nodes[li].c[0])) {
-                    // Take the exponent out
-                    nodes[vi].opcode = mul;
-                    nodes[li].opcode = logbase;
-                    nodes[vi].c[0] = nodes[li].c[1];
-                    nodes[vi].c[1] = li;
-                    nodes[li].c[1] = ri;
-                    break;
+            }
+        }
+    }
+
+    // Canonical product of canonical operands
+    size_t product(const std::vector<size_t>& operands) {
+        struct Factor {
+            size_t base;
+            std::vector<double> num_expos;
+            std::vector<size_t> expos;
+        };
+        double coeff = 1.;
+        std::vector<Factor> factors;
+        auto add_factor = [&](size_t base, size_t expo) {
+            Factor* f = nullptr;
+            for (auto& factor : factors) {
+                if (factor.base == base) f = &factor;
+            }
+            if (f == nullptr) {
+                factors.push_back(Factor{base, {}, {}});
+                f = &factors.back();
+            }
+            if (nodes[expo].opcode == OpCode::val) {
+                f->num_expos.push_back(nodes[expo].val);
+            } else {
+                f->expos.push_back(expo);
+            }
+        };
+        const size_t one = value(1.);
+        std::function<void(size_t)> collect = [&](size_t i) {
+            const auto& node = nodes[i];
+            if (is_const(i)) {
+                coeff *= const_val(i);
+            } else if (node.opcode == OpCode::mul) {
+                for (size_t ci : node.c) collect(ci);
+            } else if (node.opcode == OpCode::power) {
+                add_factor(node.c[0], node.c[1]);
+            } else {
+                add_factor(i, one);
+            }
+        };
+        for (size_t i : operands) collect(i);
+
+        std::vector<size_t> out;
+        auto emit = [&](size_t i) {
+            const auto& node = nodes[i];
+            if (is_const(i)) {
+                coeff *= const_val(i);
+            } else if (node.opcode == OpCode::mul && is_const(node.c[0])) {
+                coeff *= const_val(node.c[0]);
+                out.push_back(node.c[1]);
+            } else {
+                out.push_back(i);
+            }
+        };
+        for (const auto& factor : factors) {
+            size_t base = factor.base;
+            if (factor.expos.size() && is_pos_val(base)) {
+                // c^u * c^v = c^(u+v)
+                std::vector<size_t> expo_terms = factor.expos;
+                for (double v : factor.num_expos) expo_terms.push_back(value(v));
+                emit(power_of(base, sum(expo_terms)));
+                continue;
+            }
+            for (size_t expo : factor.expos) emit(power_of(base, expo));
+            if (factor.num_expos.empty()) continue;
+            // x^a * x^-b is NaN where x is 0 or infinite, but x^(a-b)
+            // may not be, so positive and negative powers are only merged
+            // for a plain variable and if they do not cancel (x^2/x = x)
+            std::vector<double> pos_expos, neg_expos;
+            double total = 0.;
+            for (double v : factor.num_expos) {
+                (v < 0. ? neg_expos : pos_expos).push_back(v);
+                total += v;
+            }
+            const uint32_t base_opcode = nodes[base].opcode;
+            if (pos_expos.empty() || neg_expos.empty() ||
+                    ((base_opcode == OpCode::ref || base_opcode == OpCode::arg) &&
+                     total != 0.)) {
+                emit_powers(base, factor.num_expos, emit);
+            } else {
+                emit_powers(base, pos_expos, emit);
+                emit_powers(base, neg_expos, emit);
+            }
+        }
+        if (coeff == 0.) {
+            // 0*R = 0 unless R may be NaN or negative (giving -0)
+            for (size_t i : out) {
+                if (!defined(i) || !nonneg(i)) {
+                    return op(OpCode::mul, {value(coeff), product(out)});
                 }
-                break;
-            case bnz:
-                if (nodes[li].opcode == val) {
-                    if (nodes[li].val) {
-                        nodes[vi] = nodes[ri]; // Left
-                    } else {
-                        nodes[vi] = nodes[nodes[vi].c[2]]; // Right
-                    }
-                    if (nodes[vi].opcode == OpCode::thunk_ret) {
-                        nodes[vi] = nodes[nodes[vi].c[0]];
-                    }
-                    break;
+            }
+        }
+        if (std::isnan(coeff) || coeff == 0. || out.empty()) return value(coeff);
+        size_t result = out[0];
+        for (size_t i = 1; i < out.size(); ++i) {
+            result = op(OpCode::mul, {result, out[i]});
+        }
+        if (coeff != 1.) result = op(OpCode::mul, {value(coeff), result});
+        return result;
+    }
+
+    // Canonical b^e for canonical b, e
+    size_t power_of(size_t b, size_t e) {
+        using namespace OpCode;
+        if (is_const(b) && is_const(e)) return value(fold_power(b, e));
+        if (is_val(e, 1.)) return b;
+        if (is_val(e, 0.) || is_val(b, 1.)) return value(1.);
+        const ASTLinkNode bn = nodes[b];
+        const bool int_expo = nodes[e].opcode == val && is_int(nodes[e].val);
+        if (bn.opcode == power) {
+            // (u^p)^q = u^(pq), unless this changes where the result is NaN
+            size_t u = bn.c[0], p = bn.c[1];
+            bool safe = nonneg(u) || is_pos_val(u);
+            if (!safe && int_expo && nodes[p].opcode == val) {
+                double pq = nodes[p].val * nodes[e].val;
+                safe = is_int(nodes[p].val) || !is_int(pq);
+            }
+            if (safe) return power_of(u, product({p, e}));
+        } else if (bn.opcode == mul && int_expo) {
+            // (c*u*v)^q = c^q * u^q * v^q for integer q
+            std::vector<size_t> factors;
+            std::function<void(size_t)> collect = [&](size_t i) {
+                if (nodes[i].opcode == mul) {
+                    for (size_t ci : nodes[i].c) collect(ci);
                 } else {
-                    // Remove branch if if/else exprs equal
-                    size_t r2i = nodes[vi].c[2];
-                    if (nodes[ri].opcode == OpCode::thunk_ret &&
-                        nodes[r2i].opcode == OpCode::thunk_ret) {
-                        size_t rli = nodes[ri].c[0];
-                        size_t r2li = nodes[r2i].c[0];
-                        if (nodes[rli].equals(nodes[r2li], nodes)) {
-                            nodes[vi] = nodes[rli];
-                            break;
-                        }
-                    }
-                }
-                break;
-            case bsel:
-                // Super useless opcode
-                nodes[vi] = nodes[ri];
-                break;
-            case max: case min:
-                // If both sides are same,
-                // keep only one of them
-                if (nodes[li].equals(nodes[ri], nodes)) {
-                    nodes[vi] = nodes[li];
-                }
-                break;
-            case eq: case ne: case le: case ge: case lt: case gt:
-                if (nodes[li].equals(nodes[ri], nodes)) {
-                    nodes[vi].c.clear();
-                    nodes[vi].val = (double)(
-                            nodes[vi].opcode == eq ||
-                            nodes[vi].opcode == le ||
-                            nodes[vi].opcode == ge);
-                    nodes[vi].opcode = val;
+                    factors.push_back(i);
                 }
-                break;
+            };
+            collect(b);
+            for (auto& f : factors) f = power_of(f, e);
+            return product(factors);
         }
+        if (is_pos_val(b) && nodes[e].opcode == logbase &&
+                nodes[e].c[1] == b && nonneg(nodes[e].c[0])) {
+            // b^(log_b u) = u
+            return nodes[e].c[0];
+        }
+        return op(power, {b, e});
     }
-    for (size_t j = 0; j < nodes[vi].c.size(); ++j) {
-        nodes[nodes[vi].c[j]].rehash(nodes);
-    }
-    nodes[vi].rehash(nodes);
-}
-// Final pass optimization rules, replace x^-1 with 1/x,
-// apply shorthand functions like exp(x), log2(x) etc.
-void optim_link_nodes_final_pass(Environment& env,
-        std::vector<ASTLinkNode>& nodes, size_t vi = 0) {
-    size_t i = 0;
-    for (; i < nodes[vi].c.size(); ++i) {
-        size_t ui = nodes[vi].c[i];
-        if (ui == -1) break;
-        optim_link_nodes_final_pass(env, nodes, ui);
-    }
-    if (i == 0 || !nodes[vi].nonconst_flag) {
-        // nothing
-    } else {
-        // Apply rules
+
+    // Canonical log_b(u) for canonical u, b
+    size_t log_of(size_t u, size_t b) {
         using namespace OpCode;
-        size_t li = vi, ri = vi;
-        if (nodes[vi].c.size() > 0){
-            li = nodes[vi].c[0];
-            if (nodes[vi].c.size() > 1)
-                ri = nodes[vi].c[1];
+        if (is_const(u) && is_const(b)) {
+            if (is_val(b, 2.)) return value(fold(log2b, {u}));
+            if (is_val(b, M_E)) return value(fold(logb, {u}));
+            if (is_val(b, 10.)) return value(fold(log10b, {u}));
+            return value(fold(logbase, {u, b}));
+        }
+        const ASTLinkNode un = nodes[u];
+        if (un.opcode == power) {
+            if (un.c[0] == b && is_pos_val(b)) {
+                // log_b(b^v) = v
+                return un.c[1];
+            }
+            if (is_const(un.c[1]) && nonneg(un.c[0])) {
+                // log_b(w^p) = p log_b(w)
+                return product({un.c[1], log_of(un.c[0], b)});
+            }
         }
-        switch(nodes[vi].opcode) {
+        return op(logbase, {u, b});
+    }
+
+    // Convert canonical subtree at i to the cheapest opcodes
+    size_t finalize(size_t i) {
+        auto it = final_map.find(i);
+        if (it != final_map.end()) return it->second;
+        using namespace OpCode;
+        ASTLinkNode node = nodes[i];
+        size_t result;
+        switch (node.opcode) {
             case add:
-                if (nodes[ri].opcode == unaryminus) {
-                    // Convert a+(-b) [form preferred by optimizer]
-                    // back to a-b
-                    nodes[vi].c[1] = nodes[ri].c[0];
-                    nodes[vi].opcode = sub;
+                {
+                    std::vector<size_t> terms;
+                    std::function<void(size_t)> collect = [&](size_t j) {
+                        if (nodes[j].opcode == add) {
+                            for (size_t cj : nodes[j].c) collect(cj);
+                        } else {
+                            terms.push_back(j);
+                        }
+                    };
+                    collect(i);
+                    result = -1;
+                    for (size_t t : terms) {
+                        double coeff = 1.;
+                        size_t r = t;
+                        if (nodes[t].opcode == val) {
+                            coeff = nodes[t].val;
+                            r = -1;
+                        } else if (nodes[t].opcode == mul &&
+                                   nodes[nodes[t].c[0]].opcode == val) {
+                            coeff = nodes[nodes[t].c[0]].val;
+                            r = nodes[t].c[1];
+                        }
+                        if (!~result) {
+                            result = final_term(coeff, r);
+                        } else if (coeff < 0.) {
+                            // a + -c*b = a - c*b
+                            result = op(sub, {result, final_term(-coeff, r)});
+                        } else {
+                            result = op(add, {result, final_term(coeff, r)});
+                        }
+                    }
                 }
                 break;
             case mul:
-                if (nodes[ri].opcode == divi) {
-                    size_t rli = nodes[ri].c[0];
-                    if (nodes[rli].opcode == val && nodes[rli].val == 1.) {
-                        nodes[vi].opcode = divi;
-                        nodes[ri] = nodes[nodes[ri].c[1]];
-                    }
+                if (nodes[node.c[0]].opcode == val) {
+                    result = final_term(nodes[node.c[0]].val, node.c[1]);
+                } else {
+                    result = final_term(1., i);
                 }
                 break;
             case power:
-                if (nodes[ri].opcode == val) {
-                    if (nodes[ri].val == 2.) {
-                        nodes[vi].opcode = OpCode::sqrb;
-                        nodes[vi].c.resize(1); break;
-                    } else if (nodes[ri].val == 0.5) {
-                        nodes[vi].opcode = OpCode::sqrtb;
-                        nodes[vi].c.resize(1); break;
-                    } else if (nodes[ri].val == -1) {
-                        // Convert ()^-1 back to divide
-                        nodes[vi].opcode = OpCode::divi;
-                        nodes[ri] = nodes[li];
-                        nodes[vi].c[0] = nodes.size();
-                        nodes.push_back(ASTLinkNode::value(1.0));
-                        break;
-                    }
-                }
-                if (nodes[li].opcode == val) {
-                    if (nodes[li].val == 2.) {
-                        nodes[vi].opcode = OpCode::exp2b;
-                        nodes[vi].c[0] = nodes[vi].c[1]; nodes[vi].c.resize(1); break;
-                    } else if (nodes[li].val == M_E) {
-                        nodes[vi].opcode = OpCode::expb;
-                        nodes[vi].c[0] = nodes[vi].c[1]; nodes[vi].c.resize(1); break;
-                    }
-                }
+                result = final_term(1., i);
                 break;
             case logbase:
-                if (nodes[ri].opcode == val) {
-                    if (nodes[ri].val == 2.) {
-                        nodes[vi].opcode = OpCode::log2b;
-                        nodes[vi].c.resize(1); break;
-                    } else if (nodes[ri].val == M_E) {
-                        nodes[vi].opcode = OpCode::logb;
-                        nodes[vi].c.resize(1); break;
-                    } else if (nodes[ri].val == 10.) {
-                        nodes[vi].opcode = OpCode::log10b;
-                        nodes[vi].c.resize(1); break;
-                    }
+                {
+                    size_t u = finalize(node.c[0]);
+                    if (is_val(node.c[1], 2.)) result = op(log2b, {u});
+                    else if (is_val(node.c[1], M_E)) result = op(logb, {u});
+                    else if (is_val(node.c[1], 10.)) result = op(log10b, {u});
+                    else result = op(logbase, {u, finalize(node.c[1])});
                 }
                 break;
+            default:
+                for (auto& ci : node.c) ci = finalize(ci);
+                result = make(std::move(node));
         }
+        final_map[i] = result;
+        return result;
     }
-}
+
+    // Final form of coeff * r, where r is a canonical mul chain
+    // (or -1 for constant)
+    size_t final_term(double coeff, size_t r) {
+        using namespace OpCode;
+        if (!~r) return value(coeff);
+        std::vector<std::pair<size_t, size_t> > factors; // (base, expo)
+        std::function<void(size_t)> collect = [&](size_t j) {
+            if (nodes[j].opcode == mul) {
+                for (size_t cj : nodes[j].c) collect(cj);
+            } else if (nodes[j].opcode == power) {
+                factors.emplace_back(nodes[j].c[0], nodes[j].c[1]);
+            } else {
+                factors.emplace_back(j, -1);
+            }
+        };
+        collect(r);
+        std::vector<size_t> num, den;
+        for (const auto& factor : factors) {
+            size_t expo = factor.second;
+            if (~expo && nodes[expo].opcode == val && nodes[expo].val < 0.) {
+                // Negative powers go to the denominator
+                den.push_back(final_power(factor.first,
+                            value(-nodes[expo].val)));
+            } else {
+                num.push_back(final_power(factor.first, expo));
+            }
+        }
+        const bool negate = coeff == -1.;
+        if (negate) coeff = 1.;
+        auto chain = [&](const std::vector<size_t>& items) {
+            size_t res = items[0];
+            for (size_t j = 1; j < items.size(); ++j) {
+                res = op(mul, {res, items[j]});
+            }
+            return res;
+        };
+        size_t result;
+        if (num.empty()) {
+            result = value(coeff);
+        } else {
+            result = chain(num);
+            if (coeff != 1.) result = op(mul, {value(coeff), result});
+        }
+        if (den.size()) result = op(divi, {result, chain(den)});
+        if (negate) result = op(unaryminus, {result});
+        return result;
+    }
+
+    // Final form of b^e (e = -1 means exponent 1)
+    size_t final_power(size_t b, size_t e) {
+        using namespace OpCode;
+        if (!~e || is_val(e, 1.)) return finalize(b);
+        if (is_val(e, 2.)) return op(sqrb, {finalize(b)});
+        if (is_val(e, 0.5)) return op(sqrtb, {finalize(b)});
+        if (is_val(b, 2.)) return op(exp2b, {finalize(e)});
+        if (is_val(b, M_E)) return op(expb, {finalize(e)});
+        return op(power, {finalize(b), finalize(e)});
+    }
+
+    // Node equality, not checking children recursively
+    // (children are hash-consed already)
+    static bool same(const ASTLinkNode& a, const ASTLinkNode& b) {
+        if (a.hash != b.hash || a.opcode != b.opcode || a.ref != b.ref ||
+                a.c != b.c) return false;
+        if (a.opcode == OpCode::val &&
+                memcmp(&a.val, &b.val, sizeof(double))) return false;
+        if (a.opcode == OpCode::call &&
+                memcmp(a.call_info, b.call_info, sizeof(a.call_info))) {
+            return false;
+        }
+        return true;
+    }
+
+    std::vector<ASTLinkNode>& nodes;
+    std::unordered_multimap<uint64_t, size_t> index;
+    std::unordered_map<size_t, size_t> final_map;
+    std::vector<uint64_t> loop_vars;
+    Environment env; // For constant folding
+};
 }  // namespace
 
 // Implementation of optimize in Expr class
 void Expr::optimize(int num_passes) {
-    // TOO bugged, not doing
-    return;
+    uncompile();
+    if (ast.empty()) return;
+    for (int i = 0; i < num_passes; ++i) {
+        std::vector<ASTLinkNode> nodes;
+        ast_to_link_nodes(ast, nodes);
+        Optimizer optim(nodes);
+        size_t root = optim.finalize(optim.simplify(0));
 
-    // std::cout << *this << std::endl;
-    std::vector<ASTLinkNode> nodes;
-    ast_to_link_nodes(ast, nodes);
-
-    Environment dummy_env;
-    for (int i = 0; i < num_passes; ++i)
-        optim_link_nodes_main(dummy_env, nodes);
-    optim_link_nodes_final_pass(dummy_env, nodes);
-
-    ast.clear();
-    ast_from_link_nodes(nodes, ast);
-    // std::cout << "FIN" << std::endl;
+        AST new_ast;
+        ast_from_link_nodes(nodes, new_ast, root);
+        if (new_ast == ast) break;
+        ast.swap(new_ast);
+    }
 }
 }  // namespace nivalis
@@ -0,0 +1,314 @@
+#include "plotter/plotter.hpp"
+#include "internal/simd.hpp"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+
+namespace nivalis {
+
+namespace {
+// Squared escape radius; large radius makes smooth coloring more accurate
+const double ESCAPE_RADIUS_SQR = 256.;
+// Orbit is considered periodic if it returns within this distance
+// of a saved point
+const double PERIOD_EPS = 1e-13;
+// First iteration at which the orbit point is saved for the periodicity
+// check; the point is saved again at each doubling of the iteration count
+const int PERIOD_CHECK_FIRST = 8;
+// Iteration limits; more iterations are needed when zoomed in
+const int MIN_ITER = 128, MAX_ITER = 4096;
+// Side length of tiles in pixels
+const int TILE_SIZE = 32;
+
+// True if c is in the main cardioid or the period-2 bulb of the
+// Mandelbrot set
+bool in_cardioid_or_bulb(double cr, double ci) {
+    const double xq = cr - .25, ci2 = ci * ci;
+    const double q = xq * xq + ci2;
+    if (q * (q + xq) <= .25 * ci2) return true;
+    return (cr + 1.) * (cr + 1.) + ci2 <= .0625;
+}
+
+// Approximate log2 for positive normal x (error < 2e-5), enough for
+// coloring and much faster than std::log2
+double fast_log2(double x) {
+    uint64_t bits;
+    std::memcpy(&bits, &x, sizeof bits);
+    const int expo = static_cast<int>((bits >> 52) & 0x7FF) - 1023;
+    bits = (bits & 0xFFFFFFFFFFFFFULL) | 0x3FF0000000000000ULL;
+    double m;  // Mantissa in [1, 2)
+    std::memcpy(&m, &bits, sizeof m);
+    // Polynomial interpolating log2(1 + t) at Chebyshev nodes in [0, 1]
+    const double t = m - 1.;
+    return expo + 1.6514671e-5 + t * (1.4414924 + t * (-0.70648645 +
+                t * (0.40947030 + t * (-0.18748860 + t * 0.043004958))));
+}
+
+// Continuous iteration count from the iteration and |z|^2 at escape:
+// iter + 1 - log2(log|z|), where log|z| = log2(|z|^2) * ln(2) / 2
+double smooth_iter(int iter, double mag_sqr) {
+    return std::max(iter + 1. - fast_log2(fast_log2(mag_sqr) * (.5 * M_LN2)), 0.);
+}
+
+// Number of points iterated together
+const int LANES = 8;
+
+// Escape-time iteration z <- z^2 + c for LANES points: writes the
+// iteration at which |z| passes the escape radius to iters[i] and |z|^2
+// at that point to mags[i]; iters[i] is -1 if the orbit does not escape
+// in max_iter iterations or is found to be periodic
+void escape_time_lanes(const double* zr0, const double* zi0,
+        const double* cr, const double* ci, int max_iter,
+        double* iters, double* mags) {
+    for (int k = 0; k < LANES; ++k) {
+        double zr = zr0[k], zi = zi0[k];
+        double saved_r = zr, saved_i = zi;
+        int check_at = PERIOD_CHECK_FIRST;
+        iters[k] = -1.;
+        for (int i = 0; i < max_iter; ++i) {
+            const double zr2 = zr * zr, zi2 = zi * zi;
+            if (zr2 + zi2 > ESCAPE_RADIUS_SQR) {
+                iters[k] = i;
+                mags[k] = zr2 + zi2;
+                break;
+            }
+            zi = (zr + zr) * zi + ci[k];
+            zr = (zr2 - zi2) + cr[k];
+            if (std::fabs(zr - saved_r) < PERIOD_EPS &&
+                    std::fabs(zi - saved_i) < PERIOD_EPS) break;
+            if (i == check_at) {
+                saved_r = zr; saved_i = zi;
+                check_at *= 2;
+            }
+        }
+    }
+}
+
+#ifdef NIVALIS_SIMD_X86
+// AVX2 version of escape_time_lanes; the orbits are iterated in lockstep,
+// as two independent vectors to hide instruction latency, until all
+// escape or become periodic
+NIVALIS_TARGET_AVX2 void escape_time_lanes_avx2(const double* zr0, const double* zi0,
+        const double* cr_in, const double* ci_in, int max_iter,
+        double* iters, double* mags) {
+    const int NV = LANES / 4;
+    __m256d zr[NV], zi[NV], cr[NV], ci[NV], saved_r[NV], saved_i[NV];
+    // Lanes still iterating (all bits set)
+    __m256d active[NV];
+    // Iteration and |z|^2 at escape; iteration is -1 if not escaped
+    __m256d esc_iter[NV], esc_mag[NV];
+    for (int v = 0; v < NV; ++v) {
+        zr[v] = saved_r[v] = _mm256_loadu_pd(zr0 + 4 * v);
+        zi[v] = saved_i[v] = _mm256_loadu_pd(zi0 + 4 * v);
+        cr[v] = _mm256_loadu_pd(cr_in + 4 * v);
+        ci[v] = _mm256_loadu_pd(ci_in + 4 * v);
+        active[v] = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+        esc_iter[v] = _mm256_set1_pd(-1.);
+        esc_mag[v] = _mm256_setzero_pd();
+    }
+    const __m256d escape_radius_sqr = _mm256_set1_pd(ESCAPE_RADIUS_SQR);
+    const __m256d eps = _mm256_set1_pd(PERIOD_EPS);
+    const __m256d abs_mask = _mm256_castsi256_pd(
+            _mm256_set1_epi64x(0x7FFFFFFFFFFFFFFFLL));
+    int check_at = PERIOD_CHECK_FIRST;
+    for (int i = 0; i < max_iter; ++i) {
+        const __m256d iter = _mm256_set1_pd(static_cast<double>(i));
+        int any_active = 0;
+        for (int v = 0; v < NV; ++v) {
+            const __m256d zr2 = _mm256_mul_pd(zr[v], zr[v]);
+            const __m256d zi2 = _mm256_mul_pd(zi[v], zi[v]);
+            const __m256d mag = _mm256_add_pd(zr2, zi2);
+            const __m256d escaped = _mm256_and_pd(active[v],
+                    _mm256_cmp_pd(mag, escape_radius_sqr, _CMP_GT_OQ));
+            esc_iter[v] = _mm256_blendv_pd(esc_iter[v], iter, escaped);
+            esc_mag[v] = _mm256_blendv_pd(esc_mag[v], mag, escaped);
+            zi[v] = _mm256_fmadd_pd(_mm256_add_pd(zr[v], zr[v]), zi[v], ci[v]);
+            zr[v] = _mm256_add_pd(_mm256_sub_pd(zr2, zi2), cr[v]);
+            const __m256d periodic = _mm256_and_pd(
+                    _mm256_cmp_pd(_mm256_and_pd(_mm256_sub_pd(zr[v], saved_r[v]),
+                            abs_mask), eps, _CMP_LT_OQ),
+                    _mm256_cmp_pd(_mm256_and_pd(_mm256_sub_pd(zi[v], saved_i[v]),
+                            abs_mask), eps, _CMP_LT_OQ));
+            active[v] = _mm256_andnot_pd(_mm256_or_pd(escaped, periodic), active[v]);
+            any_active |= _mm256_movemask_pd(active[v]);
+        }
+        if (!any_active) break;
+        if (i == check_at) {
+            for (int v = 0; v < NV; ++v) {
+                saved_r[v] = zr[v]; saved_i[v] = zi[v];
+            }
+            check_at *= 2;
+        }
+    }
+    for (int v = 0; v < NV; ++v) {
+        _mm256_storeu_pd(iters + 4 * v, esc_iter[v]);
+        _mm256_storeu_pd(mags + 4 * v, esc_mag[v]);
+    }
+}
+#endif
+
+// Smooth escape times of the n points (xs[i], ys[i]), or -1 for points
+// in the set: the points are c for the Mandelbrot set, or initial z for
+// the Julia set of (jr, ji). n must be a multiple of LANES
+void escape_times(const double* xs, const double* ys, size_t n,
+        bool julia, double jr, double ji, int max_iter, double* out) {
+#ifdef NIVALIS_SIMD_X86
+    const bool use_avx2 = detail::cpu_has_avx2();
+#endif
+    double zr[LANES], zi[LANES], cr[LANES], ci[LANES], iters[LANES], mags[LANES];
+    for (size_t i = 0; i < n; i += LANES) {
+        bool any_outside = false;
+        for (int k = 0; k < LANES; ++k) {
+            if (julia) {
+                zr[k] = xs[i + k]; zi[k] = ys[i + k];
+                cr[k] = jr; ci[k] = ji;
+                any_outside = true;
+            } else if (in_cardioid_or_bulb(xs[i + k], ys[i + k])) {
+                // Known to be in the set: iterate the fixed point 0
+                // instead, which the periodicity check stops immediately
+                zr[k] = zi[k] = cr[k] = ci[k] = 0.;
+            } else {
+                zr[k] = zi[k] = 0.;
+                cr[k] = xs[i + k]; ci[k] = ys[i + k];
+                any_outside = true;
+            }
+        }
+        if (!any_outside) {
+            std::fill(out + i, out + i + LANES, -1.);
+            continue;
+        }
+#ifdef NIVALIS_SIMD_X86
+        if (use_avx2) {
+            escape_time_lanes_avx2(zr, zi, cr, ci, max_iter, iters, mags);
+        } else
+#endif
+        {
+            escape_time_lanes(zr, zi, cr, ci, max_iter, iters, mags);
+        }
+        for (int k = 0; k < LANES; ++k) {
+            out[i + k] = iters[k] < 0. ? -1. :
+                smooth_iter(static_cast<int>(iters[k]), mags[k]);
+        }
+    }
+}
+}  // namespace
+
+void Plotter::plot_fractal(size_t funcid, FuncRenderOutput& out) {
+    auto& func = funcs[funcid];
+    // Julia set if parameter (cx, cy) is given, else Mandelbrot set
+    const bool julia = func.exprs.size() == 2;
+    if (!julia && func.exprs.size()) return;
+    double jr = 0., ji = 0.;
+    if (julia) {
+        EvalContext ctx(env);
+        jr = func.exprs[0](ctx);
+        ji = func.exprs[1](ctx);
+        if (!std::isfinite(jr) || !std::isfinite(ji)) return;
+    }
+    const int swid = view.swid, shigh = view.shigh;
+    if (swid <= 0 || shigh <= 0) return;
+    const double dx = (view.xmax - view.xmin) / swid;
+    const double dy = (view.ymax - view.ymin) / shigh;
+    // Iteration limit grows with log of zoom level (fixed for preview)
+    const double zoom = 4. / std::min(view.xmax - view.xmin,
+                                      view.ymax - view.ymin);
+    const int max_iter = render_coarse ? MIN_ITER : std::min(static_cast<int>(
+                MIN_ITER * (1. + std::log2(std::max(zoom, 1.)))), MAX_ITER);
+    // Alpha of pixels escaping after k iterations, increasing towards
+    // the boundary of the set as log(1 + k)
+    std::vector<float> alpha(max_iter + 2);
+    for (int k = 0; k <= max_iter + 1; ++k) {
+        alpha[k] = static_cast<float>(std::log1p(static_cast<double>(k)) /
+                std::log1p(static_cast<double>(max_iter)) * 230.);
+    }
+
+    out.raster.resize(static_cast<size_t>(swid) * shigh * 4);
+    uint8_t* pixels = reinterpret_cast<uint8_t*>(&out.raster[0]);
+    const uint8_t rgb[3] = {
+        static_cast<uint8_t>(std::min(std::max(func.line_color.r, 0.f), 1.f) * 255.f + .5f),
+        static_cast<uint8_t>(std::min(std::max(func.line_color.g, 0.f), 1.f) * 255.f + .5f),
+        static_cast<uint8_t>(std::min(std::max(func.line_color.b, 0.f), 1.f) * 255.f + .5f),
+    };
+
+    const int n_tiles_x = (swid + TILE_SIZE - 1) / TILE_SIZE;
+    const int n_tiles_y = (shigh + TILE_SIZE - 1) / TILE_SIZE;
+    // One tile per task: iteration counts vary greatly between tiles,
+    // so let work stealing balance them
+    thread_pool.parallel_for(static_cast<size_t>(n_tiles_x) * n_tiles_y, 1,
+            [&](size_t tile_begin, size_t tile_end) {
+        // Points to iterate (padded to a multiple of LANES) and
+        // their pixel offsets, results
+        std::vector<double> xs, ys, vals;
+        std::vector<size_t> pix;
+        auto add_pixel = [&](int sx, int sy) {
+            xs.push_back(view.xmin + (sx + .5) * dx);
+            ys.push_back(view.ymax - (sy + .5) * dy);
+            pix.push_back(static_cast<size_t>(sy) * swid + sx);
+        };
+        auto compute = [&]() {
+            const size_t n = pix.size();
+            while (xs.size() % LANES) {
+                xs.push_back(xs.back()); ys.push_back(ys.back());
+            }
+            vals.resize(xs.size());
+            escape_times(xs.data(), ys.data(), xs.size(), julia, jr, ji,
+                    max_iter, vals.data());
+            bool all_inside = true;
+            for (size_t i = 0; i < n; ++i) {
+                uint8_t* q = pixels + pix[i] * 4;
+                q[0] = rgb[0]; q[1] = rgb[1]; q[2] = rgb[2];
+                if (vals[i] < 0.) {
+                    q[3] = 255;
+                } else {
+                    // Interpolate alpha at the smooth iteration count
+                    all_inside = false;
+                    const double v = std::min(vals[i], static_cast<double>(max_iter));
+                    const int k = static_cast<int>(v);
+                    const float t = static_cast<float>(v - k);
+                    q[3] = static_cast<uint8_t>(
+                            alpha[k] + (alpha[k + 1] - alpha[k]) * t + .5f);
+                }
+            }
+            xs.clear(); ys.clear(); pix.clear();
+            return all_inside;
+        };
+        for (size_t tile = tile_begin; tile < tile_end; ++tile) {
+            if (render_cancelled()) return;
+            const int x0 = static_cast<int>(tile % n_tiles_x) * TILE_SIZE;
+            const int y0 = static_cast<int>(tile / n_tiles_x) * TILE_SIZE;
+            const int x1 = std::min(x0 + TILE_SIZE, swid);
+            const int y1 = std::min(y0 + TILE_SIZE, shigh);
+            // Tile border first: the Mandelbrot set and filled Julia sets
+            // have no holes, so if the whole border is inside the set,
+            // so is the tile
+            for (int sx = x0; sx < x1; ++sx) {
+                add_pixel(sx, y0);
+                if (y1 - 1 > y0) add_pixel(sx, y1 - 1);
+            }
+            for (int sy = y0 + 1; sy < y1 - 1; ++sy) {
+                add_pixel(x0, sy);
+                if (x1 - 1 > x0) add_pixel(x1 - 1, sy);
+            }
+            const bool border_inside = compute();
+            if (x1 - x0 <= 2 || y1 - y0 <= 2) continue;
+            if (border_inside) {
+                for (int sy = y0 + 1; sy < y1 - 1; ++sy) {
+                    for (int sx = x0 + 1; sx < x1 - 1; ++sx) {
+                        uint8_t* q = pixels + (static_cast<size_t>(sy) * swid + sx) * 4;
+                        q[0] = rgb[0]; q[1] = rgb[1]; q[2] = rgb[2]; q[3] = 255;
+                    }
+                }
+                continue;
+            }
+            for (int sy = y0 + 1; sy < y1 - 1; ++sy) {
+                for (int sx = x0 + 1; sx < x1 - 1; ++sx) add_pixel(sx, sy);
+            }
+            compute();
+        }
+    });
+}
+
+}  // namespace nivalis
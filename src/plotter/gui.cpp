@@ -6,6 +6,8 @@
 
 #include "json.hpp"
 #include "shell.hpp"
+#include <algorithm>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
 
@@ -50,6 +52,9 @@ int detect_func_type(const std::string& expr_str, std::string& lhs, std::string&
         // Special command
         size_t cmd_end_pos = expr_str_trimmed.find(' ');
         int type_mod = 0;
+        if (expr_str_trimmed == "%mandelbrot") {
+            return Function::FUNC_TYPE_FRACTAL_MANDELBROT;
+        }
         if (cmd_end_pos != std::string::npos &&
                 cmd_end_pos != expr_str_trimmed.size() - 1) {
             std::string cmd = expr_str_trimmed.substr(1, cmd_end_pos - 1);
@@ -71,7 +76,7 @@ int detect_func_type(const std::string& expr_str, std::string& lhs, std::string&
             else if (cmd == "circ" || cmd == "circle")
                 return Function::FUNC_TYPE_GEOM_CIRCLE | type_mod;
             else if (cmd == "ellipse") return Function::FUNC_TYPE_GEOM_ELLIPSE | type_mod;
-            else if (cmd == "mandelbrot") return Function::FUNC_TYPE_FRACTAL_MANDELBROT;
+            else if (cmd == "mandelbrot" || cmd == "julia") return Function::FUNC_TYPE_FRACTAL_MANDELBROT;
             lhs.clear();
         }
     }
@@ -279,6 +284,169 @@ bool parse_polyline_expr(const std::string& expr_str, Function& func,
 std::string gen_func_name(bool use_latex, size_t next_func_name) {
     return "f" + std::to_string(next_func_name);
 }
+
+// Check if functions are the same, ignoring compiled code (for snapshots)
+bool same_function(const Function& a, const Function& b) {
+    if (a.type != b.type || a.tmin != b.tmin || a.tmax != b.tmax ||
+        !(a.line_color == b.line_color) || a.name != b.name ||
+        a.expr_str != b.expr_str || a.str != b.str ||
+        a.exprs.size() != b.exprs.size()) return false;
+    if (a.expr.ast != b.expr.ast || a.differentiable != b.differentiable) return false;
+    for (size_t i = 0; i < a.exprs.size(); ++i) {
+        if (a.exprs[i].ast != b.exprs[i].ast) return false;
+    }
+    return true;
+}
+
+// Check if environments have the same variables and user function
+// definitions (the latter are identified by version)
+bool same_env_funcs(const Environment& a, const Environment& b) {
+    if (a.varname != b.varname || a.funcs.size() != b.funcs.size()) return false;
+    for (size_t i = 0; i < a.funcs.size(); ++i) {
+        if (a.funcs[i].version != b.funcs[i].version) return false;
+    }
+    return true;
+}
+
+// Render result transport format version
+const uint32_t RENDER_RESULT_FORMAT = 2;
+// Number of frames kept for use as base of later frames
+const size_t RENDER_RESULT_HISTORY = 8;
+
+// Encode shapes/markers of one render result slot. Points are stored as
+// float offsets from the first point of each shape, contiguously after
+// all shapes; markers are written field by field (no padding), so that
+// equal output has equal encoding
+void encode_render_slot(std::ostream& os,
+        const std::vector<const DrawBufferObject*>& objs,
+        const std::vector<const PointMarker*>& markers) {
+    util::write_bin(os, static_cast<uint32_t>(objs.size()));
+    std::vector<float> offsets;
+    for (const auto* obj : objs) {
+        util::write_bin(os, static_cast<int32_t>(obj->type));
+        util::write_bin(os, obj->thickness);
+        for (int i = 0; i < 4; ++i) util::write_bin(os, obj->c.data[i]);
+        util::write_bin(os, static_cast<uint64_t>(obj->rel_func));
+        util::write_bin(os, static_cast<uint32_t>(obj->points.size()));
+        if (obj->points.size()) {
+            const auto& origin = obj->points[0];
+            util::write_bin(os, origin);
+            for (const auto& p : obj->points) {
+                offsets.push_back(static_cast<float>(p[0] - origin[0]));
+                offsets.push_back(static_cast<float>(p[1] - origin[1]));
+            }
+        }
+        util::write_bin(os, static_cast<uint32_t>(obj->str.size()));
+        os.write(obj->str.c_str(), obj->str.size());
+    }
+    os.write(reinterpret_cast<const char*>(offsets.data()),
+             offsets.size() * sizeof(float));
+    util::write_bin(os, static_cast<uint32_t>(markers.size()));
+    for (const auto* ptm : markers) {
+        util::write_bin(os, ptm->x);
+        util::write_bin(os, ptm->y);
+        util::write_bin(os, static_cast<int32_t>(ptm->label));
+        util::write_bin(os, static_cast<uint64_t>(ptm->rel_func));
+        util::write_bin(os, ptm->drag_var_x);
+        util::write_bin(os, ptm->drag_var_y);
+        util::write_bin(os, ptm->passive);
+    }
+}
+
+void decode_render_slot(std::istream& is, std::vector<DrawBufferObject>& objs,
+        std::vector<PointMarker>& markers) {
+    uint32_t n_objs;
+    util::read_bin(is, n_objs);
+    if (!is) return;
+    objs.resize(n_objs);
+    std::vector<std::array<double, 2> > origins(n_objs);
+    size_t n_offsets = 0;
+    for (uint32_t i = 0; i < n_objs && is; ++i) {
+        auto& obj = objs[i];
+        int32_t type;
+        util::read_bin(is, type);
+        obj.type = static_cast<decltype(obj.type)>(type);
+        util::read_bin(is, obj.thickness);
+        for (int j = 0; j < 4; ++j) util::read_bin(is, obj.c.data[j]);
+        uint64_t rel_func;
+        util::read_bin(is, rel_func);
+        obj.rel_func = static_cast<size_t>(rel_func);
+        uint32_t n_points;
+        util::read_bin(is, n_points);
+        if (n_points) util::read_bin(is, origins[i]);
+        if (!is) return;
+        obj.points.resize(n_points);
+        n_offsets += 2 * static_cast<size_t>(n_points);
+        uint32_t str_len;
+        util::read_bin(is, str_len);
+        if (!is) return;
+        obj.str.resize(str_len);
+        is.read(&obj.str[0], str_len);
+    }
+    std::vector<float> offsets(n_offsets);
+    is.read(reinterpret_cast<char*>(offsets.data()), n_offsets * sizeof(float));
+    if (!is) return;
+    const float* offset = offsets.data();
+    for (uint32_t i = 0; i < n_objs; ++i) {
+        for (auto& p : objs[i].points) {
+            p[0] = origins[i][0] + offset[0];
+            p[1] = origins[i][1] + offset[1];
+            offset += 2;
+        }
+    }
+    uint32_t n_markers;
+    util::read_bin(is, n_markers);
+    if (!is) return;
+    markers.resize(n_markers);
+    for (auto& ptm : markers) {
+        int32_t label;
+        uint64_t rel_func;
+        util::read_bin(is, ptm.x);
+        util::read_bin(is, ptm.y);
+        util::read_bin(is, label);
+        util::read_bin(is, rel_func);
+        util::read_bin(is, ptm.drag_var_x);
+        util::read_bin(is, ptm.drag_var_y);
+        util::read_bin(is, ptm.passive);
+        ptm.label = static_cast<decltype(ptm.label)>(label);
+        ptm.rel_func = static_cast<size_t>(rel_func);
+    }
+}
+
+// Check if ast has a derivative wrt var, by scanning for opcodes without a
+// derivative rule (see detail::diff_ast): zeta, and polygamma order or
+// sum/prod bounds which are not numbers. Follows calls into user
+// functions; fids are the functions being scanned (recursion fails)
+bool has_derivative(const Expr::AST& ast, uint64_t var,
+        const Environment& env, std::vector<uint32_t>& fids) {
+    using namespace OpCode;
+    for (size_t i = 0; i < ast.size(); ++i) {
+        const auto& node = ast[i];
+        switch (node.opcode) {
+            case zetab: return false;
+            case polygammab:
+                if (ast[i + 1].opcode != val) return false;
+                break;
+            case sums: case prods:
+                if (node.ref == var || ast[i + 1].opcode != val ||
+                    ast[i + 2].opcode != val) return false;
+                break;
+            case call:
+                {
+                    const uint32_t fid = node.call_info[0];
+                    if (fid >= env.funcs.size() || std::find(fids.begin(),
+                                fids.end(), fid) != fids.end()) return false;
+                    fids.push_back(fid);
+                    const bool result = has_derivative(
+                            env.funcs[fid].expr.ast, var, env, fids);
+                    fids.pop_back();
+                    if (!result) return false;
+                }
+                break;
+        }
+    }
+    return true;
+}
 }  // namespace
 
 namespace util {
@@ -319,9 +487,8 @@ std::ostream& Function::to_bin(std::ostream& os) const {
     util::write_bin(os, expr_str.size());
     os.write(expr_str.c_str(), expr_str.size());
 
-    expr.to_bin(os); diff.to_bin(os);
-    ddiff.to_bin(os); recip.to_bin(os);
-    drecip.to_bin(os);
+    expr.to_bin(os);
+    util::write_bin(os, differentiable);
     for (int i = 0; i < 4; ++i) util::write_bin(os, line_color.data[i]);
     util::write_bin(os, tmin);
     util::write_bin(os, tmax);
@@ -342,9 +509,8 @@ std::istream& Function::from_bin(std::istream& is) {
     util::resize_from_read_bin(is, expr_str);
     is.read(&expr_str[0], expr_str.size());
 
-    expr.from_bin(is); diff.from_bin(is);
-    ddiff.from_bin(is); recip.from_bin(is);
-    drecip.from_bin(is);
+    expr.from_bin(is);
+    util::read_bin(is, differentiable);
     for (int i = 0; i < 4; ++i) util::read_bin(is, line_color.data[i]);
     util::read_bin(is, tmin);
     util::read_bin(is, tmax);
@@ -429,6 +595,12 @@ void Plotter::reparse_expr(size_t idx) {
 
     int ftype_nomod = func.type & ~Function::FUNC_TYPE_MOD_ALL;
     bool want_reparse_all = false;
+    // Set if a user function was (re)defined or deleted
+    bool redefined = false;
+    auto func_version = [this](const std::string& name) -> uint64_t {
+        const uint64_t fid = env.addr_of_func(name);
+        return ~fid ? env.funcs[fid].version : 0;
+    };
     switch(ftype_nomod) {
         case Function::FUNC_TYPE_EXPLICIT:
         case Function::FUNC_TYPE_EXPLICIT_Y:
@@ -506,6 +678,16 @@ void Plotter::reparse_expr(size_t idx) {
                 }
             }
             break;
+        case Function::FUNC_TYPE_FRACTAL_MANDELBROT:
+            if (lhs.size()) {
+                // Julia set
+                parse_polyline_expr(lhs, func, env,
+                        x_var, y_var, t_var, func_error);
+                if (func.exprs.size() != 2) {
+                    func_error = "Illegal %julia. Syntax: %julia (cx, cy)\n";
+                }
+            }
+            break;
         case Function::FUNC_TYPE_FUNC_DEFINITION:
             {
                 size_t funname_end = lhs.find('(');
@@ -558,10 +740,12 @@ void Plotter::reparse_expr(size_t idx) {
                         // so must reparse all
                         want_reparse_all = true;
                     }
-                    auto addr = env.def_func(funname, expr, bindings);
+                    const uint64_t prev_version = func_version(funname);
+                    env.def_func(funname, expr, bindings);
                     if (env.error_msg.size()) {
                         func_error = env.error_msg;
                     }
+                    redefined = func_version(funname) != prev_version;
                 }
             }
             break;
@@ -573,20 +757,12 @@ void Plotter::reparse_expr(size_t idx) {
             ftype_nomod != Function::FUNC_TYPE_FUNC_DEFINITION)
             func.expr.optimize();
 
-        // Compute derivatives, if explicit
+        // Check if differentiable, if explicit
         if (ftype_nomod == Function::FUNC_TYPE_EXPLICIT ||
             ftype_nomod == Function::FUNC_TYPE_EXPLICIT_Y) {
-            uint64_t var = ftype_nomod == Function::FUNC_TYPE_EXPLICIT_Y ?  y_var : x_var;
-            func.diff = func.expr.diff(var, env);
-            if (!func.diff.is_null()) {
-                func.ddiff = func.diff.diff(var, env);
-            }
-            else func.ddiff.ast[0] = OpCode::null;
-            func.recip = Expr::constant(1.) / func.expr;
-            func.recip.optimize();
-            func.drecip = func.recip.diff(var, env);
+            update_differentiable(func);
         }
-    } else func.diff.ast[0] = OpCode::null;
+    } else func.differentiable = false;
 
     // Optimize any polyline/parametric point expressions
     for (auto& point_expr : func.exprs) {
@@ -599,10 +775,12 @@ void Plotter::reparse_expr(size_t idx) {
             want_reparse_all = true;
         }
         // Register a function in env
+        const uint64_t prev_version = func_version(func.name);
         env.def_func(func.name, func.expr, { ftype_nomod == Function::FUNC_TYPE_EXPLICIT_Y ? y_var : x_var });
         if (env.error_msg.size()) {
             func_error = env.error_msg;
         }
+        redefined = func_version(func.name) != prev_version;
     } else if (ftype_nomod != Function::FUNC_TYPE_FUNC_DEFINITION) {
         if (env.addr_of_func(func.name) != -1) {
             env.del_func(func.name);
@@ -617,11 +795,26 @@ void Plotter::reparse_expr(size_t idx) {
                 reparse_expr(i);
             }
         }
+    } else if (redefined) {
+        // Whether other functions are differentiable depends on the user
+        // functions they call, so update them
+        for (size_t i = 0; i < funcs.size(); ++i) {
+            if (i != idx) update_differentiable(funcs[i]);
+        }
     }
     loss_detail = false;
     require_update = true;
 }
 
+void Plotter::update_differentiable(Function& func) {
+    const int ftype_nomod = func.type & ~Function::FUNC_TYPE_MOD_ALL;
+    if (func.expr.is_null() || (ftype_nomod != Function::FUNC_TYPE_EXPLICIT &&
+                ftype_nomod != Function::FUNC_TYPE_EXPLICIT_Y)) return;
+    uint64_t var = ftype_nomod == Function::FUNC_TYPE_EXPLICIT_Y ?  y_var : x_var;
+    std::vector<uint32_t> fids;
+    func.differentiable = has_derivative(func.expr.ast, var, env, fids);
+}
+
 void Plotter::set_curr_func(size_t func_id) {
     if (func_id != curr_func)
         func_error.clear();
@@ -1083,6 +1276,7 @@ std::ostream& Plotter::export_json(std::ostream& os, bool pretty) const {
                 {"width", view.swid},
                 {"height", view.shigh},
                 {"polar", polar_grid},
+                {"adaptive", implicit_adaptive},
                 {"axes", enable_axes},
                 {"grid", enable_grid},
             }
@@ -1131,7 +1325,7 @@ std::istream& Plotter::import_json(std::istream& is, std::string* error_msg) {
 
         // Load view
         // Defaults
-        polar_grid = false;
+        polar_grid = implicit_adaptive = false;
         enable_axes = enable_grid = true;
         if (j.count("view")) {
             json& jview = j["view"];
@@ -1149,6 +1343,7 @@ std::istream& Plotter::import_json(std::istream& is, std::string* error_msg) {
                 if (jview.count("axes")) enable_axes = jview["axes"].get<bool>();
                 if (jview.count("grid")) enable_grid = jview["grid"].get<bool>();
                 if (jview.count("polar")) polar_grid = jview["polar"].get<bool>();
+                if (jview.count("adaptive")) implicit_adaptive = jview["adaptive"].get<bool>();
             }
         }
 
@@ -1297,6 +1492,7 @@ std::ostream& Plotter::export_binary_func_and_env(std::ostream& os) const {
     util::write_bin(os, y_var);
     util::write_bin(os, t_var);
     util::write_bin(os, r_var);
+    util::write_bin(os, implicit_adaptive);
     env.to_bin(os);
     return os;
 }
@@ -1312,48 +1508,285 @@ std::istream& Plotter::import_binary_func_and_env(std::istream& is) {
     util::read_bin(is, y_var);
     util::read_bin(is, t_var);
     util::read_bin(is, r_var);
+    util::read_bin(is, implicit_adaptive);
     env.from_bin(is);
+    last_snapshot.reset();
     return is;
 }
 
-std::ostream& Plotter::export_binary_render_result(std::ostream& os) const {
-    util::write_bin(os, draw_buf.size());
-    for (size_t i = 0; i < draw_buf.size(); ++i) {
-        draw_buf[i].to_bin(os);
+std::shared_ptr<const Plotter::Snapshot> Plotter::export_snapshot() {
+    auto snapshot = std::make_shared<Snapshot>();
+    snapshot->curr_func = curr_func;
+    snapshot->funcs.resize(funcs.size());
+    for (size_t i = 0; i < funcs.size(); ++i) {
+        if (last_snapshot && i < last_snapshot->funcs.size() &&
+                same_function(*last_snapshot->funcs[i], funcs[i])) {
+            snapshot->funcs[i] = last_snapshot->funcs[i];
+        } else {
+            snapshot->funcs[i] = std::make_shared<const Function>(funcs[i]);
+        }
     }
-    util::write_bin(os, pt_markers.size());
-    for (size_t i = 0; i < pt_markers.size(); ++i) {
-        util::write_bin(os, pt_markers[i]);
+    snapshot->view = view;
+    snapshot->x_var = x_var;
+    snapshot->y_var = y_var;
+    snapshot->t_var = t_var;
+    snapshot->r_var = r_var;
+    snapshot->implicit_adaptive = implicit_adaptive;
+    // Values are copied separately, so that moving a slider does not
+    // copy the user functions
+    if (last_snapshot && same_env_funcs(*last_snapshot->env, env)) {
+        snapshot->env = last_snapshot->env;
+    } else {
+        snapshot->env = std::make_shared<const Environment>(env);
+    }
+    snapshot->vars = env.vars;
+    last_snapshot = snapshot;
+    return snapshot;
+}
+
+void Plotter::import_snapshot(const std::shared_ptr<const Snapshot>& snapshot) {
+    curr_func = snapshot->curr_func;
+    funcs.resize(snapshot->funcs.size());
+    for (size_t i = 0; i < funcs.size(); ++i) {
+        // Functions shared with the last snapshot were copied then
+        if (last_snapshot && i < last_snapshot->funcs.size() &&
+                last_snapshot->funcs[i] == snapshot->funcs[i]) continue;
+        funcs[i] = *snapshot->funcs[i];
+    }
+    view = snapshot->view;
+    x_var = snapshot->x_var;
+    y_var = snapshot->y_var;
+    t_var = snapshot->t_var;
+    r_var = snapshot->r_var;
+    implicit_adaptive = snapshot->implicit_adaptive;
+    if (!last_snapshot || last_snapshot->env != snapshot->env) {
+        env = *snapshot->env;
+    }
+    env.vars = snapshot->vars;
+    last_snapshot = snapshot;
+}
+
+std::ostream& Plotter::export_binary_render_result(std::ostream& os,
+        uint64_t ack_frame) {
+    // Group shapes and markers by slot, keeping their order as runs
+    // (slot, count) of consecutive items in the same slot
+    const size_t n_slots = funcs.size() + 1;
+    std::vector<std::vector<const DrawBufferObject*> > slot_objs(n_slots);
+    std::vector<std::vector<const PointMarker*> > slot_markers(n_slots);
+    std::vector<std::pair<uint32_t, uint32_t> > obj_runs, marker_runs;
+    auto add_to_run = [](std::vector<std::pair<uint32_t, uint32_t> >& runs,
+                         size_t slot) {
+        if (runs.size() && runs.back().first == slot) ++runs.back().second;
+        else runs.emplace_back(static_cast<uint32_t>(slot), 1);
+    };
+    for (const auto& obj : draw_buf) {
+        const size_t slot = std::min(obj.rel_func, funcs.size());
+        slot_objs[slot].push_back(&obj);
+        add_to_run(obj_runs, slot);
+    }
+    for (const auto& ptm : pt_markers) {
+        const size_t slot = std::min(ptm.rel_func, funcs.size());
+        slot_markers[slot].push_back(&ptm);
+        add_to_run(marker_runs, slot);
+    }
+    RenderResultSent sent;
+    sent.frame = next_render_result_frame++;
+    std::vector<std::string> slot_data(n_slots);
+    for (size_t i = 0; i < n_slots; ++i) {
+        std::ostringstream ss;
+        encode_render_slot(ss, slot_objs[i], slot_markers[i]);
+        slot_data[i] = ss.str();
+        sent.slot_hashes.push_back(std::hash<std::string>()(slot_data[i]));
+    }
+    sent.bitmap_hash = std::hash<std::string>()(bg_bitmap) * 31 +
+        std::hash<std::string>()(std::string(
+                    reinterpret_cast<const char*>(&bg_bitmap_view), sizeof(View)));
+
+    // Send slots which changed since the acknowledged frame,
+    // or all slots if it is unknown
+    const RenderResultSent* base = nullptr;
+    for (const auto& frame : render_result_sent) {
+        if (ack_frame && frame.frame == ack_frame) base = &frame;
+    }
+    util::write_bin(os, RENDER_RESULT_FORMAT);
+    util::write_bin(os, sent.frame);
+    util::write_bin(os, base ? base->frame : uint64_t(0));
+    util::write_bin(os, n_slots);
+    std::vector<size_t> changed;
+    for (size_t i = 0; i < n_slots; ++i) {
+        if (!base || i >= base->slot_hashes.size() ||
+                base->slot_hashes[i] != sent.slot_hashes[i]) {
+            changed.push_back(i);
+        }
+    }
+    util::write_bin(os, changed.size());
+    for (size_t i : changed) {
+        util::write_bin(os, i);
+        util::write_bin(os, slot_data[i].size());
+        os.write(slot_data[i].c_str(), slot_data[i].size());
+    }
+    for (const auto* runs : { &obj_runs, &marker_runs }) {
+        util::write_bin(os, runs->size());
+        os.write(reinterpret_cast<const char*>(runs->data()),
+                runs->size() * sizeof(runs->front()));
     }
     util::write_bin(os, func_error.size());
     os.write(func_error.c_str(), func_error.size());
     util::write_bin(os, loss_detail);
+
+    // Background bitmap if changed, run-length encoded (by pixel)
+    const bool bitmap_changed = !base || base->bitmap_hash != sent.bitmap_hash;
+    util::write_bin(os, bitmap_changed);
+    if (bitmap_changed) {
+        util::write_bin(os, bg_bitmap_view);
+        std::vector<std::pair<uint32_t, uint32_t> > runs;
+        for (size_t i = 0; i + 4 <= bg_bitmap.size(); i += 4) {
+            uint32_t px;
+            std::memcpy(&px, &bg_bitmap[i], 4);
+            if (runs.size() && runs.back().second == px) ++runs.back().first;
+            else runs.emplace_back(1, px);
+        }
+        util::write_bin(os, runs.size());
+        for (auto& run : runs) {
+            util::write_bin(os, run.first);
+            util::write_bin(os, run.second);
+        }
+    }
+
+    render_result_sent.push_back(std::move(sent));
+    if (render_result_sent.size() > RENDER_RESULT_HISTORY) {
+        render_result_sent.pop_front();
+    }
     return os;
 }
+
 std::istream& Plotter::import_binary_render_result(std::istream& is) {
-    util::resize_from_read_bin(is, draw_buf);
-    for (size_t i = 0; i < draw_buf.size(); ++i) {
-        draw_buf[i].from_bin(is);
+    uint32_t format;
+    uint64_t base_id;
+    RenderResultFrame frame;
+    util::read_bin(is, format);
+    util::read_bin(is, frame.frame);
+    util::read_bin(is, base_id);
+    if (!is || format != RENDER_RESULT_FORMAT) {
+        is.setstate(std::ios::failbit);
+        return is;
+    }
+    const RenderResultFrame* base = nullptr;
+    for (const auto& prev_frame : render_result_recv) {
+        if (base_id && prev_frame.frame == base_id) base = &prev_frame;
+    }
+    if (base_id && !base) {
+        // Base frame no longer known
+        is.setstate(std::ios::failbit);
+        return is;
+    }
+
+    // Slots: changed ones from stream, others from base frame
+    size_t n_slots, n_changed;
+    util::read_bin(is, n_slots);
+    util::read_bin(is, n_changed);
+    if (!is) return is;
+    static const auto empty_slot = std::make_shared<const RenderResultSlot>();
+    frame.slots.resize(n_slots, empty_slot);
+    if (base) {
+        for (size_t i = 0; i < n_slots && i < base->slots.size(); ++i) {
+            frame.slots[i] = base->slots[i];
+        }
+    }
+    for (size_t j = 0; j < n_changed && is; ++j) {
+        size_t i, size;
+        util::read_bin(is, i);
+        util::read_bin(is, size);
+        if (!is || i >= n_slots) {
+            is.setstate(std::ios::failbit);
+            return is;
+        }
+        auto slot = std::make_shared<RenderResultSlot>();
+        decode_render_slot(is, slot->draw_buf, slot->pt_markers);
+        frame.slots[i] = std::move(slot);
     }
-    util::resize_from_read_bin(is, pt_markers);
-    for (size_t i = 0; i < pt_markers.size(); ++i) {
-        util::read_bin(is, pt_markers[i]);
+    std::vector<std::pair<uint32_t, uint32_t> > obj_runs, marker_runs;
+    for (auto* runs : { &obj_runs, &marker_runs }) {
+        util::resize_from_read_bin(is, *runs);
+        is.read(reinterpret_cast<char*>(runs->data()),
+                runs->size() * sizeof(runs->front()));
     }
     std::string func_error_tmp;
     util::resize_from_read_bin(is, func_error_tmp);
     is.read(&func_error_tmp[0], func_error_tmp.size());
-    bool loss_detail_tmp;
+    bool loss_detail_tmp, bitmap_changed;
     util::read_bin(is, loss_detail_tmp);
+    util::read_bin(is, bitmap_changed);
+    if (!is) return is;
+    if (bitmap_changed) {
+        util::read_bin(is, frame.bitmap_view);
+        size_t n_runs;
+        util::read_bin(is, n_runs);
+        auto bitmap = std::make_shared<std::string>();
+        for (size_t i = 0; i < n_runs && is; ++i) {
+            uint32_t run_len, px;
+            util::read_bin(is, run_len);
+            util::read_bin(is, px);
+            const size_t pos = bitmap->size();
+            bitmap->resize(pos + static_cast<size_t>(run_len) * 4);
+            for (uint32_t j = 0; j < run_len; ++j) {
+                std::memcpy(&(*bitmap)[pos + j * 4], &px, 4);
+            }
+        }
+        frame.bitmap = std::move(bitmap);
+    } else if (base) {
+        frame.bitmap = base->bitmap;
+        frame.bitmap_view = base->bitmap_view;
+    }
+    if (!is) return is;
+
+    // Rebuild shapes and markers in order
+    std::vector<size_t> cursors(n_slots);
+    draw_buf.clear();
+    for (const auto& run : obj_runs) {
+        if (run.first >= n_slots) break;
+        const auto& objs = frame.slots[run.first]->draw_buf;
+        size_t& cur = cursors[run.first];
+        const size_t end = std::min(objs.size(), cur + run.second);
+        draw_buf.insert(draw_buf.end(), objs.begin() + cur, objs.begin() + end);
+        cur = end;
+    }
+    std::fill(cursors.begin(), cursors.end(), 0);
+    pt_markers.clear();
+    for (const auto& run : marker_runs) {
+        if (run.first >= n_slots) break;
+        const auto& markers = frame.slots[run.first]->pt_markers;
+        size_t& cur = cursors[run.first];
+        const size_t end = std::min(markers.size(), cur + run.second);
+        pt_markers.insert(pt_markers.end(), markers.begin() + cur, markers.begin() + end);
+        cur = end;
+    }
     if (loss_detail_tmp) {
         func_error = func_error_tmp;
     } else if (loss_detail) {
         func_error.clear();
     }
     loss_detail = loss_detail_tmp;
+    if (!frame.bitmap) {
+        bg_bitmap.clear();
+    } else if (render_result_recv.empty() ||
+            render_result_recv.back().bitmap != frame.bitmap) {
+        bg_bitmap = *frame.bitmap;
+    }
+    bg_bitmap_view = frame.bitmap_view;
+
+    render_result_recv.push_back(std::move(frame));
+    if (render_result_recv.size() > RENDER_RESULT_HISTORY) {
+        render_result_recv.pop_front();
+    }
     require_update = true;
     return is;
 }
 
+uint64_t Plotter::render_result_frame() const {
+    return render_result_recv.empty() ? 0 : render_result_recv.back().frame;
+}
+
 void Plotter::detect_marker_click(int px, int py, bool no_passive, bool drag_var) {
     auto& ptm = pt_markers[grid[py * view.swid + px]];
     if (ptm.passive && no_passive) return;
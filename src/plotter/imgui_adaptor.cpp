@@ -106,9 +106,12 @@ void ImGuiDrawListGraphicsAdaptor::string(float x, float y,
 }
 
 void ImGuiDrawListGraphicsAdaptor::image(float x, float y, float w, float h,
-                                         char* data_rgb, int cols, int rows) {
-    GLuint image_texture;
-    glGenTextures(1, &image_texture);
+                                         const char* data_rgba, int cols, int rows) {
+    if (image_texture == 0) {
+        GLuint texture;
+        glGenTextures(1, &texture);
+        image_texture = texture;
+    }
     glBindTexture(GL_TEXTURE_2D, image_texture);
 
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
@@ -117,8 +120,9 @@ void ImGuiDrawListGraphicsAdaptor::image(float x, float y, float w, float h,
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, cols, rows, 0, GL_RGB,
-                 GL_UNSIGNED_BYTE, data_rgb);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, cols, rows, 0, GL_RGBA,
+                 GL_UNSIGNED_BYTE, data_rgba);
     draw_list->AddImage((void*)(intptr_t)image_texture, ImVec2(x, y),
                         ImVec2(x + w, y + h));
 }
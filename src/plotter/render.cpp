@@ -1,17 +1,15 @@
 #include "plotter/plotter.hpp"
 #include "plotter/internal.hpp"
+#include "polynomial.hpp"
+#include <cstring>
 #include <iostream>
+#include <iterator>
+#include <sstream>
+#include <unordered_map>
 
 namespace nivalis {
 
 namespace {
-const unsigned NUM_THREADS =
-#ifdef NIVALIS_EMSCRIPTEN
-    1;  // Multithreading not supported
-#else
-    std::thread::hardware_concurrency();
-#endif
-
 color::color get_ineq_color(const color::color& func_line_color) {
     color::color ret = func_line_color;
     ret.a = 0.25;
@@ -90,51 +88,253 @@ void buf_add_screen_polyline(
             thickness, closed, line, filled) ;
 }
 
-// Add an rectangle in screen coordinates to the buffer
-// automatically merges adjacent filled rectangles of same color
-// added consecutively, where possible
-void buf_add_screen_rectangle(
-        std::vector<DrawBufferObject>& draw_buf,
-        const Plotter::View& render_view,
-        float x, float y, float w, float h, bool fill, const color::color& c,
-        float thickness, size_t rel_func) {
+// Add a rectangle in screen coordinates to be filled in
+// the background bitmap
+void fill_screen_rectangle(std::vector<FillRect>& fills,
+        float x, float y, float w, float h, const color::color& c) {
     if (w <= 0. || h <= 0.) return;
-    DrawBufferObject rect;
-    rect.type = fill ? DrawBufferObject::FILLED_RECT : DrawBufferObject::RECT;
-    rect.points = {{(double)x, (double)y}, {(double)(x+w), (double)(y+h)}};
-    rect.thickness = thickness,
-    rect.rel_func = rel_func;
-    auto xdiff = render_view.xmax - render_view.xmin;
-    auto ydiff = render_view.ymax - render_view.ymin;
-    for (size_t i = 0; i < rect.points.size(); ++i) {
-        rect.points[i][0] = rect.points[i][0]*1. /
-            render_view.swid * xdiff + render_view.xmin;
-        rect.points[i][1] = (render_view.shigh - rect.points[i][1])*1. /
-            render_view.shigh * ydiff + render_view.ymin;
+    fills.push_back(FillRect{x, y, w, h, c});
+}
+
+// Zoom levels: log2 of the scale (plot units per pixel), rounded to
+// 1/ZOOM_LEVEL_STEPS; output drawn at points of a lattice spaced by
+// the scale of the level is reusable across views with the same level
+const double ZOOM_LEVEL_STEPS = 1 << 20;
+int64_t zoom_level(double scale) {
+    return std::llround(std::log2(scale) * ZOOM_LEVEL_STEPS);
+}
+double zoom_level_scale(int64_t level) {
+    return std::exp2(level / ZOOM_LEVEL_STEPS);
+}
+
+// Move window of values at lattice indices [begin, begin + vals.size())
+// to [new_begin, new_end), keeping the values at indices in both;
+// outputs the ranges of indices whose values are to be computed
+template<class T>
+void move_lattice_window(int64_t& begin, std::vector<T>& vals,
+        int64_t new_begin, int64_t new_end,
+        std::vector<std::pair<int64_t, int64_t> >& missing) {
+    missing.clear();
+    if (new_end < new_begin) new_end = new_begin;
+    const int64_t end = begin + static_cast<int64_t>(vals.size());
+    const int64_t keep_begin = std::max(begin, new_begin),
+                  keep_end = std::min(end, new_end);
+    std::vector<T> new_vals(new_end - new_begin);
+    if (keep_begin < keep_end) {
+        std::copy(vals.begin() + (keep_begin - begin),
+                  vals.begin() + (keep_end - begin),
+                  new_vals.begin() + (keep_begin - new_begin));
+        if (new_begin < keep_begin) missing.emplace_back(new_begin, keep_begin);
+        if (keep_end < new_end) missing.emplace_back(keep_end, new_end);
+    } else if (new_begin < new_end) {
+        missing.emplace_back(new_begin, new_end);
     }
-    if (fill && draw_buf.size()) {
-        auto& last_rect = draw_buf.back();
-        if (last_rect.type == DrawBufferObject::FILLED_RECT &&
-                std::fabs(last_rect.points[0][1] - rect.points[0][1]) < 1e-6 * ydiff &&
-                std::fabs(last_rect.points[1][1] - rect.points[1][1]) < 1e-6 * ydiff &&
-                std::fabs(last_rect.points[1][0] - rect.points[0][0]) < 1e-6 * xdiff &&
-                last_rect.c == c) {
-            // Reduce shape count by merging with rectangle to left
-            last_rect.points[1][0] = rect.points[1][0];
-            return;
-        } else if (last_rect.type == DrawBufferObject::FILLED_RECT &&
-                std::fabs(last_rect.points[0][0] - rect.points[0][0]) < 1e-6 * xdiff &&
-                std::fabs(last_rect.points[1][0] - rect.points[1][0]) < 1e-6 * xdiff &&
-                std::fabs(last_rect.points[1][1] - rect.points[0][1]) < 1e-6 * ydiff &&
-                last_rect.c == c) {
-            // Reduce shape count by merging with rectangle above
-            last_rect.points[1][1] = rect.points[1][1];
-            return;
+    begin = new_begin;
+    vals.swap(new_vals);
+}
+
+// One function's layer of the background bitmap: an RGBA raster
+// (swid x shigh, straight alpha; may be empty), with fill
+// rectangles drawn over it
+struct RasterLayer {
+    const std::string* pixels;
+    const std::vector<FillRect>* fills;
+};
+
+// Rasterize layers into RGBA bitmap (swid x shigh), in order, alpha
+// blending each over the previous ones; a pixel is covered by a fill
+// rectangle if its center is in it (left/top edges inclusive).
+// Rows are split among thread pool tasks
+void rasterize_layers(std::string& bitmap, int swid, int shigh,
+        const std::vector<RasterLayer>& layers,
+        ThreadPool& pool) {
+    // Premultiplied color, reused across frames
+    static thread_local std::vector<std::array<float, 4> > acc;
+    const size_t n_px = static_cast<size_t>(swid) * shigh;
+    acc.resize(n_px);
+    bitmap.resize(n_px * 4);
+    uint8_t* out = reinterpret_cast<uint8_t*>(&bitmap[0]);
+    auto* acc_data = acc.data();
+    const size_t grain = std::max<size_t>(16, shigh / (2 * pool.concurrency()) + 1);
+    pool.parallel_for(shigh, grain, [&](size_t row_begin, size_t row_end) {
+        std::fill(acc_data + row_begin * swid, acc_data + row_end * swid,
+                std::array<float, 4>{0.f, 0.f, 0.f, 0.f});
+        for (const RasterLayer& layer : layers) {
+            if (layer.pixels->size() == n_px * 4) {
+                const uint8_t* src = reinterpret_cast<const uint8_t*>(
+                        layer.pixels->data());
+                for (size_t i = row_begin * swid; i < row_end * swid; ++i) {
+                    const uint8_t* p = src + i * 4;
+                    if (p[3] == 0) continue;
+                    const float a = p[3] * (1.f / 255.f);
+                    const float keep = 1.f - a;
+                    float* px = acc_data[i].data();
+                    for (int k = 0; k < 3; ++k) {
+                        px[k] = p[k] * (a / 255.f) + px[k] * keep;
+                    }
+                    px[3] = a + px[3] * keep;
+                }
+            }
+            for (const FillRect& rect : *layer.fills) {
+                int x0 = std::max((int)std::ceil(rect.x - .5f), 0);
+                int x1 = std::min((int)std::ceil(rect.x + rect.w - .5f), swid);
+                int y0 = std::max((int)std::ceil(rect.y - .5f), (int)row_begin);
+                int y1 = std::min((int)std::ceil(rect.y + rect.h - .5f), (int)row_end);
+                const float a = std::min(std::max(rect.c.a, 0.f), 1.f);
+                const float src[4] = { rect.c.r * a, rect.c.g * a, rect.c.b * a, a };
+                const float keep = 1.f - a;
+                for (int y = y0; y < y1; ++y) {
+                    float* px = acc_data[static_cast<size_t>(y) * swid + x0].data();
+                    float* px_end = px + 4 * (x1 - x0);
+                    for (; px < px_end; px += 4) {
+                        for (int k = 0; k < 4; ++k) px[k] = src[k] + px[k] * keep;
+                    }
+                }
+            }
         }
-    }
-    rect.c = c;
-    draw_buf.push_back(std::move(rect));
+        // Convert to straight alpha bytes
+        for (size_t i = row_begin * swid; i < row_end * swid; ++i) {
+            const auto& p = acc_data[i];
+            uint8_t* q = out + i * 4;
+            if (p[3] <= 0.f) {
+                q[0] = q[1] = q[2] = q[3] = 0;
+                continue;
+            }
+            const float scale = 255.f / p[3];
+            for (int k = 0; k < 3; ++k) {
+                q[k] = static_cast<uint8_t>(std::min(p[k] * scale, 255.f) + .5f);
+            }
+            q[3] = static_cast<uint8_t>(std::min(p[3], 1.f) * 255.f + .5f);
+        }
+    });
 }
+
+// Contour extraction for implicit functions: marching squares over
+// sampled square cells, with the crossing on each cell edge found by
+// linear interpolation, and segments stitched into polylines through
+// shared cell edges
+class ContourBuilder {
+public:
+    // Add cell with top-left screen position (sx, sy), side length size
+    // and function values at its corners (top-left, top-right,
+    // bottom-left, bottom-right); cells with undefined corners are
+    // skipped. Returns true if the contour crosses the cell
+    bool add_cell(int sx, int sy, int size, const std::array<double, 4>& z) {
+        for (double zi : z) {
+            if (std::isnan(zi)) return false;
+        }
+        // Corners in clockwise order from top-left
+        const double v[4] = { z[0], z[1], z[3], z[2] };
+        bool crossed[4];
+        int n_crossed = 0;
+        for (int i = 0; i < 4; ++i) {
+            crossed[i] = (v[i] >= 0) != (v[(i + 1) & 3] >= 0);
+            n_crossed += crossed[i];
+        }
+        if (n_crossed == 0) return false;
+        // Edge i joins corners i and i+1; top and bottom edges are
+        // horizontal, each edge is stored from its top/left end
+        auto add_segment = [&](int ea, int eb) {
+            Segment seg;
+            for (int j = 0; j < 2; ++j) {
+                const int e = j ? eb : ea;
+                const bool vertical = e & 1;
+                const int ex = e == 1 ? sx + size : sx;
+                const int ey = e == 2 ? sy + size : sy;
+                const double za = v[e == 2 ? 3 : e == 3 ? 0 : e];
+                const double zb = v[e == 2 ? 2 : e == 3 ? 3 : e + 1];
+                double t = za / (za - zb);
+                if (!(t >= 0.)) t = 0.;
+                else if (t > 1.) t = 1.;
+                seg.key[j] = edge_key(ex, ey, size, vertical);
+                seg.pt[j] = { static_cast<float>(ex + (vertical ? 0. : t * size)),
+                              static_cast<float>(ey + (vertical ? t * size : 0.)) };
+            }
+            segs.push_back(seg);
+        };
+        if (n_crossed == 2) {
+            int ea = 0;
+            while (!crossed[ea]) ++ea;
+            int eb = ea + 1;
+            while (!crossed[eb]) ++eb;
+            add_segment(ea, eb);
+        } else {
+            // Saddle: use the center value to decide which corners
+            // are connected
+            const double center = (v[0] + v[1] + v[2] + v[3]) * 0.25;
+            if ((center >= 0) == (v[0] >= 0)) {
+                add_segment(0, 1);
+                add_segment(2, 3);
+            } else {
+                add_segment(3, 0);
+                add_segment(1, 2);
+            }
+        }
+        return true;
+    }
+
+    // Append segments from another builder
+    void append(const ContourBuilder& other) {
+        segs.insert(segs.end(), other.segs.begin(), other.segs.end());
+    }
+
+    // Stitch segments into polylines, in screen coordinates;
+    // closed curves end with their first point
+    std::vector<std::vector<std::array<float, 2> > > stitch() const {
+        static const size_t NONE = -1;
+        // Segment ends (2 * segment index + side) on each crossed edge
+        std::unordered_map<uint64_t, std::array<size_t, 2> > ends;
+        ends.reserve(segs.size() * 2);
+        for (size_t i = 0; i < segs.size(); ++i) {
+            for (size_t side = 0; side < 2; ++side) {
+                auto& e = ends.emplace(segs[i].key[side],
+                        std::array<size_t, 2>{NONE, NONE}).first->second;
+                e[e[0] == NONE ? 0 : 1] = 2 * i + side;
+            }
+        }
+        std::vector<bool> used(segs.size());
+        // Follow segments connected at segment end 'end', adding points
+        auto follow = [&](size_t end, std::vector<std::array<float, 2> >& out) {
+            while (true) {
+                const auto& e = ends[segs[end / 2].key[end & 1]];
+                const size_t next = e[0] == end ? e[1] : e[0];
+                if (next == NONE || used[next / 2]) break;
+                used[next / 2] = true;
+                end = next ^ 1;
+                out.push_back(segs[end / 2].pt[end & 1]);
+            }
+        };
+        std::vector<std::vector<std::array<float, 2> > > lines;
+        std::vector<std::array<float, 2> > back;
+        for (size_t i = 0; i < segs.size(); ++i) {
+            if (used[i]) continue;
+            used[i] = true;
+            std::vector<std::array<float, 2> > line { segs[i].pt[0], segs[i].pt[1] };
+            follow(2 * i + 1, line);
+            back.clear();
+            follow(2 * i, back);
+            line.insert(line.begin(), back.rbegin(), back.rend());
+            lines.push_back(std::move(line));
+        }
+        return lines;
+    }
+
+private:
+    // Unique key for the cell edge starting at (x, y) with given length
+    static uint64_t edge_key(int x, int y, int size, bool vertical) {
+        return static_cast<uint64_t>(x + 16) |
+               static_cast<uint64_t>(y + 16) << 24 |
+               static_cast<uint64_t>(vertical) << 48 |
+               static_cast<uint64_t>(size) << 49;
+    }
+
+    // Line segment within a cell; endpoints are on cell edges
+    struct Segment {
+        uint64_t key[2];
+        std::array<float, 2> pt[2];
+    };
+    std::vector<Segment> segs;
+};
 } // namespace
 
 void Plotter::render(const View& view) {
@@ -155,47 +355,38 @@ void Plotter::render(const View& view) {
 
     bool prev_loss_detail = loss_detail;
     loss_detail = false; // Will set to show 'some detail may be lost'
+    render_complete = true;
 
     // * Clear back buffers
     pt_markers.clear(); pt_markers.reserve(500);
     draw_buf.clear();
 
-    for (size_t funcid = 0; funcid < funcs.size(); ++funcid) {
-        auto& func = funcs[funcid];
-        auto ftype_nomod = func.type & ~Function::FUNC_TYPE_MOD_ALL;
-        if (ftype_nomod == Function::FUNC_TYPE_EXPLICIT ||
-                ftype_nomod == Function::FUNC_TYPE_EXPLICIT_Y) {
-            bool has_call = false;
-            for (size_t i = 0 ; i < funcs[funcid].expr.ast.size(); ++i) {
-                if (funcs[funcid].expr.ast[i].opcode == OpCode::call) {
-                    has_call = true;
-                    break;
-                }
-            }
-            if (has_call && funcs.size() <= max_functions_find_crit_points) {
-                // Re-compute derivatives, if explicit and has
-                // at least one user-function call
-                // This is needed since the user function may have been changed
-                if (ftype_nomod == Function::FUNC_TYPE_EXPLICIT ||
-                        ftype_nomod == Function::FUNC_TYPE_EXPLICIT_Y) {
-                    uint64_t var = ftype_nomod == Function::FUNC_TYPE_EXPLICIT_Y ?  y_var : x_var;
-                    func.diff = func.expr.diff(var, env);
-                    if (!func.diff.is_null()) {
-                        func.ddiff = func.diff.diff(var, env);
-                    }
-                    else func.ddiff.ast[0] = OpCode::null;
-                    func.drecip = func.recip.diff(var, env);
-                }
+    // * Compile expressions to bytecode and, if available,
+    //   native code, inlining small user functions
+    //   (no-op if already compiled and no inlined function was redefined)
+    auto compile_func = [this](Function& func) {
+        if (!func.expr.is_compiled(env)) {
+            func.expr.compile(&env);
+            func.expr.jit(&env);
+        }
+        for (auto& expr : func.exprs) {
+            if (!expr.is_compiled(env)) {
+                expr.compile(&env);
+                expr.jit(&env);
             }
         }
-    }
+    };
+    auto is_polyline = [](const Function& func) {
+        return (func.type & ~Function::FUNC_TYPE_MOD_ALL) ==
+                Function::FUNC_TYPE_GEOM_POLYLINE;
+    };
 
     // * Draw functions
     // BEGIN_PROFILE;
     for (size_t funcid = 0; funcid < funcs.size(); ++funcid) {
         auto& func = funcs[funcid];
-        if ((func.type & ~Function::FUNC_TYPE_MOD_ALL) ==
-                Function::FUNC_TYPE_GEOM_POLYLINE) {
+        if (is_polyline(func)) {
+            compile_func(func);
             // Draw polyline
             // Do this first since it can affect other functions in the same frame
             // e.g (p, q) moved
@@ -239,27 +430,85 @@ void Plotter::render(const View& view) {
             }
         }
     }
-    // Draw all other functions
+    // Reuse the output of functions whose inputs are unchanged since they
+    // were last drawn (cache keys are found after the polyline pass,
+    // which may set variables)
+    std::vector<FuncRenderOutput> func_outs(funcs.size());
+    std::vector<size_t> funcs_to_render;
+    if (render_cancelled()) {
+        render_complete = false;
+        return;
+    }
+    // Inputs of each function other than the view (for tile_cache)
+    std::vector<std::string> scene_keys(funcs.size());
+    render_cache.resize(funcs.size());
+    explicit_cache.resize(funcs.size());
     for (size_t funcid = 0; funcid < funcs.size(); ++funcid) {
+        if (is_polyline(funcs[funcid])) continue;
+        auto& cache = render_cache[funcid];
+        std::string key;
+        std::vector<uint64_t> var_addrs;
+        get_render_inputs(funcid, key, var_addrs);
+        std::vector<double> var_vals(var_addrs.size());
+        for (size_t i = 0; i < var_addrs.size(); ++i) {
+            var_vals[i] = var_addrs[i] < env.vars.size() ? env.vars[var_addrs[i]] :
+                std::numeric_limits<double>::quiet_NaN();
+        }
+        scene_keys[funcid] = key;
+        scene_keys[funcid].append(reinterpret_cast<const char*>(var_vals.data()),
+                var_vals.size() * sizeof(double));
+        key.append(reinterpret_cast<const char*>(&view), sizeof(View));
+        // Compare values bitwise, so that NaN matches NaN (memcmp may not
+        // be passed the null data() of empty vectors)
+        if (cache.valid && cache.key == key && cache.var_addrs == var_addrs &&
+                (var_vals.empty() ||
+                 std::memcmp(cache.var_vals.data(), var_vals.data(),
+                     var_vals.size() * sizeof(double)) == 0)) {
+            func_outs[funcid] = cache.out;
+            continue;
+        }
+        cache.valid = false;
+        cache.key = std::move(key);
+        cache.var_addrs = std::move(var_addrs);
+        cache.var_vals = std::move(var_vals);
+        compile_func(funcs[funcid]);
+        specialize_func(funcs[funcid]);
+        funcs_to_render.push_back(funcid);
+    }
+
+    // Draw all other functions, one task per function; each draws into its
+    // own output, which are merged in function order below
+    auto render_func = [&](size_t funcid) {
+        if (render_cancelled()) return;
         auto& func = funcs[funcid];
+        auto& draw_buf = func_outs[funcid].draw_buf;
+        // Evaluation context for this function
+        EvalContext ctx(env);
         auto ftype_nomod = func.type & ~Function::FUNC_TYPE_MOD_ALL;
         switch (ftype_nomod) {
             case Function::FUNC_TYPE_IMPLICIT:
-                plot_implicit(funcid); break;
+                plot_tiled(funcid, view, scene_keys[funcid],
+                        [this, funcid](const View& tile_view, FuncRenderOutput& tile_out) {
+                            plot_implicit(funcid, tile_view, tile_out);
+                        }, func_outs[funcid]);
+                break;
             case Function::FUNC_TYPE_PARAMETRIC:
                 {
-                    if (func.exprs.size() != 2) continue;
+                    if (func.frame_exprs.size() != 2) break;
                     std::vector<std::array<float, 2> > curr_line;
                     double tmin = (double)func.tmin;
                     double tmax = (double)func.tmax;
                     if (tmin > tmax) std::swap(tmin, tmax);
                     double tstep = std::max((tmax - tmin) / PARAMETRIC_STEPS, 1e-12);
+                    std::vector<double> ts, xs, ys;
+                    for (double t = tmin; t <= tmax; t += tstep) ts.push_back(t);
+                    xs.resize(ts.size()); ys.resize(ts.size());
+                    func.frame_exprs[0].eval_batch(t_var, ts.data(), xs.data(), ts.size(), ctx);
+                    func.frame_exprs[1].eval_batch(t_var, ts.data(), ys.data(), ts.size(), ctx);
                     double px, py;
-                    for (double t = tmin; t <= tmax; t += tstep) {
-                        env.vars[t_var] = t;
-                        double x = func.exprs[0](env),
-                               y = func.exprs[1](env);
-                        if (t > tmin && util::sqr_dist(x, y, px, py) > PARAMETRIC_DISCONN_THRESH) {
+                    for (size_t i = 0; i < ts.size(); ++i) {
+                        double x = xs[i], y = ys[i];
+                        if (i > 0 && util::sqr_dist(x, y, px, py) > PARAMETRIC_DISCONN_THRESH) {
                             buf_add_screen_polyline(draw_buf, view, curr_line, func.line_color, funcid, 2.f);
                             curr_line.clear();
                         }
@@ -280,18 +529,16 @@ void Plotter::render(const View& view) {
                     bool has_line = ((func.type & Function::FUNC_TYPE_MOD_INEQ_STRICT) == 0);
                     bool is_ineq = (func.type & Function::FUNC_TYPE_MOD_INEQ) != 0;
                     bool is_ineq_less = (func.type & Function::FUNC_TYPE_MOD_INEQ_LESS) != 0;
-                    if (is_ineq) {
-                        vals.reserve((tmax - tmin) / POLAR_STEP_SIZE + 1);
-                    }
                     if (has_line) {
                         curr_line.reserve((tmax - tmin) / POLAR_STEP_SIZE + 1);
                     }
-                    for (double t = tmin; t <= tmax; t += POLAR_STEP_SIZE) {
-                        env.vars[t_var] = t;
-                        double r = func.expr(env);
-                        if (is_ineq) vals.push_back(r);
-                        if (has_line) {
-                            double x = r * cos(t), y = r * sin(t);
+                    std::vector<double> ts;
+                    for (double t = tmin; t <= tmax; t += POLAR_STEP_SIZE) ts.push_back(t);
+                    vals.resize(ts.size());
+                    func.frame_expr.eval_batch(t_var, ts.data(), vals.data(), ts.size(), ctx);
+                    if (has_line) {
+                        for (size_t i = 0; i < ts.size(); ++i) {
+                            double x = vals[i] * cos(ts[i]), y = vals[i] * sin(ts[i]);
                             curr_line.push_back({x, y});
                         }
                     }
@@ -300,13 +547,14 @@ void Plotter::render(const View& view) {
                                 false, true, false);
                     }
                     if (is_ineq) {
-                        const float INTERVAL = 1.5f;
+                        const float INTERVAL = render_coarse ? 6.f : 1.5f;
                         double beg_mod = std::fmod(tmin, 2*M_PI);
                         double end_mod = std::fmod(tmax, 2*M_PI);
                         if (beg_mod < 0) beg_mod += 2 * M_PI;
                         if (end_mod < 0) end_mod += 2 * M_PI;
                         double t_start = tmin - beg_mod;
                         double t_end = tmax + (end_mod == 0.0 ? 0.0 : (2*M_PI - end_mod));
+                        auto plot_tile = [&](const View& view, FuncRenderOutput& tile_out) {
                         for (float sy = 0; sy < view.shigh; sy += INTERVAL) {
                             double y = _SY_TO_Y(sy);
                             for (float sx = 0; sx < view.swid; sx += INTERVAL) {
@@ -329,18 +577,25 @@ void Plotter::render(const View& view) {
                                 if (alpha > 0.) {
                                     color::color c = func.line_color;
                                     c.a = alpha;
-                                    buf_add_screen_rectangle(draw_buf, view, sx, sy,
-                                            INTERVAL, INTERVAL, true, c, 0.0f, funcid);
+                                    fill_screen_rectangle(tile_out.fills,
+                                            sx, sy, INTERVAL, INTERVAL, c);
                                 }
                             }
                         }
+                        };
+                        plot_tiled(funcid, view, scene_keys[funcid], plot_tile,
+                                func_outs[funcid]);
                     }
                 }
                 break;
             case Function::FUNC_TYPE_EXPLICIT:
-                plot_explicit(funcid, false); break;
+                plot_explicit(funcid, false, scene_keys[funcid],
+                        func_outs[funcid]);
+                break;
             case Function::FUNC_TYPE_EXPLICIT_Y:
-                plot_explicit(funcid, true); break;
+                plot_explicit(funcid, true, scene_keys[funcid],
+                        func_outs[funcid]);
+                break;
 
             // Geometry (other than polyline)
             case Function::FUNC_TYPE_GEOM_RECT:
@@ -353,10 +608,10 @@ void Plotter::render(const View& view) {
                     obj.type = DrawBufferObject::RECT;
                     obj.points.resize(2);
                     auto& a = obj.points[0], &b = obj.points[1];
-                    a[0] = func.exprs[0](env);
-                    a[1] = func.exprs[1](env);
-                    b[0] = func.exprs[2](env);
-                    b[1] = func.exprs[3](env);
+                    a[0] = func.exprs[0](ctx);
+                    a[1] = func.exprs[1](ctx);
+                    b[0] = func.exprs[2](ctx);
+                    b[1] = func.exprs[3](ctx);
                     if (b[0] < a[0]) std::swap(a[0], b[0]);
                     if (b[1] < a[1]) std::swap(a[1], b[1]);
                     if (func.type & Function::FUNC_TYPE_MOD_FILLED) {
@@ -382,11 +637,11 @@ void Plotter::render(const View& view) {
                     obj.type = is_ellipse ? DrawBufferObject::ELLIPSE : DrawBufferObject::CIRCLE;
                     obj.points.resize(2);
                     auto& a = obj.points[0], &right = obj.points[1];
-                    a[0] = func.exprs[0](env);
-                    a[1] = func.exprs[1](env);
-                    right[0] = a[0] + func.exprs[2](env);
+                    a[0] = func.exprs[0](ctx);
+                    a[1] = func.exprs[1](ctx);
+                    right[0] = a[0] + func.exprs[2](ctx);
                     right[1] = a[1];
-                    if (is_ellipse) right[1] += func.exprs[3](env);
+                    if (is_ellipse) right[1] += func.exprs[3](ctx);
                     if (func.type & Function::FUNC_TYPE_MOD_FILLED) {
                         DrawBufferObject obj2 = obj;
                         obj2.type = is_ellipse ? DrawBufferObject::FILLED_ELLIPSE :
@@ -406,16 +661,63 @@ void Plotter::render(const View& view) {
                     obj.rel_func = funcid;
                     obj.c = func.line_color;
                     obj.type = DrawBufferObject::TEXT;
-                    obj.points = { { func.exprs[0](env), func.exprs[1](env) } };
+                    obj.points = { { func.exprs[0](ctx), func.exprs[1](ctx) } };
                     obj.str = func.str;
                     draw_buf.push_back(std::move(obj));
                 }
                 break;
             case Function::FUNC_TYPE_FRACTAL_MANDELBROT:
-                {
-                }
-                break;
+                plot_fractal(funcid, func_outs[funcid]); break;
         }
+    };
+    {
+        ThreadPool::TaskGroup group(thread_pool);
+        for (size_t funcid : funcs_to_render) {
+            group.run([&render_func, funcid]() { render_func(funcid); });
+        }
+        group.wait();
+    }
+    if (render_cancelled()) {
+        // Output is partial, keep previous bitmap and do not cache
+        render_complete = false;
+        return;
+    }
+    for (size_t funcid : funcs_to_render) {
+        render_cache[funcid].out = func_outs[funcid];
+        render_cache[funcid].valid = true;
+    }
+    // Rasterize inequality regions and fractals, in function order; regions of the
+    // current function are highlighted (as draw() does for shapes)
+    std::vector<RasterLayer> layers;
+    size_t layer_func = 0;
+    for (size_t funcid = 0; funcid < funcs.size(); ++funcid) {
+        auto& fills = func_outs[funcid].fills;
+        if (fills.empty() && func_outs[funcid].raster.empty()) continue;
+        if (funcid == curr_func) {
+            for (auto& rect : fills) {
+                if (rect.c.a <= .8f) rect.c.a += .2f;
+            }
+        }
+        layers.push_back(RasterLayer{&func_outs[funcid].raster, &fills});
+        layer_func = funcid;
+    }
+    bg_bitmap_view = view;
+    if (layers.size() == 1 && layers[0].fills->empty()) {
+        // Single raster (e.g. a fractal), use as is
+        bg_bitmap.swap(func_outs[layer_func].raster);
+    } else if (layers.size()) {
+        rasterize_layers(bg_bitmap, view.swid, view.shigh, layers, thread_pool);
+    } else {
+        bg_bitmap.clear();
+    }
+    for (auto& out : func_outs) {
+        draw_buf.insert(draw_buf.end(),
+                std::make_move_iterator(out.draw_buf.begin()),
+                std::make_move_iterator(out.draw_buf.end()));
+        pt_markers.insert(pt_markers.end(),
+                std::make_move_iterator(out.pt_markers.begin()),
+                std::make_move_iterator(out.pt_markers.end()));
+        if (out.loss_detail) loss_detail = true;
     }
     // PROFILE(all);
     if (loss_detail) {
@@ -429,6 +731,240 @@ void Plotter::render() {
     render(view);
 }
 
+void Plotter::get_render_inputs(size_t funcid, std::string& key,
+        std::vector<uint64_t>& var_addrs) const {
+    const auto& func = funcs[funcid];
+    const int ftype_nomod = func.type & ~Function::FUNC_TYPE_MOD_ALL;
+    std::ostringstream os;
+    util::write_bin(os, render_coarse);
+    // Functions whose expressions are read
+    std::vector<size_t> funcids{ funcid };
+    if (ftype_nomod == Function::FUNC_TYPE_EXPLICIT ||
+            ftype_nomod == Function::FUNC_TYPE_EXPLICIT_Y) {
+        // Which critical points/intersections plot_explicit looks for
+        const bool find_all_crit_pts = funcs.size() <= max_functions_find_all_crit_points
+                                         || funcid == curr_func;
+        const bool find_crit_pts = funcs.size() <= max_functions_find_crit_points;
+        util::write_bin(os, find_all_crit_pts);
+        util::write_bin(os, find_crit_pts);
+        if (func.differentiable && find_crit_pts && find_all_crit_pts) {
+            const size_t n_funcs2 = funcs.size() <= max_functions_find_all_crit_points ?
+                funcid : funcs.size();
+            for (size_t funcid2 = 0; funcid2 < n_funcs2; ++funcid2) {
+                if (funcs[funcid2].differentiable) funcids.push_back(funcid2);
+            }
+        }
+    } else if (ftype_nomod == Function::FUNC_TYPE_IMPLICIT) {
+        // Pixel limits depend on the number of threads
+        util::write_bin(os, implicit_adaptive);
+        util::write_bin(os, thread_pool.concurrency());
+    }
+
+    // Collect variables and user functions referenced
+    std::vector<uint64_t> stk;
+    auto add_refs = [&](const Expr& expr) {
+        for (const auto& nd : expr.ast) {
+            if (nd.opcode == OpCode::call) {
+                stk.push_back(nd.call_info[0]);
+            } else if (OpCode::has_ref(nd.opcode) && nd.opcode != OpCode::arg) {
+                var_addrs.push_back(nd.ref);
+            }
+        }
+    };
+    for (size_t id : funcids) {
+        const auto& f = funcs[id];
+        f.to_bin(os);
+        add_refs(f.expr);
+        for (const auto& expr : f.exprs) add_refs(expr);
+    }
+    // User functions called, directly or indirectly
+    std::vector<bool> visited(env.funcs.size());
+    while (stk.size()) {
+        uint64_t fid = stk.back(); stk.pop_back();
+        if (fid >= env.funcs.size() || visited[fid]) continue;
+        visited[fid] = true;
+        const auto& user_func = env.funcs[fid];
+        util::write_bin(os, fid);
+        util::write_bin(os, user_func.n_args);
+        user_func.expr.to_bin(os);
+        add_refs(user_func.expr);
+        stk.insert(stk.end(), user_func.deps.begin(), user_func.deps.end());
+    }
+    std::sort(var_addrs.begin(), var_addrs.end());
+    var_addrs.resize(std::unique(var_addrs.begin(), var_addrs.end()) -
+                     var_addrs.begin());
+    key = os.str();
+}
+
+void Plotter::specialize_func(Function& func) {
+    // Inline small user functions, so that variables they read are folded
+    // too; variables other than x, y, t and sum/prod indices are constant
+    std::vector<Expr> exprs{ func.expr.inline_calls(env) };
+    for (const auto& expr : func.exprs) exprs.push_back(expr.inline_calls(env));
+    std::vector<uint64_t> var_addrs, index_addrs{ x_var, y_var, t_var };
+    for (const auto& expr : exprs) {
+        for (const auto& nd : expr.ast) {
+            if (nd.opcode == OpCode::ref) {
+                var_addrs.push_back(nd.ref);
+            } else if (nd.opcode == OpCode::sums || nd.opcode == OpCode::prods) {
+                index_addrs.push_back(nd.ref);
+            }
+        }
+    }
+    for (auto* addrs : { &var_addrs, &index_addrs }) {
+        std::sort(addrs->begin(), addrs->end());
+        addrs->resize(std::unique(addrs->begin(), addrs->end()) - addrs->begin());
+    }
+    std::vector<uint64_t> folded_addrs;
+    std::set_difference(var_addrs.begin(), var_addrs.end(),
+            index_addrs.begin(), index_addrs.end(),
+            std::back_inserter(folded_addrs));
+
+    std::ostringstream os;
+    for (const auto& expr : exprs) {
+        expr.to_bin(os);
+        for (const auto& fid_version : env.call_versions(expr)) {
+            util::write_bin(os, fid_version.first);
+            util::write_bin(os, fid_version.second);
+        }
+    }
+    for (uint64_t addr : folded_addrs) {
+        util::write_bin(os, addr);
+        util::write_bin(os, addr < env.vars.size() ? env.vars[addr] :
+                std::numeric_limits<double>::quiet_NaN());
+    }
+    std::string key = os.str();
+    if (key == func.frame_key && func.frame_expr.is_compiled(env)) return;
+
+    for (auto& expr : exprs) {
+        for (auto& nd : expr.ast) {
+            if (nd.opcode == OpCode::ref && std::binary_search(
+                        folded_addrs.begin(), folded_addrs.end(), nd.ref)) {
+                nd = Expr::ASTNode(nd.ref < env.vars.size() ? env.vars[nd.ref] :
+                        std::numeric_limits<double>::quiet_NaN());
+            }
+        }
+        expr.optimize();
+        expr.compile(&env);
+        expr.jit(&env);
+    }
+    func.frame_expr = std::move(exprs[0]);
+    func.frame_exprs.assign(exprs.begin() + 1, exprs.end());
+    func.frame_key = std::move(key);
+}
+
+void Plotter::plot_tiled(size_t funcid, const View& view,
+        const std::string& scene_key,
+        const std::function<void(const View&, FuncRenderOutput&)>& plot_tile,
+        FuncRenderOutput& out) {
+    // Side length of tiles in pixels (fill intervals 1.5, 4, 6, 8 divide it)
+    static const int TILE_SIZE = 48;
+    // Above this many tiles (or far from the origin), plot view directly
+    static const double MAX_TILES = 4096, MAX_TILE_INDEX = 1e12;
+
+    const double psx = (view.xmax - view.xmin) / view.swid,
+                 psy = (view.ymax - view.ymin) / view.shigh;
+    if (view.swid <= 0 || view.shigh <= 0 ||
+            !(psx > 0.) || !(psy > 0.) ||
+            !std::isfinite(psx) || !std::isfinite(psy)) {
+        plot_tile(view, out);
+        return;
+    }
+    // Zoom level and its (canonical) plot units per pixel
+    const int64_t lx = zoom_level(psx), ly = zoom_level(psy);
+    const double cpsx = zoom_level_scale(lx), cpsy = zoom_level_scale(ly);
+    const double tile_wid = TILE_SIZE * cpsx, tile_high = TILE_SIZE * cpsy;
+    // Tile (i, j) covers x in [i, i+1] * tile_wid, y in [-j-1, -j] * tile_high
+    const double i0 = std::floor(view.xmin / tile_wid),
+                 i1 = std::ceil(view.xmax / tile_wid) - 1,
+                 j0 = std::floor(-view.ymax / tile_high),
+                 j1 = std::ceil(-view.ymin / tile_high) - 1;
+    if (!(std::max(std::fabs(i0), std::fabs(i1)) < MAX_TILE_INDEX) ||
+        !(std::max(std::fabs(j0), std::fabs(j1)) < MAX_TILE_INDEX) ||
+        (i1 - i0 + 1) * (j1 - j0 + 1) > MAX_TILES) {
+        plot_tile(view, out);
+        return;
+    }
+    const int64_t n_cols = (int64_t)(i1 - i0) + 1, n_rows = (int64_t)(j1 - j0) + 1;
+
+    // Look up tiles, plotting the missing ones
+    std::vector<std::shared_ptr<const RenderTile> > tiles(n_cols * n_rows);
+    std::vector<std::string> tile_keys(tiles.size());
+    {
+        ThreadPool::TaskGroup group(thread_pool);
+        for (int64_t r = 0; r < n_rows; ++r) {
+            for (int64_t c = 0; c < n_cols; ++c) {
+                const size_t idx = r * n_cols + c;
+                const int64_t i = (int64_t)i0 + c, j = (int64_t)j0 + r;
+                std::ostringstream os;
+                util::write_bin(os, funcid);
+                util::write_bin(os, lx);
+                util::write_bin(os, ly);
+                util::write_bin(os, i);
+                util::write_bin(os, j);
+                tile_keys[idx] = scene_key + os.str();
+                tiles[idx] = tile_cache.get(tile_keys[idx]);
+                if (tiles[idx]) continue;
+                group.run([&, idx, i, j]() {
+                    if (render_cancelled()) return;
+                    View tile_view;
+                    tile_view.swid = tile_view.shigh = TILE_SIZE;
+                    tile_view.xmin = i * tile_wid;
+                    tile_view.xmax = (i + 1) * tile_wid;
+                    tile_view.ymax = -j * tile_high;
+                    tile_view.ymin = -(j + 1) * tile_high;
+                    FuncRenderOutput tile_out;
+                    plot_tile(tile_view, tile_out);
+                    if (render_cancelled()) return;  // Partial tile
+
+                    auto tile = std::make_shared<RenderTile>();
+                    size_t cost = sizeof(RenderTile) + tile_keys[idx].size();
+                    for (auto& rect : tile_out.fills) {
+                        // Clip to tile
+                        const float x0 = std::max(rect.x, 0.f),
+                                    y0 = std::max(rect.y, 0.f),
+                                    x1 = std::min(rect.x + rect.w, (float)TILE_SIZE),
+                                    y1 = std::min(rect.y + rect.h, (float)TILE_SIZE);
+                        if (x1 <= x0 || y1 <= y0) continue;
+                        tile->fills.push_back(FillRect{x0, y0, x1 - x0, y1 - y0, rect.c});
+                    }
+                    cost += tile->fills.size() * sizeof(FillRect);
+                    for (const auto& obj : tile_out.draw_buf) {
+                        cost += sizeof(DrawBufferObject) + obj.str.size() +
+                            obj.points.size() * sizeof(obj.points[0]);
+                    }
+                    tile->draw_buf = std::move(tile_out.draw_buf);
+                    tile->loss_detail = tile_out.loss_detail;
+                    tiles[idx] = tile;
+                    tile_cache.put(tile_keys[idx], std::move(tile), cost);
+                });
+            }
+        }
+        group.wait();
+    }
+    if (render_cancelled()) return;
+
+    // Compose tiles in view
+    const double scale_x = cpsx / psx, scale_y = cpsy / psy;
+    for (int64_t r = 0; r < n_rows; ++r) {
+        const double tile_sy = (view.ymax + (j0 + r) * tile_high) / psy;
+        for (int64_t c = 0; c < n_cols; ++c) {
+            const double tile_sx = ((i0 + c) * tile_wid - view.xmin) / psx;
+            const RenderTile& tile = *tiles[r * n_cols + c];
+            out.draw_buf.insert(out.draw_buf.end(),
+                    tile.draw_buf.begin(), tile.draw_buf.end());
+            for (const auto& rect : tile.fills) {
+                fill_screen_rectangle(out.fills,
+                        (float)(tile_sx + rect.x * scale_x),
+                        (float)(tile_sy + rect.y * scale_y),
+                        (float)(rect.w * scale_x), (float)(rect.h * scale_y),
+                        rect.c);
+            }
+            if (tile.loss_detail) out.loss_detail = true;
+        }
+    }
+}
+
 void Plotter::populate_grid() {
     const int r = marker_clickable_radius;
     grid.resize(view.swid * view.shigh);
@@ -533,15 +1069,23 @@ void Plotter::populate_grid() {
     bfs();
 }
 
-void Plotter::plot_implicit(size_t funcid) {
+void Plotter::plot_implicit(size_t funcid, const View& view,
+        FuncRenderOutput& out) {
     auto& func = funcs[funcid];
     // Implicit function
-    if (func.expr.is_null() ||
-            (func.expr.ast[0].opcode == OpCode::val &&
+    if (func.frame_expr.is_null() ||
+            (func.frame_expr.ast[0].opcode == OpCode::val &&
              func.type == Function::FUNC_TYPE_IMPLICIT)) {
         // Either 0=0 or c=0 for some c, do not draw
         return;
     }
+    if (implicit_adaptive) {
+        plot_implicit_adaptive(funcid, view, out);
+        return;
+    }
+    auto& draw_buf = out.draw_buf;
+    // Evaluation context for this function
+    EvalContext ctx(env);
 
     // Inequality color
     color::color ineq_color = get_ineq_color(func.line_color);
@@ -563,13 +1107,28 @@ void Plotter::plot_implicit(size_t funcid) {
     using Square = std::tuple<int, int, int, int, double>;
     std::vector<Square> interest_squares;
 
-    // Increase interval per x pixels
-    static const size_t HIGH_PIX_LIMIT =
-        std::max<size_t>(200000 / NUM_THREADS, 20000);
+    // Increase interval per x pixels (over all threads)
+    const size_t HIGH_PIX_LIMIT = std::max<size_t>(200000,
+            20000 * thread_pool.concurrency());
     // Maximum number of pixels to draw (stops drawing)
-    static const size_t MAX_PIXELS = 300000;
-    // Epsilon for bisection
-    static const double BISECTION_EPS = 1e-4;
+    const size_t MAX_PIXELS = 300000 * thread_pool.concurrency();
+
+    // Coarse grid columns: screen x, interval from previous column,
+    // plot x; each row is evaluated in one batch
+    std::vector<int> coarse_sxs, coarse_sxis;
+    std::vector<double> coarse_xs, coarse_zs;
+    for (int csx = -1; csx < view.swid + COARSE_INTERVAL - 1; csx += COARSE_INTERVAL) {
+        int cxi = COARSE_INTERVAL;
+        if (csx >= view.swid) {
+            csx = view.swid - 1;
+            cxi = (view.swid-1) % COARSE_INTERVAL;
+            if (cxi == 0) break;
+        }
+        coarse_sxs.push_back(csx);
+        coarse_sxis.push_back(cxi);
+        coarse_xs.push_back(_SX_TO_X(csx));
+    }
+    coarse_zs.resize(coarse_xs.size());
 
     for (int csy = -1; csy < view.shigh + COARSE_INTERVAL - 1; csy += COARSE_INTERVAL) {
         int cyi = COARSE_INTERVAL;
@@ -578,23 +1137,15 @@ void Plotter::plot_implicit(size_t funcid) {
             cyi = (view.shigh-1) % COARSE_INTERVAL;
             if (cyi == 0) break;
         }
+        if (render_cancelled()) return;
         const double cy = _SY_TO_Y(csy);
         coarse_right_interesting = false;
-        for (int csx = -1; csx < view.swid + COARSE_INTERVAL - 1; csx += COARSE_INTERVAL) {
-            int cxi = COARSE_INTERVAL;
-            if (csx >= view.swid) {
-                csx = view.swid - 1;
-                cxi = (view.swid-1) % COARSE_INTERVAL;
-                if (cxi == 0) break;
-            }
-            // Update interval based on point count
-            const double coarse_x = _SX_TO_X(csx);
-            double precise_x = coarse_x, precise_y = cy;
-            const int xy_pos = csy * view.swid + csx;
-
-            env.vars[y_var] = cy;
-            env.vars[x_var] = coarse_x;
-            double z = func.expr(env);
+        ctx.vars[y_var] = cy;
+        func.frame_expr.eval_batch(x_var, coarse_xs.data(), coarse_zs.data(),
+                coarse_xs.size(), ctx);
+        for (size_t ci = 0; ci < coarse_sxs.size(); ++ci) {
+            const int csx = coarse_sxs[ci], cxi = coarse_sxis[ci];
+            const double z = coarse_zs[ci];
             if (csx >= cxi-1 && csy >= cyi-1) {
                 bool interesting_square = false;
                 int sgn_z = (z < 0 ? -1 : z == 0 ? 0 : 1);
@@ -621,179 +1172,328 @@ void Plotter::plot_implicit(size_t funcid) {
                         func.type !=
                         Function::FUNC_TYPE_IMPLICIT) {
                     // Inequality region
-                    buf_add_screen_rectangle(draw_buf, view,
+                    fill_screen_rectangle(out.fills,
                             csx + (float)(- cxi + 1),
                             csy + (float)(- cyi + 1),
-                            (float)cxi, (float)cyi,
-                            true, ineq_color, 0.0, funcid);
+                            (float)cxi, (float)cyi, ineq_color);
                 }
             }
             coarse_line[csx+1] = z;
         }
     }
 
-#ifndef NIVALIS_EMSCRIPTEN
-    std::atomic<int> sqr_id(0);
-#else
-    int sqr_id(0);
-#endif
-    auto worker = [&]() {
+    // Interesting squares are processed in contiguous bands, one pool task
+    // per band; each band draws into its own buffers, which are merged in
+    // band order afterwards so the output does not depend on scheduling
+    struct Band {
+        ContourBuilder contour;
+        std::vector<std::array<int, 3> > draws_ineq;
+        bool lost_detail = false;
+    };
+    const size_t n_threads = thread_pool.concurrency();
+    const size_t band_size = std::max<size_t>(16,
+            interest_squares.size() / (8 * n_threads) + 1);
+    std::vector<Band> bands((interest_squares.size() + band_size - 1) / band_size);
+    // Number of pixels drawn over all bands, used to increase fine interval
+    std::atomic<size_t> pix_cnt(0);
+
+    auto worker = [&](size_t band_id) {
+        Band& band = bands[band_id];
         std::vector<double> line(view.swid + 2);
-        std::vector<bool> fine_paint_below(view.swid + 2);
-        std::vector<std::array<int, 3> > tdraws, tdraws_ineq;
-        std::vector<PointMarker> tpt_markers;
-        Environment tenv = env;
-        bool fine_paint_right;
-        // Number of pixels drawn, used to increase fine interval
-        size_t tpix_cnt = 0;
+        auto& tdraws_ineq = band.draws_ineq;
+        // Per-task evaluation context (no copy of the environment)
+        EvalContext tctx = EvalContext::fork(ctx);
+        std::vector<double> sqr_xs, sqr_ys, sqr_zs;
         // Fine interval (variable)
         int fine_interval = 1;
-        while (true) {
-            int i = sqr_id++;
-            if (i >= interest_squares.size()) break;
+        const size_t sqr_end = std::min(interest_squares.size(),
+                (band_id + 1) * band_size);
+        for (size_t i = band_id * band_size; i < sqr_end; ++i) {
             auto& sqr = interest_squares[i];
 
-            if (tpix_cnt > MAX_PIXELS) break;
-            // Update interval based on point count
-            fine_interval = static_cast<int>(tpix_cnt /
-                    HIGH_PIX_LIMIT) + 1;
-            if (fine_interval >= 3) fine_interval = 4;
+            if (render_cancelled()) break;
+            const size_t cnt = pix_cnt.load(std::memory_order_relaxed);
+            if (cnt > MAX_PIXELS) break;
+            if (render_coarse) {
+                // Preview: squares of the coarse grid only
+                fine_interval = COARSE_INTERVAL;
+            } else {
+                // Update interval based on point count
+                fine_interval = static_cast<int>(cnt / HIGH_PIX_LIMIT) + 1;
+                if (fine_interval >= 3) fine_interval = 4;
+                if (fine_interval > 1) band.lost_detail = true;
+            }
+            size_t sqr_pix_cnt = 0;
 
             int ylo, yhi, xlo, xhi; double z_at_xy_hi;
             std::tie(ylo, yhi, xlo, xhi, z_at_xy_hi) = sqr;
 
-            std::fill(fine_paint_below.begin() + (xlo + 1),
-                    fine_paint_below.begin() + (xhi + 2), false);
+            // Evaluate all points in square in one batch
+            sqr_xs.clear(); sqr_ys.clear();
             for (int sy = ylo; sy <= yhi; sy += fine_interval) {
-                fine_paint_right = false;
-                const double y = _SY_TO_Y(sy);
                 for (int sx = xlo; sx <= xhi; sx += fine_interval) {
-
-                    const double x = _SX_TO_X(sx);
-                    double z;
+                    sqr_xs.push_back(_SX_TO_X(sx));
+                    sqr_ys.push_back(_SY_TO_Y(sy));
+                }
+            }
+            sqr_zs.resize(sqr_xs.size());
+            func.frame_expr.eval_batch({x_var, y_var}, {sqr_xs.data(), sqr_ys.data()},
+                    sqr_zs.data(), sqr_zs.size(), tctx);
+            size_t sqr_pt_idx = 0;
+            for (int sy = ylo; sy <= yhi; sy += fine_interval) {
+                // Value above and to the left of the current point
+                double zup_left = 0.;
+                for (int sx = xlo; sx <= xhi; sx += fine_interval) {
+                    double z = sqr_zs[sqr_pt_idx++];
                     if (sy == yhi && sx == xhi) {
                         z = z_at_xy_hi;
-                    } else {
-                        tenv.vars[y_var] = y;
-                        tenv.vars[x_var] = x;
-                        z = func.expr(tenv);
                     }
+                    const double zup = line[sx+1];
                     if (sy > ylo && sx > xlo) {
-                        int sgn_z = (z < 0 ? -1 : z == 0 ? 0 : 1);
-                        bool paint_square = false;
-                        bool paint_from_left = fine_paint_right;
-                        bool paint_from_above = fine_paint_below[sx+1];
-                        fine_paint_right = fine_paint_below[sx+1] = false;
-                        double zup = line[sx+1];
-                        int sgn_zup = (zup < 0 ? -1 : zup == 0 ? 0 : 1);
-                        if (sgn_zup * sgn_z <= 0) {
-                            //     // Bisect up
-                            //     tenv.vars[x_var] = x;
-                            //     double lo = y;
-                            //     double hi = (view.shigh - (sy - fine_interval))*1. / view.shigh * ydiff + view.ymin;
-                            //     while (hi - lo > BISECTION_EPS) {
-                            //         double mi = (lo + hi) / 2;
-                            //         tenv.vars[y_var] = mi;
-                            //         double zmi = expr(tenv);
-                            //         int sgn_zmi = (zmi < 0 ? -1 : 1);
-                            //         if (sgn_z == sgn_zmi) lo = mi;
-                            //         else hi = mi;
-                            //     }
-                            //     precise_y = lo;
-                            paint_square = fine_paint_right = true;
-                        }
-                        double zleft = line[sx+1 - fine_interval];
-                        int sgn_zleft = (zleft < 0 ? -1 : zleft == 0 ? 0 : 1);
-                        if (sgn_zleft * sgn_z <= 0) {
-                            // if (!paint_square) {
-                            //     // Bisect left
-                            //     tenv.vars[y_var] = y;
-                            //     double lo = 1.*(sx - fine_interval) / view.swid * xdiff + view.xmin;
-                            //     double hi = x;
-                            //     while (hi - lo > BISECTION_EPS) {
-                            //         double mi = (lo + hi) / 2;
-                            //         tenv.vars[x_var] = mi;
-                            //         double zmi = expr(tenv);
-                            //         int sgn_zmi = (zmi < 0 ? -1 : 1);
-                            //         if (sgn_zleft == sgn_zmi) lo = mi;
-                            //         else hi = mi;
-                            //     }
-                            //     precise_x = lo;
-                            // }
-                            paint_square = fine_paint_below[sx+1] = true;
+                        // Cell with bottom-right corner at current point
+                        const double zleft = line[sx+1 - fine_interval];
+                        if (band.contour.add_cell(sx - fine_interval,
+                                    sy - fine_interval, fine_interval,
+                                    {zup_left, zup, zleft, z})) {
+                            ++sqr_pix_cnt;
                         }
-                        if (paint_square || paint_from_left || paint_from_above) {
-                            // float precise_sy =
-                            //     static_cast<float>(
-                            //             (view.ymax - y) / ydiff * view.shigh);
-                            // float precise_sx = static_cast<float>(
-                            //         (x - view.xmin) / xdiff * view.swid);
-                            tdraws.push_back({sx, sy, fine_interval});
-                            ++tpix_cnt;
-                        } else if (sgn_z >= 0 &&
-                                func.type !=
-                                Function::FUNC_TYPE_IMPLICIT) {
-                            // Inequality region
-                            tdraws_ineq.push_back({sx, sy, fine_interval});
+                        if (z >= 0 || std::isnan(z)) {
+                            if (func.type != Function::FUNC_TYPE_IMPLICIT) {
+                                // Inequality region
+                                tdraws_ineq.push_back({sx, sy, fine_interval});
+                            }
                         }
                     }
+                    zup_left = zup;
                     line[sx+1] = z;
                 }
             }
+            pix_cnt.fetch_add(sqr_pix_cnt, std::memory_order_relaxed);
         }
+    };
 
-        {
-#ifndef NIVALIS_EMSCRIPTEN
-            std::lock_guard<std::mutex> lock(mtx);
-#endif
-            if ((func.type & Function::FUNC_TYPE_MOD_INEQ_STRICT) == 0) {
-                // Draw function line (boundary)
-                for (auto& p : tdraws) {
-                    buf_add_screen_rectangle(draw_buf, view,
-                            p[0] + (float)(- p[2] + 1),
-                            p[1] + (float)(- p[2] + 1),
-                            (float)(p[2]),
-                            (float)(p[2]),
-                            true, func.line_color, 0.0, funcid);
-                }
+    {
+        ThreadPool::TaskGroup group(thread_pool);
+        for (size_t i = 0; i < bands.size(); ++i) {
+            group.run([&worker, i]() { worker(i); });
+        }
+        group.wait();
+    }
+    if (render_cancelled()) return;
+
+    ContourBuilder contour;
+    for (auto& band : bands) {
+        for (auto& p : band.draws_ineq) {
+            // Draw inequality region
+            fill_screen_rectangle(out.fills,
+                    p[0] + (float)(- p[2] + 1),
+                    p[1] + (float)(- p[2] + 1),
+                    (float)p[2],
+                    (float)p[2],
+                    ineq_color);
+        }
+        contour.append(band.contour);
+        // Show detail lost warning
+        if (band.lost_detail) out.loss_detail = true;
+    }
+    if ((func.type & Function::FUNC_TYPE_MOD_INEQ_STRICT) == 0) {
+        // Draw function line (boundary)
+        for (auto& line : contour.stitch()) {
+            buf_add_screen_polyline(draw_buf, view, line, func.line_color,
+                    funcid, 2.f);
+        }
+    }
+} // void plot_implicit
+
+void Plotter::plot_implicit_adaptive(size_t funcid, const View& view,
+        FuncRenderOutput& out) {
+    auto& func = funcs[funcid];
+    color::color ineq_color = get_ineq_color(func.line_color);
+    const bool is_ineq = func.type != Function::FUNC_TYPE_IMPLICIT;
+
+    // Side length of root cells, in pixels (power of 2)
+    static const int ROOT_SIZE = 8;
+    // A cell without sign change is still subdivided if the smallest
+    // absolute value at a corner is at most this times the difference
+    // between the largest and smallest values (curve may pass nearby)
+    static const double GRADIENT_FACTOR = 0.5;
+    // Increase leaf size per x pixels (over all threads)
+    const size_t HIGH_PIX_LIMIT = std::max<size_t>(200000,
+            20000 * thread_pool.concurrency());
+    // Maximum number of pixels to draw (stops drawing)
+    const size_t MAX_PIXELS = 300000 * thread_pool.concurrency();
+
+    const int n_cols = (view.swid + ROOT_SIZE - 1) / ROOT_SIZE;
+    const int n_rows = (view.shigh + ROOT_SIZE - 1) / ROOT_SIZE;
+    if (n_cols <= 0 || n_rows <= 0) return;
+
+    // Cell: screen x, y of top-left corner, side length,
+    // function values at corners (top-left, top-right,
+    // bottom-left, bottom-right)
+    struct Cell {
+        int sx, sy, size;
+        std::array<double, 4> z;
+    };
+
+    // Evaluate root grid corners, one batch per row
+    const int n_grid_cols = n_cols + 1;
+    std::vector<double> grid_xs(n_grid_cols), grid_zs(n_grid_cols * (n_rows + 1));
+    for (int c = 0; c < n_grid_cols; ++c) {
+        grid_xs[c] = _SX_TO_X(c * ROOT_SIZE);
+    }
+    thread_pool.parallel_for(n_rows + 1, 4, [&](size_t begin, size_t end) {
+        EvalContext ctx(env);
+        for (size_t r = begin; r < end; ++r) {
+            ctx.vars[y_var] = _SY_TO_Y(r * ROOT_SIZE);
+            func.frame_expr.eval_batch(x_var, grid_xs.data(),
+                    grid_zs.data() + r * n_grid_cols, n_grid_cols, ctx);
+        }
+    });
+
+    // Each row of root cells is refined in its own task, breadth-first so
+    // that the new points of each level are evaluated in one batch
+    struct Band {
+        ContourBuilder contour;
+        std::vector<std::array<int, 3> > draws_ineq;
+        bool lost_detail = false;
+    };
+    std::vector<Band> bands(n_rows);
+    // Number of pixels drawn over all bands, used to increase leaf size
+    std::atomic<size_t> pix_cnt(0);
+    auto sgn = [](double z) { return z < 0 ? -1 : z == 0 ? 0 : 1; };
+
+    auto worker = [&](int row) {
+        Band& band = bands[row];
+        EvalContext ctx(env);
+        std::vector<Cell> cells, next_cells;
+        std::vector<double> new_xs, new_ys, new_zs;
+        for (int c = 0; c < n_cols; ++c) {
+            const double* zrow = grid_zs.data() + row * n_grid_cols + c;
+            cells.push_back(Cell{c * ROOT_SIZE, row * ROOT_SIZE, ROOT_SIZE,
+                    {zrow[0], zrow[1], zrow[n_grid_cols], zrow[n_grid_cols + 1]}});
+        }
+        while (cells.size()) {
+            if (render_cancelled()) break;
+            const size_t cnt = pix_cnt.load(std::memory_order_relaxed);
+            if (cnt > MAX_PIXELS) {
+                band.lost_detail = true;
+                break;
             }
-            for (auto& p : tdraws_ineq) {
-                // Draw inequality region
-                buf_add_screen_rectangle(draw_buf, view,
-                        p[0] + (float)(- p[2] + 1),
-                        p[1] + (float)(- p[2] + 1),
-                        (float)p[2],
-                        (float)p[2],
-                        true,
-                        ineq_color, 0.0, funcid);
+            int leaf_size = 4;  // Preview if render_coarse
+            if (!render_coarse) {
+                // Update leaf size based on point count
+                leaf_size = static_cast<int>(cnt / HIGH_PIX_LIMIT) + 1;
+                if (leaf_size >= 3) leaf_size = 4;
+                if (leaf_size > 1) band.lost_detail = true;
             }
 
-            size_t sz = pt_markers.size();
-            pt_markers.resize(sz + tpt_markers.size());
-            std::move(tpt_markers.begin(), tpt_markers.end(),
-                    pt_markers.begin() + sz);
+            // Classify cells; leaves are drawn, others are split
+            size_t n_split = 0, cell_pix_cnt = 0;
+            for (auto& cell : cells) {
+                const auto& z = cell.z;
+                const int sgn_z = sgn(z[3]);
+                bool sign_change = false;
+                for (int i = 0; i < 3; ++i) {
+                    if (sgn(z[i]) * sgn_z <= 0) sign_change = true;
+                }
+                bool split = false;
+                if (cell.size > leaf_size) {
+                    split = sign_change;
+                    if (!split) {
+                        double zmin = std::numeric_limits<double>::infinity(),
+                               zmax = -zmin, absmin = zmin;
+                        for (double zi : z) {
+                            if (std::isnan(zi)) continue;
+                            zmin = std::min(zmin, zi);
+                            zmax = std::max(zmax, zi);
+                            absmin = std::min(absmin, std::fabs(zi));
+                        }
+                        split = zmax > zmin &&
+                                absmin <= GRADIENT_FACTOR * (zmax - zmin);
+                    }
+                }
+                if (split) {
+                    cells[n_split++] = cell;
+                    continue;
+                }
+                if (sign_change && band.contour.add_cell(cell.sx, cell.sy,
+                            cell.size, z)) {
+                    ++cell_pix_cnt;
+                }
+                if (sgn_z >= 0 && is_ineq) {
+                    // Inequality region
+                    band.draws_ineq.push_back({cell.sx, cell.sy, cell.size});
+                }
+            }
+            pix_cnt.fetch_add(cell_pix_cnt, std::memory_order_relaxed);
+            cells.resize(n_split);
 
-            // Show detail lost warning
-            if (fine_interval > 1) loss_detail = true;
+            // Evaluate edge midpoints and center of each cell to split
+            // (in order top, left, center, right, bottom)
+            new_xs.clear(); new_ys.clear();
+            for (auto& cell : cells) {
+                const int h = cell.size / 2;
+                const double xl = _SX_TO_X(cell.sx), xm = _SX_TO_X(cell.sx + h),
+                             xr = _SX_TO_X(cell.sx + cell.size);
+                const double yt = _SY_TO_Y(cell.sy), ym = _SY_TO_Y(cell.sy + h),
+                             yb = _SY_TO_Y(cell.sy + cell.size);
+                new_xs.insert(new_xs.end(), {xm, xl, xm, xr, xm});
+                new_ys.insert(new_ys.end(), {yt, ym, ym, ym, yb});
+            }
+            new_zs.resize(new_xs.size());
+            func.frame_expr.eval_batch({x_var, y_var}, {new_xs.data(), new_ys.data()},
+                    new_zs.data(), new_zs.size(), ctx);
+            next_cells.clear();
+            for (size_t i = 0; i < cells.size(); ++i) {
+                const auto& cell = cells[i];
+                const auto& z = cell.z;
+                const double* nz = new_zs.data() + 5 * i;
+                const int h = cell.size / 2;
+                next_cells.push_back(Cell{cell.sx, cell.sy, h,
+                        {z[0], nz[0], nz[1], nz[2]}});
+                next_cells.push_back(Cell{cell.sx + h, cell.sy, h,
+                        {nz[0], z[1], nz[2], nz[3]}});
+                next_cells.push_back(Cell{cell.sx, cell.sy + h, h,
+                        {nz[1], nz[2], z[2], nz[4]}});
+                next_cells.push_back(Cell{cell.sx + h, cell.sy + h, h,
+                        {nz[2], nz[3], nz[4], z[3]}});
+            }
+            cells.swap(next_cells);
         }
     };
 
-#ifndef NIVALIS_EMSCRIPTEN
-    if (NUM_THREADS <= 1) {
-        worker();
-    } else {
-        std::vector<std::thread> pool;
-        for (size_t i = 0; i < NUM_THREADS; ++i) {
-            pool.emplace_back(worker);
+    {
+        ThreadPool::TaskGroup group(thread_pool);
+        for (int row = 0; row < n_rows; ++row) {
+            group.run([&worker, row]() { worker(row); });
         }
-        for (size_t i = 0; i < pool.size(); ++i) pool[i].join();
+        group.wait();
     }
-#else
-    worker();
-#endif
-} // void plot_implicit
+    if (render_cancelled()) return;
+
+    auto& draw_buf = out.draw_buf;
+    ContourBuilder contour;
+    for (auto& band : bands) {
+        // Draw inequality region
+        for (auto& p : band.draws_ineq) {
+            fill_screen_rectangle(out.fills, (float)p[0], (float)p[1],
+                    (float)p[2], (float)p[2], ineq_color);
+        }
+        contour.append(band.contour);
+        // Show detail lost warning
+        if (band.lost_detail) out.loss_detail = true;
+    }
+    if ((func.type & Function::FUNC_TYPE_MOD_INEQ_STRICT) == 0) {
+        // Draw function line (boundary)
+        for (auto& line : contour.stitch()) {
+            buf_add_screen_polyline(draw_buf, view, line, func.line_color,
+                    funcid, 2.f);
+        }
+    }
+} // void plot_implicit_adaptive
 
-void Plotter::plot_explicit(size_t funcid, bool reverse_xy) {
+void Plotter::plot_explicit(size_t funcid, bool reverse_xy,
+        const std::string& scene_key, FuncRenderOutput& out) {
     const bool find_all_crit_pts = funcs.size() <= max_functions_find_all_crit_points
                                      || funcid == curr_func;
 
@@ -810,16 +1510,59 @@ void Plotter::plot_explicit(size_t funcid, bool reverse_xy) {
         var = y_var;
     }
     auto& func = funcs[funcid];
+    // Expression specialized for this render (specialize_func)
+    const Expr& expr = func.frame_expr;
     color::color ineq_color = get_ineq_color(func.line_color);
+    auto& draw_buf = out.draw_buf;
+    auto& pt_markers = out.pt_markers;
+    // Evaluation context for this function
+    EvalContext ctx(env);
+    if (!(xdiff > 0.) || !std::isfinite(xdiff)) return;
 
+    // Function samples and Newton's method seeds are at points of a
+    // lattice fixed in plot coordinates for the zoom level, so that
+    // results at points still visible after a pan are reused from
+    // explicit_cache; tolerances use the scale of the zoom level
+    const int64_t zoom_x = zoom_level(xdiff / swid),
+                  zoom_y = zoom_level(ydiff / shigh);
+    const double lattice_xdiff = zoom_level_scale(zoom_x) * swid,
+                 lattice_ydiff = zoom_level_scale(zoom_y) * shigh;
+    // Spacing of samples (0.2 pixel, 1 pixel for preview) and seeds (4 pixels)
+    const double SAMPLE_STEP = lattice_xdiff / swid * (render_coarse ? 1. : 0.2);
+    const int64_t SAMPLES_PER_SEED = 20;
+    // Lattice points are origin + k * SAMPLE_STEP; far from 0, lattice
+    // indices would lose precision, so use the view instead
+    double lattice_origin = 0.;
+    if (!(std::max(std::fabs(xmin), std::fabs(xmax)) < SAMPLE_STEP * 1e12)) {
+        lattice_origin = xmin;
+    }
+    // (previews are not cached)
+    ExplicitSampleCache preview_cache;
+    auto& cache = render_coarse ? preview_cache : explicit_cache[funcid];
+    {
+        std::ostringstream os;
+        util::write_bin(os, zoom_x);
+        util::write_bin(os, zoom_y);
+        util::write_bin(os, swid);
+        util::write_bin(os, shigh);
+        util::write_bin(os, lattice_origin);
+        std::string key = scene_key + os.str();
+        if (key != cache.key) {
+            cache = ExplicitSampleCache();
+            cache.key = std::move(key);
+        }
+    }
+    auto lattice_x = [&](int64_t k) {
+        return lattice_origin + k * SAMPLE_STEP;
+    };
 
     // Constants
     // Newton's method parameters
-    const double EPS_STEP  = 1e-7 * xdiff;
-    const double EPS_ABS   = 1e-10 * ydiff;
+    const double EPS_STEP  = 1e-7 * lattice_xdiff;
+    const double EPS_ABS   = 1e-10 * lattice_ydiff;
     static const int MAX_ITER  = 100;
     // Shorthand for Newton's method arguments
-#define NEWTON_ARGS var, x, env, EPS_STEP, EPS_ABS, MAX_ITER, \
+#define NEWTON_ARGS(ctx) var, x, ctx, EPS_STEP, EPS_ABS, MAX_ITER, \
     xmin - NEWTON_SIDE_ALLOW, xmax + NEWTON_SIDE_ALLOW
     // Amount x-coordinate is allowed to exceed the display boundaries
     const double NEWTON_SIDE_ALLOW = xdiff / 20.;
@@ -827,7 +1570,7 @@ void Plotter::plot_explicit(size_t funcid, bool reverse_xy) {
 
     // x-epsilon for domain bisection
     // (finding cutoff where function becomes undefined)
-    const double DOMAIN_BISECTION_EPS = 1e-9 * xdiff;
+    const double DOMAIN_BISECTION_EPS = 1e-9 * lattice_xdiff;
 
     // Asymptote check constants:
     // Assume asymptote at discontinuity if slope between
@@ -847,7 +1590,7 @@ void Plotter::plot_explicit(size_t funcid, bool reverse_xy) {
     // Minimum x-distance between critical points
     const double MIN_DIST_BETWEEN_ROOTS  = 1e-7 * xdiff;
 
-    env.vars[y_var] = std::numeric_limits<double>::quiet_NaN();
+    ctx.vars[y_var] = std::numeric_limits<double>::quiet_NaN();
     // Discontinuity/root/extremum type enum
     enum {
         DISCONT_ASYMPT = 0, // asymptote (in middle of domain, e.g. 0 of 1/x)
@@ -926,84 +1669,277 @@ void Plotter::plot_explicit(size_t funcid, bool reverse_xy) {
         if (func.type & Function::FUNC_TYPE_MOD_INEQ) {
             if (func.type & Function::FUNC_TYPE_MOD_INEQ_LESS) {
                 if (reverse_xy) {
-                    buf_add_screen_rectangle(draw_buf, view,
-                            0, psy, sx, sy - psy, true, ineq_color, 0.0f, funcid);
+                    fill_screen_rectangle(out.fills,
+                            0, psy, sx, sy - psy, ineq_color);
                 } else {
-                    buf_add_screen_rectangle(draw_buf, view,
-                            psx, sy, sx - psx, view.shigh - sy, true, ineq_color,
-                            0.0f, funcid);
+                    fill_screen_rectangle(out.fills,
+                            psx, sy, sx - psx, view.shigh - sy, ineq_color);
                 }
             } else {
                 if (reverse_xy) {
-                    buf_add_screen_rectangle(draw_buf, view,
-                            psx, psy, view.swid - psx, sy - psy, true, ineq_color,
-                            0.0f, funcid);
+                    fill_screen_rectangle(out.fills,
+                            psx, psy, view.swid - psx, sy - psy, ineq_color);
                 } else {
-                    buf_add_screen_rectangle(draw_buf, view,
-                            psx, 0, sx - psx, sy, true, ineq_color, 0.0f,
-                            funcid);
+                    fill_screen_rectangle(out.fills,
+                            psx, 0, sx - psx, sy, ineq_color);
                 }
             }
         }
     };
+    // Polynomial or rational function of var: evaluated from its
+    // coefficients (Horner's method), with roots, poles and extrema
+    // found by Sturm sequences instead of Newton's method
+    RationalFunction rational;
+    const bool is_rational = to_rational(expr, var, ctx, rational);
+    auto eval_batch = [&](const double* xs, double* ys, size_t n,
+            EvalContext& tctx) {
+        if (is_rational) rational.eval_batch(xs, ys, n);
+        else expr.eval_batch(var, xs, ys, n, tctx);
+    };
+
+    // Evaluate function at lattice points in view not already in cache
+    std::vector<std::pair<int64_t, int64_t> > missing;
+    move_lattice_window(cache.sample_begin, cache.sample_ys,
+            static_cast<int64_t>(std::ceil((xmin - lattice_origin) / SAMPLE_STEP)),
+            static_cast<int64_t>(std::floor((xmax - lattice_origin) / SAMPLE_STEP)) + 1,
+            missing);
+    for (const auto& range : missing) {
+        const size_t n_samples = range.second - range.first;
+        thread_pool.parallel_for(n_samples,
+                std::max<size_t>(256, n_samples / (4 * thread_pool.concurrency())),
+                [&](size_t begin, size_t end) {
+            if (render_cancelled()) return;
+            EvalContext tctx = EvalContext::fork(ctx);
+            std::vector<double> sample_xs(end - begin);
+            for (size_t i = begin; i < end; ++i) {
+                sample_xs[i - begin] = lattice_x(range.first + static_cast<int64_t>(i));
+            }
+            eval_batch(sample_xs.data(),
+                    cache.sample_ys.data() + (range.first - cache.sample_begin + begin),
+                    sample_xs.size(), tctx);
+        });
+    }
+
     // ** Find roots, asymptotes, extrema
-    if (!func.diff.is_null() && funcs.size() <= max_functions_find_crit_points) {
-        double prev_x, prev_y = 0.;
-        for (int sx = 0; sx < swid; sx += 4) {
-            const double x = reverse_xy ? _SY_TO_Y(sx) : _SX_TO_X(sx);
-            env.vars[var] = x;
-            double y = func.expr(env);
-            const bool is_y_nan = std::isnan(y);
-
-            if (!is_y_nan) {
-                env.vars[var] = x;
-                double dy = func.diff(env);
-                if (!std::isnan(dy)) {
-                    if (find_all_crit_pts) {
-                        double root = func.expr.newton(NEWTON_ARGS, &func.diff, y, dy);
-                        push_critpt_if_valid(root, ROOT, roots_and_extrema);
-                    }
-                    double asymp = func.recip.newton(NEWTON_ARGS,
-                            &func.drecip, 1. / y, -dy / (y*y));
-                    push_critpt_if_valid(asymp, DISCONT_ASYMPT, discont);
-
-                    if (find_all_crit_pts) {
-                        env.vars[var] = x;
-                        double ddy = func.ddiff(env);
-                        if (!std::isnan(ddy)) {
-                            double extr = func.diff.newton(NEWTON_ARGS,
-                                    &func.ddiff, dy, ddy);
-                            push_critpt_if_valid(extr, EXTREMUM, roots_and_extrema);
+    if (is_rational && funcs.size() <= max_functions_find_crit_points &&
+            !render_coarse) {
+        // All real roots in view; zeros shared by the numerator and
+        // denominator are holes, and are neither roots nor poles
+        const Polynomial& num = rational.num;
+        const Polynomial& den = rational.den;
+        auto is_zero_at = [](const Polynomial& p, double x) {
+            double bound = 0.;
+            for (size_t i = p.coeffs.size(); i-- > 0; ) {
+                bound = bound * std::fabs(x) + std::fabs(p.coeffs[i]);
+            }
+            return std::fabs(p(x)) <= 1e-9 * bound;
+        };
+        for (double x : den.real_roots(xmin, xmax, EPS_STEP)) {
+            if (!is_zero_at(num, x)) {
+                push_critpt_if_valid(x, DISCONT_ASYMPT, discont);
+            }
+        }
+        if (find_all_crit_pts) {
+            for (double x : num.real_roots(xmin, xmax, EPS_STEP)) {
+                if (!is_zero_at(den, x)) {
+                    push_critpt_if_valid(x, ROOT, roots_and_extrema);
+                }
+            }
+            // Extrema: zeros of the numerator of the derivative
+            const Polynomial dnum = rational.is_polynomial() ? num.diff() :
+                num.diff() * den - num * den.diff();
+            for (double x : dnum.real_roots(xmin, xmax, EPS_STEP)) {
+                if (!is_zero_at(den, x)) {
+                    push_critpt_if_valid(x, EXTREMUM, roots_and_extrema);
+                }
+            }
+        }
+    } else if (func.differentiable && funcs.size() <= max_functions_find_crit_points &&
+            !render_coarse) {
+        // Evaluate function and its first two derivatives at each seed
+        // point, in one pass (forward-mode AD); the same jets seed Newton's
+        // method for roots, asymptotes (roots of 1/f, whose jet follows
+        // from that of f) and extrema (roots of f').
+        // Newton's method is confined to a window around the seed as wide
+        // as the view on each side, so results do not depend on the view
+        const double SEED_STEP = SAMPLE_STEP * SAMPLES_PER_SEED;
+        const double NEWTON_RANGE = lattice_xdiff + lattice_xdiff / 20.;
+        move_lattice_window(cache.seed_begin, cache.seeds,
+                static_cast<int64_t>(std::ceil((xmin - lattice_origin) / SEED_STEP)),
+                static_cast<int64_t>(std::floor((xmax - lattice_origin) / SEED_STEP)) + 1,
+                missing);
+        auto seed_x = [&](int64_t k) {
+            return lattice_x(k * SAMPLES_PER_SEED);
+        };
+        const double NaN = std::numeric_limits<double>::quiet_NaN();
+        for (const auto& range : missing) {
+            const size_t n_seeds = range.second - range.first;
+            thread_pool.parallel_for(n_seeds,
+                    std::max<size_t>(8, n_seeds / (4 * thread_pool.concurrency())),
+                    [&](size_t begin, size_t end) {
+                EvalContext tctx = EvalContext::fork(ctx);
+                for (size_t i = begin; i < end; ++i) {
+                    if (render_cancelled()) return;
+                    const double x = seed_x(range.first + static_cast<int64_t>(i));
+                    const Expr::Jet jet = expr.eval_jet(var, x, tctx);
+                    const double y = jet.val, dy = jet.diff;
+                    double root = NaN, asymp = NaN, extr = NaN;
+                    const double lo = x - NEWTON_RANGE, hi = x + NEWTON_RANGE;
+                    if (!std::isnan(y) && !std::isnan(dy)) {
+                        if (find_all_crit_pts) {
+                            root = expr.newton_jet(var, x, tctx, EPS_STEP, EPS_ABS,
+                                    MAX_ITER, lo, hi, 0, &jet);
+                        }
+                        asymp = expr.newton_jet(var, x, tctx, EPS_STEP, EPS_ABS,
+                                MAX_ITER, lo, hi, -1, &jet);
+                        if (find_all_crit_pts && !std::isnan(jet.ddiff)) {
+                            extr = expr.newton_jet(var, x, tctx, EPS_STEP, EPS_ABS,
+                                    MAX_ITER, lo, hi, 1, &jet);
                         }
                     }
+                    auto& seed = cache.seeds[range.first - cache.seed_begin + i];
+                    seed.y = y; seed.root = root; seed.asymp = asymp; seed.extr = extr;
+                    seed.has_domain = false;
                 }
-            }
-            if (sx) {
-                const bool is_prev_y_nan = std::isnan(prev_y);
-                if (is_y_nan != is_prev_y_nan) {
+            });
+        }
+        // Collect results in seed order
+        for (size_t i = 0; i < cache.seeds.size(); ++i) {
+            auto& seed = cache.seeds[i];
+            push_critpt_if_valid(seed.root, ROOT, roots_and_extrema);
+            push_critpt_if_valid(seed.asymp, DISCONT_ASYMPT, discont);
+            push_critpt_if_valid(seed.extr, EXTREMUM, roots_and_extrema);
+            if (i == 0) continue;
+            if (!seed.has_domain) {
+                seed.domain = NaN;
+                seed.has_domain = true;
+                const bool is_prev_y_nan = std::isnan(cache.seeds[i - 1].y);
+                if (std::isnan(seed.y) != is_prev_y_nan) {
                     // Search for cutoff via bisection
-                    double lo = prev_x, hi = x;
+                    double lo = seed_x(cache.seed_begin + static_cast<int64_t>(i) - 1),
+                           hi = seed_x(cache.seed_begin + static_cast<int64_t>(i));
                     while (hi - lo > DOMAIN_BISECTION_EPS) {
                         double mi = (lo + hi) * 0.5;
-                        env.vars[var] = mi; double mi_y = func.expr(env);
+                        ctx.vars[var] = mi; double mi_y = expr(ctx);
                         if (std::isnan(mi_y) == is_prev_y_nan) {
                             lo = mi;
                         } else {
                             hi = mi;
                         }
                     }
-                    double boundary_x_not_nan_side = is_prev_y_nan ? hi : lo;
-                    push_critpt_if_valid(boundary_x_not_nan_side,
-                            DISCONT_DOMAIN, discont);
+                    seed.domain = is_prev_y_nan ? hi : lo;
                 }
             }
-            prev_x = x; prev_y = y;
+            push_critpt_if_valid(seed.domain, DISCONT_DOMAIN, discont);
         }
     }
+    if (render_cancelled()) {
+        // Samples/seeds may be missing
+        cache.key.clear();
+        return;
+    }
     // Add screen edges to discontinuities list for convenience
     discont.emplace(xmin, DISCONT_SCREEN);
     discont.emplace(xmax, DISCONT_SCREEN);
 
+    // Screen positions of discontinuities
+    std::vector<float> discont_sxs;
+    for (const auto& discontinuity : discont) {
+        discont_sxs.push_back(reverse_xy ? _Y_TO_SY(discontinuity.first) :
+                                           _X_TO_SX(discontinuity.first));
+    }
+    // Sample screen positions and function values for the segment
+    // ending at each discontinuity: lattice points, plus points just
+    // inside the ends and (finer) near discontinuities, evaluated in
+    // parallel over segments
+    std::vector<std::vector<float> > seg_sxs(discont.size());
+    std::vector<std::vector<double> > seg_ys(discont.size());
+    {
+        auto to_sx = [&](double x) -> float {
+            return reverse_xy ? _Y_TO_SY(x) : _X_TO_SX(x);
+        };
+        std::vector<double> discont_xs;
+        for (const auto& discontinuity : discont) {
+            discont_xs.push_back(discontinuity.first);
+        }
+        const bool refine = discont.size() > 2 && discont.size() < 100;
+        ThreadPool::TaskGroup group(thread_pool);
+        for (size_t as_idx = 1; as_idx < discont.size(); ++as_idx) {
+            group.run([&, as_idx]() {
+                if (render_cancelled()) return;
+                float sx_begin = discont_sxs[as_idx - 1],
+                      sx_end = discont_sxs[as_idx];
+                if (reverse_xy) std::swap(sx_begin, sx_end);
+                // Screen positions nearer to an inner discontinuity than this
+                // are sampled twice as finely
+                const float near_begin = reverse_xy ?
+                    (as_idx < discont.size() - 1 ? sx_begin + 1.f : -1.f) :
+                    (as_idx > 1 ? sx_begin + 1.f : -1.f);
+                const float near_end = reverse_xy ?
+                    (as_idx > 1 ? sx_end - 1.f : 1e30f) :
+                    (as_idx < discont.size() - 1 ? sx_end - 1.f : 1e30f);
+                const float sx_lo = sx_begin + DISCONTINUITY_EPS,
+                            sx_hi = sx_end - DISCONTINUITY_EPS;
+                if (!(sx_lo < sx_hi)) return;
+
+                // Lattice points in segment, in screen order
+                int64_t k_begin = static_cast<int64_t>(
+                        std::ceil((discont_xs[as_idx - 1] - lattice_origin) / SAMPLE_STEP));
+                int64_t k_end = static_cast<int64_t>(
+                        std::floor((discont_xs[as_idx] - lattice_origin) / SAMPLE_STEP)) + 1;
+                k_begin = std::max(k_begin, cache.sample_begin);
+                k_end = std::min<int64_t>(k_end,
+                        cache.sample_begin + cache.sample_ys.size());
+                std::vector<int64_t> ks;
+                for (int64_t k = k_begin; k < k_end; ++k) {
+                    const float sx = to_sx(lattice_x(k));
+                    if (sx > sx_lo && sx < sx_hi) ks.push_back(k);
+                }
+                if (reverse_xy) std::reverse(ks.begin(), ks.end());
+
+                // Points (screen position, plot position, lattice index
+                // or -1 if not a lattice point)
+                struct Sample { float sx; double x; int64_t k; };
+                std::vector<Sample> samples;
+                auto add_sample = [&](float sx, double x, int64_t k) {
+                    if (samples.size() && refine &&
+                            (sx < near_begin || samples.back().sx > near_end)) {
+                        // Midpoint near discontinuity
+                        const double mid_x = (samples.back().x + x) * 0.5;
+                        const float mid_sx = to_sx(mid_x);
+                        if (mid_sx > samples.back().sx && mid_sx < sx) {
+                            samples.push_back(Sample{mid_sx, mid_x, -1});
+                        }
+                    }
+                    samples.push_back(Sample{sx, x, k});
+                };
+                add_sample(sx_lo, reverse_xy ? _SY_TO_Y(sx_lo) : _SX_TO_X(sx_lo), -1);
+                for (int64_t k : ks) add_sample(to_sx(lattice_x(k)), lattice_x(k), k);
+                add_sample(sx_hi, reverse_xy ? _SY_TO_Y(sx_hi) : _SX_TO_X(sx_hi), -1);
+
+                // Evaluate points not on the lattice in one batch
+                std::vector<double> extra_xs, extra_ys;
+                for (const auto& sample : samples) {
+                    if (sample.k < 0) extra_xs.push_back(sample.x);
+                }
+                extra_ys.resize(extra_xs.size());
+                EvalContext tctx = EvalContext::fork(ctx);
+                eval_batch(extra_xs.data(), extra_ys.data(),
+                        extra_xs.size(), tctx);
+                auto& sample_sxs = seg_sxs[as_idx];
+                auto& sample_ys = seg_ys[as_idx];
+                size_t extra_idx = 0;
+                for (const auto& sample : samples) {
+                    sample_sxs.push_back(sample.sx);
+                    sample_ys.push_back(sample.k < 0 ? extra_ys[extra_idx++] :
+                            cache.sample_ys[sample.k - cache.sample_begin]);
+                }
+            });
+        }
+        group.wait();
+    }
+    if (render_cancelled()) return;
+
     // Previous discontinuity infop
     double prev_discont_x = xmin;
     float prev_discont_sx;
@@ -1015,7 +1951,7 @@ void Plotter::plot_explicit(size_t funcid, bool reverse_xy) {
         float psx = -1.f, psy = -1.f;
         double discont_x = discontinuity.first;
         int discont_type = discontinuity.second;
-        float discont_sx = reverse_xy ? _Y_TO_SY(discont_x) : _X_TO_SX(discont_x);
+        float discont_sx = discont_sxs[as_idx];
 
         if (as_idx > 0) {
             bool connector = prev_discont_type != DISCONT_SCREEN;
@@ -1025,11 +1961,12 @@ void Plotter::plot_explicit(size_t funcid, bool reverse_xy) {
                 std::swap(sx_begin, sx_end);
                 std::swap(x_begin, x_end);
             }
+            const auto& sample_sxs = seg_sxs[as_idx];
+            const auto& sample_ys = seg_ys[as_idx];
             // Draw func between asymptotes
-            for (float sxd = sx_begin + DISCONTINUITY_EPS; sxd < sx_end - DISCONTINUITY_EPS;) {
-                const double x = reverse_xy ? _SY_TO_Y(sxd) : _SX_TO_X(sxd);
-                env.vars[var] = x;
-                double y = func.expr(env);
+            for (size_t si = 0; si < sample_sxs.size(); ++si) {
+                const float sxd = sample_sxs[si];
+                double y = sample_ys[si];
 
                 if (!std::isnan(y)) {
                     if (y > ymax + ydiff) y = ymax + ydiff;
@@ -1039,10 +1976,10 @@ void Plotter::plot_explicit(size_t funcid, bool reverse_xy) {
                         // Check if asymptote at previous position;
                         // if so then connect it
                         connector = false;
-                        env.vars[var] = x_begin + ASYMPTOTE_CHECK_DELTA1;
-                        double yp = func.expr(env);
-                        env.vars[var] = x_begin + ASYMPTOTE_CHECK_DELTA2;
-                        double yp2 = func.expr(env);
+                        ctx.vars[var] = x_begin + ASYMPTOTE_CHECK_DELTA1;
+                        double yp = expr(ctx);
+                        ctx.vars[var] = x_begin + ASYMPTOTE_CHECK_DELTA2;
+                        double yp2 = expr(ctx);
                         double eps = discont_type == DISCONT_ASYMPT ?
                             ASYMPTOTE_CHECK_EPS:
                             ASYMPTOTE_CHECK_BOUNDARY_EPS;
@@ -1060,23 +1997,13 @@ void Plotter::plot_explicit(size_t funcid, bool reverse_xy) {
                 } else {
                     psx = -1;
                 }
-                if (discont.size() > 2 && discont.size() < 100) {
-                    if ((as_idx > 1 && sxd - prev_discont_sx < 1.) ||
-                            (as_idx < discont.size() - 1 && discont_sx - sxd < 1.)) {
-                        sxd += 0.1f;
-                    } else {
-                        sxd += 0.2f;
-                    }
-                } else {
-                    sxd += 0.2f;
-                }
             }
             // Connect next asymptote
             if (discont_type != DISCONT_SCREEN) {
-                env.vars[var] = x_end - ASYMPTOTE_CHECK_DELTA1;
-                double yp = func.expr(env);
-                env.vars[var] = x_end - ASYMPTOTE_CHECK_DELTA2;
-                double yp2 = func.expr(env);
+                ctx.vars[var] = x_end - ASYMPTOTE_CHECK_DELTA1;
+                double yp = expr(ctx);
+                ctx.vars[var] = x_end - ASYMPTOTE_CHECK_DELTA2;
+                double yp2 = expr(ctx);
                 float sx = -1, sy;
                 double eps = discont_type == DISCONT_ASYMPT ?
                     ASYMPTOTE_CHECK_EPS:
@@ -1104,14 +2031,12 @@ void Plotter::plot_explicit(size_t funcid, bool reverse_xy) {
     if (curr_line.size() > 1 && (func.type & Function::FUNC_TYPE_MOD_INEQ_STRICT) == 0) {
         buf_add_screen_polyline(draw_buf, view, curr_line, func.line_color, funcid, 2.);
     }
-    if (funcs.size() <= max_functions_find_crit_points) {
+    if (funcs.size() <= max_functions_find_crit_points && !render_coarse) {
         if (find_all_crit_pts) {
             std::vector<CritPoint> to_erase; // Save dubious points to delete from roots_and_extrama
             // Helper to draw roots/extrema/y-int and add a marker for it
             auto draw_extremum = [&](const CritPoint& cpt, double y) {
-                env.vars[var] = cpt.first;
-                double dy = func.diff(env);
-                double ddy = func.ddiff(env);
+                double ddy = expr.eval_jet(var, cpt.first, ctx).ddiff;
                 double x; int type;
                 std::tie(x, type) = cpt;
                 auto label =
@@ -1140,17 +2065,17 @@ void Plotter::plot_explicit(size_t funcid, bool reverse_xy) {
                 pt_markers.push_back(std::move(ptm));
             };
             for (const CritPoint& cpt : roots_and_extrema) {
-                env.vars[var] = cpt.first;
-                double y = func.expr(env);
+                ctx.vars[var] = cpt.first;
+                double y = expr(ctx);
                 draw_extremum(cpt, y);
             }
             // Delete the "dubious" points
             for (const CritPoint& x : to_erase) {
                 roots_and_extrema.erase(x);
             }
-            if (!func.expr.is_null() && !func.diff.is_null()) {
-                env.vars[var] = 0;
-                double y = func.expr(env);
+            if (!expr.is_null() && func.differentiable) {
+                ctx.vars[var] = 0;
+                double y = expr(ctx);
                 if (!std::isnan(y) && !std::isinf(y)) {
                     push_critpt_if_valid(0., Y_INT, roots_and_extrema); // y-int
                     auto cpt = CritPoint(0., Y_INT);
@@ -1162,29 +2087,26 @@ void Plotter::plot_explicit(size_t funcid, bool reverse_xy) {
         }
 
         // Function intersection
-        if (!func.diff.is_null() && funcs.size() <= max_functions_find_crit_points) {
+        if (func.differentiable && funcs.size() <= max_functions_find_crit_points) {
             if (find_all_crit_pts) {
                 for (size_t funcid2 = 0; funcid2 < (funcs.size() <= max_functions_find_all_crit_points
                                                     ? funcid : funcs.size()); ++funcid2) {
                     auto& func2 = funcs[funcid2];
-                    if (func2.diff.is_null()) continue;
+                    if (!func2.differentiable) continue;
                     int ft_nomod = func.type & ~Function::FUNC_TYPE_MOD_ALL;
                     int f2t_nomod = func2.type & ~Function::FUNC_TYPE_MOD_ALL;
                     if (ft_nomod == f2t_nomod) {
                         // Same direction, use Newton on difference.
                         Expr sub_expr = func.expr - func2.expr;
-                        Expr diff_sub_expr = func.diff - func2.diff;
-                        // diff_sub_expr.optimize();
-                        if (diff_sub_expr.is_null()) continue;
                         std::set<double> st;
                         for (int sxd = 0; sxd < swid; sxd += 10) {
                             const double x = reverse_xy ? _SY_TO_Y(sxd) : _SX_TO_X(sxd);
-                            double root = sub_expr.newton(NEWTON_ARGS, &diff_sub_expr);
+                            double root = sub_expr.newton_jet(NEWTON_ARGS(ctx));
                             push_if_valid(root, st);
                         }
                         for (double x : st) {
-                            env.vars[var] = x;
-                            double y = func.expr(env);
+                            ctx.vars[var] = x;
+                            double y = func.expr(ctx);
                             size_t idx = pt_markers.size();
                             PointMarker ptm;
                             ptm.label = PointMarker::LABEL_INTERSECTION;
@@ -1202,24 +2124,17 @@ void Plotter::plot_explicit(size_t funcid, bool reverse_xy) {
                         comp_expr.sub_var(other_var, func.expr);
                         comp_expr = comp_expr - Expr::AST{Expr::ASTNode::varref(var)};
                         comp_expr.optimize();
-
-                        Expr diff_comp_expr = func2.diff;
-                        diff_comp_expr.sub_var(other_var, func.expr);
-                        diff_comp_expr = diff_comp_expr * func.diff - Expr::constant(1.);
-                        diff_comp_expr.optimize();
-                        if (diff_comp_expr.is_null()) continue;
                         std::set<double> st;
                         for (int sxd = 0; sxd < swid; sxd += 2) {
                             const double x = reverse_xy ? _SY_TO_Y(sxd) : _SX_TO_X(sxd);
-                            double root = comp_expr.newton(
-                                    var, x, env, EPS_STEP * 10.f, EPS_ABS * 10.f, MAX_ITER,
-                                    xmin - NEWTON_SIDE_ALLOW, xmax + NEWTON_SIDE_ALLOW,
-                                    &diff_comp_expr);
+                            double root = comp_expr.newton_jet(
+                                    var, x, ctx, EPS_STEP * 10.f, EPS_ABS * 10.f, MAX_ITER,
+                                    xmin - NEWTON_SIDE_ALLOW, xmax + NEWTON_SIDE_ALLOW);
                             push_if_valid(root, st);
                         }
                         for (double x : st) {
-                            env.vars[var] = x;
-                            double y = func.expr(env);
+                            ctx.vars[var] = x;
+                            double y = func.expr(ctx);
                             size_t idx = pt_markers.size();
                             PointMarker ptm;
                             ptm.label = PointMarker::LABEL_INTERSECTION;
@@ -1234,7 +2149,7 @@ void Plotter::plot_explicit(size_t funcid, bool reverse_xy) {
                     // o.w. not supported.
                 } // for funcid2
             } // if (find_all_intersections || funcid == curr_func)
-        } // if (!func.diff.is_null())
+        } // if (func.differentiable)
     } // if (funcs.size() <= max_functions_find_crit_points)
     // * End of function intersection code
 } // void plot_explicit
@@ -0,0 +1,213 @@
+#include "plotter/thread_pool.hpp"
+
+#include "version.hpp"
+#include <algorithm>
+#include <vector>
+#ifndef NIVALIS_EMSCRIPTEN
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#endif
+
+namespace nivalis {
+
+#ifndef NIVALIS_EMSCRIPTEN
+struct ThreadPool::Impl {
+    struct Task {
+        std::function<void()> fn;
+        TaskGroup* group;
+    };
+    // Task deque owned by one worker
+    struct Queue {
+        std::mutex mtx;
+        std::deque<Task> tasks;
+    };
+
+    explicit Impl(size_t n_workers) {
+        for (size_t i = 0; i < n_workers; ++i) {
+            queues.emplace_back(new Queue);
+        }
+        for (size_t i = 0; i < n_workers; ++i) {
+            threads.emplace_back([this, i]() { worker_loop(i); });
+        }
+    }
+
+    ~Impl() {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mtx);
+            stopping = true;
+        }
+        sleep_cv.notify_all();
+        for (auto& thd : threads) thd.join();
+    }
+
+    void push(Task&& task) {
+        // Tasks submitted by a worker go to its own queue,
+        // others are spread over the workers
+        size_t idx = cur_pool == this ? cur_index :
+            next_queue++ % queues.size();
+        ++n_queued;
+        {
+            std::lock_guard<std::mutex> lock(queues[idx]->mtx);
+            queues[idx]->tasks.push_back(std::move(task));
+        }
+        { std::lock_guard<std::mutex> lock(sleep_mtx); }
+        sleep_cv.notify_one();
+    }
+
+    // Take a task: own newest task if a worker, else steal oldest task
+    bool pop(Task& task) {
+        const size_t n = queues.size();
+        size_t start = 0;
+        if (cur_pool == this) {
+            Queue& own = *queues[cur_index];
+            std::lock_guard<std::mutex> lock(own.mtx);
+            if (own.tasks.size()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                --n_queued;
+                return true;
+            }
+            start = cur_index + 1;
+        }
+        for (size_t k = 0; k < n; ++k) {
+            Queue& victim = *queues[(start + k) % n];
+            std::lock_guard<std::mutex> lock(victim.mtx);
+            if (victim.tasks.size()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                --n_queued;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void execute(Task& task) {
+        task.fn();
+        if (--task.group->remaining == 0) {
+            // Wake threads waiting for the group
+            { std::lock_guard<std::mutex> lock(sleep_mtx); }
+            sleep_cv.notify_all();
+        }
+    }
+
+    void worker_loop(size_t index) {
+        cur_pool = this;
+        cur_index = index;
+        Task task;
+        while (true) {
+            if (pop(task)) {
+                execute(task);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleep_mtx);
+            sleep_cv.wait(lock, [this]() { return stopping || n_queued > 0; });
+            if (stopping && n_queued == 0) break;
+        }
+    }
+
+    void wait(TaskGroup& group) {
+        Task task;
+        while (group.remaining > 0) {
+            if (pop(task)) {
+                execute(task);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleep_mtx);
+            sleep_cv.wait(lock, [this, &group]() {
+                return group.remaining == 0 || n_queued > 0;
+            });
+        }
+    }
+
+    std::vector<std::unique_ptr<Queue> > queues;
+    std::vector<std::thread> threads;
+    // Number of tasks in queues
+    std::atomic<size_t> n_queued{0};
+    // Next queue for tasks submitted from outside the pool
+    std::atomic<size_t> next_queue{0};
+    // Sleeping workers/waiters wait on this
+    std::mutex sleep_mtx;
+    std::condition_variable sleep_cv;
+    bool stopping = false;
+
+    // Pool and worker index of the current thread, if a worker
+    static thread_local const Impl* cur_pool;
+    static thread_local size_t cur_index;
+};
+thread_local const ThreadPool::Impl* ThreadPool::Impl::cur_pool = nullptr;
+thread_local size_t ThreadPool::Impl::cur_index = 0;
+#else
+struct ThreadPool::Impl { };
+#endif
+
+ThreadPool::TaskGroup::TaskGroup(ThreadPool& pool) : pool(pool), remaining(0) { }
+
+ThreadPool::TaskGroup::~TaskGroup() {
+    wait();
+}
+
+void ThreadPool::TaskGroup::run(std::function<void()> task) {
+#ifndef NIVALIS_EMSCRIPTEN
+    if (pool.impl) {
+        ++remaining;
+        pool.impl->push(Impl::Task{std::move(task), this});
+        return;
+    }
+#endif
+    task();
+}
+
+void ThreadPool::TaskGroup::wait() {
+#ifndef NIVALIS_EMSCRIPTEN
+    if (pool.impl) pool.impl->wait(*this);
+#endif
+}
+
+ThreadPool::ThreadPool(size_t n_workers) {
+    resize(n_workers);
+}
+
+ThreadPool::~ThreadPool() { }
+
+void ThreadPool::resize(size_t n_workers) {
+    impl.reset();
+#ifndef NIVALIS_EMSCRIPTEN
+    if (n_workers > 0) impl.reset(new Impl(n_workers));
+#endif
+}
+
+size_t ThreadPool::size() const {
+#ifndef NIVALIS_EMSCRIPTEN
+    if (impl) return impl->threads.size();
+#endif
+    return 0;
+}
+
+size_t ThreadPool::concurrency() const {
+    return size() + 1;
+}
+
+void ThreadPool::parallel_for(size_t n, size_t grain,
+        const std::function<void(size_t, size_t)>& fn) {
+    if (grain == 0) grain = 1;
+    TaskGroup group(*this);
+    for (size_t begin = 0; begin < n; begin += grain) {
+        const size_t end = std::min(n, begin + grain);
+        group.run([&fn, begin, end]() { fn(begin, end); });
+    }
+    group.wait();
+}
+
+size_t ThreadPool::default_size() {
+#ifdef NIVALIS_EMSCRIPTEN
+    return 0;  // Multithreading not supported
+#else
+    const size_t n_hw = std::thread::hardware_concurrency();
+    return n_hw > 1 ? n_hw - 1 : 0;
+#endif
+}
+
+}  // namespace nivalis
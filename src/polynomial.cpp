@@ -0,0 +1,412 @@
+#include "polynomial.hpp"
+
+#include <cmath>
+#include <algorithm>
+#include "opcodes.hpp"
+
+namespace nivalis {
+namespace {
+// Number of points evaluated together in eval_batch
+const size_t BATCH_BLOCK = 256;
+
+// Remove highest coefficients with absolute value at most eps
+void trim(std::vector<double>& coeffs, double eps = 0.) {
+    while (coeffs.size() && std::fabs(coeffs.back()) <= eps) coeffs.pop_back();
+}
+
+double max_abs_coeff(const Polynomial& p) {
+    double result = 0.;
+    for (double c : p.coeffs) result = std::max(result, std::fabs(c));
+    return result;
+}
+
+// Remainder of a / b, dropping coefficients which are rounding error
+// relative to a (b must be nonzero)
+Polynomial remainder(Polynomial a, const Polynomial& b) {
+    auto& r = a.coeffs;
+    const int db = b.degree();
+    const double eps = max_abs_coeff(a) * 1e-12;
+    for (int i = a.degree(); i >= db; --i) {
+        const double q = r[i] / b.coeffs[db];
+        for (int j = 0; j < db; ++j) r[i - db + j] -= q * b.coeffs[j];
+        r[i] = 0.;
+    }
+    trim(r, eps);
+    return a;
+}
+
+// Sturm sequence p, p', -rem(p, p'), ...; each scaled to
+// maximum absolute coefficient 1
+std::vector<Polynomial> sturm_sequence(const Polynomial& p) {
+    std::vector<Polynomial> seq{ p, p.diff() };
+    while (seq.back().degree() > 0) {
+        Polynomial r = -remainder(seq[seq.size() - 2], seq.back());
+        if (r.degree() < 0) break;
+        seq.push_back(std::move(r));
+    }
+    for (auto& q : seq) q = q * (1. / max_abs_coeff(q));
+    return seq;
+}
+
+// Number of sign changes in Sturm sequence at x
+int sign_changes(const std::vector<Polynomial>& seq, double x) {
+    int result = 0;
+    double prev = 0.;
+    for (const auto& q : seq) {
+        double y = q(x);
+        if (y == 0.) continue;
+        if ((y < 0.) != (prev < 0.) && prev != 0.) ++result;
+        prev = y;
+    }
+    return result;
+}
+
+// Find roots in (lo, hi], given numbers of sign changes at lo and hi
+void isolate_roots(const Polynomial& p, const std::vector<Polynomial>& seq,
+        double lo, double hi, int changes_lo, int changes_hi, double eps,
+        int depth, std::vector<double>& out) {
+    static const int MAX_DEPTH = 64;
+    if (changes_lo - changes_hi <= 0) return;
+    if (hi - lo <= eps || depth >= MAX_DEPTH) {
+        out.push_back((lo + hi) * 0.5);
+        return;
+    }
+    if (changes_lo - changes_hi == 1) {
+        double p_lo = p(lo), p_hi = p(hi);
+        if ((p_lo < 0.) != (p_hi < 0.) && p_lo != 0. && p_hi != 0.) {
+            // One simple root: bisection
+            while (hi - lo > eps) {
+                double mi = (lo + hi) * 0.5;
+                if (mi <= lo || mi >= hi) break;
+                double p_mi = p(mi);
+                if (p_mi == 0.) {
+                    lo = hi = mi;
+                } else if ((p_mi < 0.) == (p_lo < 0.)) {
+                    lo = mi;
+                } else {
+                    hi = mi;
+                }
+            }
+            out.push_back((lo + hi) * 0.5);
+            return;
+        }
+    }
+    const double mi = (lo + hi) * 0.5;
+    const int changes_mi = sign_changes(seq, mi);
+    isolate_roots(p, seq, lo, mi, changes_lo, changes_mi, eps, depth + 1, out);
+    isolate_roots(p, seq, mi, hi, changes_mi, changes_hi, eps, depth + 1, out);
+}
+}  // namespace
+
+Polynomial::Polynomial() { }
+Polynomial::Polynomial(double c) : coeffs{c} { trim(coeffs); }
+Polynomial::Polynomial(const std::vector<double>& coeffs) : coeffs(coeffs) {
+    trim(this->coeffs);
+}
+
+int Polynomial::degree() const {
+    return static_cast<int>(coeffs.size()) - 1;
+}
+
+double Polynomial::operator()(double x) const {
+    double result = 0.;
+    for (size_t i = coeffs.size(); i-- > 0; ) {
+        result = result * x + coeffs[i];
+    }
+    return result;
+}
+
+void Polynomial::eval_batch(const double* xs, double* out, size_t n) const {
+    if (coeffs.empty()) {
+        std::fill(out, out + n, 0.);
+        return;
+    }
+    // Horner's method over blocks of points, innermost loop over points
+    // (vectorizable)
+    for (size_t begin = 0; begin < n; begin += BATCH_BLOCK) {
+        const size_t end = std::min(n, begin + BATCH_BLOCK);
+        std::fill(out + begin, out + end, coeffs.back());
+        for (size_t j = coeffs.size() - 1; j-- > 0; ) {
+            const double c = coeffs[j];
+            for (size_t i = begin; i < end; ++i) {
+                out[i] = out[i] * xs[i] + c;
+            }
+        }
+    }
+}
+
+Polynomial Polynomial::diff() const {
+    Polynomial result;
+    if (coeffs.size() <= 1) return result;
+    result.coeffs.resize(coeffs.size() - 1);
+    for (size_t i = 1; i < coeffs.size(); ++i) {
+        result.coeffs[i - 1] = coeffs[i] * static_cast<double>(i);
+    }
+    return result;
+}
+
+Polynomial Polynomial::operator+(const Polynomial& other) const {
+    Polynomial result;
+    result.coeffs.resize(std::max(coeffs.size(), other.coeffs.size()));
+    for (size_t i = 0; i < coeffs.size(); ++i) result.coeffs[i] = coeffs[i];
+    for (size_t i = 0; i < other.coeffs.size(); ++i) {
+        result.coeffs[i] += other.coeffs[i];
+    }
+    trim(result.coeffs);
+    return result;
+}
+
+Polynomial Polynomial::operator-(const Polynomial& other) const {
+    return *this + (-other);
+}
+
+Polynomial Polynomial::operator*(const Polynomial& other) const {
+    Polynomial result;
+    if (coeffs.empty() || other.coeffs.empty()) return result;
+    result.coeffs.resize(coeffs.size() + other.coeffs.size() - 1);
+    for (size_t i = 0; i < coeffs.size(); ++i) {
+        for (size_t j = 0; j < other.coeffs.size(); ++j) {
+            result.coeffs[i + j] += coeffs[i] * other.coeffs[j];
+        }
+    }
+    trim(result.coeffs);
+    return result;
+}
+
+Polynomial Polynomial::operator*(double c) const {
+    Polynomial result = *this;
+    for (double& coeff : result.coeffs) coeff *= c;
+    trim(result.coeffs);
+    return result;
+}
+
+Polynomial Polynomial::operator-() const {
+    Polynomial result = *this;
+    for (double& coeff : result.coeffs) coeff = -coeff;
+    return result;
+}
+
+std::vector<double> Polynomial::real_roots(double lo, double hi,
+        double eps) const {
+    std::vector<double> result;
+    if (!(lo < hi)) return result;
+    if (degree() == 1) {
+        double root = -coeffs[0] / coeffs[1];
+        if (root >= lo && root <= hi) result.push_back(root);
+        return result;
+    }
+    if (degree() < 1) return result;
+    auto seq = sturm_sequence(*this);
+    isolate_roots(*this, seq, lo, hi, sign_changes(seq, lo),
+            sign_changes(seq, hi), eps, 0, result);
+    return result;
+}
+
+double RationalFunction::operator()(double x) const {
+    return num(x) / den(x);
+}
+
+void RationalFunction::eval_batch(const double* xs, double* out,
+        size_t n) const {
+    num.eval_batch(xs, out, n);
+    if (is_polynomial()) {
+        if (den.coeffs.empty() || den.coeffs[0] != 1.) {
+            const double c = den(0.);
+            for (size_t i = 0; i < n; ++i) out[i] /= c;
+        }
+        return;
+    }
+    double den_vals[BATCH_BLOCK];
+    for (size_t begin = 0; begin < n; begin += BATCH_BLOCK) {
+        const size_t end = std::min(n, begin + BATCH_BLOCK);
+        den.eval_batch(xs + begin, den_vals, end - begin);
+        for (size_t i = begin; i < end; ++i) out[i] /= den_vals[i - begin];
+    }
+}
+
+bool RationalFunction::is_polynomial() const {
+    return den.degree() <= 0;
+}
+
+namespace {
+// Whether p has at most one nonzero coefficient
+bool is_monomial(const Polynomial& p) {
+    size_t n_terms = 0;
+    for (double c : p.coeffs) n_terms += (c != 0.);
+    return n_terms <= 1;
+}
+
+// Builds the rational function for an AST
+struct RationalBuilder {
+    RationalBuilder(uint64_t var_addr, EvalContext& ctx, int max_degree)
+        : var_addr(var_addr), ctx(ctx), max_degree(max_degree) { }
+
+    // Convert the subtree at *ast, advancing *ast past it
+    bool build(const Expr::ASTNode** ast, RationalFunction& out) {
+        using namespace OpCode;
+        const Expr::ASTNode* node = *ast;
+        switch (node->opcode) {
+            case val: ++*ast; return constant(node->val, out);
+            case ref:
+                      ++*ast;
+                      if (node->ref == var_addr) {
+                          out.num = Polynomial({0., 1.});
+                          out.den = Polynomial(1.);
+                          return true;
+                      }
+                      return constant(ctx.vars[node->ref], out);
+            case add: case sub: case mul: case divi:
+                      {
+                          ++*ast;
+                          RationalFunction a, b;
+                          if (!build(ast, a) || !build(ast, b)) return false;
+                          if (node->opcode == mul) return product(a, b, out);
+                          if (node->opcode == divi) {
+                              std::swap(b.num, b.den);
+                              return product(a, b, out);
+                          }
+                          if (node->opcode == sub) b.num = -b.num;
+                          return sum(a, b, out);
+                      }
+            case unaryminus:
+                      ++*ast;
+                      if (!build(ast, out)) return false;
+                      out.num = -out.num;
+                      return true;
+            case sqrb:
+                      {
+                          ++*ast;
+                          RationalFunction a;
+                          return build(ast, a) && product(a, a, out);
+                      }
+            case power:
+                      {
+                          ++*ast;
+                          RationalFunction base, expo;
+                          double expo_val;
+                          if (!build(ast, base) || !build(ast, expo) ||
+                                  !is_constant(expo, expo_val)) return false;
+                          double base_val;
+                          if (is_constant(base, base_val)) {
+                              Expr::AST pow_ast{power, base_val, expo_val};
+                              return constant(detail::eval_ast(ctx, pow_ast), out);
+                          }
+                          if (expo_val != std::floor(expo_val) ||
+                                  std::fabs(expo_val) > max_degree) return false;
+                          int k = static_cast<int>(expo_val);
+                          if (k < 0) {
+                              std::swap(base.num, base.den);
+                              k = -k;
+                          }
+                          // Repeated multiplication
+                          out.num = out.den = Polynomial(1.);
+                          for (int i = 0; i < k; ++i) {
+                              if (!product(out, base, out)) return false;
+                          }
+                          return true;
+                      }
+            default:
+                      {
+                          // Constant subexpression
+                          const Expr::ASTNode* end = *ast;
+                          if (!skip_constant(&end)) return false;
+                          Expr::AST sub_ast(*ast, end);
+                          *ast = end;
+                          return constant(detail::eval_ast(ctx, sub_ast), out);
+                      }
+        }
+    }
+
+private:
+    bool constant(double value, RationalFunction& out) {
+        if (!std::isfinite(value)) return false;
+        out.num = Polynomial(value);
+        out.den = Polynomial(1.);
+        return true;
+    }
+
+    bool is_constant(const RationalFunction& f, double& value) {
+        if (f.num.degree() > 0 || f.den.degree() != 0) return false;
+        value = f.num(0.) / f.den.coeffs[0];
+        return true;
+    }
+
+    // Check degrees and divide by a constant denominator
+    bool normalize(RationalFunction& f) {
+        if (f.num.degree() > max_degree || f.den.degree() > max_degree ||
+                f.den.degree() < 0) return false;
+        for (double c : f.num.coeffs) if (!std::isfinite(c)) return false;
+        for (double c : f.den.coeffs) if (!std::isfinite(c)) return false;
+        if (f.den.degree() == 0 && f.den.coeffs[0] != 1.) {
+            for (double& c : f.num.coeffs) c /= f.den.coeffs[0];
+            f.num = Polynomial(f.num.coeffs);
+            f.den = Polynomial(1.);
+            for (double c : f.num.coeffs) if (!std::isfinite(c)) return false;
+        }
+        return true;
+    }
+
+    // Product of polynomials, if one is a monomial (so that no sums are
+    // multiplied out)
+    bool product(const Polynomial& a, const Polynomial& b, Polynomial& out) {
+        if (!is_monomial(a) && !is_monomial(b)) return false;
+        out = a * b;
+        return true;
+    }
+
+    bool product(const RationalFunction& a, const RationalFunction& b,
+            RationalFunction& out) {
+        RationalFunction result;
+        if (!product(a.num, b.num, result.num) ||
+                !product(a.den, b.den, result.den)) return false;
+        out = std::move(result);
+        return normalize(out);
+    }
+
+    bool sum(const RationalFunction& a, const RationalFunction& b,
+            RationalFunction& out) {
+        RationalFunction result;
+        if (a.den.coeffs == b.den.coeffs) {
+            result.num = a.num + b.num;
+            result.den = a.den;
+        } else {
+            Polynomial ad, bd;
+            if (!product(a.num, b.den, ad) || !product(b.num, a.den, bd) ||
+                    !product(a.den, b.den, result.den)) return false;
+            result.num = ad + bd;
+        }
+        out = std::move(result);
+        return normalize(out);
+    }
+
+    // Advance *ast past the subtree if it does not depend on the variable
+    // (or on function arguments/calls); false if it does
+    bool skip_constant(const Expr::ASTNode** ast) {
+        using namespace OpCode;
+        const Expr::ASTNode* node = *ast;
+        if (node->opcode == call || node->opcode == arg ||
+                (has_ref(node->opcode) && node->ref == var_addr)) {
+            return false;
+        }
+        ++*ast;
+        for (size_t i = 0; i < n_args(node->opcode); ++i) {
+            if (!skip_constant(ast)) return false;
+        }
+        return true;
+    }
+
+    uint64_t var_addr;
+    EvalContext& ctx;
+    int max_degree;
+};
+}  // namespace
+
+bool to_rational(const Expr& expr, uint64_t var_addr, EvalContext& ctx,
+                 RationalFunction& out, int max_degree) {
+    const Expr::ASTNode* ast = &expr.ast[0];
+    RationalBuilder builder(var_addr, ctx, max_degree);
+    if (!builder.build(&ast, out)) return false;
+    return ast == &expr.ast[0] + expr.ast.size();
+}
+
+}  // namespace nivalis
@@ -0,0 +1,60 @@
+#include "expr.hpp"
+#include "env.hpp"
+#include "parser.hpp"
+#include "test_common.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+
+// Benchmark for symbolic differentiation (Expr::diff):
+// AST node counts of the expression and of its first few derivatives,
+// as built by the differentiator and after optimize(), and timings.
+// Usage: bench_diff_expr [n_diffs]
+
+using namespace nivalis;
+using namespace nivalis::test;
+
+int main(int argc, char** argv) {
+    const size_t n_diffs = argc > 1 ? std::atoi(argv[1]) : 1000;
+    static const int MAX_ORDER = 3;
+    Environment env; env.set("x", 0.); env.set("a", 2.5);
+    uint64_t x = env.addr_of("x");
+    uint64_t u = env.addr_of("u", false);
+    env.def_func("f", parse("u^2 - a*u", env, false, true), {u});
+
+    for (const char* str : {
+            "a*x^2 - 3*x + 1",
+            "sin(x)*exp(-x^2/10) + cos(3*x)",
+            "x^x",
+            "log(x^2 + 1) / (x^2 + 1)",
+            "sqrt(1 + sin(x)^2) * tanh(a*x)",
+            "{x < 0: -x, x > 5: 5, x^2/5}",
+            "sum(k=1, 5)[x^k / k]",
+            "prod(k=1, 4)[x + k]",
+            "f(sin(x)) + f(2*x)" }) {
+        Expr expr = parse(str, env, false, true);
+        printf("%s\n  nodes: %zu", str, expr.ast.size());
+        // Derivatives as built by the differentiator / after optimize()
+        Expr raw = expr, optimized = expr;
+        for (int i = 1; i <= MAX_ORDER; ++i) {
+            raw.ast = detail::diff_ast(raw.ast, x, env);
+            optimized = optimized.diff(x, env);
+            printf(" | d%d: %zu raw, %zu optimized", i,
+                    raw.ast.size(), optimized.ast.size());
+        }
+        printf("\n");
+
+        size_t total_nodes = 0;
+        BEGIN_PROFILE;
+        for (size_t i = 0; i < n_diffs; ++i) {
+            total_nodes += detail::diff_ast(expr.ast, x, env).size();
+        }
+        PROFILE_STEPS(diff_raw, n_diffs);
+        for (size_t i = 0; i < n_diffs; ++i) {
+            total_nodes += expr.diff(x, env).ast.size();
+        }
+        PROFILE_STEPS(diff_optimized, n_diffs);
+        printf("(total nodes: %zu)\n\n", total_nodes);
+    }
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include "expr.hpp"
+#include "env.hpp"
+#include "parser.hpp"
+#include "polynomial.hpp"
+#include "test_common.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+
+// Benchmark for the expression evaluators:
+// AST interpreter (eval_ast), bytecode (Expr::compile), native code (Expr::jit)
+// and batch evaluation (Expr::eval_batch), and for polynomials and rational
+// functions, RationalFunction::eval_batch.
+// Usage: bench_eval_expr [n_evals]
+
+using namespace nivalis;
+using namespace nivalis::test;
+
+int main(int argc, char** argv) {
+    const size_t n_evals = argc > 1 ? std::atoi(argv[1]) : 1000000;
+    Environment env; env.set("x", 0.); env.set("y", 1.5); env.set("a", 2.5);
+    uint64_t x = env.addr_of("x");
+    uint64_t u = env.addr_of("u", false);
+    env.def_func("f", parse("u^2 - a*u", env, false, true), {u});
+
+    std::vector<double> xs(n_evals), out(n_evals);
+    for (size_t i = 0; i < n_evals; ++i) xs[i] = -10. + 20. * i / n_evals;
+
+    for (const char* str : {
+            "a*x^2 - 3*x + 1",
+            "x^3 - 2*x*y + y^2 - 1",
+            "sin(x)*exp(-x^2/10) + cos(3*x)",
+            "{x < 0: -x, x > 5: 5, x^2/5}",
+            "sqrt(abs(x)) + max(x, y) - min(x, -y)",
+            "sum(k=1, 5)[x^k / k]",
+            "f(x) + f(2*x)" }) {
+        Expr expr = parse(str, env, false, true);
+        Expr compiled = expr, jitted = expr;
+        compiled.compile();
+        const bool has_jit = jitted.jit();
+        printf("%s\n", str);
+        // Sum of results, to prevent evaluation from being optimized away
+        double sum_interp = 0., sum_bytecode = 0., sum_jit = 0.;
+
+        BEGIN_PROFILE;
+        for (size_t i = 0; i < n_evals; ++i) {
+            env.vars[x] = xs[i];
+            sum_interp += detail::eval_ast(env, expr.ast);
+        }
+        PROFILE_STEPS(interpreter, n_evals);
+        for (size_t i = 0; i < n_evals; ++i) {
+            env.vars[x] = xs[i];
+            sum_bytecode += compiled(env);
+        }
+        PROFILE_STEPS(bytecode, n_evals);
+        if (has_jit) {
+            for (size_t i = 0; i < n_evals; ++i) {
+                env.vars[x] = xs[i];
+                sum_jit += jitted(env);
+            }
+            PROFILE_STEPS(jit, n_evals);
+        }
+        compiled.eval_batch(x, xs.data(), out.data(), n_evals, env);
+        PROFILE_STEPS(batch, n_evals);
+        EvalContext ctx(env);
+        RationalFunction rational;
+        std::vector<double> rational_out(n_evals);
+        if (to_rational(expr, x, ctx, rational)) {
+            rational.eval_batch(xs.data(), rational_out.data(), n_evals);
+            PROFILE_STEPS(rational, n_evals);
+        }
+        printf("(sums: %g %g %g %g)\n\n", sum_interp, sum_bytecode,
+               sum_jit, out[n_evals / 2]);
+    }
+    return 0;
+}
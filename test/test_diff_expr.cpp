@@ -35,6 +35,35 @@ namespace {
         }
         return true;
     }
+
+    // Test if eval_jet agrees with value and symbolic 1st/2nd derivatives
+    bool test_jet_random(const std::string& str, uint32_t var_id,
+            double xmin = -100, double xmax = 100) {
+        Expr expr = parse(str, env);
+        Expr diff = expr.diff(var_id, env);
+        Expr ddiff = diff.diff(var_id, env);
+        static const int N_ITER = 1000;
+        std::uniform_real_distribution<double> unif(xmin, xmax);
+        auto equiv = [](double x, double y) {
+            return (std::isnan(x) && std::isnan(y)) ||
+                absrelerr(x, y) < FLOAT_EPS;
+        };
+        for (int i = 0; i < N_ITER; ++i) {
+            double x = unif(test::reng);
+            Expr::Jet jet = expr.eval_jet(var_id, x, env);
+            double fx = expr(env), dfx = diff(env), ddfx = ddiff(env);
+            // Symbolic derivatives may exist outside the domain
+            if (!equiv(jet.val, fx) || (!std::isnan(fx) &&
+                (!equiv(jet.diff, dfx) || !equiv(jet.ddiff, ddfx)))) {
+                std::cerr << "Jet test fail for " << str << " at " << x <<
+                    "\njet    " << jet.val << " " << jet.diff << " " <<
+                    jet.ddiff << "\nexpect " << fx << " " << dfx << " " <<
+                    ddfx << "\n";
+                return false;
+            }
+        }
+        return true;
+    }
 }  // namespace
 
 int main() {
@@ -85,5 +114,43 @@ int main() {
                 "beta(x,x^2)*(digamma(x) - digamma(x+x^2)) + "
                 "2*x*beta(x,x^2)*(digamma(x^2) - digamma(x+x^2))", 0));
 
+    // Forward-mode derivatives
+    for (const char* str : { "x^3 - 2*x + a", "1/x + x/(1+x^2)", "sqrt(x)",
+            "log(x) + log2(x) - log(x, a)", "sin(x)*cos(x) + tan(x)",
+            "arcsin(x/100) + arccos(x/100) + arctan(x)",
+            "sinh(x/20) - cosh(x/20) + tanh(x)", "exp(sin(x))", "exp2(-x/10)",
+            "a^(x/10) + x^x", "abs(x^3) - sgn(x) + floor(x)",
+            "max(x, 2*x) - min(x^2, 3)", "{x < 0: x^2, sin(x)}",
+            "erf(x/10)", "sigmoid(x/10) + softplus(x/10) + N(x/10)",
+            "gamma(x/50 + 1) + lgamma(x/50 + 3) + digamma(x / 50 + 3)",
+            "sum(k=1, 4)[k*x^k]", "prod(k=1, 3)[x + k]" }) {
+        ASSERT(test_jet_random(str, 0, -10., 10.));
+    }
+    {
+        uint64_t u = env.addr_of("u", false);
+        env.def_func("f", parse("sin(u)^2 + u", env, false, true), {u});
+        ASSERT(test_jet_random("f(x^2) * x", 0, -10., 10.));
+        // Functions of both their argument and the variable
+        env.def_func("g", parse("2^u + u*x", env, false, true), {u});
+        ASSERT(test_derivative_random("g(x^2)",
+                    "ln(2)*2*x*2^(x^2) + 3*x^2", 0, -3., 3.));
+        env.def_func("h", parse("g(u) * x", env, false, true), {u});
+        ASSERT(test_derivative_random("h(x)",
+                    "(ln(2)*2^x + 2*x)*x + 2^x + x^2", 0, -3., 3.));
+        // Loop index shadowing the variable
+        Expr::Jet jet = parse("sum(x=1, 3)[x] + x", env).eval_jet(0, 0.5, env);
+        ASSERT_FLOAT_EQ(jet.val, 6.5);
+        ASSERT_FLOAT_EQ(jet.diff, 1.);
+        // Newton's method for root and extremum
+        Expr expr = parse("x^2 - 2", env);
+        ASSERT_FLOAT_EQ(expr.newton_jet(0, 1., env, 1e-10, 1e-10), sqrt(2.));
+        ASSERT_FLOAT_EQ(expr.newton_jet(0, 1., env, 1e-10, 1e-10, 20,
+                    -10., 10., 1) + 1., 1.);
+        // Pole (root of 1/f)
+        expr = parse("1/(x - 3) + 1", env);
+        ASSERT_FLOAT_EQ(expr.newton_jet(0, 2.9, env, 1e-10, 1e-10, 20,
+                    -10., 10., -1), 3.);
+    }
+
     END_TEST;
 }
@@ -2,14 +2,34 @@
 #include "env.hpp"
 #include "opcodes.hpp"
 #include "util.hpp"
+#include "parser.hpp"
+#include "version.hpp"
 #include "test_common.hpp"
 
+#include <atomic>
 #include <cmath>
+#include <cstdlib>
+#include <new>
+#include <thread>
 
 using namespace nivalis;
 using namespace nivalis::detail;
 using namespace nivalis::test;
 
+namespace {
+// Number of heap allocations so far
+std::atomic<size_t> n_allocs(0);
+}  // namespace
+
+// Count allocations (to check evaluation does not allocate)
+void* operator new(size_t size) {
+    ++n_allocs;
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
 int main() {
     BEGIN_TEST(test_eval_expr);
 
@@ -135,5 +155,270 @@ int main() {
         thunk.end();
         ASSERT_FLOAT_EQ(eval_ast(env, ast), 4950000.);
     }
+
+    {
+        // Batch evaluation must agree with scalar evaluation
+        Environment env; env.set("x", 0.); env.set("a", 2.5);
+        uint64_t x = env.addr_of("x");
+        std::vector<double> xs(1000), out(xs.size());
+        for (size_t i = 0; i < xs.size(); ++i) xs[i] = unif(reng);
+        xs[3] = 0.; xs[7] = std::numeric_limits<double>::quiet_NaN();
+        for (const char* str : { "a*x^2 - 3*x + 1", "x/(x-1) + sqrt(x)",
+                "max(x, a) - min(-x, 1) + abs(x)", "(x < a) + (x >= 1) - (x != 0)",
+                "sgn(x) + floor(x/3) - ceil(x/7) + round(x/9)",
+                "x > 0 & x < 50 | !(x + 1)", "sin(x)*exp(-x^2) + ln(x) + tgamma(x/20)",
+                "{x < 0: -x, x}", "sum(k=1, 3)[x*k]", "-(x % 3) + gcd(x, 6)" }) {
+            Expr expr = parse(str, env, false, true);
+            expr.eval_batch(x, xs.data(), out.data(), xs.size(), env);
+            for (size_t i = 0; i < xs.size(); ++i) {
+                env.vars[x] = xs[i];
+                double expected = expr(env);
+                ASSERT_EQ(std::isnan(out[i]), std::isnan(expected));
+                if (!std::isnan(expected)) ASSERT_FLOAT_EQ(out[i], expected);
+            }
+        }
+        // Binding two variables
+        uint64_t a = env.addr_of("a");
+        std::vector<double> as(xs.size());
+        for (size_t i = 0; i < as.size(); ++i) as[i] = unif(reng);
+        Expr expr = parse("x*a - a^2", env, false, true);
+        expr.eval_batch({x, a}, {xs.data(), as.data()}, out.data(), xs.size(), env);
+        for (size_t i = 0; i < 10; ++i) {
+            ASSERT_FLOAT_EQ(out[i], xs[i] * as[i] - as[i] * as[i]);
+        }
+    }
+
+    {
+        // Compiled bytecode must agree with AST evaluation
+        Environment env; env.set("x", 0.); env.set("a", 2.5);
+        env.set("k", 0.);
+        uint64_t x = env.addr_of("x");
+        uint64_t u = env.addr_of("u", false), v = env.addr_of("v", false);
+        env.def_func("f", parse("u^2 - v*a", env, false, true), {u, v});
+        env.def_func("g", parse("f(u, 1) + {u < 0: -u, 2*u}", env, false, true), {u});
+        ASSERT(env.funcs[env.addr_of_func("f")].expr.is_compiled());
+        for (const char* str : { "a*x^2 - 3*x + 1", "x*a + 1 + x*x", "1 + x*a",
+                "x^3 + x^0.5 + 2^x", "max(x, a) - min(-x, 1) + abs(x) - gcd(x, 6)",
+                "{x < 0: -x, x > 10: 10, x}", "{x: 1/x}", "sum(k=1, 3)[x*k]",
+                "prod(k=x, 1)[k + 1]", "sum(k=1, 3)[k] + k", "k + sum(k=1, 3)[k]",
+                "sum(k=1, 3)[prod(j=1, k)[j + x]]", "f(x, 2) - g(x)",
+                "g(f(x, x))", "sin(x)*exp(-x^2) + ln(x) + tgamma(x/20)",
+                // Common subexpressions
+                "sin(x*a)^2 + cos(x*a) + x*a + 1", "(x+a)*(x+a)^2 + (x+a)",
+                "{x < 1: (x+a)^2 + (x+a), (x+a)*3} + (x+a)",
+                "sum(k=1, 3)[(x*k)^2 + x*k] + x*k + x*k",
+                "f(x*a, 1) + (x*a)^2 + x*a" }) {
+            Expr expr = parse(str, env, false, true);
+            Expr compiled = expr;
+            compiled.compile();
+            ASSERT(compiled.is_compiled());
+            for (int i = 0; i < 50; ++i) {
+                double xv = i < 2 ? i - 1 : unif(reng);
+                env.vars[x] = xv; env.set("k", 0.);
+                double expected = eval_ast(env, expr.ast);
+                env.vars[x] = xv; env.set("k", 0.);
+                double result = compiled(env);
+                ASSERT_EQ(std::isnan(result), std::isnan(expected));
+                if (!std::isnan(expected)) ASSERT_FLOAT_EQ(result, expected);
+            }
+        }
+        // Modifying AST through member functions discards program
+        Expr expr = parse("x + a", env, false, true);
+        expr.compile();
+        expr.sub_var(x, 1.);
+        ASSERT(!expr.is_compiled());
+        ASSERT_FLOAT_EQ(expr(env), 3.5);
+    }
+
+    {
+        // Native code must agree with AST evaluation
+        Environment env; env.set("x", 0.); env.set("a", 2.5);
+        env.set("k", 0.);
+        uint64_t x = env.addr_of("x");
+        uint64_t u = env.addr_of("u", false);
+        env.def_func("f", parse("u^2 - a*u", env, false, true), {u});
+        for (const char* str : { "a*x^2 - 3*x + 1", "x/(x-1) + sqrt(x) - x^3",
+                "max(x, a) - min(-x, 1) + abs(x) - max(x, 0/0) + min(0/0, x)",
+                "(x < a) + 2*(x <= 1) + 4*(x == 0) + 8*(x != 0) + 16*(x >= 1) + 32*(x > a)",
+                "(x & a) + 2*(x | 0) + 4*(x ^ a) + 8*!x + 16*(0/0 & 1)",
+                "{x < 0: -x, x > 10: 10, x}", "{x: 1/x}", "{0/0: 1, 2}",
+                "sgn(x) + floor(x/3) - ceil(x/7) + round(x/9) + gcd(x, 6) + x % 3",
+                "sin(x)*exp(-x^2) + ln(x) + cos(x) - tan(x) + atan(x) + tgamma(x/20)",
+                "sum(k=1, 3)[x*k] + k", "f(x) + f(2*x)", "f(x) + u" }) {
+            Expr expr = parse(str, env, false, true);
+            Expr jitted = expr;
+#ifdef ENABLE_NIVALIS_JIT
+            ASSERT(jitted.jit());
+            ASSERT(jitted.is_jitted());
+#else
+            ASSERT(!jitted.jit());
+#endif
+            for (int i = 0; i < 50; ++i) {
+                double xv = i < 3 ? i - 1 : unif(reng);
+                env.vars[x] = xv; env.set("k", 0.);
+                double expected = eval_ast(env, expr.ast);
+                env.vars[x] = xv; env.set("k", 0.);
+                double result = jitted(env);
+                ASSERT_EQ(std::isnan(result), std::isnan(expected));
+                if (!std::isnan(expected)) ASSERT_FLOAT_EQ(result, expected);
+            }
+        }
+        // Function arguments (as in a user function body)
+        Expr body = env.funcs[env.addr_of_func("f")].expr;
+        body.jit();
+        ASSERT_FLOAT_EQ(body(3., env), 9. - 2.5 * 3.);
+        ASSERT_FLOAT_EQ(body(std::vector<double>{-1.}, env), 1. + 2.5);
+    }
+
+    {
+        // Nested user function calls must not allocate
+        Environment env; env.set("x", 0.);
+        uint64_t x = env.addr_of("x");
+        uint64_t u = env.addr_of("u", false);
+        env.def_func("f", parse("u^2 + 1", env, false, true), {u});
+        env.def_func("g", parse("f(u) + f(2*u)", env, false, true), {u});
+        env.def_func("h", parse("g(u) - f(u)", env, false, true), {u});
+        Expr expr = parse("h(x) + g(x + 1)", env, false, true);
+        Expr compiled = expr;
+        compiled.compile();
+        Environment env_uncompiled = env;
+        for (auto& func : env_uncompiled.funcs) func.expr.uncompile();
+        // h(3) + g(4) = (10 + 37 - 10) + (17 + 65)
+        ASSERT_FLOAT_EQ(eval_ast(env_uncompiled,
+                    { Expr::ASTNode::call(env.addr_of_func("h"), 1), 3. }), 37.);
+        env.vars[x] = env_uncompiled.vars[x] = 3.;
+        ASSERT_FLOAT_EQ(eval_ast(env_uncompiled, expr.ast), 119.);
+        ASSERT_FLOAT_EQ(compiled(env), 119.);
+
+        size_t allocs_before = n_allocs;
+        double sum_uncompiled = 0., sum_compiled = 0.;
+        for (int i = 0; i < 1000; ++i) {
+            env.vars[x] = env_uncompiled.vars[x] = i * 0.01;
+            sum_uncompiled += eval_ast(env_uncompiled, expr.ast);
+            sum_compiled += compiled(env);
+        }
+        ASSERT_EQ(n_allocs - allocs_before, 0);
+        ASSERT_FLOAT_EQ(sum_uncompiled, sum_compiled);
+    }
+    {
+        // Inlining user functions at call sites
+        Environment env; env.set("x", 0.);
+        uint64_t x = env.addr_of("x");
+        uint64_t u = env.addr_of("u", false);
+        uint64_t f = env.def_func("f", parse("u^2 + 1", env, false, true), {u});
+        uint64_t g = env.def_func("g",
+                parse("{u < 0: -u, f(u)}", env, false, true), {u});
+        Expr expr = parse("g(x) - f(x * 2) + sum(k=1, 3)[g(k) * x]",
+                env, false, true);
+        std::vector<uint64_t> inlined;
+        Expr inlined_expr = expr.inline_calls(env, 64, &inlined);
+        ASSERT_EQ(inlined.size(), 2);
+        for (const auto& node : inlined_expr.ast) {
+            ASSERT(node.opcode != call);
+        }
+        Expr compiled = expr;
+        compiled.compile(&env);
+        ASSERT(compiled.is_compiled(env));
+        for (int i = 0; i < 50; ++i) {
+            env.vars[x] = i < 3 ? i - 1 : unif(reng);
+            double expected = eval_ast(env, expr.ast);
+            ASSERT_FLOAT_EQ(eval_ast(env, inlined_expr.ast), expected);
+            ASSERT_FLOAT_EQ(compiled(env), expected);
+        }
+        // Non-trivial argument used twice in body is not inlined
+        inlined_expr = parse("g(x + 1)", env, false, true).inline_calls(env);
+        ASSERT_EQ(inlined_expr.ast[0].opcode, call);
+        // Argument reading the loop variable of a sum in the body is not
+        // captured by it (the loop overwrites k, so reset it each time)
+        uint64_t k = env.addr_of("k", false);
+        uint64_t v = env.addr_of("v", false);
+        env.def_func("s", parse("sum(k=1, 3)[u]", env, false, true), {u});
+        env.def_func("h", parse("s(v * k)", env, false, true), {v});
+        // (also when the loop is in a function called by the body)
+        env.def_func("sk", parse("u * s(1)", env, false, true), {u});
+        env.def_func("hk", parse("sk(u * k)", env, false, true), {u});
+        for (const auto& str_expected : std::vector<std::pair<std::string, double> >{
+                    { "s(k)", 15. }, { "h(x)", 30. },
+                    { "sk(k)", 15. }, { "hk(1)", 15. } }) {
+            Expr captured = parse(str_expected.first, env, false, true);
+            Expr captured_compiled = captured, captured_jitted = captured;
+            captured_compiled.compile(&env);
+            captured_jitted.jit(&env);
+            env.vars[x] = 2.;
+            const double expected = str_expected.second;
+            env.vars[k] = 5.;
+            ASSERT_FLOAT_EQ(eval_ast(env, captured.ast), expected);
+            env.vars[k] = 5.;
+            ASSERT_FLOAT_EQ(eval_ast(env, captured.inline_calls(env).ast),
+                            expected);
+            env.vars[k] = 5.;
+            ASSERT_FLOAT_EQ(captured_compiled(env), expected);
+            env.vars[k] = 5.;
+            ASSERT_FLOAT_EQ(captured_jitted(env), expected);
+        }
+        // Non-trivial argument used in the body of a sum is not inlined
+        inlined_expr = parse("s(x + 1)", env, false, true).inline_calls(env);
+        ASSERT_EQ(inlined_expr.ast[0].opcode, call);
+        inlined_expr = parse("s(x)", env, false, true).inline_calls(env);
+        ASSERT_EQ(inlined_expr.ast[0].opcode, sums);
+
+        // Redefining a function invalidates inlined copies,
+        // and dependent user functions are recompiled
+        env.vars[x] = 3.;
+        ASSERT_FLOAT_EQ(compiled(env), 10. - 37. + (2. + 5. + 10.) * 3.);
+        ASSERT(env.funcs[g].expr.is_compiled(env));
+        // Redefining a function with the same body keeps it current
+        auto versions = env.call_versions(expr);
+        ASSERT_EQ(versions.size(), 2);
+        env.def_func("f", parse("u^2 + 1", env, false, true), {u});
+        ASSERT(compiled.is_compiled(env));
+        ASSERT(env.call_versions(expr) == versions);
+        env.def_func("f", parse("u * 3", env, false, true), {u});
+        ASSERT(env.call_versions(expr) != versions);
+        ASSERT(!compiled.is_compiled(env));
+        ASSERT(env.funcs[g].expr.is_compiled(env));
+        ASSERT_FLOAT_EQ(env.funcs[g].expr(3., env), 9.);
+        compiled.compile(&env);
+        ASSERT(compiled.is_compiled(env));
+        ASSERT_FLOAT_EQ(compiled(env), 9. - 18. + (3. + 6. + 9.) * 3.);
+        env.del_func("f");
+        ASSERT(!compiled.is_compiled(env));
+        ASSERT(std::isnan(env.funcs[g].expr(3., env)));
+        (void) f;
+    }
+    {
+        // Concurrent evaluation in separate contexts
+        Environment env; env.set("x", 0.); env.set("k", -1.);
+        uint64_t x = env.addr_of("x");
+        uint64_t u = env.addr_of("u", false);
+        env.def_func("f", parse("u^2 + 1", env, false, true), {u});
+        Expr expr = parse("sum(k=1, 10)[f(x) * k] + {x < 0: -x, x}",
+                env, false, true);
+        std::vector<Expr> exprs(3, expr);
+        exprs[1].compile(); exprs[2].jit();
+        const size_t n_threads = 4, n_points = 1000;
+        std::vector<std::vector<double> > results(n_threads,
+                std::vector<double>(n_points));
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < n_threads; ++t) {
+            threads.emplace_back([&, t]() {
+                EvalContext ctx(env);
+                for (size_t i = 0; i < n_points; ++i) {
+                    ctx.vars[x] = i * 0.01 - t;
+                    results[t][i] = exprs[(i + t) % 3](ctx);
+                }
+            });
+        }
+        for (auto& thd : threads) thd.join();
+        for (size_t t = 0; t < n_threads; ++t) {
+            for (size_t i = 0; i < n_points; ++i) {
+                double xv = i * 0.01 - t;
+                ASSERT_FLOAT_EQ(results[t][i], 55. * (xv * xv + 1) + std::fabs(xv));
+            }
+        }
+        // Environment's variables are not written
+        ASSERT_EQ(env.get("x"), 0.);
+        ASSERT_EQ(env.get("k"), -1.);
+    }
     END_TEST;
 }
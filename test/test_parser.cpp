@@ -144,7 +144,7 @@ int main() {
         Environment env; env.addr_of("a", false);
         env.addr_of("x", false);
 
-        AST ast = { mul, divi, 1., mul, log(2), Ref(1), Ref(0) };
+        AST ast = { divi, mul, 1. / log(2), Ref(0), Ref(1) };
 
         ASSERT_EQ(parse("diff(x)[a*log(x, 2)]", env).ast, ast);
         ASSERT(err.empty());
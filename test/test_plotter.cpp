@@ -0,0 +1,223 @@
+#include "plotter/plotter.hpp"
+#include "test_common.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <sstream>
+#include <vector>
+// This test file assumes parser, expr works
+// it checks the expressions the plotter renders with, syncing with a worker,
+// and a few properties of the output shapes
+
+using namespace nivalis;
+namespace {
+    // Add function with the given expression string to the plotter
+    size_t add_func(Plotter& plot, const std::string& str) {
+        if (!plot.funcs.back().expr_str.empty()) plot.add_func();
+        size_t idx = plot.funcs.size() - 1;
+        plot.funcs[idx].expr_str = str;
+        plot.reparse_expr(idx);
+        return idx;
+    }
+
+    // Points of the polylines drawn for function idx, in screen coordinates
+    std::vector<std::array<double, 2> > curve_points(const Plotter& plot,
+            size_t idx) {
+        std::vector<std::array<double, 2> > points;
+        for (const auto& obj : plot.draw_buf) {
+            if (obj.rel_func != idx ||
+                obj.type != DrawBufferObject::POLYLINE) continue;
+            points.insert(points.end(), obj.points.begin(), obj.points.end());
+        }
+        return points;
+    }
+
+    // Max distance from a point of a to the nearest point of b
+    double max_nearest_dist(const std::vector<std::array<double, 2> >& a,
+                            const std::vector<std::array<double, 2> >& b) {
+        double result = 0.;
+        for (const auto& p : a) {
+            double nearest = std::numeric_limits<double>::infinity();
+            for (const auto& q : b) {
+                nearest = std::min(nearest,
+                        std::hypot(p[0] - q[0], p[1] - q[1]));
+            }
+            result = std::max(result, nearest);
+        }
+        return result;
+    }
+
+    // Check if receiver's render output matches sender's; points are sent
+    // as float offsets, so they may differ by rounding
+    bool same_render_result(const Plotter& sender, const Plotter& receiver) {
+        if (sender.draw_buf.size() != receiver.draw_buf.size() ||
+            sender.pt_markers.size() != receiver.pt_markers.size()) return false;
+        for (size_t i = 0; i < sender.draw_buf.size(); ++i) {
+            const auto& a = sender.draw_buf[i];
+            const auto& b = receiver.draw_buf[i];
+            if (a.type != b.type || a.thickness != b.thickness ||
+                a.c != b.c || a.rel_func != b.rel_func || a.str != b.str ||
+                a.points.size() != b.points.size()) return false;
+            for (size_t j = 0; j < a.points.size(); ++j) {
+                if (std::fabs(a.points[j][0] - b.points[j][0]) > 1e-3 ||
+                    std::fabs(a.points[j][1] - b.points[j][1]) > 1e-3)
+                    return false;
+            }
+        }
+        for (size_t i = 0; i < sender.pt_markers.size(); ++i) {
+            const auto& a = sender.pt_markers[i];
+            const auto& b = receiver.pt_markers[i];
+            if (a.x != b.x || a.y != b.y || a.label != b.label ||
+                a.rel_func != b.rel_func || a.passive != b.passive) return false;
+        }
+        return sender.bg_bitmap == receiver.bg_bitmap &&
+            (sender.bg_bitmap.empty() ||
+             sender.bg_bitmap_view == receiver.bg_bitmap_view);
+    }
+
+    // Send render result from sender to receiver relative to the last
+    // frame the receiver has; returns the size of the message
+    size_t send_render_result(Plotter& sender, Plotter& receiver) {
+        std::stringstream ss;
+        sender.export_binary_render_result(ss, receiver.render_result_frame());
+        const size_t size = ss.str().size();
+        receiver.import_binary_render_result(ss);
+        return ss ? size : 0;
+    }
+}  // namespace
+
+int main() {
+    BEGIN_TEST(test_plotter);
+    {
+        // Frame specialization (inlining and folding slider values)
+        Plotter plot;
+        plot.resize(160, 120);
+        plot.env.set("a", 2.);
+        plot.env.set("k", 5.);
+        add_func(plot, "s(u)=sum(k=1, 3)[u]");
+        add_func(plot, "w(u)=a*u");
+        size_t fs = add_func(plot, "y=s(k)*x");
+        size_t fw = add_func(plot, "y=w(x)+a");
+        uint64_t x = plot.env.addr_of("x");
+        uint64_t k = plot.env.addr_of("k");
+        plot.render();
+
+        // Slider k is passed into s, whose loop index is also k:
+        // it must be folded as the slider value, not captured by the loop
+        plot.env.vars[x] = 2.;
+        ASSERT_FLOAT_EQ(plot.funcs[fs].frame_expr(plot.env), 30.);
+        plot.env.vars[k] = 5.;  // the loop in s overwrites k
+        // w is inlined and a folded
+        const auto& frame_ast = plot.funcs[fw].frame_expr.ast;
+        for (const auto& node : frame_ast) {
+            ASSERT(node.opcode != OpCode::call);
+            ASSERT(node.opcode != OpCode::ref || node.ref == x);
+        }
+        ASSERT_FLOAT_EQ(plot.funcs[fw].frame_expr(plot.env), 6.);
+
+        // Changing a slider invalidates the specialized expressions
+        plot.env.set("a", 3.);
+        plot.render();
+        ASSERT_FLOAT_EQ(plot.funcs[fw].frame_expr(plot.env), 9.);
+    }
+    {
+        // Critical points are only searched for differentiable functions
+        Plotter plot;
+        size_t fd = add_func(plot, "y=sin(x)*x^2");
+        size_t fn = add_func(plot, "y=zeta(x)");
+        ASSERT(plot.funcs[fd].differentiable);
+        ASSERT(!plot.funcs[fn].differentiable);
+        // Calls to user functions are followed, and redefining them updates
+        // their callers
+        size_t fg = add_func(plot, "g(u)=zeta(u)");
+        size_t fc = add_func(plot, "y=g(x)+1");
+        ASSERT(!plot.funcs[fc].differentiable);
+        plot.funcs[fg].expr_str = "g(u)=sin(u)";
+        plot.reparse_expr(fg);
+        ASSERT(plot.funcs[fc].differentiable);
+    }
+    {
+        // Snapshots share user function definitions when only values change
+        Plotter plot, worker;
+        plot.env.set("a", 2.);
+        add_func(plot, "w(u)=a*u");
+        size_t fw = add_func(plot, "y=w(x)");
+        auto snapshot = plot.export_snapshot();
+        worker.import_snapshot(snapshot);
+        plot.env.set("a", 3.);
+        auto snapshot2 = plot.export_snapshot();
+        ASSERT(snapshot2->env == snapshot->env);
+        ASSERT(snapshot2->funcs[fw] == snapshot->funcs[fw]);
+        worker.import_snapshot(snapshot2);
+        ASSERT_FLOAT_EQ(worker.env.get("a"), 3.);
+        ASSERT_FLOAT_EQ(worker.funcs[fw].expr(2., worker.env), 6.);
+        // Redefining a function copies the definitions
+        plot.funcs[0].expr_str = "w(u)=a*u+1";
+        plot.reparse_expr(0);
+        plot.implicit_adaptive = true;
+        auto snapshot3 = plot.export_snapshot();
+        ASSERT(snapshot3->env != snapshot2->env);
+        worker.import_snapshot(snapshot3);
+        ASSERT_FLOAT_EQ(worker.funcs[fw].expr(2., worker.env), 7.);
+        ASSERT(worker.implicit_adaptive);
+    }
+    {
+        // Adaptive and uniform implicit plots draw the same curve
+        Plotter plot;
+        plot.resize(320, 240);
+        size_t fc = add_func(plot, "x^2+y^2=1");
+        plot.render();
+        const auto uniform = curve_points(plot, fc);
+        plot.implicit_adaptive = true;
+        plot.render();
+        const auto adaptive = curve_points(plot, fc);
+        ASSERT(uniform.size() > 0);
+        ASSERT(adaptive.size() > 0);
+        ASSERT(max_nearest_dist(uniform, adaptive) < 2.);
+        ASSERT(max_nearest_dist(adaptive, uniform) < 2.);
+    }
+    {
+        // Render results sent to the main thread are reproduced exactly,
+        // both in full and relative to an earlier frame
+        Plotter plot, receiver;
+        plot.resize(320, 240);
+        size_t fa = add_func(plot, "y=x^2-1");
+        add_func(plot, "y=sin(x)");
+        add_func(plot, "x^2+y^2<2");
+        plot.render();
+        const size_t full_size = send_render_result(plot, receiver);
+        ASSERT(full_size > 0);
+        ASSERT(plot.draw_buf.size() > 0);
+        ASSERT(plot.pt_markers.size() > 0);
+        ASSERT(plot.bg_bitmap.size() > 0);
+        ASSERT(same_render_result(plot, receiver));
+
+        // Relative to the last frame: one function changed, the other
+        // function and the bitmap did not
+        plot.funcs[fa].expr_str = "y=x^3-1";
+        plot.reparse_expr(fa);
+        plot.render();
+        const size_t delta_size = send_render_result(plot, receiver);
+        ASSERT(delta_size > 0);
+        ASSERT(delta_size < full_size);
+        ASSERT(same_render_result(plot, receiver));
+
+        // Pan, changing everything
+        plot.view.xmin += 0.5; plot.view.xmax += 0.5;
+        plot.view.ymin -= 0.25; plot.view.ymax -= 0.25;
+        plot.render();
+        ASSERT(send_render_result(plot, receiver) > 0);
+        ASSERT(same_render_result(plot, receiver));
+
+        // A receiver without the base frame rejects the delta
+        Plotter other;
+        std::stringstream ss;
+        plot.render();
+        plot.export_binary_render_result(ss, receiver.render_result_frame());
+        other.import_binary_render_result(ss);
+        ASSERT(!ss);
+    }
+    END_TEST;
+}
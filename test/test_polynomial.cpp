@@ -0,0 +1,120 @@
+#include "polynomial.hpp"
+#include "parser.hpp"
+#include "test_common.hpp"
+// This test file assumes parser, expr works
+
+using namespace nivalis;
+namespace {
+    Environment env;
+
+    // Test if the expression is detected as a rational function, and
+    // agrees with the expression
+    bool test_rational_random(const std::string& str, uint32_t var_id,
+            double xmin = -100, double xmax = 100) {
+        Expr expr = parse(str, env);
+        EvalContext ctx(env);
+        RationalFunction rational;
+        if (!to_rational(expr, var_id, ctx, rational)) {
+            std::cerr << "Rational function not detected: " << str << "\n";
+            return false;
+        }
+        static const int N_ITER = 1000;
+        std::uniform_real_distribution<double> unif(xmin, xmax);
+        std::vector<double> xs(N_ITER), ys(N_ITER);
+        for (int i = 0; i < N_ITER; ++i) xs[i] = unif(test::reng);
+        rational.eval_batch(xs.data(), ys.data(), N_ITER);
+        for (int i = 0; i < N_ITER; ++i) {
+            env.vars[var_id] = xs[i];
+            double fx = expr(env);
+            if (absrelerr(ys[i], fx) > FLOAT_EPS ||
+                    absrelerr(rational(xs[i]), fx) > FLOAT_EPS) {
+                std::cerr << "Rational function test fail for " << str <<
+                    " at " << xs[i] << "\ngot    " << ys[i] <<
+                    "\nexpect " << fx << "\n";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool is_rational(const std::string& str, uint32_t var_id) {
+        EvalContext ctx(env);
+        RationalFunction rational;
+        return to_rational(parse(str, env), var_id, ctx, rational);
+    }
+
+    // Test if roots are as expected (up to eps)
+    bool test_roots(const Polynomial& p, double lo, double hi,
+            const std::vector<double>& expect) {
+        static const double EPS = 1e-9;
+        auto roots = p.real_roots(lo, hi, EPS);
+        bool ok = roots.size() == expect.size();
+        for (size_t i = 0; ok && i < roots.size(); ++i) {
+            ok = std::fabs(roots[i] - expect[i]) < 10 * EPS;
+        }
+        if (!ok) {
+            std::cerr << "Roots test fail, got";
+            for (double r : roots) std::cerr << " " << r;
+            std::cerr << "\n";
+        }
+        return ok;
+    }
+}  // namespace
+
+int main() {
+    BEGIN_TEST(test_polynomial);
+
+    {
+        // (x - 1)(x - 2)(x + 3) = x^3 - 7x + 6
+        Polynomial p({6., -7., 0., 1.});
+        ASSERT_EQ(p.degree(), 3);
+        ASSERT_FLOAT_EQ(p(2.5), 4.125);
+        Polynomial dp = p.diff();
+        ASSERT_EQ(dp.degree(), 2);
+        ASSERT_FLOAT_EQ(dp(2.), 5.);
+        Polynomial q = Polynomial({-1., 1.}) * Polynomial({-2., 1.}) *
+            Polynomial({3., 1.});
+        ASSERT(q.coeffs == p.coeffs);
+        ASSERT_EQ((p - q).degree(), -1);
+        ASSERT(test_roots(p, -10., 10., {-3., 1., 2.}));
+        ASSERT(test_roots(p, 0., 10., {1., 2.}));
+        ASSERT(test_roots(dp, -10., 10., {-std::sqrt(7. / 3.), std::sqrt(7. / 3.)}));
+        // Double root, no roots, many roots
+        ASSERT(test_roots(Polynomial({1., -2., 1.}), -10., 10., {1.}));
+        ASSERT(test_roots(Polynomial({1., 0., 1.}), -10., 10., {}));
+        Polynomial w(1.);
+        std::vector<double> expect;
+        for (int i = 1; i <= 8; ++i) {
+            w = w * Polynomial({-static_cast<double>(i), 1.});
+            expect.push_back(static_cast<double>(i));
+        }
+        ASSERT(test_roots(w, 0.5, 8.5, expect));
+    }
+
+    env.addr_of("x", false); env.set("a", 3.0);
+    ASSERT(test_rational_random("x^3 - 2*x + a", 0));
+    ASSERT(test_rational_random("a*x^2/4 - 3*x + 1", 0));
+    ASSERT(test_rational_random("-x^5 + sqrt(a)*x^4 - x^2/a + 1", 0, -3., 3.));
+    ASSERT(test_rational_random("(x^2 + 1) / (x - a)", 0));
+    ASSERT(test_rational_random("1/x + x^-2 + x", 0));
+    ASSERT(test_rational_random("sin(a) * x + exp(a)", 0));
+    ASSERT(!is_rational("sin(x) + x", 0));
+    ASSERT(!is_rational("x^0.5", 0));
+    ASSERT(!is_rational("x^a + x^(1/2)", 0));
+    // Products of sums are not expanded
+    ASSERT(!is_rational("(x - 1)^8", 0));
+    ASSERT(!is_rational("(x - 1) * (x + 1)", 0));
+    {
+        // Coefficients
+        EvalContext ctx(env);
+        RationalFunction rational;
+        ASSERT(to_rational(parse("2*x^2 - a*x + 5", env), 0, ctx, rational));
+        ASSERT(rational.is_polynomial());
+        ASSERT(rational.num.coeffs == std::vector<double>({5., -3., 2.}));
+        ASSERT(to_rational(parse("x / (x^2 - 4)", env), 0, ctx, rational));
+        ASSERT(!rational.is_polynomial());
+        ASSERT(test_roots(rational.den, -10., 10., {-2., 2.}));
+    }
+
+    END_TEST;
+}